@@ -0,0 +1,76 @@
+#!/bin/sh
+#
+# $Id$
+#
+# File:   compressionBench.sh
+# Author: Werner Jaeger
+#
+# Copyright 2015 Werner Jaeger.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Compares push and pull times of a mixed corpus with and without option
+# compress.
+#
+# Usage: compressionBench.sh <adbncfs binary> <mount point> <device directory>
+#
+# The device directory (e.g. /sdcard/adbncfs-bench) is created and removed.
+#
+
+ADBNCFS=${1:?adbncfs binary missing}
+MOUNTPOINT=${2:?mount point missing}
+DEVICEDIR=${3:?device directory missing}
+CORPUS=$(mktemp -d /tmp/adbncfs-corpus-XXXXXX)
+
+trap 'rm -rf "$CORPUS"' EXIT
+
+# text heavy files compress 5-10x
+seq 1 400000 | sed 's/^/2015-11-17 13:28:00 I\/ActivityManager: line /' > "$CORPUS/main.log"
+seq 1 100000 | sed 's/.*/{"id": &, "name": "entry &", "enabled": true},/' > "$CORPUS/config.json"
+seq 1 200000 | sed 's/.*/INSERT INTO t VALUES(&, "value &");/' > "$CORPUS/dump.sql"
+# already compressed media, never compressed
+head -c 8388608 /dev/urandom > "$CORPUS/IMG_0001.jpg"
+head -c 16777216 /dev/urandom > "$CORPUS/VID_0001.mp4"
+# unknown types, decided by probing a sample
+head -c 4194304 /dev/urandom > "$CORPUS/random.bin"
+seq 1 300000 > "$CORPUS/numbers.dat"
+
+ls -l "$CORPUS"
+
+run()
+{
+    OPTIONS=$1
+
+    "$ADBNCFS" "$MOUNTPOINT" $OPTIONS || exit 1
+    mkdir -p "$MOUNTPOINT$DEVICEDIR"
+
+    START=$(date +%s.%N)
+    cp "$CORPUS"/* "$MOUNTPOINT$DEVICEDIR"
+    PUSHED=$(date +%s.%N)
+    fusermount -u "$MOUNTPOINT"
+
+    # remount to start with an empty local cache
+    "$ADBNCFS" "$MOUNTPOINT" $OPTIONS || exit 1
+    PULLSTART=$(date +%s.%N)
+    cat "$MOUNTPOINT$DEVICEDIR"/* > /dev/null
+    PULLED=$(date +%s.%N)
+
+    rm -rf "$MOUNTPOINT$DEVICEDIR"
+    fusermount -u "$MOUNTPOINT"
+
+    echo "$OPTIONS: push $(echo "$PUSHED - $START" | bc) s, pull $(echo "$PULLED - $PULLSTART" | bc) s"
+}
+
+run "-o nocompress"
+run "-o compress"
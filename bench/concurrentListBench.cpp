@@ -0,0 +1,346 @@
+/*
+ * $Id$
+ *
+ * File:   concurrentListBench.cpp
+ * Author: Werner Jaeger
+ *
+ * Copyright 2015 Werner Jaeger.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Runs 16 concurrent ls -lR of a tree of 50 directories of 100 files each,
+ * every thread starting with a different directory, on empty caches. Once
+ * like adbncfs did before, one listing at a time in adbnc_opendir() under a
+ * global mutex, once with the listing kept in the directory handle like
+ * adbnc_opendir() does now, so listings run at the same time and identical
+ * ones share one command through SingleFlight.
+ *
+ * Every command is run by a local shell with busybox in front like
+ * sharedShell() sends it, delayed by a fixed latency standing in for the
+ * round trip via adb and netcat. Commands of different threads overlap like
+ * they do on the netcat connection, see netCatBench.
+ *
+ * Usage: make bench, then concurrentListBench [latency in ms] [work directory],
+ * busybox must be in the PATH
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <string>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include "../src/fileInfoCache.h"
+
+using namespace std;
+
+/** Concurrent ls -lR */
+static const unsigned int uiThreads(16);
+
+/** Directories below the root of the tree */
+static const unsigned int uiDirs(50);
+
+/** Files per directory */
+static const unsigned int uiFilesPerDir(100);
+
+/** FileStatus in fileinfoCache.cpp refers to these, they are not called here */
+int adbncPush(const string& strLocalSource, const string& strRemoteDestination) { return(0); }
+int adbncShell(const string& strCommand) { return(0); }
+
+/** Microseconds every command is delayed by */
+static useconds_t uiLatency;
+
+/** Caches shared by the threads like in adbncfs.cpp */
+static FileCache* pFileCache;
+static DirCache* pDirCache;
+static SingleFlight* pSingleFlight;
+
+/** The listings of the former adbnc_opendir() */
+static map<string, deque<string> > openDirs;
+
+/** Held by the former adbnc_opendir() and adbnc_releasedir() */
+static pthread_mutex_t openDirMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Commands sent to the stand-in for the device */
+static unsigned long ulCommands;
+static pthread_mutex_t commandsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static double now()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/**
+ * Runs a command like execCommandViaNetCat() does, as busybox applet, and
+ * returns its output lines.
+ */
+static deque<string> shell(const string& strCommand)
+{
+    deque<string> output;
+
+    ::pthread_mutex_lock(&commandsMutex);
+    ulCommands++;
+    ::pthread_mutex_unlock(&commandsMutex);
+
+    ::usleep(uiLatency);
+
+    FILE* pPipe(::popen(("busybox " + strCommand).c_str(), "r"));
+    if (pPipe)
+    {
+        char acLine[PATH_MAX + 256];
+        while (::fgets(acLine, sizeof(acLine), pPipe))
+            output.push_back(string(acLine, ::strlen(acLine) - 1));
+        ::pclose(pPipe);
+    }
+
+    return(output);
+}
+
+static string dirPath(const string& strRootDir, unsigned int uiDir)
+{
+    char acDir[32];
+    ::snprintf(acDir, sizeof(acDir), "/DIR_%03u", uiDir);
+    return(strRootDir + acDir);
+}
+
+static void createTree(const string& strRootDir)
+{
+    char acName[32];
+    for (unsigned int i = 0; i < uiDirs; i++)
+    {
+        const string strDir(dirPath(strRootDir, i));
+        ::mkdir(strDir.c_str(), 0755);
+
+        for (unsigned int j = 0; j < uiFilesPerDir; j++)
+        {
+            ::snprintf(acName, sizeof(acName), "/IMG_%05u.jpg", j);
+            const int iFd(::open((strDir + acName).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+            if (iFd != -1)
+                ::close(iFd);
+        }
+    }
+}
+
+/**
+ * The command listDirectory() in adbncfs.cpp hands to sharedShell().
+ */
+static string listingCommand(const string& strDir)
+{
+    const string strPrefix(strDir + "/");
+
+    string strCommand("stat -t --");
+    const char* const apcPatterns[] = { ".", "..", ".*", "*", NULL };
+    for (int i = 0; apcPatterns[i]; i++)
+        strCommand.append(" '").append(strPrefix).append("'").append(apcPatterns[i]);
+    strCommand.append(" 2>/dev/null");
+
+    return(strCommand);
+}
+
+/**
+ * listDirectory() in adbncfs.cpp, names never contain blanks here.
+ */
+static void listDirectory(const string& strDir, deque<string>* pNames)
+{
+    if (pDirCache->get(strDir.c_str(), pNames))
+        return;
+
+    const deque<string> output(pSingleFlight->run(listingCommand(strDir), shell));
+
+    struct stat statBuf;
+    ::memset(&statBuf, 0, sizeof(statBuf));
+    for (deque<string>::const_iterator it(output.begin()); it != output.end(); ++it)
+    {
+        // the entries are named with the directory in front
+        const string strEntry(it->substr(strDir.length() + 1));
+        const string strName(strEntry.substr(0, strEntry.find(' ')));
+        if (find(pNames->begin(), pNames->end(), strName) != pNames->end())
+            continue;
+
+        // name size blocks mode ...
+        char* pcPos(NULL);
+        statBuf.st_size = ::strtoll(strEntry.c_str() + strName.length(), &pcPos, 10);
+        ::strtoul(pcPos, &pcPos, 10);
+        statBuf.st_mode = ::strtoul(pcPos, NULL, 16);
+        pNames->push_back(strName);
+
+        if (strName == ".")
+            pFileCache->putStat(strDir.c_str(), statBuf);
+        else if (strName != "..")
+            pFileCache->putStat((strDir + "/" + strName).c_str(), statBuf);
+    }
+
+    pDirCache->put(strDir.c_str(), *pNames, 0);
+}
+
+/**
+ * The former adbnc_opendir(), adbnc_readdir() and adbnc_releasedir(), the
+ * listing is taken from #openDirs under the mutex here, so a release by
+ * another thread opening the same directory cannot erase it meanwhile.
+ */
+static deque<string> listSerialized(const string& strDir)
+{
+    deque<string> names;
+
+    ::pthread_mutex_lock(&openDirMutex);
+    listDirectory(strDir, &names);
+    if (openDirs.find(strDir) == openDirs.end())
+        openDirs.insert(make_pair(strDir, names));
+    names = openDirs[strDir];
+    ::pthread_mutex_unlock(&openDirMutex);
+
+    ::pthread_mutex_lock(&openDirMutex);
+    openDirs.erase(strDir);
+    ::pthread_mutex_unlock(&openDirMutex);
+
+    return(names);
+}
+
+/**
+ * adbnc_opendir(), adbnc_readdir() and adbnc_releasedir() in adbncfs.cpp.
+ */
+static deque<string> listInHandle(const string& strDir)
+{
+    deque<string>* const pNames(new deque<string>());
+    listDirectory(strDir, pNames);
+
+    deque<string> listing(*pNames);
+    delete pNames;
+
+    return(listing);
+}
+
+/** Arguments of lsThreadMain() */
+struct LsArgs
+{
+    const string* pstrRootDir;
+    unsigned int uiFirstDir;
+    deque<string> (*pfnList)(const string& strDir);
+    unsigned long ulEntries;
+};
+
+/**
+ * ls -lR: lists a directory, looks up the attributes of every entry like
+ * the kernel does through adbnc_getattr() and descends into directories.
+ */
+static void lsR(const string& strDir, deque<string> (*pfnList)(const string& strDir), unsigned long* pulEntries)
+{
+    const deque<string> names(pfnList(strDir));
+
+    struct stat statBuf;
+    bool fRefresh;
+    for (deque<string>::size_type i = 2; i < names.size(); i++)
+    {
+        const string strPath(strDir + "/" + names[i]);
+        if (pFileCache->getStat(strPath.c_str(), &statBuf, &fRefresh))
+        {
+            (*pulEntries)++;
+            if (S_ISDIR(statBuf.st_mode))
+                lsR(strPath, pfnList, pulEntries);
+        }
+    }
+}
+
+static void* lsThreadMain(void* pvArg)
+{
+    LsArgs* const pArgs(static_cast<LsArgs*>(pvArg));
+
+    // the root first, then its directories starting with a different one per thread
+    const deque<string> names(pArgs->pfnList(*pArgs->pstrRootDir));
+    for (unsigned int i = 0; i < uiDirs; i++)
+        lsR(dirPath(*pArgs->pstrRootDir, (pArgs->uiFirstDir + i) % uiDirs), pArgs->pfnList, &pArgs->ulEntries);
+
+    pArgs->ulEntries += names.size() > 2 ? names.size() - 2 : 0;
+
+    return(NULL);
+}
+
+/**
+ * Runs uiThreads concurrent ls -lR on empty caches.
+ *
+ * @return the seconds until the last one finished.
+ */
+static double run(const string& strRootDir, deque<string> (*pfnList)(const string& strDir), unsigned long* pulEntries)
+{
+    FileCache fileCache;
+    DirCache dirCache;
+    SingleFlight singleFlight;
+    pFileCache = &fileCache;
+    pDirCache = &dirCache;
+    pSingleFlight = &singleFlight;
+    ulCommands = 0;
+
+    pthread_t aThreads[uiThreads];
+    LsArgs aArgs[uiThreads];
+
+    const double dStart(now());
+    for (unsigned int i = 0; i < uiThreads; i++)
+    {
+        aArgs[i].pstrRootDir = &strRootDir;
+        aArgs[i].uiFirstDir = i * uiDirs / uiThreads;
+        aArgs[i].pfnList = pfnList;
+        aArgs[i].ulEntries = 0;
+        ::pthread_create(&aThreads[i], NULL, lsThreadMain, &aArgs[i]);
+    }
+
+    *pulEntries = 0;
+    for (unsigned int i = 0; i < uiThreads; i++)
+    {
+        ::pthread_join(aThreads[i], NULL);
+        *pulEntries += aArgs[i].ulEntries;
+    }
+
+    return(now() - dStart);
+}
+
+int main(int argc, char** argv)
+{
+    uiLatency = static_cast<useconds_t>((argc > 1 ? ::strtod(argv[1], NULL) : 10.0) * 1000);
+
+    char acDir[PATH_MAX];
+    ::snprintf(acDir, sizeof(acDir), "%s/adbncfs-bench-XXXXXX", argc > 2 ? argv[2] : "/tmp");
+    if (!::mkdtemp(acDir))
+    {
+        ::perror(acDir);
+        return(1);
+    }
+
+    const string strRootDir(acDir);
+    createTree(strRootDir);
+
+    ::printf("%u concurrent ls -lR of %u files in %u directories, %.1f ms per command\n", uiThreads, uiDirs * uiFilesPerDir, uiDirs, uiLatency / 1000.0);
+
+    unsigned long ulEntries;
+    double dTime(run(strRootDir, listSerialized, &ulEntries));
+    ::printf("one listing at a time:  %7.3fs, %lu commands, %lu entries\n", dTime, ulCommands, ulEntries);
+
+    dTime = run(strRootDir, listInHandle, &ulEntries);
+    ::printf("listing in the handle:  %7.3fs, %lu commands, %lu entries\n", dTime, ulCommands, ulEntries);
+
+    const string strCommand("rm -rf '" + strRootDir + "'");
+    if (::system(strCommand.c_str()) != 0)
+        ::fprintf(stderr, "failed to remove %s\n", acDir);
+
+    return(0);
+}
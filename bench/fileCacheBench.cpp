@@ -0,0 +1,166 @@
+/*
+ * $Id$
+ *
+ * File:   fileCacheBench.cpp
+ * Author: Werner Jaeger
+ *
+ * Copyright 2015 Werner Jaeger.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Measures FileCache lookup throughput with 1 to 32 threads, 90% getStat(),
+ * 5% putStat() and 5% invalidate() on 4096 paths, against a map guarded by a
+ * single mutex as FileCache used to be.
+ *
+ * Usage: make bench, then fileCacheBench [operations per thread]
+ *
+ * To check for data races build it with
+ * make bench BENCH_CXXFLAGS="-std=c++11 -O1 -g -fsanitize=thread -Isrc"
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <string>
+#include <deque>
+#include <map>
+#include "../src/fileInfoCache.h"
+
+using namespace std;
+
+/** Number of distinct paths */
+static const int iNumPaths(4096);
+
+/** FileStatus in fileinfoCache.cpp refers to these, they are not called here */
+int adbncPush(const string& strLocalSource, const string& strRemoteDestination) { return(0); }
+int adbncShell(const string& strCommand) { return(0); }
+
+/**
+ * The former FileCache, one map and one lock.
+ */
+class GlobalLockCache
+{
+public:
+    GlobalLockCache() : m_Entries() { ::pthread_mutex_init(&m_Mutex, NULL); }
+    ~GlobalLockCache() { ::pthread_mutex_destroy(&m_Mutex); }
+
+    void putStat(const char *pcPath, const struct stat& statBuf)
+    {
+        ::pthread_mutex_lock(&m_Mutex);
+        m_Entries[pcPath] = statBuf;
+        ::pthread_mutex_unlock(&m_Mutex);
+    }
+
+    bool getStat(const char *pcPath, struct stat* pStatBuf)
+    {
+        ::pthread_mutex_lock(&m_Mutex);
+        const map<string, struct stat>::const_iterator it(m_Entries.find(pcPath));
+        const bool fRes(it != m_Entries.end());
+        if (fRes)
+            *pStatBuf = it->second;
+        ::pthread_mutex_unlock(&m_Mutex);
+        return(fRes);
+    }
+
+    void invalidate(const char *pcPath)
+    {
+        ::pthread_mutex_lock(&m_Mutex);
+        m_Entries.erase(pcPath);
+        ::pthread_mutex_unlock(&m_Mutex);
+    }
+
+private:
+    map<string, struct stat> m_Entries;
+    pthread_mutex_t m_Mutex;
+};
+
+static int iNumOperations(1000000);
+
+static double now()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+template<class Cache> struct WorkerArg
+{
+    Cache* pCache;
+    unsigned int uiSeed;
+};
+
+template<class Cache> static void* worker(void* pvArg)
+{
+    WorkerArg<Cache>* pArg(static_cast<WorkerArg<Cache>*>(pvArg));
+    struct stat attr;
+    ::memset(&attr, 0, sizeof(attr));
+    attr.st_mode = 0x81b0;
+    attr.st_size = 2811392;
+
+    struct stat statBuf;
+    char acPath[64];
+
+    for (int i = 0; i < iNumOperations; i++)
+    {
+        const int iRandom(::rand_r(&pArg->uiSeed));
+        ::snprintf(acPath, sizeof(acPath), "/sdcard/DCIM/Camera/IMG_%04d.jpg", iRandom % iNumPaths);
+
+        const int iOp((iRandom >> 16) % 20);
+        if (iOp == 0)
+            pArg->pCache->putStat(acPath, attr);
+        else if (iOp == 1)
+            pArg->pCache->invalidate(acPath);
+        else
+            pArg->pCache->getStat(acPath, &statBuf);
+    }
+
+    return(NULL);
+}
+
+template<class Cache> static double run(const int iNumThreads)
+{
+    Cache cache;
+    pthread_t threads[iNumThreads];
+    WorkerArg<Cache> args[iNumThreads];
+
+    const double dStart(now());
+
+    for (int i = 0; i < iNumThreads; i++)
+    {
+        args[i].pCache = &cache;
+        args[i].uiSeed = i + 1;
+        ::pthread_create(&threads[i], NULL, worker<Cache>, &args[i]);
+    }
+
+    for (int i = 0; i < iNumThreads; i++)
+        ::pthread_join(threads[i], NULL);
+
+    return(static_cast<double>(iNumThreads) * iNumOperations / (now() - dStart));
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1)
+        iNumOperations = ::atoi(argv[1]);
+
+    ::printf("threads  global lock ops/s  FileCache ops/s\n");
+    for (int iNumThreads = 1; iNumThreads <= 32; iNumThreads *= 2)
+        ::printf("%7d  %17.0f  %13.0f\n", iNumThreads, run<GlobalLockCache>(iNumThreads), run<FileCache>(iNumThreads));
+
+    return(0);
+}
@@ -0,0 +1,177 @@
+/*
+ * $Id$
+ *
+ * File:   getattrBench.cpp
+ * Author: Werner Jaeger
+ *
+ * Copyright 2015 Werner Jaeger.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Measures the cost of a getattr served from FileCache: the former way,
+ * copying the cached stat -t output lines, concatenating and tokenizing them
+ * and converting each token, against copying the parsed attributes.
+ *
+ * Usage: make bench, then getattrBench [number of lookups]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <map>
+#include "../src/fileInfoCache.h"
+
+using namespace std;
+
+/** Number of distinct paths */
+static const int iNumPaths(4096);
+
+/** FileStatus in fileinfoCache.cpp refers to these, they are not called here */
+int adbncPush(const string& strLocalSource, const string& strRemoteDestination) { return(0); }
+int adbncShell(const string& strCommand) { return(0); }
+
+static double now()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/** As in adbncfs.cpp */
+static vector<string> tokenize(const string& strData)
+{
+    vector<string> tokens;
+
+    const char* pcDelimiters = " \t";
+    const int iLen(strData.length() + 1);
+
+    char acTokens[iLen];
+    ::strncpy(acTokens, strData.c_str(), iLen);
+
+    char *pcSave;
+    char* pch = ::strtok_r(acTokens, pcDelimiters, &pcSave);
+    while (pch != NULL)
+    {
+        tokens.push_back(pch);
+        pch = ::strtok_r(NULL, pcDelimiters, &pcSave);
+    }
+
+    return(tokens);
+}
+
+/**
+ * The former doStat() and adbnc_getattr() on a cache hit.
+ */
+static int formerGetattr(const map<string, deque<string> >& cache, const char* pcPath, struct stat* pStatBuf)
+{
+    ::memset(pStatBuf, 0, sizeof(struct stat));
+
+    const map<string, deque<string> >::const_iterator it(cache.find(pcPath));
+    if (it == cache.end())
+        return(-1);
+
+    deque<string> output(it->second);
+    if (output.size() > 1)
+    {
+        deque<string>::iterator itLine(output.begin());
+        while (itLine != output.end())
+            output.front() += *itLine++;
+    }
+
+    vector<string> tokens(tokenize(output.front()));
+    while (tokens.size() > 15)
+        tokens.erase(tokens.begin());
+
+    pStatBuf->st_ino = stoul(tokens[7].c_str());
+    pStatBuf->st_mode = stoul(tokens[3], NULL, 16) | 0700;
+    pStatBuf->st_nlink = 1;
+    pStatBuf->st_uid = stoul(tokens[4].c_str());
+    pStatBuf->st_gid = stoul(tokens[5].c_str());
+    pStatBuf->st_rdev = stoul(tokens[6], NULL, 16);
+    pStatBuf->st_size = stoul(tokens[1].c_str());
+    pStatBuf->st_blksize = stol(tokens[14].c_str());
+    pStatBuf->st_blocks = stoul(tokens[2].c_str());
+    pStatBuf->st_atime = stol(tokens[11].c_str());
+    pStatBuf->st_mtime = stol(tokens[12].c_str());
+    pStatBuf->st_ctime = stol(tokens[13].c_str());
+
+    return(0);
+}
+
+/**
+ * doStat() and adbnc_getattr() on a cache hit now.
+ */
+static int getattr(const FileCache& cache, const char* pcPath, struct stat* pStatBuf)
+{
+    if (!cache.getStat(pcPath, pStatBuf))
+        return(-1);
+
+    pStatBuf->st_mode |= 0700;
+
+    return(0);
+}
+
+int main(int argc, char** argv)
+{
+    const int iNumLookups(argc > 1 ? ::atoi(argv[1]) : 2000000);
+
+    map<string, deque<string> > formerCache;
+    FileCache cache;
+    vector<string> paths;
+
+    char acPath[64];
+    char acLine[256];
+    for (int i = 0; i < iNumPaths; i++)
+    {
+        ::snprintf(acPath, sizeof(acPath), "/sdcard/DCIM/Camera/IMG_%04d.jpg", i);
+        ::snprintf(acLine, sizeof(acLine), "%s %d 5496 81b0 1023 1023 1c %d 1 0 0 1448450000 1448450000 1448450000 4096", acPath, 2811392 + i, 53825 + i);
+        paths.push_back(acPath);
+
+        formerCache[acPath] = deque<string>(1, acLine);
+
+        struct stat statBuf;
+        formerGetattr(formerCache, acPath, &statBuf);
+        statBuf.st_mode &= ~0700;
+        cache.putStat(acPath, statBuf);
+    }
+
+    struct stat statBuf;
+    unsigned long long ullSum(0);
+
+    double dStart(now());
+    for (int i = 0; i < iNumLookups; i++)
+    {
+        formerGetattr(formerCache, paths[i % iNumPaths].c_str(), &statBuf);
+        ullSum += statBuf.st_size;
+    }
+    const double dFormer(now() - dStart);
+
+    dStart = now();
+    for (int i = 0; i < iNumLookups; i++)
+    {
+        getattr(cache, paths[i % iNumPaths].c_str(), &statBuf);
+        ullSum -= statBuf.st_size;
+    }
+    const double dParsed(now() - dStart);
+
+    ::printf("getattr cache hit: stat output %.0f ns, parsed attributes %.0f ns (%s)\n", dFormer * 1e9 / iNumLookups, dParsed * 1e9 / iNumLookups, ullSum ? "MISMATCH" : "same results");
+
+    return(0);
+}
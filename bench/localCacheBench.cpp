@@ -0,0 +1,202 @@
+/*
+ * $Id$
+ *
+ * File:   localCacheBench.cpp
+ * Author: Werner Jaeger
+ *
+ * Copyright 2015 Werner Jaeger.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Creates, stats and removes cached files for 500k remote paths, once in a
+ * single flat directory the way the former makeLocalPath() did and once via
+ * LocalCache, and reports the times and the number of colliding paths.
+ *
+ * Usage: make bench, then localCacheBench [number of files] [work directory]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include "../src/localCache.h"
+
+using namespace std;
+
+static double now()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static string flatLocalPath(const string& strRootDir, const string& strPath)
+{
+    string strLocalPath(strPath);
+    for (size_t i = 0; i < strLocalPath.length(); i++)
+        if (strLocalPath[i] == '/')
+            strLocalPath[i] = '-';
+
+    return(strRootDir + strLocalPath);
+}
+
+/**
+ * Builds remote paths the way a copied photo library or source tree looks
+ * like, including pairs like /a/b-c and /a-b/c.
+ */
+static vector<string> remotePaths(unsigned int uiCount)
+{
+    vector<string> paths;
+    paths.reserve(uiCount);
+
+    char acPath[128];
+    for (unsigned int i = 0; i < uiCount; i++)
+    {
+        if (i % 10 == 9)
+            ::snprintf(acPath, sizeof(acPath), "/sdcard/src-%u/mod/f%u", i / 1000, i - 9);
+        else
+            ::snprintf(acPath, sizeof(acPath), "/sdcard/src/%u-mod/f%u", i / 1000, i);
+        paths.push_back(acPath);
+    }
+
+    return(paths);
+}
+
+static void touch(const string& strLocalPath)
+{
+    const int iFd(::open(strLocalPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    if (iFd != -1)
+        ::close(iFd);
+}
+
+static void report(const char* pcLayout, double dCreate, double dStat, double dList, double dRemove, unsigned int uiFiles, unsigned int uiCollisions)
+{
+    ::printf("%-8s create %7.2fs  stat %7.2fs  list root %7.3fs  remove %7.2fs  files %u  collisions %u\n", pcLayout, dCreate, dStat, dList, dRemove, uiFiles, uiCollisions);
+}
+
+static double listDir(const string& strDir)
+{
+    const double dStart(now());
+    DIR* pDir(::opendir(strDir.c_str()));
+    if (pDir)
+    {
+        while (::readdir(pDir))
+            ;
+        ::closedir(pDir);
+    }
+
+    return(now() - dStart);
+}
+
+static void benchFlat(const string& strRootDir, const vector<string>& paths)
+{
+    const string strDir(strRootDir + "flat/");
+    ::mkdir(strDir.c_str(), 0755);
+
+    unordered_set<string> localPaths;
+    double dStart(now());
+    for (const string& strPath : paths)
+    {
+        const string strLocalPath(flatLocalPath(strDir, strPath));
+        localPaths.insert(strLocalPath);
+        touch(strLocalPath);
+    }
+    const double dCreate(now() - dStart);
+
+    struct stat statBuf;
+    dStart = now();
+    for (const string& strPath : paths)
+        ::stat(flatLocalPath(strDir, strPath).c_str(), &statBuf);
+    const double dStat(now() - dStart);
+
+    const double dList(listDir(strDir));
+
+    dStart = now();
+    for (const string& strLocalPath : localPaths)
+        ::unlink(strLocalPath.c_str());
+    const double dRemove(now() - dStart);
+    ::rmdir(strDir.c_str());
+
+    report("flat", dCreate, dStat, dList, dRemove, localPaths.size(), paths.size() - localPaths.size());
+}
+
+static void benchHashed(const string& strRootDir, const vector<string>& paths)
+{
+    const string strDir(strRootDir + "hashed/");
+    ::mkdir(strDir.c_str(), 0755);
+
+    LocalCache cache;
+    cache.rootDir(strDir);
+
+    unordered_set<string> localPaths;
+    double dStart(now());
+    for (const string& strPath : paths)
+    {
+        const string strLocalPath(cache.localPath(strPath.c_str()));
+        localPaths.insert(strLocalPath);
+        touch(strLocalPath);
+    }
+    const double dCreate(now() - dStart);
+
+    struct stat statBuf;
+    dStart = now();
+    for (const string& strPath : paths)
+        ::stat(cache.localPath(strPath.c_str()).c_str(), &statBuf);
+    const double dStat(now() - dStart);
+
+    const double dList(listDir(strDir + "files/"));
+
+    dStart = now();
+    for (const string& strPath : paths)
+        cache.remove(strPath.c_str());
+    const double dRemove(now() - dStart);
+
+    const string strCommand("rm -rf '" + strDir + "'");
+    if (::system(strCommand.c_str()) != 0)
+        ::fprintf(stderr, "failed to remove %s\n", strDir.c_str());
+
+    report("hashed", dCreate, dStat, dList, dRemove, localPaths.size(), paths.size() - localPaths.size());
+}
+
+int main(int argc, char** argv)
+{
+    const unsigned int uiCount(argc > 1 ? ::strtoul(argv[1], NULL, 10) : 500000);
+
+    char acDir[PATH_MAX];
+    ::snprintf(acDir, sizeof(acDir), "%s/adbncfs-bench-XXXXXX", argc > 2 ? argv[2] : "/tmp");
+    if (!::mkdtemp(acDir))
+    {
+        ::perror(acDir);
+        return(1);
+    }
+
+    const string strRootDir(string(acDir) + "/");
+    const vector<string> paths(remotePaths(uiCount));
+
+    ::printf("%u remote paths in %s\n", uiCount, acDir);
+    benchFlat(strRootDir, paths);
+    benchHashed(strRootDir, paths);
+
+    ::rmdir(acDir);
+
+    return(0);
+}
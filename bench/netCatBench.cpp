@@ -0,0 +1,417 @@
+/*
+ * $Id$
+ *
+ * File:   netCatBench.cpp
+ * Author: Werner Jaeger
+ *
+ * Copyright 2015 Werner Jaeger.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Runs short commands from a growing number of threads over a single channel
+ * to a local shell, once holding the channel for the whole round trip like
+ * execCommandViaNetCat() did, once only for writing the command while a
+ * reader thread completes the commands in order like execCommandViaNetCat()
+ * does now. The shell stands in for the device, the channel delays every line
+ * in both directions, standing in for the adb port forwarding.
+ *
+ * Usage: make bench, then netCatBench [latency in ms] [number of commands]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <string>
+#include <deque>
+
+using namespace std;
+
+/** end of command marker */
+static const char* pcDone = "---eoc---";
+
+static double now()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/**
+ * Copies lines from one file descriptor to another, every line delayed by a
+ * fixed latency, lines following each other closely are not delayed more.
+ */
+class DelayLine
+{
+public:
+    DelayLine(int iInFd, int iOutFd, double dLatency) : m_pIn(::fdopen(iInFd, "r")), m_pOut(::fdopen(iOutFd, "w")), m_dLatency(dLatency), m_fEof(false)
+    {
+        ::pthread_mutex_init(&m_Mutex, NULL);
+        ::pthread_cond_init(&m_Cond, NULL);
+        ::pthread_create(&m_Reader, NULL, readerMain, this);
+        ::pthread_create(&m_Writer, NULL, writerMain, this);
+    }
+
+    /**
+     * Waits until the input is closed and all lines are written, then closes
+     * the output.
+     */
+    ~DelayLine()
+    {
+        ::pthread_join(m_Reader, NULL);
+        ::pthread_join(m_Writer, NULL);
+        ::pthread_mutex_destroy(&m_Mutex);
+        ::pthread_cond_destroy(&m_Cond);
+        ::fclose(m_pIn);
+    }
+
+private:
+    /** Prevent copy-construction */
+    DelayLine(const DelayLine& orig);
+
+    /** Prevent assignment */
+    DelayLine& operator=(const DelayLine& orig);
+
+    static void* readerMain(void* pvArg)
+    {
+        DelayLine* pThis(static_cast<DelayLine*>(pvArg));
+
+        char acLine[4096];
+        while (::fgets(acLine, sizeof(acLine), pThis->m_pIn))
+        {
+            ::pthread_mutex_lock(&pThis->m_Mutex);
+            pThis->m_Lines.push_back(make_pair(now() + pThis->m_dLatency, string(acLine)));
+            ::pthread_cond_signal(&pThis->m_Cond);
+            ::pthread_mutex_unlock(&pThis->m_Mutex);
+        }
+
+        ::pthread_mutex_lock(&pThis->m_Mutex);
+        pThis->m_fEof = true;
+        ::pthread_cond_signal(&pThis->m_Cond);
+        ::pthread_mutex_unlock(&pThis->m_Mutex);
+
+        return(NULL);
+    }
+
+    static void* writerMain(void* pvArg)
+    {
+        DelayLine* pThis(static_cast<DelayLine*>(pvArg));
+
+        ::pthread_mutex_lock(&pThis->m_Mutex);
+        for (;;)
+        {
+            while (pThis->m_Lines.empty() && !pThis->m_fEof)
+                ::pthread_cond_wait(&pThis->m_Cond, &pThis->m_Mutex);
+
+            if (pThis->m_Lines.empty())
+                break;
+
+            const pair<double, string> line(pThis->m_Lines.front());
+            pThis->m_Lines.pop_front();
+            ::pthread_mutex_unlock(&pThis->m_Mutex);
+
+            const double dWait(line.first - now());
+            if (dWait > 0)
+            {
+                struct timespec ts;
+                ts.tv_sec = (time_t)dWait;
+                ts.tv_nsec = (long)((dWait - ts.tv_sec) * 1e9);
+                ::nanosleep(&ts, NULL);
+            }
+
+            ::fputs(line.second.c_str(), pThis->m_pOut);
+
+            ::pthread_mutex_lock(&pThis->m_Mutex);
+            if (pThis->m_Lines.empty())
+                ::fflush(pThis->m_pOut);
+        }
+        ::pthread_mutex_unlock(&pThis->m_Mutex);
+
+        ::fclose(pThis->m_pOut);
+
+        return(NULL);
+    }
+
+    FILE* m_pIn;
+    FILE* m_pOut;
+    const double m_dLatency;
+    pthread_t m_Reader;
+    pthread_t m_Writer;
+    pthread_mutex_t m_Mutex;
+    pthread_cond_t m_Cond;
+    deque<pair<double, string> > m_Lines;
+    bool m_fEof;
+};
+
+/**
+ * A shell connected via two DelayLine, the counterpart of pNetCat in
+ * adbncfs.cpp.
+ */
+class Channel
+{
+public:
+    Channel(double dLatency) : m_pUp(NULL), m_pDown(NULL)
+    {
+        int aiToUp[2], aiToShell[2], aiFromShell[2], aiFromDown[2];
+        if (::pipe(aiToUp) || ::pipe(aiToShell) || ::pipe(aiFromShell) || ::pipe(aiFromDown))
+        {
+            ::perror("pipe");
+            ::exit(1);
+        }
+
+        m_iShellPid = ::fork();
+        if (m_iShellPid == 0)
+        {
+            ::dup2(aiToShell[0], 0);
+            ::dup2(aiFromShell[1], 1);
+            for (int iFd = 3; iFd < 64; iFd++)
+                ::close(iFd);
+            ::execlp("sh", "sh", (char*)NULL);
+            ::_exit(127);
+        }
+
+        ::close(aiToShell[0]);
+        ::close(aiFromShell[1]);
+
+        m_pUp = new DelayLine(aiToUp[0], aiToShell[1], dLatency);
+        m_pDown = new DelayLine(aiFromShell[0], aiFromDown[1], dLatency);
+        m_pWrite = ::fdopen(aiToUp[1], "w");
+        m_pRead = ::fdopen(aiFromDown[0], "r");
+    }
+
+    ~Channel()
+    {
+        ::fclose(m_pRead);
+    }
+
+    /**
+     * Lets the shell exit and waits until all its output passed the channel,
+     * read() returns false then.
+     */
+    void close()
+    {
+        ::fclose(m_pWrite);
+        delete m_pUp;
+        ::waitpid(m_iShellPid, NULL, 0);
+        delete m_pDown;
+    }
+
+    void write(const string& strCommand)
+    {
+        ::fprintf(m_pWrite, "%s\necho '%s'\n", strCommand.c_str(), pcDone);
+        ::fflush(m_pWrite);
+    }
+
+    /**
+     * Reads the output of the oldest command written.
+     *
+     * @return false if the shell closed its output.
+     */
+    bool read(deque<string>* pOutput)
+    {
+        char acLine[4096];
+        while (::fgets(acLine, sizeof(acLine), m_pRead))
+        {
+            if (::strstr(acLine, pcDone))
+                return(true);
+
+            pOutput->push_back(string(acLine, ::strlen(acLine) - 1));
+        }
+
+        return(false);
+    }
+
+private:
+    /** Prevent copy-construction */
+    Channel(const Channel& orig);
+
+    /** Prevent assignment */
+    Channel& operator=(const Channel& orig);
+
+    pid_t m_iShellPid;
+    DelayLine* m_pUp;
+    DelayLine* m_pDown;
+    FILE* m_pWrite;
+    FILE* m_pRead;
+};
+
+static Channel* pChannel(NULL);
+static pthread_mutex_t cmdMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pendingMutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct Request
+{
+    deque<string> output;
+    bool fDone;
+    pthread_cond_t doneCond;
+};
+
+static deque<Request*> pending;
+
+/**
+ * execCommandViaNetCat() before, the channel is held for the round trip.
+ */
+static deque<string> execBlocking(const string& strCommand)
+{
+    deque<string> output;
+
+    ::pthread_mutex_lock(&cmdMutex);
+    pChannel->write(strCommand);
+    pChannel->read(&output);
+    ::pthread_mutex_unlock(&cmdMutex);
+
+    return(output);
+}
+
+/**
+ * ncReaderThreadMain() in adbncfs.cpp.
+ */
+static void* readerMain(void* pvArg)
+{
+    deque<string> output;
+    while (pChannel->read(&output))
+    {
+        ::pthread_mutex_lock(&pendingMutex);
+        Request* pRequest(pending.front());
+        pending.pop_front();
+        pRequest->output.swap(output);
+        pRequest->fDone = true;
+        ::pthread_cond_signal(&pRequest->doneCond);
+        ::pthread_mutex_unlock(&pendingMutex);
+
+        output.clear();
+    }
+
+    return(NULL);
+}
+
+/**
+ * execCommandViaNetCat() now, the channel is held for writing the command.
+ */
+static deque<string> execPipelined(const string& strCommand)
+{
+    Request request;
+    request.fDone = false;
+    ::pthread_cond_init(&request.doneCond, NULL);
+
+    ::pthread_mutex_lock(&cmdMutex);
+    ::pthread_mutex_lock(&pendingMutex);
+    pending.push_back(&request);
+    ::pthread_mutex_unlock(&pendingMutex);
+    pChannel->write(strCommand);
+    ::pthread_mutex_unlock(&cmdMutex);
+
+    ::pthread_mutex_lock(&pendingMutex);
+    while (!request.fDone)
+        ::pthread_cond_wait(&request.doneCond, &pendingMutex);
+    ::pthread_mutex_unlock(&pendingMutex);
+
+    ::pthread_cond_destroy(&request.doneCond);
+
+    return(request.output);
+}
+
+struct Worker
+{
+    deque<string> (*pfnExec)(const string&);
+    unsigned int uiCommands;
+    unsigned int uiFirst;
+    unsigned int uiErrors;
+};
+
+static void* workerMain(void* pvArg)
+{
+    Worker* pWorker(static_cast<Worker*>(pvArg));
+
+    char acCommand[64];
+    for (unsigned int i = 0; i < pWorker->uiCommands; i++)
+    {
+        const unsigned int uiId(pWorker->uiFirst + i);
+        ::snprintf(acCommand, sizeof(acCommand), "echo %u", uiId);
+
+        const deque<string> output(pWorker->pfnExec(acCommand));
+        if (output.size() != 1 || ::strtoul(output.front().c_str(), NULL, 10) != uiId)
+            pWorker->uiErrors++;
+    }
+
+    return(NULL);
+}
+
+/**
+ * Runs uiCommands commands from uiThreads threads.
+ *
+ * @return the elapsed seconds.
+ */
+static double run(deque<string> (*pfnExec)(const string&), unsigned int uiThreads, unsigned int uiCommands, unsigned int* puiErrors)
+{
+    deque<pthread_t> threads(uiThreads);
+    deque<Worker> workers(uiThreads);
+
+    const double dStart(now());
+    for (unsigned int i = 0; i < uiThreads; i++)
+    {
+        workers[i].pfnExec = pfnExec;
+        workers[i].uiCommands = uiCommands / uiThreads;
+        workers[i].uiFirst = i * workers[i].uiCommands;
+        workers[i].uiErrors = 0;
+        ::pthread_create(&threads[i], NULL, workerMain, &workers[i]);
+    }
+
+    for (unsigned int i = 0; i < uiThreads; i++)
+    {
+        ::pthread_join(threads[i], NULL);
+        *puiErrors += workers[i].uiErrors;
+    }
+
+    return(now() - dStart);
+}
+
+int main(int argc, char** argv)
+{
+    const double dLatency((argc > 1 ? ::strtod(argv[1], NULL) : 2.0) / 1000);
+    const unsigned int uiCommands(argc > 2 ? ::strtoul(argv[2], NULL, 10) : 2048);
+    const unsigned int auiThreads[] = { 1, 4, 16, 64, 256 };
+
+    ::signal(SIGPIPE, SIG_IGN);
+
+    ::printf("%u commands, %.1f ms latency each way\n", uiCommands, dLatency * 1000);
+    ::printf("threads   blocking commands/s   pipelined commands/s\n");
+
+    for (unsigned int i = 0; i < sizeof(auiThreads) / sizeof(*auiThreads); i++)
+    {
+        unsigned int uiErrors(0);
+
+        pChannel = new Channel(dLatency);
+        const double dBlocking(run(execBlocking, auiThreads[i], uiCommands, &uiErrors));
+        pChannel->close();
+        delete pChannel;
+
+        pChannel = new Channel(dLatency);
+        pthread_t reader;
+        ::pthread_create(&reader, NULL, readerMain, NULL);
+        const double dPipelined(run(execPipelined, auiThreads[i], uiCommands, &uiErrors));
+        pChannel->close();
+        ::pthread_join(reader, NULL);
+        delete pChannel;
+
+        ::printf("%7u %22.0f %22.0f%s\n", auiThreads[i], uiCommands / dBlocking, uiCommands / dPipelined, uiErrors ? "  WRONG OUTPUT" : "");
+    }
+
+    return(0);
+}
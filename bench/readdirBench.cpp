@@ -0,0 +1,160 @@
+/*
+ * $Id$
+ *
+ * File:   readdirBench.cpp
+ * Author: Werner Jaeger
+ *
+ * Copyright 2015 Werner Jaeger.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Lists directories of 100, 1,000 and 10,000 files the way adbncfs did
+ * before, ls -1a followed by one stat -t per entry, and with a single stat -t
+ * on all entries. Every command is run by a local shell with busybox in front
+ * like sharedShell() sends it, standing in for a round trip to the device, a
+ * real round trip via adb and netcat takes considerably longer.
+ *
+ * Usage: make bench, then readdirBench [work directory], busybox must be in
+ * the PATH
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <deque>
+
+using namespace std;
+
+static double now()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/**
+ * Runs a command like sharedShell() does, as busybox applet, and returns its
+ * output lines.
+ */
+static deque<string> shell(const string& strCommand)
+{
+    deque<string> output;
+
+    FILE* pPipe(::popen(("busybox " + strCommand).c_str(), "r"));
+    if (pPipe)
+    {
+        char acLine[PATH_MAX + 256];
+        while (::fgets(acLine, sizeof(acLine), pPipe))
+            output.push_back(acLine);
+        ::pclose(pPipe);
+    }
+
+    return(output);
+}
+
+static void createFiles(const string& strDir, unsigned int uiCount)
+{
+    ::mkdir(strDir.c_str(), 0755);
+
+    char acName[32];
+    for (unsigned int i = 0; i < uiCount; i++)
+    {
+        ::snprintf(acName, sizeof(acName), "/IMG_%05u.jpg", i);
+        const int iFd(::open((strDir + acName).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+        if (iFd != -1)
+            ::close(iFd);
+    }
+}
+
+/**
+ * The former adbnc_opendir() and adbnc_readdir() on a cold cache.
+ */
+static unsigned int listPerEntry(const string& strDir)
+{
+    const deque<string> names(shell("ls -1a '" + strDir + "'"));
+
+    unsigned int uiLines(0);
+    for (deque<string>::size_type i = 2; i < names.size(); i++)
+    {
+        const string strName(names[i].substr(0, names[i].length() - 1));
+        uiLines += shell("stat -t '" + strDir + "/" + strName + "'").size();
+    }
+
+    return(uiLines);
+}
+
+/**
+ * The command listDirectory() in adbncfs.cpp hands to sharedShell().
+ */
+static string listingCommand(const string& strDir)
+{
+    const string strPrefix(strDir + "/");
+
+    string strCommand("stat -t --");
+    const char* const apcPatterns[] = { ".", "..", ".*", "*", NULL };
+    for (int i = 0; apcPatterns[i]; i++)
+        strCommand.append(" '").append(strPrefix).append("'").append(apcPatterns[i]);
+    strCommand.append(" 2>/dev/null");
+
+    return(strCommand);
+}
+
+/**
+ * listDirectory() in adbncfs.cpp on a cold cache.
+ */
+static unsigned int listAtOnce(const string& strDir)
+{
+    return(shell(listingCommand(strDir)).size());
+}
+
+int main(int argc, char** argv)
+{
+    char acDir[PATH_MAX];
+    ::snprintf(acDir, sizeof(acDir), "%s/adbncfs-bench-XXXXXX", argc > 1 ? argv[1] : "/tmp");
+    if (!::mkdtemp(acDir))
+    {
+        ::perror(acDir);
+        return(1);
+    }
+
+    const unsigned int auiCounts[] = { 100, 1000, 10000 };
+    for (unsigned int i = 0; i < sizeof(auiCounts) / sizeof(auiCounts[0]); i++)
+    {
+        char acSubDir[PATH_MAX];
+        ::snprintf(acSubDir, sizeof(acSubDir), "%s/%u", acDir, auiCounts[i]);
+        createFiles(acSubDir, auiCounts[i]);
+
+        double dStart(now());
+        const unsigned int uiPerEntry(listPerEntry(acSubDir));
+        const double dPerEntry(now() - dStart);
+
+        dStart = now();
+        const unsigned int uiAtOnce(listAtOnce(acSubDir));
+        const double dAtOnce(now() - dStart);
+
+        ::printf("%5u entries: ls and stat per entry %8.3fs (%u commands), stat all entries %6.3fs (1 command, %u lines)\n", auiCounts[i], dPerEntry, uiPerEntry + 1, dAtOnce, uiAtOnce);
+    }
+
+    const string strCommand("rm -rf '" + string(acDir) + "'");
+    if (::system(strCommand.c_str()) != 0)
+        ::fprintf(stderr, "failed to remove %s\n", acDir);
+
+    return(0);
+}
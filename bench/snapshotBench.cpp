@@ -0,0 +1,264 @@
+/*
+ * $Id$
+ *
+ * File:   snapshotBench.cpp
+ * Author: Werner Jaeger
+ *
+ * Copyright 2015 Werner Jaeger.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Browses a tree of 50,000 files in 500 directories right after mounting,
+ * once with empty caches, every directory listed with a single stat -t like
+ * listDirectory() does, and once with the caches restored from a snapshot,
+ * every listing revalidated with the modification time of its directory and
+ * listed again afterwards, like the refresh thread does in the background.
+ * Every command is run by a local shell with busybox in front like
+ * sharedShell() sends it, standing in for a round trip to the device, a real
+ * round trip via adb and netcat takes considerably longer.
+ *
+ * Usage: make bench, then snapshotBench [number of directories] [work directory],
+ * busybox must be in the PATH
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <deque>
+#include <algorithm>
+#include "../src/fileInfoCache.h"
+
+using namespace std;
+
+/** Files per directory */
+static const unsigned int uiFilesPerDir(100);
+
+/** FileStatus in fileinfoCache.cpp refers to these, they are not called here */
+int adbncPush(const string& strLocalSource, const string& strRemoteDestination) { return(0); }
+int adbncShell(const string& strCommand) { return(0); }
+
+static double now()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/**
+ * Runs a command like sharedShell() does, as busybox applet, and returns its
+ * output lines.
+ */
+static deque<string> shell(const string& strCommand)
+{
+    deque<string> output;
+
+    FILE* pPipe(::popen(("busybox " + strCommand).c_str(), "r"));
+    if (pPipe)
+    {
+        char acLine[PATH_MAX + 256];
+        while (::fgets(acLine, sizeof(acLine), pPipe))
+            output.push_back(string(acLine, ::strlen(acLine) - 1));
+        ::pclose(pPipe);
+    }
+
+    return(output);
+}
+
+static string dirPath(const string& strRootDir, unsigned int uiDir)
+{
+    char acDir[32];
+    ::snprintf(acDir, sizeof(acDir), "/DIR_%03u", uiDir);
+    return(strRootDir + acDir);
+}
+
+static void createTree(const string& strRootDir, unsigned int uiDirs)
+{
+    char acName[32];
+    for (unsigned int i = 0; i < uiDirs; i++)
+    {
+        const string strDir(dirPath(strRootDir, i));
+        ::mkdir(strDir.c_str(), 0755);
+
+        for (unsigned int j = 0; j < uiFilesPerDir; j++)
+        {
+            ::snprintf(acName, sizeof(acName), "/IMG_%05u.jpg", j);
+            const int iFd(::open((strDir + acName).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+            if (iFd != -1)
+                ::close(iFd);
+        }
+    }
+}
+
+/**
+ * The command listDirectory() in adbncfs.cpp hands to sharedShell().
+ */
+static string listingCommand(const string& strDir)
+{
+    const string strPrefix(strDir + "/");
+
+    string strCommand("stat -t --");
+    const char* const apcPatterns[] = { ".", "..", ".*", "*", NULL };
+    for (int i = 0; apcPatterns[i]; i++)
+        strCommand.append(" '").append(strPrefix).append("'").append(apcPatterns[i]);
+    strCommand.append(" 2>/dev/null");
+
+    return(strCommand);
+}
+
+/**
+ * listDirectory() in adbncfs.cpp on a cold cache, names never contain blanks
+ * here.
+ */
+static void listDirectory(const string& strDir, FileCache* pFileCache, DirCache* pDirCache)
+{
+    const deque<string> output(shell(listingCommand(strDir)));
+
+    deque<string> names;
+    struct stat statBuf;
+    ::memset(&statBuf, 0, sizeof(statBuf));
+    for (deque<string>::const_iterator it(output.begin()); it != output.end(); ++it)
+    {
+        // the entries are named with the directory in front
+        const string strEntry(it->substr(strDir.length() + 1));
+        const string strName(strEntry.substr(0, strEntry.find(' ')));
+        if (find(names.begin(), names.end(), strName) != names.end())
+            continue;
+
+        statBuf.st_size = ::strtoll(strEntry.c_str() + strName.length(), NULL, 10);
+        names.push_back(strName);
+
+        if (strName == ".")
+            pFileCache->putStat(strDir.c_str(), statBuf);
+        else if (strName != "..")
+            pFileCache->putStat((strDir + "/" + strName).c_str(), statBuf);
+    }
+
+    pDirCache->put(strDir.c_str(), names, 0);
+}
+
+/**
+ * listDirectory() in adbncfs.cpp on a restored cache, with the lookup of
+ * attributesCached().
+ *
+ * @param pfRefresh set to true if the directory has to be listed again in the
+ *        background, unchanged otherwise.
+ */
+static bool revalidateDirectory(const string& strDir, FileCache* pFileCache, DirCache* pDirCache, bool* pfRefresh)
+{
+    const deque<string> output(shell("stat -c '%Y' '" + strDir + "'"));
+
+    deque<string> names;
+    struct stat statBuf;
+    bool fRefresh;
+    if (output.empty() || !pDirCache->revalidate(strDir.c_str(), 0) || !pDirCache->get(strDir.c_str(), &names))
+        return(false);
+
+    for (deque<string>::size_type i = 2; i < names.size(); i++)
+    {
+        if (!pFileCache->getStat((strDir + "/" + names[i]).c_str(), &statBuf, &fRefresh))
+            return(false);
+
+        if (fRefresh)
+            *pfRefresh = true;
+    }
+
+    return(true);
+}
+
+int main(int argc, char** argv)
+{
+    const unsigned int uiDirs(argc > 1 ? ::strtoul(argv[1], NULL, 10) : 500);
+
+    char acDir[PATH_MAX];
+    ::snprintf(acDir, sizeof(acDir), "%s/adbncfs-bench-XXXXXX", argc > 2 ? argv[2] : "/tmp");
+    if (!::mkdtemp(acDir))
+    {
+        ::perror(acDir);
+        return(1);
+    }
+
+    const string strRootDir(acDir);
+    const string strSnapshot(strRootDir + "/snapshot");
+    createTree(strRootDir, uiDirs);
+
+    ::printf("%u files in %u directories in %s\n", uiDirs * uiFilesPerDir, uiDirs, acDir);
+
+    // first mount
+    {
+        FileCache fileCache;
+        DirCache dirCache;
+
+        const double dStart(now());
+        for (unsigned int i = 0; i < uiDirs; i++)
+            listDirectory(dirPath(strRootDir, i), &fileCache, &dirCache);
+        const double dBrowse(now() - dStart);
+
+        const double dSaveStart(now());
+        CacheSnapshot::save(strSnapshot.c_str(), fileCache, dirCache);
+        const double dSave(now() - dSaveStart);
+
+        struct stat statBuf;
+        ::stat(strSnapshot.c_str(), &statBuf);
+        ::printf("without snapshot: browse %7.3fs, save snapshot %6.3fs, %lld bytes\n", dBrowse, dSave, (long long)statBuf.st_size);
+    }
+
+    // next mount
+    {
+        FileCache fileCache;
+        DirCache dirCache;
+
+        double dStart(now());
+        CacheSnapshot::load(strSnapshot.c_str(), &fileCache, &dirCache);
+        const double dLoad(now() - dStart);
+
+        unsigned int uiRevalidated(0);
+        deque<string> refreshes;
+        dStart = now();
+        for (unsigned int i = 0; i < uiDirs; i++)
+        {
+            bool fRefresh(false);
+            if (revalidateDirectory(dirPath(strRootDir, i), &fileCache, &dirCache, &fRefresh))
+            {
+                uiRevalidated++;
+                if (fRefresh)
+                    refreshes.push_back(dirPath(strRootDir, i));
+            }
+            else
+                listDirectory(dirPath(strRootDir, i), &fileCache, &dirCache);
+        }
+        const double dBrowse(now() - dStart);
+
+        // the refresh thread's share, not waited for by the browsing
+        dStart = now();
+        for (deque<string>::const_iterator it(refreshes.begin()); it != refreshes.end(); ++it)
+            listDirectory(*it, &fileCache, &dirCache);
+        const double dRefresh(now() - dStart);
+
+        ::printf("with snapshot:    browse %7.3fs, load snapshot %6.3fs, %u of %u listings revalidated\n", dBrowse, dLoad, uiRevalidated, uiDirs);
+        ::printf("                  %zu listings refreshed in the background in %6.3fs\n", refreshes.size(), dRefresh);
+    }
+
+    const string strCommand("rm -rf '" + strRootDir + "'");
+    if (::system(strCommand.c_str()) != 0)
+        ::fprintf(stderr, "failed to remove %s\n", acDir);
+
+    return(0);
+}
@@ -0,0 +1,138 @@
+/*
+ * $Id$
+ *
+ * File:   spawnBench.cpp
+ * Author: Werner Jaeger
+ *
+ * Copyright 2015 Werner Jaeger.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * Measures how long it takes to run true(1) like execProg() runs adb, while
+ * the process holds a growing amount of memory, standing in for the caches of
+ * a long running adbncfs. Once with Spawn, once with fork() and exec like
+ * Spawn did before.
+ *
+ * Usage: make bench, then spawnBench [maximum MiB] [spawns per size]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string>
+#include "../src/spawn.h"
+
+using namespace std;
+
+static double now()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/**
+ * execProg() in adbncfs.cpp, reads the output until the child terminates.
+ */
+static void spawnTrue()
+{
+    const char* const argv[] = { "true", NULL };
+    Spawn cmd(argv, false, true);
+
+    string strLine;
+    while (!getline(cmd.inStream(), strLine).eof());
+
+    cmd.sendEof();
+    cmd.wait();
+}
+
+/**
+ * Spawn::Spawn() before, fork() followed by exec.
+ */
+static void forkTrue()
+{
+    int aiIn[2], aiOut[2];
+    if (::pipe(aiIn) || ::pipe(aiOut))
+        return;
+
+    const pid_t iPid(::fork());
+    if (iPid == 0)
+    {
+        ::dup2(aiIn[0], STDIN_FILENO);
+        ::dup2(aiOut[1], STDOUT_FILENO);
+        ::close(aiIn[0]);
+        ::close(aiIn[1]);
+        ::close(aiOut[0]);
+        ::close(aiOut[1]);
+        ::execlp("true", "true", (char*)NULL);
+        ::_exit(127);
+    }
+
+    ::close(aiIn[0]);
+    ::close(aiOut[1]);
+
+    char acBuf[256];
+    while (::read(aiOut[0], acBuf, sizeof(acBuf)) > 0);
+
+    ::close(aiIn[1]);
+    ::close(aiOut[0]);
+    ::waitpid(iPid, NULL, 0);
+}
+
+/**
+ * @return the average microseconds per call of pfnSpawn.
+ */
+static double measure(void (*pfnSpawn)(), unsigned int uiSpawns)
+{
+    const double dStart(now());
+    for (unsigned int i = 0; i < uiSpawns; i++)
+        pfnSpawn();
+
+    return((now() - dStart) * 1e6 / uiSpawns);
+}
+
+int main(int argc, char** argv)
+{
+    const unsigned int uiMaxMb(argc > 1 ? ::strtoul(argv[1], NULL, 10) : 2048);
+    const unsigned int uiSpawns(argc > 2 ? ::strtoul(argv[2], NULL, 10) : 200);
+
+    ::printf("%u spawns of true per size\n", uiSpawns);
+    ::printf("    RSS MiB   posix_spawn us   fork+exec us\n");
+
+    unsigned int uiMb(0);
+    for (;;)
+    {
+        ::printf("%11u %16.0f %14.0f\n", uiMb, measure(spawnTrue, uiSpawns), measure(forkTrue, uiSpawns));
+        ::fflush(stdout);
+
+        const unsigned int uiNextMb(uiMb ? uiMb * 4 : 64);
+        if (uiNextMb > uiMaxMb)
+            break;
+
+        // touched, so it is resident and mapped by page tables
+        const size_t uiBytes((size_t)(uiNextMb - uiMb) * 1024 * 1024);
+        char* pcMemory(static_cast<char*>(::malloc(uiBytes)));
+        if (!pcMemory)
+            break;
+        ::memset(pcMemory, 1, uiBytes);
+
+        uiMb = uiNextMb;
+    }
+
+    return(0);
+}
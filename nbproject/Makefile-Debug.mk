@@ -37,6 +37,7 @@ OBJECTDIR=${CND_BUILDDIR}/${CND_CONF}/${CND_PLATFORM}
 OBJECTFILES= \
 	${OBJECTDIR}/src/adbncfs.o \
 	${OBJECTDIR}/src/fileinfoCache.o \
+	${OBJECTDIR}/src/localCache.o \
 	${OBJECTDIR}/src/main.o \
 	${OBJECTDIR}/src/mountInfo.o \
 	${OBJECTDIR}/src/spawn.o \
@@ -49,13 +50,19 @@ TESTDIR=${CND_BUILDDIR}/${CND_CONF}/${CND_PLATFORM}/tests
 TESTFILES= \
 	${TESTDIR}/TestFiles/f3 \
 	${TESTDIR}/TestFiles/f1 \
-	${TESTDIR}/TestFiles/f2
+	${TESTDIR}/TestFiles/f2 \
+	${TESTDIR}/TestFiles/f4 \
+	${TESTDIR}/TestFiles/f5
 
 # Test Object Files
 TESTOBJECTFILES= \
 	${TESTDIR}/tests/adbncFileSystemTestRunner.o \
+	${TESTDIR}/tests/fileCacheTestRunner.o \
+	${TESTDIR}/tests/localCacheTestRunner.o \
 	${TESTDIR}/tests/mountPointTestRunner.o \
 	${TESTDIR}/tests/testAdbncFileSystem.o \
+	${TESTDIR}/tests/testFileCache.o \
+	${TESTDIR}/tests/testLocalCache.o \
 	${TESTDIR}/tests/testMountPoint.o \
 	${TESTDIR}/tests/testUserInfo.o \
 	${TESTDIR}/tests/userInfoTestRunner.o
@@ -94,6 +101,11 @@ ${OBJECTDIR}/src/fileinfoCache.o: src/fileinfoCache.cpp
 	${RM} "$@.d"
 	$(COMPILE.cc) -g -DDEBUG -D_FILE_OFFSET_BITS=64 -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/src/fileinfoCache.o src/fileinfoCache.cpp
 
+${OBJECTDIR}/src/localCache.o: src/localCache.cpp 
+	${MKDIR} -p ${OBJECTDIR}/src
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -DDEBUG -D_FILE_OFFSET_BITS=64 -std=c++11 -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/src/localCache.o src/localCache.cpp
+
 ${OBJECTDIR}/src/main.o: src/main.cpp 
 	${MKDIR} -p ${OBJECTDIR}/src
 	${RM} "$@.d"
@@ -133,6 +145,14 @@ ${TESTDIR}/TestFiles/f2: ${TESTDIR}/tests/testUserInfo.o ${TESTDIR}/tests/userIn
 	${MKDIR} -p ${TESTDIR}/TestFiles
 	${LINK.cc}   -o ${TESTDIR}/TestFiles/f2 $^ ${LDLIBSOPTIONS} `cppunit-config --libs` `pkg-config --libs fuse`   
 
+${TESTDIR}/TestFiles/f4: ${TESTDIR}/tests/localCacheTestRunner.o ${TESTDIR}/tests/testLocalCache.o ${OBJECTFILES:%.o=%_nomain.o}
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc}   -o ${TESTDIR}/TestFiles/f4 $^ ${LDLIBSOPTIONS} `cppunit-config --libs` `pkg-config --libs fuse`   
+
+${TESTDIR}/TestFiles/f5: ${TESTDIR}/tests/fileCacheTestRunner.o ${TESTDIR}/tests/testFileCache.o ${OBJECTFILES:%.o=%_nomain.o}
+	${MKDIR} -p ${TESTDIR}/TestFiles
+	${LINK.cc}   -o ${TESTDIR}/TestFiles/f5 $^ ${LDLIBSOPTIONS} `cppunit-config --libs` `pkg-config --libs fuse`   
+
 
 ${TESTDIR}/tests/mountPointTestRunner.o: tests/mountPointTestRunner.cpp 
 	${MKDIR} -p ${TESTDIR}/tests
@@ -170,6 +190,30 @@ ${TESTDIR}/tests/userInfoTestRunner.o: tests/userInfoTestRunner.cpp
 	$(COMPILE.cc) -g -DDEBUG -D_FILE_OFFSET_BITS=64 -Isrc -std=c++11 `cppunit-config --cflags` -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/userInfoTestRunner.o tests/userInfoTestRunner.cpp
 
 
+${TESTDIR}/tests/localCacheTestRunner.o: tests/localCacheTestRunner.cpp 
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -DDEBUG -D_FILE_OFFSET_BITS=64 -Isrc -std=c++11 `cppunit-config --cflags` -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/localCacheTestRunner.o tests/localCacheTestRunner.cpp
+
+
+${TESTDIR}/tests/testLocalCache.o: tests/testLocalCache.cpp 
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -DDEBUG -D_FILE_OFFSET_BITS=64 -Isrc -std=c++11 `cppunit-config --cflags` -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/testLocalCache.o tests/testLocalCache.cpp
+
+
+${TESTDIR}/tests/fileCacheTestRunner.o: tests/fileCacheTestRunner.cpp 
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -DDEBUG -D_FILE_OFFSET_BITS=64 -Isrc -std=c++11 `cppunit-config --cflags` -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/fileCacheTestRunner.o tests/fileCacheTestRunner.cpp
+
+
+${TESTDIR}/tests/testFileCache.o: tests/testFileCache.cpp 
+	${MKDIR} -p ${TESTDIR}/tests
+	${RM} "$@.d"
+	$(COMPILE.cc) -g -DDEBUG -D_FILE_OFFSET_BITS=64 -Isrc -std=c++11 `cppunit-config --cflags` -MMD -MP -MF "$@.d" -o ${TESTDIR}/tests/testFileCache.o tests/testFileCache.cpp
+
+
 ${OBJECTDIR}/src/adbncfs_nomain.o: ${OBJECTDIR}/src/adbncfs.o src/adbncfs.cpp 
 	${MKDIR} -p ${OBJECTDIR}/src
 	@NMOUTPUT=`${NM} ${OBJECTDIR}/src/adbncfs.o`; \
@@ -196,6 +240,19 @@ ${OBJECTDIR}/src/fileinfoCache_nomain.o: ${OBJECTDIR}/src/fileinfoCache.o src/fi
 	    ${CP} ${OBJECTDIR}/src/fileinfoCache.o ${OBJECTDIR}/src/fileinfoCache_nomain.o;\
 	fi
 
+${OBJECTDIR}/src/localCache_nomain.o: ${OBJECTDIR}/src/localCache.o src/localCache.cpp 
+	${MKDIR} -p ${OBJECTDIR}/src
+	@NMOUTPUT=`${NM} ${OBJECTDIR}/src/localCache.o`; \
+	if (echo "$$NMOUTPUT" | ${GREP} '|main$$') || \
+	   (echo "$$NMOUTPUT" | ${GREP} 'T main$$') || \
+	   (echo "$$NMOUTPUT" | ${GREP} 'T _main$$'); \
+	then  \
+	    ${RM} "$@.d";\
+	    $(COMPILE.cc) -g -DDEBUG -D_FILE_OFFSET_BITS=64 -std=c++11 -Dmain=__nomain -MMD -MP -MF "$@.d" -o ${OBJECTDIR}/src/localCache_nomain.o src/localCache.cpp;\
+	else  \
+	    ${CP} ${OBJECTDIR}/src/localCache.o ${OBJECTDIR}/src/localCache_nomain.o;\
+	fi
+
 ${OBJECTDIR}/src/main_nomain.o: ${OBJECTDIR}/src/main.o src/main.cpp 
 	${MKDIR} -p ${OBJECTDIR}/src
 	@NMOUTPUT=`${NM} ${OBJECTDIR}/src/main.o`; \
@@ -255,6 +312,8 @@ ${OBJECTDIR}/src/userInfo_nomain.o: ${OBJECTDIR}/src/userInfo.o src/userInfo.cpp
 	    ${TESTDIR}/TestFiles/f3 || true; \
 	    ${TESTDIR}/TestFiles/f1 || true; \
 	    ${TESTDIR}/TestFiles/f2 || true; \
+	    ${TESTDIR}/TestFiles/f5 || true; \
+	    ${TESTDIR}/TestFiles/f4 || true; \
 	else  \
 	    ./${TEST} || true; \
 	fi
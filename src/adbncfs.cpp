@@ -22,14 +22,25 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <atomic>
+#include <algorithm>
 
 #include <sys/statvfs.h>
 #include <execinfo.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+#include <math.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include "adbncfs.h"
 #include "fileInfoCache.h"
+#include "localCache.h"
 #include "spawn.h"
 #include "userInfo.h"
 #include "mountInfo.h"
@@ -55,6 +66,354 @@ static const char* pcDone = "---eoc---";    // end of command marker
 /** Template used to makeTempDir() */
 static const char* pcTempDirTemplate = "/tmp/adbncfs-XXXXXX";
 
+/** Directory on the android device used to stage compressed transfers */
+static const char* pcRemoteStagingDir = "/data/local/tmp";
+
+/** Number of bytes sampled to probe the compressibility of a file */
+static const size_t uiCompressProbeSize(65536);
+
+/** A file is transferred compressed if a sample shrinks below this ratio */
+static const double dCompressMaxRatio(0.8);
+
+/**
+ * Extensions of file formats that are compressed already. Files of these
+ * types are never transferred compressed.
+ */
+static const char* const apcCompressedExtensions[] =
+{
+    "jpg", "jpeg", "png", "gif", "webp", "heic", "heif",
+    "mp4", "m4v", "m4a", "3gp", "mkv", "webm", "avi", "mov",
+    "mp3", "aac", "ogg", "oga", "opus", "flac", "amr",
+    "zip", "apk", "jar", "obb", "gz", "tgz", "bz2", "xz", "7z", "rar", "zst", "lz4",
+    NULL
+};
+
+/**
+ * Extensions of file formats known to compress well. Files of these types are
+ * transferred compressed without probing.
+ */
+static const char* const apcCompressibleExtensions[] =
+{
+    "txt", "log", "json", "xml", "html", "htm", "csv", "tsv", "sql",
+    "db", "sqlite", "sqlite3", "wal", "journal",
+    "conf", "cfg", "ini", "prop", "properties", "yaml", "yml",
+    "js", "css", "svg", "md", "bmp", "wav", "tar",
+    NULL
+};
+
+/** Echoed by modifyOnDevice() after a command succeeded */
+static const char* const pcCommandOk("---ok---");
+
+/** Maximum length of a stat command of statListingCommands(), far below ARG_MAX on the device */
+static const size_t uiMaxStatCommandLength(64 * 1024);
+
+/** An error message of a busybox command and the errno it stands for */
+struct DeviceError
+{
+    const char* pcMessage;
+    int iErrno;
+};
+
+/** Error messages recognized by parseCommandResult() */
+static const DeviceError aDeviceErrors[] =
+{
+    { "Permission denied", EACCES },
+    { "Operation not permitted", EPERM },
+    { "Read-only file system", EROFS },
+    { "No such file or directory", ENOENT },
+    { "File exists", EEXIST },
+    { "Directory not empty", ENOTEMPTY },
+    { "Not a directory", ENOTDIR },
+    { "Is a directory", EISDIR },
+    { "Device or resource busy", EBUSY },
+    { "No space left on device", ENOSPC },
+    { NULL, 0 }
+};
+
+/**
+ * Command line options specific to adbncfs.
+ *
+ * Parsed by fuse_opt_parse() in initAdbncFs(), all other options are passed on
+ * to fuse_main().
+ */
+struct AdbncOptions
+{
+    /** If not zero files are transferred gzip compressed if worthwhile */
+    int iCompress;
+
+    /** Files smaller than this number of KiB are never transferred compressed */
+    unsigned int uiCompressMinSizeKb;
+
+    /** If not zero files already in the blob store are not transferred again */
+    int iDedup;
+
+    /** Files smaller than this number of KiB are never deduplicated */
+    unsigned int uiDedupMinSizeKb;
+
+    /** Closed files are evicted from #localCache beyond this number of MiB, 0 for no limit */
+    unsigned int uiCacheSizeMb;
+
+    /** Seconds paths found missing are remembered in #fileCache, 0 to disable */
+    unsigned int uiNegativeCacheTimeout;
+
+    /** Seconds a listing in #dirCache is used without revalidation */
+    unsigned int uiDirCacheTimeout;
+
+    /** Maximum number of paths in #fileCache, 0 for no limit */
+    unsigned int uiAttrCacheEntries;
+
+    /** Maximum MiB of memory used by #fileCache, 0 for no limit */
+    unsigned int uiAttrCacheSizeMb;
+
+    /** Colon separated directories watched by #watcherThread, NULL for none */
+    char* pcWatch;
+
+    /** Seconds attributes of watched paths are cached */
+    unsigned int uiWatchTimeout;
+
+    /** If not zero the caches are saved on unmount and restored on mount */
+    int iSnapshot;
+
+    /** Seconds expired attributes are served while #refreshThread refreshes them, 0 to disable */
+    unsigned int uiAttrStaleTimeout;
+
+    /** Seconds the kernel caches names and attributes, 0 for FUSE's defaults, see addKernelTimeouts() */
+    unsigned int uiKernelTimeout;
+
+    /** Maximum number of adb processes run by execProg() at the same time, 0 for no limit */
+    unsigned int uiAdbProcesses;
+
+    /** If not zero the handshake with the device is completed after mounting, see handshakeThreadMain() */
+    int iLazyHandshake;
+
+    /** Seconds FUSE callbacks wait for the handshake, see awaitHandshake() */
+    unsigned int uiHandshakeTimeout;
+
+    /** If not zero netcat and port forwarding are left running on unmount, see saveSession() */
+    int iKeepSession;
+
+    /** Seconds file system statistics are reused by adbnc_statfs(), 0 to disable */
+    unsigned int uiStatfsTimeout;
+};
+
+/** Options as parsed in initAdbncFs() */
+static struct AdbncOptions options = { 0, 256, 1, 64, 1024, 30, 30, 262144, 64, NULL, 3600, 1, 30, 0, 4, 0, 30, 0, 10 };
+
+/** Templates used by fuse_opt_parse() to fill #options */
+static const struct fuse_opt adbncOpts[] =
+{
+    { "compress", offsetof(struct AdbncOptions, iCompress), 1 },
+    { "nocompress", offsetof(struct AdbncOptions, iCompress), 0 },
+    { "compress_min_size=%u", offsetof(struct AdbncOptions, uiCompressMinSizeKb), 0 },
+    { "dedup", offsetof(struct AdbncOptions, iDedup), 1 },
+    { "nodedup", offsetof(struct AdbncOptions, iDedup), 0 },
+    { "dedup_min_size=%u", offsetof(struct AdbncOptions, uiDedupMinSizeKb), 0 },
+    { "cache_size=%u", offsetof(struct AdbncOptions, uiCacheSizeMb), 0 },
+    { "negative_cache_timeout=%u", offsetof(struct AdbncOptions, uiNegativeCacheTimeout), 0 },
+    { "dir_cache_timeout=%u", offsetof(struct AdbncOptions, uiDirCacheTimeout), 0 },
+    { "attr_cache_entries=%u", offsetof(struct AdbncOptions, uiAttrCacheEntries), 0 },
+    { "attr_cache_size=%u", offsetof(struct AdbncOptions, uiAttrCacheSizeMb), 0 },
+    { "watch=%s", offsetof(struct AdbncOptions, pcWatch), 0 },
+    { "watch_timeout=%u", offsetof(struct AdbncOptions, uiWatchTimeout), 0 },
+    { "snapshot", offsetof(struct AdbncOptions, iSnapshot), 1 },
+    { "nosnapshot", offsetof(struct AdbncOptions, iSnapshot), 0 },
+    { "attr_stale_timeout=%u", offsetof(struct AdbncOptions, uiAttrStaleTimeout), 0 },
+    { "kernel_timeout=%u", offsetof(struct AdbncOptions, uiKernelTimeout), 0 },
+    { "adb_processes=%u", offsetof(struct AdbncOptions, uiAdbProcesses), 0 },
+    { "lazy_handshake", offsetof(struct AdbncOptions, iLazyHandshake), 1 },
+    { "nolazy_handshake", offsetof(struct AdbncOptions, iLazyHandshake), 0 },
+    { "handshake_timeout=%u", offsetof(struct AdbncOptions, uiHandshakeTimeout), 0 },
+    { "keep_session", offsetof(struct AdbncOptions, iKeepSession), 1 },
+    { "nokeep_session", offsetof(struct AdbncOptions, iKeepSession), 0 },
+    { "statfs_timeout=%u", offsetof(struct AdbncOptions, uiStatfsTimeout), 0 },
+    FUSE_OPT_END
+};
+
+/** Used by remoteStagingPath() to make staging file names unique */
+static atomic<unsigned long> ulStagingCount(0);
+
+/** Number of pulls served from the blob store, see pullToCache() */
+static atomic<unsigned long> ulDedupHits(0);
+
+/** Number of bytes not transferred because they were found in the blob store */
+static atomic<unsigned long long> ullDedupBytesAvoided(0);
+
+/** Number of opened files not pulled because the cached copy was current */
+static atomic<unsigned long> ulOpenCacheHits(0);
+
+/** Number of adbnc_getattr() calls by the kernel */
+static atomic<unsigned long> ulGetattrCalls(0);
+
+/** Number of directories opened with a listing from #dirCache */
+static atomic<unsigned long> ulDirCacheHits(0);
+
+/** Number of expired listings in #dirCache found unchanged */
+static atomic<unsigned long> ulDirCacheRevalidations(0);
+
+/** Thread logging statistics on SIGUSR1, see statisticsThreadMain() */
+static pthread_t statisticsThread;
+
+/** true if and only if #statisticsThread is started */
+static bool fStatisticsThreadStarted(false);
+
+/** Seconds between two runs of #evictionThread */
+static const int iEvictionIntervalSeconds(10);
+
+/** Thread evicting closed files from #localCache, see evictionThreadMain() */
+static pthread_t evictionThread;
+
+/** true if and only if #evictionThread is started */
+static bool fEvictionThreadStarted(false);
+
+/** Mutex protecting #fStopEviction */
+static pthread_mutex_t evictionMutex;
+
+/** Signaled to wake up #evictionThread early */
+static pthread_cond_t evictionCond;
+
+/** Set in adbnc_destroy() to let #evictionThread terminate */
+static bool fStopEviction(false);
+
+/** Seconds between two runs of #sweepThread */
+static const int iSweepIntervalSeconds(1);
+
+/** Maximum number of expired entries dropped per run of #sweepThread */
+static const unsigned long ulSweepEntries(4096);
+
+/** Thread dropping expired entries from #fileCache, see sweepThreadMain() */
+static pthread_t sweepThread;
+
+/** true if and only if #sweepThread is started */
+static bool fSweepThreadStarted(false);
+
+/** Mutex protecting #fStopSweep */
+static pthread_mutex_t sweepMutex;
+
+/** Signaled to let #sweepThread terminate */
+static pthread_cond_t sweepCond;
+
+/** Set in adbnc_destroy() to let #sweepThread terminate */
+static bool fStopSweep(false);
+
+/** Events inotifyd reports for watched directories, see watcherThreadMain() */
+static const char* const pcWatchMask("wemyndDMxu");
+
+/** Written by the watcher's shell once inotifyd is running */
+static const char* const pcWatching("--*-- watching");
+
+/** Thread applying change notifications of watched directories */
+static pthread_t watcherThread;
+
+/** true if and only if #watcherThread is started */
+static bool fWatcherThreadStarted(false);
+
+/** netcat process connected to the shell running inotifyd on the device */
+static Spawn* pWatcher = NULL;
+
+/** Number of change notifications received from the device */
+static atomic<unsigned long> ulWatchEvents(0);
+
+/** Maximum number of paths waiting for #refreshThread */
+static const size_t uiMaxRefreshQueue(1024);
+
+/** Thread refreshing stale and restored attributes in #fileCache, see refreshThreadMain() */
+static pthread_t refreshThread;
+
+/** true if and only if #refreshThread is started */
+static bool fRefreshThreadStarted(false);
+
+/** Mutex protecting #refreshQueue and #fStopRefresh */
+static pthread_mutex_t refreshMutex;
+
+/** Signaled when a path is queued or #fStopRefresh is set */
+static pthread_cond_t refreshCond;
+
+/** Paths to refresh, true to list the directory, see requestRefresh() */
+static deque<pair<string, bool> > refreshQueue;
+
+/** Set in adbnc_destroy() to let #refreshThread terminate */
+static bool fStopRefresh(false);
+
+/** Number of attributes and listings refreshed by #refreshThread */
+static atomic<unsigned long> ulRefreshes(0);
+
+/**
+ * A command written to #pNetCat by execCommandViaNetCat(), completed by
+ * #ncReaderThread once the command's end marker is read.
+ */
+struct NetCatRequest
+{
+    /** Lines written to stdout by the command */
+    deque<string> output;
+
+    /** true once #output is complete */
+    bool fDone;
+
+    /** Signaled when #fDone is set */
+    pthread_cond_t doneCond;
+};
+
+/**
+ * Thread reading the output of the commands in #ncPending, see
+ * ncReaderThreadMain().
+ */
+static pthread_t ncReaderThread;
+
+/** true if and only if #ncReaderThread is started */
+static bool fNcReaderThreadStarted(false);
+
+/**
+ * Mutex protecting #ncPending and #fNcClosed, never held while writing to or
+ * reading from #pNetCat.
+ */
+static pthread_mutex_t ncPendingMutex;
+
+/** Commands written to #pNetCat whose output is not read yet, oldest first */
+static deque<NetCatRequest*> ncPending;
+
+/** Set by #ncReaderThread when netcat closed its stdout */
+static bool fNcClosed(false);
+
+/** Maximum number of commands in #ncPending at the same time */
+static atomic<unsigned long> ulNcMaxInFlight(0);
+
+/** Parts of the handshake with the device FUSE callbacks may wait for */
+enum HandshakePart
+{
+    /** The device is found, adb can be used */
+    hpDevice = 1,
+
+    /** Commands can be executed via netcat */
+    hpNetCat = 2,
+
+    /** #pUserInfo is queried */
+    hpUserInfo = 4,
+
+    /** #pMountInfo is queried */
+    hpMountInfo = 8,
+
+    /** All parts */
+    hpAll = 15
+};
+
+/** Thread running the handshake if option lazy_handshake is given */
+static pthread_t handshakeThread;
+
+/** true if and only if #handshakeThread is started */
+static bool fHandshakeThreadStarted(false);
+
+/** Mutex protecting #uiHandshakeDone and #uiHandshakeFailed */
+static pthread_mutex_t handshakeMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Broadcast when parts of the handshake are done */
+static pthread_cond_t handshakeCond = PTHREAD_COND_INITIALIZER;
+
+/** HandshakePart flags of the parts done, successful or not */
+static unsigned int uiHandshakeDone(0);
+
+/** HandshakePart flags of the parts failed */
+static unsigned int uiHandshakeFailed(0);
+
 /**
  * Big Hack, don't now how to figure out wher sdcard on a phone is mounted.
  *
@@ -68,6 +427,15 @@ static const char* pcSdCardMountEntry = "sdcardfs on /storage/emulated/legacy ty
  */
 static string strTempDirPath;
 
+/** Serial number of the device as listed by adb devices */
+static string strDeviceSerial;
+
+/**
+ * Path of the snapshot of #fileCache and #dirCache of the device set in
+ * loadSnapshot(), empty if option nosnapshot is given.
+ */
+static string strSnapshotPath;
+
 /** Debug mode as set in initAdbncFs() */
 static bool fDebug(false);
 
@@ -77,11 +445,17 @@ static Spawn* pNetCat = NULL;
 static FileCache fileCache;
 static FileStatus fileStatus;
 
-/**
- * Map to store directory listing retrieved with adbnc_opendir() from android
- * device. Key is the pathname to the directory.
- */
-static map<string, deque<string> > openDirs;
+/** Directory listings retrieved by adbnc_opendir() */
+static DirCache dirCache;
+
+/** Shares device commands retrieving information between threads, see sharedShell() */
+static SingleFlight singleFlight;
+
+/** Limits the number of programs run by execProg() at the same time */
+static SpawnQueue spawnQueue;
+
+/** Maps remote paths to the files caching them within #strTempDirPath */
+static LocalCache localCache;
 
 /** Pointer to user info instance initialized in queryUserInfo() */
 static UserInfo* pUserInfo = NULL;
@@ -89,24 +463,51 @@ static UserInfo* pUserInfo = NULL;
 /** Pointer to mount info instance initialized in queryMountInfo() */
 static MountInfo* pMountInfo = NULL;
 
-/** Mutex to synchronize thread access to execCommandViaNetCat() */
-static pthread_mutex_t ncCmdMutex;
+/** Output of busybox id #pUserInfo is made of, kept by saveSession() */
+static string strUserInfoOutput;
 
-/** Mutex to synchronize thread access to adbnc_open() */
-static pthread_mutex_t openMutex;
+/** Output of busybox mount #pMountInfo is made of, kept by saveSession() */
+static deque<string> mountInfoOutput;
 
-/**
- * Mutex to synchronize thread access to adbnc_opendir() and adbnc_releasedir()
- */
-static pthread_mutex_t inReleaseDirMutex;
+/** First line of a session file written by saveSession() */
+static const char* const pcSessionMagic("ADBNCSS1");
+
+/** Directory on the device the identity token of a kept session is stored in */
+static const char* const pcDeviceSessionDir("/data/local/tmp");
+
+/** File system statistics of a volume on the device as cached by adbnc_statfs() */
+struct StatFsEntry
+{
+    /** The statistics as returned by statFsOnDevice() */
+    struct statvfs fst;
+
+    /** When the statistics were retrieved, clock_gettime(CLOCK_MONOTONIC) */
+    struct timespec fetched;
+};
+
+/** Statistics retrieved by adbnc_statfs(), key is the mount point, see statFsKey() */
+static map<string, StatFsEntry> statFsCache;
+
+/** Mutex protecting #statFsCache and #ulStatFsGeneration */
+static pthread_mutex_t statFsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Incremented by forgetStatFs(), so statistics retrieved before are not cached */
+static unsigned long ulStatFsGeneration(0);
+
+/** Pushing at least this number of bytes drops the statistics of the volume */
+static const off_t iStatFsWriteBytes(1024 * 1024);
+
+/** Number of adbnc_statfs() calls answered from #statFsCache */
+static atomic<unsigned long> ulStatFsCacheHits(0);
 
 /**
- * Condition to block adbnc_opendir() until adbnc_releasedir() is finished.
+ * Mutex to synchronize writing commands to #pNetCat in execCommandViaNetCat(),
+ * so they are queued in #ncPending in the order the device runs them.
  */
-static pthread_cond_t inReleaseDirCond;
+static pthread_mutex_t ncCmdMutex;
 
-/** Waited for condition variable */
-static bool fInReleaseDirCond(false);
+/** Mutex to synchronize thread access to adbnc_open() */
+static pthread_mutex_t openMutex;
 
 /**
  * Segmentation fault handler.
@@ -131,43 +532,201 @@ static void sig11Handler(int iSig)
 }
 
 /**
- * Spawns a netcat process on the local host with the local forward port.
+ * Writes the statistics collected since mount to stdout.
+ */
+static void logStatistics()
+{
+    INF("Statistics:");
+    INF("  deduplicated pulls: " << ulDedupHits);
+    INF("  bytes not transferred due to deduplication: " << ullDedupBytesAvoided);
+    INF("  paths remembered as missing: " << fileCache.negativeEntries());
+    INF("  lookups answered as missing from cache: " << fileCache.negativeHits());
+    INF("  paths in attribute cache: " << fileCache.entries() << " (" << fileCache.bytes() << " bytes, " << fileCache.bytesPerEntry() << " per path)");
+    INF("  paths evicted from attribute cache: " << fileCache.evictions() << ", expired: " << fileCache.expirations());
+    INF("  attribute requests from kernel: " << ulGetattrCalls);
+    INF("  device requests shared with a concurrent identical one: " << singleFlight.shared());
+    INF("  device commands in flight at most: " << ulNcMaxInFlight);
+    INF("  programs run: " << spawnQueue.spawns() << " (" << spawnQueue.spawnMicros() / 1000 << " ms spawning), waited for one of " << spawnQueue.limit() << " slots: " << spawnQueue.waits() << " (" << spawnQueue.waitMicros() / 1000 << " ms, longest " << spawnQueue.maxWaitMicros() / 1000 << " ms)");
+    INF("  lookups answered stale while refreshed (synchronous misses avoided): " << fileCache.staleHits() << " (" << ulRefreshes << " refreshed)");
+    INF("  change notifications from device: " << ulWatchEvents);
+    INF("  directory listings from cache: " << ulDirCacheHits << " (" << ulDirCacheRevalidations << " revalidated)");
+    INF("  opens served from local cache: " << ulOpenCacheHits);
+    INF("  bytes in local cache: " << localCache.bytes());
+    INF("  file system statistics from cache: " << ulStatFsCacheHits);
+    INF("  files evicted from local cache: " << localCache.evictions());
+}
+
+/**
+ * Start routine of #statisticsThread.
  *
- * Writes the used start command to stdout.
+ * Waits for SIGUSR1 and calls logStatistics() each time it is received.
+ * SIGUSR1 is blocked in all threads by initAdbncFs(), so it is delivered
+ * here only.
  *
- * @return a reference to the spawned netcat process is returned.
+ * @param pvArg not used.
+ *
+ * @return never returns, the thread is cancelled in adbnc_destroy().
  */
-static Spawn& initNetCat()
+static void* statisticsThreadMain(void* /*pvArg*/)
 {
-    if (!pNetCat)
+    sigset_t sigSet;
+    ::sigemptyset(&sigSet);
+    ::sigaddset(&sigSet, SIGUSR1);
+
+    for (;;)
     {
-        ostringstream strForward;
-        strForward << iForwardPort;
-        const char* const argv[] = { "nc", "localhost", strForward.str().c_str(), NULL };
+        int iSig;
+        if (::sigwait(&sigSet, &iSig) == 0)
+            logStatistics();
+    }
 
-        cout << "--*-- " << "spawn: ";
-        for (int i = 0; argv[i]; i++)
+    return(NULL);
+}
+
+/**
+ * Returns the disk budget of #localCache as set by option cache_size.
+ *
+ * @return the budget in bytes, 0 if there is no limit.
+ */
+static unsigned long long cacheBudget()
+{
+    return(options.uiCacheSizeMb * 1024ULL * 1024ULL);
+}
+
+/**
+ * Start routine of #evictionThread.
+ *
+ * Every #iEvictionIntervalSeconds seconds, or when signaled through
+ * #evictionCond, evicts least recently used closed and unmodified files from
+ * #localCache until it fits into cacheBudget().
+ *
+ * @param pvArg not used.
+ *
+ * @return NULL once #fStopEviction is set.
+ */
+static void* evictionThreadMain(void* /*pvArg*/)
+{
+    ::pthread_mutex_lock(&evictionMutex);
+
+    while (!fStopEviction)
+    {
+        struct timespec deadline;
+        ::clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += iEvictionIntervalSeconds;
+
+        ::pthread_cond_timedwait(&evictionCond, &evictionMutex, &deadline);
+
+        if (!fStopEviction)
         {
-            cout << argv[i];
-            if (argv[i+1])
-                cout << ", ";
+            ::pthread_mutex_unlock(&evictionMutex);
+
+            const unsigned long ulEvicted(localCache.evict(cacheBudget()));
+            if (ulEvicted)
+                DBG("evicted " << ulEvicted << " files from local cache");
+
+            ::pthread_mutex_lock(&evictionMutex);
         }
-        cout << endl;
+    }
+
+    ::pthread_mutex_unlock(&evictionMutex);
+
+    return(NULL);
+}
+
+/**
+ * Start routine of #sweepThread.
+ *
+ * Every #iSweepIntervalSeconds seconds drops up to #ulSweepEntries expired
+ * entries from #fileCache, so it is not locked for long at once.
+ *
+ * @param pvArg not used.
+ *
+ * @return NULL once #fStopSweep is set.
+ */
+static void* sweepThreadMain(void* /*pvArg*/)
+{
+    ::pthread_mutex_lock(&sweepMutex);
+
+    while (!fStopSweep)
+    {
+        struct timespec deadline;
+        ::clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += iSweepIntervalSeconds;
+
+        ::pthread_cond_timedwait(&sweepCond, &sweepMutex, &deadline);
+
+        if (!fStopSweep)
+        {
+            ::pthread_mutex_unlock(&sweepMutex);
+
+            const unsigned long ulExpired(fileCache.sweep(ulSweepEntries));
+            if (ulExpired)
+                DBG("swept " << ulExpired << " expired paths from attribute cache");
+
+            ::pthread_mutex_lock(&sweepMutex);
+        }
+    }
+
+    ::pthread_mutex_unlock(&sweepMutex);
 
-        pNetCat = new Spawn(argv, false, true);
+    return(NULL);
+}
+
+/**
+ * Spawns a netcat process on the local host connected to the local forward
+ * port, each connection gets its own shell on the device.
+ *
+ * Writes the used start command to stdout.
+ *
+ * @return the spawned netcat process, to be deleted by the caller.
+ */
+static Spawn* spawnNetCat()
+{
+    ostringstream strForward;
+    strForward << iForwardPort;
+    const char* const argv[] = { "nc", "localhost", strForward.str().c_str(), NULL };
+
+    cout << "--*-- " << "spawn: ";
+    for (int i = 0; argv[i]; i++)
+    {
+        cout << argv[i];
+        if (argv[i+1])
+            cout << ", ";
     }
+    cout << endl;
+
+    return(new Spawn(argv, false, true));
+}
+
+/**
+ * Spawns the netcat process used by adbncShell() if not done already.
+ *
+ * @return a reference to the spawned netcat process is returned.
+ */
+static Spawn& initNetCat()
+{
+    if (!pNetCat)
+        pNetCat = spawnNetCat();
 
     return(*pNetCat);
 }
 
 /**
- * Kills the netcat process spawned in initNetCat().
+ * Kills the netcat process spawned in initNetCat() and terminates
+ * #ncReaderThread.
  */
 static void destroyNetCat()
 {
     if (pNetCat)
     {
         pNetCat->sendEof();
+
+        if (fNcReaderThreadStarted)
+        {
+            ::pthread_join(ncReaderThread, NULL);
+            fNcReaderThreadStarted = false;
+        }
+
         INF("Waiting to terminate netcat...");
         INF("Status: " << pNetCat->wait());
         delete pNetCat;
@@ -176,25 +735,62 @@ static void destroyNetCat()
 }
 
 /**
- * Replace all instances of string strFind with string strReplace in the given
- * string strSource, which is modified in-place.
+ * Marks parts of the handshake with the device done and wakes up the FUSE
+ * callbacks waiting for them.
+ *
+ * @param uiParts the HandshakePart flags of the parts.
+ * @param fOk false if the parts not done before failed.
+ */
+static void handshakeDone(unsigned int uiParts, bool fOk)
+{
+    ::pthread_mutex_lock(&handshakeMutex);
+    if (!fOk)
+        uiHandshakeFailed |= uiParts & ~uiHandshakeDone;
+    uiHandshakeDone |= uiParts;
+    ::pthread_cond_broadcast(&handshakeCond);
+    ::pthread_mutex_unlock(&handshakeMutex);
+}
+
+/**
+ * Waits until the given parts of the handshake with the device are done,
+ * for at most handshake_timeout seconds.
+ *
+ * Without option lazy_handshake all parts are done before mounting.
  *
- * The work proceeds down the string and skips over the text
- * introduced by the replacement.
+ * @param uiParts the HandshakePart flags of the parts needed.
  *
- * @param strSource the string to be modified.
- * @param strFind the pattern to be replaced.
- * @param strReplace the replacement for strFind.
+ * @return 0 if the parts succeeded, -EIO if one failed, -ETIMEDOUT if they
+ *         are not done in time.
  */
-static void stringReplacer(string& strSource, const string& strFind, const string& strReplace)
+static int awaitHandshake(unsigned int uiParts)
 {
-    const int iLen(strFind.length());
-    size_t j(0);
-    for (; (j = strSource.find(strFind, j)) != string::npos ;)
+    ::pthread_mutex_lock(&handshakeMutex);
+
+    if ((uiHandshakeDone & uiParts) != uiParts)
     {
-	strSource.replace(j, iLen, strReplace);
-        j += strReplace.length();
+        struct timespec deadline;
+        ::clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += options.uiHandshakeTimeout;
+
+        while ((uiHandshakeDone & uiParts) != uiParts)
+        {
+            if (::pthread_cond_timedwait(&handshakeCond, &handshakeMutex, &deadline) == ETIMEDOUT)
+                break;
+        }
     }
+
+    int iRes(0);
+    if ((uiHandshakeDone & uiParts) != uiParts)
+        iRes = -ETIMEDOUT;
+    else if (uiHandshakeFailed & uiParts)
+        iRes = -EIO;
+
+    ::pthread_mutex_unlock(&handshakeMutex);
+
+    if (iRes)
+        INF("Handshake with android device " << (iRes == -EIO ? "failed" : "not done in time"));
+
+    return(iRes);
 }
 
 /**
@@ -204,16 +800,12 @@ static void stringReplacer(string& strSource, const string& strFind, const strin
  *
  * @return the path used on the local host within #strTempDirPath
  *
- * @see #pcTempDirTemplate
+ * @see LocalCache
  * @see makeTempDir()
  */
 static string makeLocalPath(const string& strPath)
 {
-    string strLocalPath(strTempDirPath);
-    string strRemotePath(strPath);
-    stringReplacer(strRemotePath, "/", "-");
-    strLocalPath.append(strRemotePath);
-    return(strLocalPath);
+    return(localCache.localPath(strPath.c_str()));
 }
 
 /**
@@ -304,42 +896,305 @@ static bool fileExists(const char* pcName)
     return (::stat(pcName, &buffer) == 0);
 }
 
+static int doStat(const char *pcPath, struct stat* pStatBuf = NULL);
+static string childPath(const char *pcDir, const string& strName);
+static deque<string> adbncShell(const string& strCommand);
+static int listOnDevice(const char *pcPath, deque<string>* pNames);
+
 /**
- * Execute the given command string via netcat.
+ * Splits a line written by inotifyd - into its fields.
  *
- * @param strCommand the string to be executed as a command.
+ * @param strLine the line, the event characters, the watched directory and,
+ *        for events of a file in it, the file's name, separated by tabs.
+ * @param pstrEvents receives the event characters.
+ * @param pstrDir receives the watched directory.
+ * @param pstrName receives the file's name, empty for events of the
+ *        directory itself.
  *
- * @return the queue of lines written to stdout by the executed command.
+ * @return true if strLine is an event.
  */
-static deque<string>execCommandViaNetCat(const string& strCommand)
+static bool parseWatchEvent(const string& strLine, string* pstrEvents, string* pstrDir, string* pstrName)
 {
-    ::pthread_mutex_lock(&ncCmdMutex);
+    const size_t uiDir(strLine.find('\t'));
+    if (uiDir == string::npos || uiDir == 0)
+        return(false);
 
-    DBG("execCommandViaNetCat: " << strCommand);
+    const size_t uiName(strLine.find('\t', uiDir + 1));
 
-    pNetCat->outStream() << strCommand << endl << "echo '" << pcDone << "'" << endl;
+    *pstrEvents = strLine.substr(0, uiDir);
+    *pstrDir = strLine.substr(uiDir + 1, uiName == string::npos ? string::npos : uiName - uiDir - 1);
+    *pstrName = uiName == string::npos ? "" : strLine.substr(uiName + 1);
 
-    deque<string> output;
+    return(!pstrDir->empty());
+}
 
-    string strTmpString;
-    while (!getline(pNetCat->inStream(), strTmpString).eof())
-    {
-        if (strTmpString.find(pcDone) != string::npos)
-            break;
+/**
+ * Invalidates what #fileCache and #dirCache hold for the path a change
+ * notification is about.
+ *
+ * @param strLine the line written by inotifyd.
+ * @param watchedDirs the directories inotifyd watches.
+ */
+static void applyWatchEvent(const string& strLine, const deque<string>& watchedDirs)
+{
+    string strEvents, strDir, strName;
+    if (!parseWatchEvent(strLine, &strEvents, &strDir, &strName))
+        return;
 
-        output.push_back(strTmpString);
-    }
+    DBG("notification " << strEvents << " " << strDir << " " << strName);
+    ulWatchEvents++;
 
-    if (!output.empty())
-        DBG("output: " << output.front());
+    if (strEvents.find('o') != string::npos)
+    {
+        // the event queue overflowed, any change may have been missed
+        for (deque<string>::const_iterator it(watchedDirs.begin()); it != watchedDirs.end(); ++it)
+        {
+            fileCache.invalidateTree(it->c_str());
+            dirCache.invalidate(it->c_str());
+        }
+
+        for (deque<string>::const_iterator it(watchedDirs.begin()); it != watchedDirs.end(); ++it)
+            fileCache.watch(it->c_str(), true);
+    }
+    else if (!strName.empty())
+    {
+        const string strPath(childPath(strDir.c_str(), strName));
+        if (strEvents.find_first_of("ymnd") != string::npos)
+        {
+            // created, deleted or moved, the directory changed too
+            fileCache.invalidateTree(strPath.c_str());
+            fileCache.invalidate(strDir.c_str());
+            dirCache.invalidate(strPath.c_str());
+            dirCache.invalidate(strDir.c_str());
+        }
+        else
+            fileCache.invalidate(strPath.c_str());
+    }
+    else if (strEvents.find_first_of("DMxu") != string::npos)
+    {
+        // the watched directory is gone
+        fileCache.invalidateTree(strDir.c_str());
+        dirCache.invalidate(strDir.c_str());
+    }
     else
-        DBG("output: EMPTY");
+        fileCache.invalidate(strDir.c_str());
+}
+
+/**
+ * Start routine of #watcherThread.
+ *
+ * Starts busybox inotifyd in the background of the shell #pWatcher is
+ * connected to, for all directories below the ones given by option watch.
+ * Once it runs the directories are marked as watched in #fileCache, so their
+ * attributes are cached for option watch_timeout seconds, and each change
+ * notification is applied by applyWatchEvent().
+ *
+ * @param pvArg not used.
+ *
+ * @return NULL when the connection is closed by adbnc_destroy().
+ */
+static void* watcherThreadMain(void* /*pvArg*/)
+{
+    // adbncShell() runs it as busybox applet
+    string strFind("find");
+    const string strWatch(options.pcWatch);
+    for (size_t uiStart = 0; uiStart < strWatch.length();)
+    {
+        size_t uiEnd(strWatch.find(':', uiStart));
+        if (uiEnd == string::npos)
+            uiEnd = strWatch.length();
+
+        if (uiEnd > uiStart)
+            strFind.append(" '").append(strWatch.substr(uiStart, uiEnd - uiStart)).append("'");
+
+        uiStart = uiEnd + 1;
+    }
+    strFind.append(" -type d");
+
+    const deque<string> watchedDirs(adbncShell(strFind));
+
+    ostringstream strCommand;
+    strCommand << "busybox inotifyd -";
+    for (deque<string>::const_iterator it(watchedDirs.begin()); it != watchedDirs.end(); ++it)
+        strCommand << " '" << *it << ":" << pcWatchMask << "'";
+    strCommand << " & sleep 1; kill -0 $! && echo '" << pcWatching << "'";
+
+    pWatcher->outStream() << strCommand.str() << endl;
+
+    string strLine;
+    while (!getline(pWatcher->inStream(), strLine).eof())
+    {
+        if (strLine == pcWatching)
+        {
+            for (deque<string>::const_iterator it(watchedDirs.begin()); it != watchedDirs.end(); ++it)
+                fileCache.watch(it->c_str(), true);
+
+            INF("Watching " << watchedDirs.size() << " directories on android device");
+        }
+        else
+            applyWatchEvent(strLine, watchedDirs);
+    }
+
+    // no more notifications
+    for (deque<string>::const_iterator it(watchedDirs.begin()); it != watchedDirs.end(); ++it)
+        fileCache.watch(it->c_str(), false);
+
+    return(NULL);
+}
+
+/**
+ * Writes a command to a netcat process and reads its output up to the end of
+ * command marker, as long as no other thread uses the process.
+ *
+ * @param pChannel the netcat process.
+ * @param strCommand the string to be executed as a command.
+ *
+ * @return the queue of lines written to stdout by the executed command,
+ *         empty if netcat exits, e.g. if it cannot connect.
+ */
+static deque<string> execCommandDirectly(Spawn* pChannel, const string& strCommand)
+{
+    pChannel->outStream() << strCommand << endl << "echo '" << pcDone << "'" << endl;
+
+    deque<string> output;
 
-    ::pthread_mutex_unlock(&ncCmdMutex);
+    string strTmpString;
+    while (!getline(pChannel->inStream(), strTmpString).eof())
+    {
+        if (strTmpString.find(pcDone) != string::npos)
+            break;
+
+        output.push_back(strTmpString);
+    }
 
     return(output);
 }
 
+/**
+ * Start routine of #ncReaderThread.
+ *
+ * The device's shell runs the commands written to #pNetCat one after the
+ * other, so their output arrives in the order of #ncPending. Collects the
+ * output lines up to each end of command marker and completes the oldest
+ * request with them. When netcat closes its stdout all pending requests are
+ * completed with what is read so far.
+ *
+ * @param pvArg not used.
+ *
+ * @return NULL when netcat closed its stdout, see destroyNetCat().
+ */
+static void* ncReaderThreadMain(void* /*pvArg*/)
+{
+    deque<string> output;
+
+    string strTmpString;
+    while (!getline(pNetCat->inStream(), strTmpString).eof())
+    {
+        if (strTmpString.find(pcDone) == string::npos)
+        {
+            output.push_back(strTmpString);
+            continue;
+        }
+
+        ::pthread_mutex_lock(&ncPendingMutex);
+        if (!ncPending.empty())
+        {
+            NetCatRequest* pRequest(ncPending.front());
+            ncPending.pop_front();
+
+            pRequest->output.swap(output);
+            pRequest->fDone = true;
+            ::pthread_cond_signal(&pRequest->doneCond);
+        }
+        ::pthread_mutex_unlock(&ncPendingMutex);
+
+        output.clear();
+    }
+
+    ::pthread_mutex_lock(&ncPendingMutex);
+    fNcClosed = true;
+    while (!ncPending.empty())
+    {
+        NetCatRequest* pRequest(ncPending.front());
+        ncPending.pop_front();
+
+        pRequest->output.swap(output);
+        pRequest->fDone = true;
+        ::pthread_cond_signal(&pRequest->doneCond);
+    }
+    ::pthread_mutex_unlock(&ncPendingMutex);
+
+    return(NULL);
+}
+
+/**
+ * Execute the given command string via netcat.
+ *
+ * Waits for netcat to be ready first, see awaitHandshake().
+ *
+ * Once #ncReaderThread is started the calling thread holds #ncCmdMutex only
+ * while writing the command, it then waits for #ncReaderThread to complete
+ * it. So commands of other threads are written while this one is on its way
+ * to the device and its round trip overlaps theirs, instead of the device
+ * sitting idle between them.
+ *
+ * @param strCommand the string to be executed as a command.
+ *
+ * @return the queue of lines written to stdout by the executed command.
+ */
+static deque<string>execCommandViaNetCat(const string& strCommand)
+{
+    if (awaitHandshake(hpNetCat))
+        return(deque<string>());
+
+    NetCatRequest request;
+    request.fDone = false;
+    ::pthread_cond_init(&request.doneCond, NULL);
+
+    ::pthread_mutex_lock(&ncCmdMutex);
+
+    DBG("execCommandViaNetCat: " << strCommand);
+
+    if (fNcReaderThreadStarted)
+    {
+        ::pthread_mutex_lock(&ncPendingMutex);
+        if (fNcClosed)
+            request.fDone = true;
+        else
+        {
+            ncPending.push_back(&request);
+            if (ncPending.size() > ulNcMaxInFlight)
+                ulNcMaxInFlight = ncPending.size();
+        }
+        ::pthread_mutex_unlock(&ncPendingMutex);
+
+        if (!request.fDone)
+            pNetCat->outStream() << strCommand << endl << "echo '" << pcDone << "'" << endl;
+
+        ::pthread_mutex_unlock(&ncCmdMutex);
+
+        ::pthread_mutex_lock(&ncPendingMutex);
+        while (!request.fDone)
+            ::pthread_cond_wait(&request.doneCond, &ncPendingMutex);
+        ::pthread_mutex_unlock(&ncPendingMutex);
+    }
+    else
+    {
+        request.output = execCommandDirectly(pNetCat, strCommand);
+
+        ::pthread_mutex_unlock(&ncCmdMutex);
+    }
+
+    ::pthread_cond_destroy(&request.doneCond);
+
+    if (!request.output.empty())
+        DBG("output: " << request.output.front());
+    else
+        DBG("output: EMPTY");
+
+    return(request.output);
+}
+
 /**
  * Execute a program.
  *
@@ -353,11 +1208,13 @@ static deque<string>execCommandViaNetCat(const string& strCommand)
  *        being executed. The array of pointers must be terminated by a NULL
  *        pointer.
  * @param fUseStdErr if true stderr is redirected instead of stdout.
+ * @param fUrgent if false the program waits for a free slot of #spawnQueue
+ *        until no urgent one is waiting anymore.
  *
  * @return the queue of lines written to stdout respectively stderr by the
  *         executed program.
  */
-static deque<string> execProg(const char* const argv[], const bool fUseStdErr = false, int* const piError = NULL)
+static deque<string> execProg(const char* const argv[], const bool fUseStdErr = false, int* const piError = NULL, const bool fUrgent = true)
 {
     if (fDebug)
     {
@@ -373,9 +1230,15 @@ static deque<string> execProg(const char* const argv[], const bool fUseStdErr =
 
     deque<string> output;
 
+    spawnQueue.acquire(fUrgent);
+
     try
     {
+        struct timespec start, end;
+        ::clock_gettime(CLOCK_MONOTONIC, &start);
         Spawn cmd(argv, fUseStdErr, true);
+        ::clock_gettime(CLOCK_MONOTONIC, &end);
+        spawnQueue.spawned((end.tv_sec - start.tv_sec) * 1000000ULL + end.tv_nsec / 1000 - start.tv_nsec / 1000);
 
         string strTmpString;
         while (!getline(cmd.inStream(), strTmpString).eof())
@@ -427,6 +1290,8 @@ static deque<string> execProg(const char* const argv[], const bool fUseStdErr =
             *piError = -EIO;
     }
 
+    spawnQueue.release();
+
     return(output);
 }
 
@@ -449,581 +1314,2232 @@ static deque<string> adbncShell(const string& strCommand)
 }
 
 /**
- * Execute an adb push or pull command with given paths.
+ * Parses the output of a command run by modifyOnDevice().
  *
- * @param fPush true for a push command, false for pull.
- * @param strLocalPath path on local host for push or pull command.
- * @param strRemotePath path on remote device for push or pull command.
-   @return 0 if no error, non zero otherwise
- * @see adbncPull.
- * @see adbncPush.
+ * @param output the lines written to stdout and stderr by the command.
+ *
+ * @return 0 if the command succeeded, the negated errno its error message
+ *         stands for, see #aDeviceErrors, or -EIO if none is recognized.
  */
-static int adbncPushPullCmd(const bool fPush, const string& strLocalPath, const string& strRemotePath)
+static int parseCommandResult(const deque<string>& output)
 {
-    string strCmdPath1("'");
-    strCmdPath1.append((fPush ? strLocalPath : strRemotePath));
-    strCmdPath1.append("'");
-
-    string strCmdPath2("'");
-    strCmdPath2.append((fPush ? strRemotePath : strLocalPath));
-    strCmdPath2.append("'");
-
-    const char* argv[5];
-    argv[0] = "adb";
-    argv[1] = fPush ? "push" : "pull";
-    argv[2] = fPush ? strLocalPath.c_str() : strRemotePath.c_str();
-    argv[3] = fPush ? strRemotePath.c_str() : strLocalPath.c_str();
-    argv[4] = NULL;
+    if (!output.empty() && output.back() == pcCommandOk)
+        return(0);
 
-    int iRes(adbnc_access(fPush ? parent(strRemotePath).c_str() : strRemotePath.c_str(), fPush ? W_OK : R_OK));
-    if (!iRes)
+    for (auto it = output.begin(); it != output.end(); ++it)
     {
-        /*
-         * uses stderr instead of stdout (second arg is true) because we need
-         * the error messages which adb writes to stderr.
-         *
-         * Beside error messages adb also writes performance statistics to
-         * stderr (e.g 238 KB/s (19074 bytes in 0.078s). This way we always have
-         * at least one output line.
-         *
-         * Exit status is unfortunately not useful, it seems to be 256 always.
-         */
-        execProg(argv, true, &iRes);
+        for (int i = 0; aDeviceErrors[i].pcMessage; i++)
+        {
+            if (it->find(aDeviceErrors[i].pcMessage) != string::npos)
+                return(-aDeviceErrors[i].iErrno);
+        }
     }
 
-    return(iRes);
+    return(-EIO);
 }
 
 /**
- * Copy (using adb pull) a file from the Android device to the local
- * host.
- *
- * @param strRemoteSource Android-side file path to copy.
- * @param strLocalDestination local host-side destination path for copy.
+ * Execute a shell command changing the file system on the android device.
  *
- * @return 0 if no error, non zero otherwise.
+ * Like adbncShell(), but tells whether the command succeeded, so cached
+ * listings are changed only if the device did.
  *
- * @see adbncPush.
- * @see adbncPushPullCmd.
+ * @param strCommand the command to execute.
  *
- * @bug problems with files with ? in filenames (adb bug?)
+ * @return 0 if the command succeeded, -errno otherwise, see
+ *         parseCommandResult().
  */
-static int adbncPull(const string& strRemoteSource, const string& strLocalDestination)
+static int modifyOnDevice(const string& strCommand)
 {
-    return(adbncPushPullCmd(false, strLocalDestination, strRemoteSource));
+    // the command may change what the commands in flight report
+    singleFlight.forget();
+
+    string strActualCommand(strCommand);
+    strActualCommand.append(" 2>&1 && echo '").append(pcCommandOk).append("'");
+
+    return(parseCommandResult(adbncShell(strActualCommand)));
 }
 
 /**
- * Copy (using adb push) a file from the local host to the Android
- * device. Very similar to adbnc_pull().
+ * Execute a shell command without side effects on the android device.
  *
- * @return 0 if no error, non zero otherwise.
+ * Like adbncShell(), but threads executing the same command at the same time
+ * share one round trip to the device, see #singleFlight.
  *
- * @see adbncPull.
- * @see adbncPushPullCmd.
+ * @param strCommand the command to execute.
  *
- * @bug problems with files with ? in filenames (adb bug?).
+ * @return the queue of lines written to stdout by the executed command.
  */
-int adbncPush(const string& strLocalSource, const string& strRemoteDestination)
+static deque<string> sharedShell(const string& strCommand)
 {
-    return(adbncPushPullCmd(true, strLocalSource, strRemoteDestination));
+    string strActualCommand(strCommand);
+    strActualCommand.insert(0, "busybox ");
+    return(singleFlight.run(strActualCommand, execCommandViaNetCat));
 }
 
 /**
- * Execute a stat command on android file or directory denoted by pcPath.
+ * Returns the key of the statistics of the volume a path on the device is
+ * located on in #statFsCache.
  *
- * @param pcPath pathname of file or directory on android device.
- * @param pOutputTokens if not NULL receives the tokenized output of the stat.
- *        command.
+ * @param pcPath the path on the device.
  *
- * @return -ENOENT if pcPath does not exists, zero otherwise.
+ * @return the mount point pcPath is located on according to #pMountInfo, or
+ *         pcPath itself if the mount point is unknown.
  */
-static int doStat(const char *pcPath, vector<string>* pOutputTokens = NULL)
+static string statFsKey(const char* pcPath)
 {
-    deque<string> output;
-    const deque<string>* pOutput(fileCache.getStat(pcPath));
-
-    if (!pOutput)
-    {
-        string strCommand("stat -t '");
-        strCommand.append(pcPath);
-        strCommand.append("'");
-
-        output = adbncShell(strCommand);
-        fileCache.putStat(pcPath, output);
-    }
-    else
-    {
-        // from cache
-        output = *pOutput;
-        if (!output.empty())
-            DBG("from cache " << output.front());
-        else
-            DBG("from cache EMPTY");
-    }
-
-    if (output.empty())
-        return -ENOENT;
-
-    if (output.size() > 1)
-    {
-        deque<string>::iterator it(output.begin());
-        while (it != output.end())
-            output.front() += *it++;
-    }
-
-    if (pOutputTokens)
-    {
-        *pOutputTokens = tokenize(output.front());
-        if (pOutputTokens->size() < 13)
-            return -ENOENT;
-
-        while (pOutputTokens->size() > 15)
-            pOutputTokens->erase(pOutputTokens->begin());
-    }
+    const auto pEntry(pMountInfo ? pMountInfo->mountPoint(pcPath) : NULL);
 
-    return(0);
+    return(pEntry ? pEntry->mountPoint() : string(pcPath));
 }
 
 /**
- * Return the command line used to start netcat process on android device.
+ * Drops the cached statistics of the volume a path on the device is located
+ * on, so the next adbnc_statfs() retrieves them from the device.
  *
- * @return nc -ll -p forwardport -e /system/xbin/bash
- * @see androidStartNetcat
+ * @param pcPath the path on the device.
  */
-static const string androidNetCatStartCommand()
+static void forgetStatFs(const char* pcPath)
 {
-    ostringstream strCmdStream;
-    strCmdStream << "nc -ll -p " << iForwardPort << " -e /system/xbin/bash";
+    const string strKey(statFsKey(pcPath));
 
-    return(strCmdStream.str());
+    ::pthread_mutex_lock(&statFsMutex);
+    statFsCache.erase(strKey);
+    ulStatFsGeneration++;
+    ::pthread_mutex_unlock(&statFsMutex);
 }
 
 /**
- * Test if netcat is started on the android device.
+ * Execute an adb push or pull command with given paths.
  *
- * @return pid of netcat or 0 if not started.
+ * @param fPush true for a push command, false for pull.
+ * @param strLocalPath path on local host for push or pull command.
+ * @param strRemotePath path on remote device for push or pull command.
+ *
+ * @return 0 if no error, non zero otherwise
  */
-static int androidNetcatStarted()
+static int adbTransfer(const bool fPush, const string& strLocalPath, const string& strRemotePath)
 {
-    int iPid(0);
+    const int iHandshake(awaitHandshake(hpDevice));
+    if (iHandshake)
+        return(iHandshake);
 
-    const char* const argv[] = { "adb", "shell", "su", "-c", "busybox", "ps", "|", "grep", androidNetCatStartCommand().c_str(), NULL };
+    const char* argv[5];
+    argv[0] = "adb";
+    argv[1] = fPush ? "push" : "pull";
+    argv[2] = fPush ? strLocalPath.c_str() : strRemotePath.c_str();
+    argv[3] = fPush ? strRemotePath.c_str() : strLocalPath.c_str();
+    argv[4] = NULL;
 
-    deque<string> output(execProg(argv));
+    int iRes(0);
 
-    while (output.size() > 0)
-    {
-        if (output.front().find("grep") == string::npos)
-        {
-            vector<string> tokens(tokenize(output.front()));
-            iPid = stoi(tokens[0].c_str());
-            break;
-        }
-        else
-            output.pop_front();
-    }
+    /*
+     * uses stderr instead of stdout (second arg is true) because we need
+     * the error messages which adb writes to stderr.
+     *
+     * Beside error messages adb also writes performance statistics to
+     * stderr (e.g 238 KB/s (19074 bytes in 0.078s). This way we always have
+     * at least one output line.
+     *
+     * Exit status is unfortunately not useful, it seems to be 256 always.
+     *
+     * Pulls are urgent, an open() waits for them, pushes queue behind them.
+     */
+    execProg(argv, true, &iRes, !fPush);
 
-    return(iPid);
+    return(iRes);
 }
 
 /**
- * Kills the running netcat process on android device.
+ * Returns the lower case file name extension of the given path.
  *
- * @see androidStartNetcat.
+ * A leading dot of the last path element (hidden files) does not start an
+ * extension.
+ *
+ * @param strPath the pathname thats extension to retrieve.
+ *
+ * @return the characters following the last dot of the last path element or
+ *         an empty string if there is no extension.
  */
-static void androidKillNetCat()
+static string extension(const string& strPath)
 {
-    int iPid(androidNetcatStarted());
+    string strExtension;
 
-    if (iPid > 0)
+    const size_t uiSlash(strPath.rfind('/'));
+    const size_t uiDot(strPath.rfind('.'));
+    if (uiDot != string::npos && uiDot > (uiSlash == string::npos ? 0 : uiSlash + 1))
     {
-        const string strPid(to_string(iPid));
-        const char* const argv[] = { "adb", "shell", "su", "-c", "busybox", "kill", strPid.c_str(), NULL };
-        execProg(argv);
+        strExtension = strPath.substr(uiDot + 1);
+        for (size_t i(0); i < strExtension.length(); i++)
+            strExtension[i] = ::tolower(strExtension[i]);
     }
 
-    iPid = androidNetcatStarted();
-    if (iPid == 0)
-        INF("Netcat successfully stopped on android device");
-    else
-        INF("Failed to kill NetCat on android device");
+    return(strExtension);
 }
 
 /**
- * Starts a netcat process on the android device.
+ * Tests whether the extension of strPath is contained in the given NULL
+ * terminated list of extensions.
  *
- * @return 0 if netcat could successfully be started, 3 otherwise.
+ * @param strPath the pathname to test.
+ * @param apcExtensions NULL terminated array of lower case extensions.
  *
- * @see androidNetCatStartCommand.
+ * @return true if and only if the extension of strPath is in apcExtensions.
  */
-static int androidStartNetcat()
+static bool hasExtension(const string& strPath, const char* const apcExtensions[])
 {
-    if (!androidNetcatStarted())
-    {
-        const char* const argv[] = { "adb", "shell", "su", "-c", "busybox", "nohup", androidNetCatStartCommand().c_str(), "2>/dev/null",  "1>/dev/null", "&", NULL };
-        execProg(argv);
-    }
+    bool fRes(false);
 
-    const int iStarted(androidNetcatStarted());
-    if (!iStarted)
-        INF("error: could not start netcat on android device");
-    else
-        INF("Netcat successfully started on android device");
+    const string strExtension(extension(strPath));
+    if (!strExtension.empty())
+    {
+        for (int i(0); !fRes && apcExtensions[i]; i++)
+            fRes = (strExtension == apcExtensions[i]);
+    }
 
-    return(iStarted ? 0 : 3);
+    return(fRes);
 }
 
 /**
- * Tests if any android device is connected to a local host's usb port.
+ * Tests if the given file is stored in an already compressed format.
  *
- * @return 0 if a device is connected; 1 otherwise.
+ * @param strPath the pathname of the file.
+ *
+ * @return true if the extension of strPath names a compressed format.
  */
-static int isAndroidDeviceConnected()
+static bool isCompressedFormat(const string& strPath)
 {
-    int iRes(1);
+    return(hasExtension(strPath, apcCompressedExtensions));
+}
 
-    // check if a android device is connected
-    int iError(0);
+/**
+ * Tests if the given file is stored in a format known to compress well.
+ *
+ * @param strPath the pathname of the file.
+ *
+ * @return true if the extension of strPath names a well compressible format.
+ */
+static bool isCompressibleFormat(const string& strPath)
+{
+    return(hasExtension(strPath, apcCompressibleExtensions));
+}
 
-    const char* const argv[] = { "adb", "devices", NULL };
-    deque<string> output(execProg(argv, false, &iError));
+/**
+ * Estimates the compression ratio of the given data from its order-0 entropy.
+ *
+ * This is a lower bound for what gzip achieves on repetitive data like text,
+ * so the estimate errs on the side of not compressing.
+ *
+ * @param pcData the data to estimate.
+ * @param uiSize number of bytes in pcData.
+ *
+ * @return the estimated compressed size divided by uiSize, 1.0 if uiSize is
+ *         zero.
+ */
+static double estimateCompressionRatio(const char* pcData, const size_t uiSize)
+{
+    double dRatio(1.0);
 
-    if (!iError)
+    if (uiSize > 0)
     {
-        if (output.size() > 2)
-        {
-            const string strDeviceId(output[output.size() - 2].substr(0, 8));
+        size_t auiCounts[256] = { 0 };
+        for (size_t i(0); i < uiSize; i++)
+            auiCounts[static_cast<unsigned char>(pcData[i])]++;
 
-            if (strDeviceId != "List of ")
+        double dEntropy(0.0);
+        for (int i(0); i < 256; i++)
+        {
+            if (auiCounts[i])
             {
-                INF("Using android device " << strDeviceId);
-                iRes = 0;
-            } // error message already written by adb
-         }  // error message already written by adb
+                const double dProbability(static_cast<double>(auiCounts[i]) / uiSize);
+                dEntropy -= dProbability * ::log2(dProbability);
+            }
+        }
+
+        dRatio = dEntropy / 8.0;
     }
 
-    return(iRes);
+    return(dRatio);
 }
 
 /**
- * Tests if tcp socket connections from local port to remote port on the android
- * device is in place.
- *
- * @param strForwardArg the local and remote port to be used for testing.
- *        e.g. "tcp:4444 tcp:4444"
+ * Probes a sample from the start of a file on the local host for
+ * compressibility.
  *
- * @return true if and only if adb port forwarding is in place; false otherwise.
+ * @param strLocalPath path of the file on the local host.
  *
- * @see setAndroidPortForwarding
+ * @return true if the sample is estimated to compress well.
  */
-static bool isAndroidPortForwarded(const string& strForwardArg)
+static bool isLocalFileCompressible(const string& strLocalPath)
 {
     bool fRes(false);
 
-    const char* const argv[] = { "adb", "forward", "--list", NULL };
-    deque<string> output(execProg(argv));
-
-    for(deque<string>::iterator it = output.begin(); it != output.end(); ++it)
+    const int iFd(::open(strLocalPath.c_str(), O_RDONLY));
+    if (iFd != -1)
     {
-        if((*it).find(strForwardArg) != string::npos)
-        {
-            fRes = true;
-            break;
-        }
+        char acSample[uiCompressProbeSize];
+        const ssize_t iRead(::read(iFd, acSample, sizeof(acSample)));
+        if (iRead > 0)
+            fRes = estimateCompressionRatio(acSample, iRead) < dCompressMaxRatio;
+
+        ::close(iFd);
     }
 
     return(fRes);
 }
 
 /**
- * Enable adb port forwarding for our local and remote port.
+ * Probes a sample from the start of a file on the android device for
+ * compressibility.
  *
- * @return 0 if port forwarding could be enabled, 2 otherwise.
+ * The sample is compressed on the device, only the compressed size is
+ * transferred.
+ *
+ * @param strRemotePath path of the file on the android device.
+ * @param ulSize the size of the file.
+ *
+ * @return true if the sample compresses well.
  */
-static int setAndroidPortForwarding()
+static bool isRemoteFileCompressible(const string& strRemotePath, const unsigned long ulSize)
 {
-    int iRes(2);
-
-    ostringstream strForwardPort;
-    strForwardPort << "tcp:" << iForwardPort;
+    bool fRes(false);
 
-    ostringstream strForwardArg;
-    strForwardArg << strForwardPort.str() << " " << strForwardPort.str();
+    string strCommand("head -c ");
+    strCommand.append(to_string(uiCompressProbeSize));
+    strCommand.append(" '");
+    strCommand.append(strRemotePath);
+    strCommand.append("' | busybox gzip -1 -c | busybox wc -c");
 
-    if (!isAndroidPortForwarded(strForwardArg.str()))
+    const deque<string> output(adbncShell(strCommand));
+    if (!output.empty())
     {
-        const char* const argv[] = { "adb", "forward", strForwardPort.str().c_str(), strForwardPort.str().c_str(), NULL };
-        execProg(argv);
+        try
+        {
+            const unsigned long ulSample(ulSize < uiCompressProbeSize ? ulSize : uiCompressProbeSize);
+            const unsigned long ulCompressed(stoul(output.front()));
+            fRes = ulSample > 0 && static_cast<double>(ulCompressed) / ulSample < dCompressMaxRatio;
+        }
+        catch (const exception& e)
+        {
+            ERR("Exception thrown in isRemoteFileCompressible(" << strRemotePath << ")" << ": " << e.what());
+        }
     }
 
-    if (isAndroidPortForwarded(strForwardArg.str()))
-    {
-        INF("Port " << strForwardPort.str() << " successfully forwarded to android device");
-        iRes = 0;
-    }
-    else
-        INF("Failed to forward Port " << strForwardPort.str() << " to android device");
+    DBG("compressible(" << strRemotePath << "): " << fRes);
 
-    return(iRes);
+    return(fRes);
 }
 
 /**
- * Tries to remove android port forwarding.
+ * Decides if a file should be transferred gzip compressed.
  *
- * @return true if and only if adb port forwarding for our local and remote
- *         port is removed; false otherwise.
+ * Compression is only used if enabled with option compress and only for files
+ * not smaller than option compress_min_size. Files in an already compressed
+ * format are never compressed, files in a format known to compress well always,
+ * all other files only if a sample of the file compresses well.
  *
- * @see setAndroidPortForwarding.
+ * @param fPush true for a push, false for a pull.
+ * @param strLocalPath path on local host.
+ * @param strRemotePath path on android device.
+ *
+ * @return true if the transfer should be done compressed.
  */
-static bool removeAndroidPortForwarding()
+static bool useCompression(const bool fPush, const string& strLocalPath, const string& strRemotePath)
 {
-    ostringstream strForwardPort;
-    strForwardPort << "tcp:" << iForwardPort;
-
-    ostringstream strForwardArg;
-    strForwardArg << strForwardPort.str() << " " << strForwardPort.str();
+    bool fRes(false);
 
-    if (isAndroidPortForwarded(strForwardArg.str()))
+    if (options.iCompress && !isCompressedFormat(strRemotePath))
     {
-        const char* const argv[] = { "adb", "forward", "--remove", strForwardPort.str().c_str(), NULL };
-        execProg(argv);
-    }
+        unsigned long ulSize(0);
 
-    bool fRet(!isAndroidPortForwarded(strForwardArg.str()));
-    if (fRet)
-        INF("Forward port " << strForwardPort.str() << " to android device successfully removed");
-    else
-        INF("Failed to remove forward port " << strForwardPort.str() << " from android device");
+        if (fPush)
+        {
+            struct stat statBuf;
+            if (::stat(strLocalPath.c_str(), &statBuf) == 0)
+                ulSize = statBuf.st_size;
+        }
+        else
+        {
+            struct stat statBuf;
+            if (!doStat(strRemotePath.c_str(), &statBuf))
+                ulSize = statBuf.st_size;
+        }
+
+        if (ulSize > 0 && ulSize >= options.uiCompressMinSizeKb * 1024UL)
+        {
+            if (isCompressibleFormat(strRemotePath))
+                fRes = true;
+            else
+                fRes = fPush ? isLocalFileCompressible(strLocalPath) : isRemoteFileCompressible(strRemotePath, ulSize);
+        }
+    }
 
-    return(fRet);
+    return(fRes);
 }
 
 /**
- * Recursively deletes the temporary directory created in makeTempDir().
+ * Returns a unique path in #pcRemoteStagingDir to stage a compressed transfer.
+ *
+ * @return the path of a not yet existing file on the android device.
  */
-static void cleanupTempDir(void)
+static string remoteStagingPath()
 {
-    const char* const argv[] = { "rm", "-rf", strTempDirPath.c_str(), NULL };
-    execProg(argv);
+    ostringstream strPath;
+    strPath << pcRemoteStagingDir << "/adbncfs-" << ::getpid() << "-" << ulStagingCount++ << ".gz";
+    return(strPath.str());
 }
 
 /**
- * Create a temporary directory and stores the path in #strTempDirPath variable.
+ * Copy a file from the Android device to the local host gzip compressed.
  *
- * @return errno if an error occurred or 0 otherwise.
+ * The file is compressed into #pcRemoteStagingDir on the device, pulled and
+ * decompressed on the local host.
  *
- * @see acTempDirTemplate
+ * @param strRemoteSource Android-side file path to copy.
+ * @param strLocalDestination local host-side destination path for copy.
+ *
+ * @return 0 if no error, non zero otherwise.
  */
-static int makeTempDir(void)
+static int adbncCompressedPull(const string& strRemoteSource, const string& strLocalDestination)
 {
-    char acTempDirTemplate[::strlen(pcTempDirTemplate) + 1];
-    ::strncpy(acTempDirTemplate, pcTempDirTemplate, sizeof(acTempDirTemplate));
-    const char * pcTempDir = ::mkdtemp(&acTempDirTemplate[0]);
+    const string strStaging(remoteStagingPath());
+    const string strLocalStaging(strLocalDestination + ".gz");
+
+    string strCommand("gzip -1 -c '");
+    strCommand.append(strRemoteSource);
+    strCommand.append("' > '");
+    strCommand.append(strStaging);
+    strCommand.append("' && echo ok");
+
+    const deque<string> output(adbncShell(strCommand));
+    int iRes(!output.empty() && output.back() == "ok" ? 0 : -EIO);
+
+    if (!iRes)
+        iRes = adbTransfer(false, strLocalStaging, strStaging);
+
+    adbncShell(string("rm -f '") + strStaging + "'");
 
-    if (pcTempDir)
+    if (!iRes)
     {
-        strTempDirPath.assign(pcTempDir);
-        strTempDirPath.append("/");
+        // gzip -d replaces strLocalStaging by strLocalDestination
+        const char* const argv[] = { "gzip", "-d", "-f", strLocalStaging.c_str(), NULL };
+        execProg(argv, true);
+
+        if (fileExists(strLocalStaging.c_str()) || !fileExists(strLocalDestination.c_str()))
+            iRes = -EIO;
     }
 
-    return(pcTempDir ? 0 : errno);
+    ::unlink(strLocalStaging.c_str());
+
+    return(iRes);
 }
 
 /**
- * Query user information (uid, gid, groups) form android device.
+ * Copy a file from the local host to the Android device gzip compressed.
  *
- * A "adb shell busybox id" command is executed and the output is stored in
- * a UserInfo instance for later retrieval. A pointer to the UserInfo object
- * is stored in #pUserInfo.
+ * The file is compressed on the local host, pushed to #pcRemoteStagingDir on
+ * the device and decompressed to its destination there.
  *
- * If command failed en error message is written to stdout
+ * @param strLocalSource local host-side file path to copy.
+ * @param strRemoteDestination Android-side destination path for copy.
  *
- * @return 0 if user information is obtained, 1 otherwise.
+ * @return 0 if no error, non zero otherwise.
  */
-static int queryUserInfo()
+static int adbncCompressedPush(const string& strLocalSource, const string& strRemoteDestination)
 {
-    const char* const argv[] = { "adb", "shell", "busybox id", NULL };
-    deque<string> output(execProg(argv));
+    const string strStaging(remoteStagingPath());
+    const string strLocalStaging(strLocalSource + ".gz");
 
-    int iRes(!(output.size() == 1));
-    if (!iRes && output.front().length() > 5 && output.front()[0] == 'u')
-        pUserInfo = new UserInfo(output.front().c_str());
-    else
-        INF("Failed to query user info from device");
+    const char* const argv[] = { "gzip", "-1", "-k", "-f", strLocalSource.c_str(), NULL };
+    execProg(argv, true, NULL, false);
+
+    int iRes(fileExists(strLocalStaging.c_str()) ? 0 : -EIO);
+    if (!iRes)
+        iRes = adbTransfer(true, strLocalStaging, strStaging);
+
+    ::unlink(strLocalStaging.c_str());
+
+    if (!iRes)
+    {
+        string strCommand("gzip -d -c '");
+        strCommand.append(strStaging);
+        strCommand.append("' > '");
+        strCommand.append(strRemoteDestination);
+        strCommand.append("' && echo ok");
+
+        const deque<string> output(adbncShell(strCommand));
+        iRes = (!output.empty() && output.back() == "ok" ? 0 : -EIO);
+    }
+
+    adbncShell(string("rm -f '") + strStaging + "'");
 
     return(iRes);
 }
 
 /**
- * Query mount information form android device.
+ * Returns the path of the blob with the given checksum in the blob store.
  *
- * A "adb shell busybox mount" command is executed and the output is stored in
- * a MontInfo instance for later retrieval. A pointer to the MontInfo object
- * is stored in #pMountInfo.
+ * The blob store is the directory blobs within #strTempDirPath, it holds one
+ * hard link to every pulled file named by the md5 checksum of its content.
  *
- * If command failed en error message is written to stdout
+ * @param strChecksum the md5 checksum of the content.
  *
- * @return 0 if mount information is obtained, 1 otherwise.
+ * @return the path of the blob on the local host.
  */
-static int queryMountInfo()
+static string blobPath(const string& strChecksum)
 {
-    const char* const argv[] = { "adb", "shell", "busybox mount", NULL };
-    deque<string> output(execProg(argv));
-
-    int iRes(!(output.size() > 0));
-    if (!iRes)
-    {
-        /*
-         * Big Hack, coz. I don't know how to get mount info for sdcard from device.
-         *
-         * @todo get rid of that
-         */
-        output.push_back(pcSdCardMountEntry);
-        pMountInfo = new MountInfo(output);
-    }
-    else
-        INF("Failed to query mount info from device");
-
-    return(iRes);
+    string strBlobPath(strTempDirPath);
+    strBlobPath.append("blobs/");
+    strBlobPath.append(strChecksum);
+    return(strBlobPath);
 }
 
 /**
- * Initialize the file system application
+ * Retrieves the md5 checksum of a file on the android device.
  *
- * - A segmentation fault signal handler() is installed.
- * - makeTempDir() is called.
- * - setAndroidPortForwarding() is called
- * - androidStartNetcat() is called
- * - queryUserInfo() is called
- * - queryMountInfo() is called
- * - initNetCat() is called
+ * The checksum is computed on the device, only the checksum is transferred.
  *
- * @return 0 if a device is connected and no other error occurred;
- *         a value != 0 otherwise.
+ * @param strRemotePath path of the file on the android device.
+ *
+ * @return the checksum as 32 hex digits or an empty string if the checksum
+ *         could not be retrieved.
  */
-int initAdbncFs(const int argc, char** const argv)
+static string remoteChecksum(const string& strRemotePath)
 {
-    ::signal(SIGSEGV, sig11Handler);   // install our handler
+    string strChecksum;
 
-    bool fInitRequired(true);
+    string strCommand("md5sum '");
+    strCommand.append(strRemotePath);
+    strCommand.append("'");
 
-    // check if debug option is set or -h/--help or -V/--version
-    for (int i = 1; i < argc; i++)
+    const deque<string> output(adbncShell(strCommand));
+    if (!output.empty() && output.front().length() > 32 && output.front()[32] == ' ')
     {
-        if (::strcmp(argv[i], "-d") == 0)
-            fDebug = true;
-
-        if (::strcmp(argv[i], "-h") == 0)
-            fInitRequired = false;
-
-        if (::strcmp(argv[i], "--help") == 0)
-            fInitRequired = false;
-
-        if (::strcmp(argv[i], "-V") == 0)
-            fInitRequired = false;
-
-        if (::strcmp(argv[i], "--version") == 0)
-            fInitRequired = false;
+        strChecksum = output.front().substr(0, 32);
+        if (strChecksum.find_first_not_of("0123456789abcdef") != string::npos)
+            strChecksum.clear();
     }
 
+    return(strChecksum);
+}
+
+/**
+ * Copies a file on the local host.
+ *
+ * Tries to reflink the copy first, so on file systems supporting it no data
+ * is copied.
+ *
+ * @param strFrom path of the file to copy.
+ * @param strTo path of the copy, overwritten if it exists.
+ *
+ * @return 0 on success, -errno otherwise.
+ */
+static int copyLocalFile(const string& strFrom, const string& strTo)
+{
     int iRes(0);
 
-    if (fInitRequired)
+    const int iFromFd(::open(strFrom.c_str(), O_RDONLY));
+    if (iFromFd != -1)
     {
-        iRes =makeTempDir();
-
-        if (!iRes)
+        const int iToFd(::open(strTo.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600));
+        if (iToFd != -1)
         {
-            iRes = isAndroidDeviceConnected();
-
-            if (!iRes)
+            if (::ioctl(iToFd, FICLONE, iFromFd) == -1)
             {
-                iRes = setAndroidPortForwarding();
-
-                if (!iRes)
+                char acBuf[65536];
+                ssize_t iRead;
+                while (!iRes && (iRead = ::read(iFromFd, acBuf, sizeof(acBuf))) > 0)
                 {
-                    iRes = androidStartNetcat();
-                    if (!iRes)
-                    {
-                        iRes = queryUserInfo();
-                        if (!iRes)
-                        {
-                            iRes = queryMountInfo();
-                            initNetCat();
-                        }
-                    }
+                    if (::write(iToFd, acBuf, iRead) != iRead)
+                        iRes = -errno;
                 }
+
+                if (iRead == -1)
+                    iRes = -errno;
             }
+
+            if (::close(iToFd) == -1 && !iRes)
+                iRes = -errno;
         }
+        else
+            iRes = -errno;
+
+        ::close(iFromFd);
     }
+    else
+        iRes = -errno;
 
     return(iRes);
 }
 
 /**
- * FUSE callback function to initialize the file system.
+ * Makes sure a file in the local cache does not share its content with the
+ * blob store or any other cached file.
  *
- * One-time setup of #cmdMutex, #openMutex, #inReleaseDirMutex and
- * #inReleaseDirCond.
+ * Must be called before a cached file is modified, otherwise the modification
+ * would show up in all files linked to the same blob.
  *
- * @param pConn gives information about what features are supported by FUSE.
+ * @param strLocalPath path of the file on the local host.
  *
- * @return NULL.
+ * @return 0 on success, -errno otherwise.
  */
-void* adbnc_init(struct fuse_conn_info *pConn)
+static int unshareLocalFile(const string& strLocalPath)
 {
-    DBG("adbnc_init()");
+    int iRes(0);
 
-//    pConn->async_read = 0;
-//    pConn->want &= ~ FUSE_CAP_ASYNC_READ; // clear async read flag
-    pConn->want |= FUSE_CAP_EXPORT_SUPPORT; // set . and .. not handled by us
+    struct stat statBuf;
+    if (::stat(strLocalPath.c_str(), &statBuf) == 0 && statBuf.st_nlink > 1)
+    {
+        const string strUnshared(strLocalPath + ".unshare");
 
-    ::pthread_mutex_init(&ncCmdMutex, NULL);
-    ::pthread_mutex_init(&openMutex, NULL);
-    ::pthread_mutex_init(&inReleaseDirMutex, NULL);
-    ::pthread_cond_init (&inReleaseDirCond, NULL);
+        iRes = copyLocalFile(strLocalPath, strUnshared);
+        if (!iRes && ::rename(strUnshared.c_str(), strLocalPath.c_str()) == -1)
+            iRes = -errno;
+
+        if (iRes)
+            ::unlink(strUnshared.c_str());
+    }
+
+    return(iRes);
+}
+
+/**
+ * Replaces the given file on the local host by a hard link to a blob.
+ *
+ * @param strBlobPath path of the blob in the blob store.
+ * @param strLocalPath path of the file to replace.
+ *
+ * @return true if the link is in place, false otherwise.
+ */
+static bool linkFromBlobStore(const string& strBlobPath, const string& strLocalPath)
+{
+    const string strLink(strLocalPath + ".link");
+
+    ::unlink(strLink.c_str());
+    bool fRes(::link(strBlobPath.c_str(), strLink.c_str()) == 0);
+    if (fRes)
+    {
+        fRes = (::rename(strLink.c_str(), strLocalPath.c_str()) == 0);
+        if (!fRes)
+            ::unlink(strLink.c_str());
+    }
+
+    return(fRes);
+}
+
+/**
+ * Execute an adb push or pull command with given paths after checking access
+ * rights.
+ *
+ * The transfer is done compressed if useCompression() says so. If a
+ * compressed transfer fails it is retried uncompressed.
+ *
+ * @param fPush true for a push command, false for pull.
+ * @param strLocalPath path on local host for push or pull command.
+ * @param strRemotePath path on remote device for push or pull command.
+   @return 0 if no error, non zero otherwise
+ * @see adbncPull.
+ * @see adbncPush.
+ */
+static int adbncPushPullCmd(const bool fPush, const string& strLocalPath, const string& strRemotePath)
+{
+    if (fPush)
+        singleFlight.forget();
+
+    int iRes(adbnc_access(fPush ? parent(strRemotePath).c_str() : strRemotePath.c_str(), fPush ? W_OK : R_OK));
+    if (!iRes)
+    {
+        if (useCompression(fPush, strLocalPath, strRemotePath))
+        {
+            DBG("compressed " << (fPush ? "push " : "pull ") << strRemotePath);
+
+            iRes = fPush ? adbncCompressedPush(strLocalPath, strRemotePath) : adbncCompressedPull(strRemotePath, strLocalPath);
+            if (iRes)
+            {
+                DBG("compressed transfer failed, retrying uncompressed");
+                iRes = adbTransfer(fPush, strLocalPath, strRemotePath);
+            }
+        }
+        else
+            iRes = adbTransfer(fPush, strLocalPath, strRemotePath);
+
+        struct stat statBuf;
+        if (!iRes && fPush && !::stat(strLocalPath.c_str(), &statBuf) && statBuf.st_size >= iStatFsWriteBytes)
+            forgetStatFs(strRemotePath.c_str());
+    }
+
+    return(iRes);
+}
+
+/**
+ * Copy (using adb pull) a file from the Android device to the local
+ * host.
+ *
+ * @param strRemoteSource Android-side file path to copy.
+ * @param strLocalDestination local host-side destination path for copy.
+ *
+ * @return 0 if no error, non zero otherwise.
+ *
+ * @see adbncPush.
+ * @see adbncPushPullCmd.
+ *
+ * @bug problems with files with ? in filenames (adb bug?)
+ */
+static int adbncPull(const string& strRemoteSource, const string& strLocalDestination)
+{
+    return(adbncPushPullCmd(false, strLocalDestination, strRemoteSource));
+}
+
+/**
+ * Copy a file from the Android device into the local cache.
+ *
+ * If deduplication is enabled (option dedup) the md5 checksum of the file is
+ * computed on the device first. If the blob store already holds a blob with
+ * that checksum the cached file is hard linked to it instead of pulled.
+ * Otherwise the file is pulled and, unless opened for writing, added to the
+ * blob store.
+ *
+ * @param strRemoteSource Android-side file path to copy.
+ * @param strLocalDestination local host-side destination path for copy.
+ * @param fForWrite true if the file is going to be modified.
+ *
+ * @return 0 if no error, non zero otherwise.
+ */
+static int pullToCache(const string& strRemoteSource, const string& strLocalDestination, const bool fForWrite)
+{
+    string strChecksum;
+    unsigned long ulSize(0);
+
+    if (options.iDedup)
+    {
+        struct stat statBuf;
+        if (!doStat(strRemoteSource.c_str(), &statBuf))
+            ulSize = statBuf.st_size;
+
+        if (ulSize > 0 && ulSize >= options.uiDedupMinSizeKb * 1024UL)
+            strChecksum = remoteChecksum(strRemoteSource);
+    }
+
+    int iRes(0);
+
+    if (!strChecksum.empty() && fileExists(blobPath(strChecksum).c_str()))
+    {
+        iRes = adbnc_access(strRemoteSource.c_str(), R_OK);
+        if (!iRes)
+        {
+            if (linkFromBlobStore(blobPath(strChecksum), strLocalDestination))
+            {
+                DBG("deduplicated " << strRemoteSource << " to blob " << strChecksum);
+
+                localCache.blob(strRemoteSource.c_str(), blobPath(strChecksum));
+
+                ulDedupHits++;
+                ullDedupBytesAvoided += ulSize;
+            }
+            else
+                iRes = adbncPull(strRemoteSource, strLocalDestination);
+        }
+    }
+    else
+    {
+        iRes = adbncPull(strRemoteSource, strLocalDestination);
+        if (!iRes && !strChecksum.empty() && !fForWrite && ::link(strLocalDestination.c_str(), blobPath(strChecksum).c_str()) == 0)
+            localCache.blob(strRemoteSource.c_str(), blobPath(strChecksum));
+    }
+
+    return(iRes);
+}
+
+/**
+ * Copy (using adb push) a file from the local host to the Android
+ * device. Very similar to adbnc_pull().
+ *
+ * @return 0 if no error, non zero otherwise.
+ *
+ * @see adbncPull.
+ * @see adbncPushPullCmd.
+ *
+ * @bug problems with files with ? in filenames (adb bug?).
+ */
+int adbncPush(const string& strLocalSource, const string& strRemoteDestination)
+{
+    return(adbncPushPullCmd(true, strLocalSource, strRemoteDestination));
+}
+
+/**
+ * Parses the output of a stat -t command.
+ *
+ * stat -t Explained:
+ * file name (%n)
+ * total size (%s)
+ * number of blocks (%b)
+ * raw mode in hex (%f)
+ * UID of owner (%u)
+ * GID of file (%g)
+ * device number in hex (%D)
+ * inode number (%i)
+ * number of hard links (%h)
+ * major device type in hex (%t)
+ * minor device type in hex (%T)
+ * last access time as seconds since the Unix Epoch (%X)
+ * last modification as seconds since the Unix Epoch (%Y)
+ * last change as seconds since the Unix Epoch (%Z)
+ * I/O block size (%o)
+ *
+ * The file name may contain blanks, so the last 15 tokens are used.
+ *
+ * @param output the output lines of the stat command.
+ * @param pStatBuf receives the attributes, st_mode is the raw mode.
+ *
+ * @return -ENOENT if the output does not describe a file, -EIO if it could
+ *         not be parsed, zero otherwise.
+ */
+static int parseStatOutput(const deque<string>& output, struct stat* pStatBuf)
+{
+    if (output.empty())
+        return -ENOENT;
+
+    string strLine;
+    for (deque<string>::const_iterator it(output.begin()); it != output.end(); ++it)
+        strLine += *it;
+
+    vector<string> tokens(tokenize(strLine));
+    if (tokens.size() < 15)
+        return -ENOENT;
+
+    if (tokens.size() > 15)
+        tokens.erase(tokens.begin(), tokens.end() - 15);
+
+    int iRes(0);
+    ::memset(pStatBuf, 0, sizeof(struct stat));
+
+    try
+    {
+        pStatBuf->st_ino = stoul(tokens[7]);              /* inode number */
+        pStatBuf->st_mode = stoul(tokens[3], NULL, 16);   /* protection */
+        pStatBuf->st_nlink = 1;                           /* number of hard links */
+        pStatBuf->st_uid = stoul(tokens[4]);              /* user ID of owner */
+        pStatBuf->st_gid = stoul(tokens[5]);              /* group ID of owner */
+        pStatBuf->st_rdev = stoul(tokens[6], NULL, 16);   /* device ID (if special file) */
+        pStatBuf->st_size = stoull(tokens[1]);            /* total size, in bytes */
+        pStatBuf->st_blksize = stol(tokens[14]);          /* blocksize for filesystem I/O */
+        pStatBuf->st_blocks = stoul(tokens[2]);           /* number of blocks allocated */
+        pStatBuf->st_atime = stol(tokens[11]);            /* time of last access */
+        pStatBuf->st_mtime = stol(tokens[12]);            /* time of last modification */
+        pStatBuf->st_ctime = stol(tokens[13]);            /* time of last status change */
+    }
+    catch (const exception& e)
+    {
+        ERR("Exception thrown in parseStatOutput(): " << e.what());
+
+        for (int i = 0; i < tokens.size(); i++)
+            ERR("Token[" << i << "] :" << tokens[i]);
+
+        iRes = -EIO;
+    }
+
+    return(iRes);
+}
+
+/**
+ * Parses the output of a stat -t command run on all entries of a directory,
+ * one line per entry.
+ *
+ * @param strPrefix the pathname of the directory followed by a slash, the
+ *        entries are named with it, see listDirectory().
+ * @param output the output lines of the stat command.
+ * @param pNames receives the names of the entries like ls -1a lists them,
+ *        dot and dot-dot first.
+ * @param pAttributes receives the attributes of each entry by name, st_mode
+ *        is the raw mode.
+ *
+ * @return -ENOENT if the output does not describe the directory itself,
+ *         zero otherwise.
+ */
+static int parseStatListing(const string& strPrefix, const deque<string>& output, deque<string>* pNames, map<string, struct stat>* pAttributes)
+{
+    pNames->clear();
+    pAttributes->clear();
+
+    string strLine;
+    for (deque<string>::const_iterator it(output.begin()); it != output.end(); ++it)
+    {
+        strLine += *it;
+
+        // the name is all but the last 14 tokens, it may contain blanks
+        size_t uiEnd(strLine.find_last_not_of(" \t"));
+        for (int i = 0; i < 14 && uiEnd != string::npos; i++)
+        {
+            uiEnd = strLine.find_last_of(" \t", uiEnd);
+            if (uiEnd != string::npos)
+                uiEnd = strLine.find_last_not_of(" \t", uiEnd);
+        }
+
+        // as in parseStatOutput() an entry may be split over several lines
+        if (uiEnd == string::npos)
+            continue;
+
+        const string strEntry(strLine);
+        strLine.clear();
+
+        struct stat statBuf;
+        if (parseStatOutput(deque<string>(1, strEntry), &statBuf))
+            continue;
+
+        if (strEntry.compare(0, strPrefix.length(), strPrefix) != 0)
+            continue;
+
+        const string strName(strEntry.substr(strPrefix.length(), uiEnd + 1 - strPrefix.length()));
+        if (pAttributes->insert(make_pair(strName, statBuf)).second && strName != "." && strName != "..")
+            pNames->push_back(strName);
+    }
+
+    int iRes(0);
+    if (pAttributes->find(".") != pAttributes->end())
+    {
+        pNames->push_front("..");
+        pNames->push_front(".");
+    }
+    else
+    {
+        pNames->clear();
+        iRes = -ENOENT;
+    }
+
+    return(iRes);
+}
+
+/**
+ * Builds the stat commands retrieving the attributes of the entries of a
+ * directory listed by ls -1a, for a directory whose names do not fit into a
+ * single argument list.
+ *
+ * Each command is at most #uiMaxStatCommandLength long, unless a single
+ * name is longer, their output put together is parsed by parseStatListing().
+ *
+ * @param strPrefix the pathname of the directory with a slash appended.
+ * @param names the output of ls -1a.
+ *
+ * @return the commands, each one naming at least one entry.
+ */
+static deque<string> statListingCommands(const string& strPrefix, const deque<string>& names)
+{
+    static const string strStat("stat -t --");
+    static const string strRedirect(" 2>/dev/null");
+
+    deque<string> commands;
+    string strCommand(strStat);
+    for (deque<string>::const_iterator it(names.begin()); it != names.end(); ++it)
+    {
+        const string strArg(" '" + strPrefix + *it + "'");
+        if (strCommand.length() > strStat.length() && strCommand.length() + strArg.length() + strRedirect.length() > uiMaxStatCommandLength)
+        {
+            commands.push_back(strCommand + strRedirect);
+            strCommand = strStat;
+        }
+
+        strCommand.append(strArg);
+    }
+
+    if (strCommand.length() > strStat.length())
+        commands.push_back(strCommand + strRedirect);
+
+    return(commands);
+}
+
+/**
+ * Retrieves file attributes from the android device and caches them in
+ * #fileCache.
+ *
+ * @param pcPath the pathname of the file.
+ * @param pStatBuf receives the attributes.
+ *
+ * @return 0 on success, -ENOENT if pcPath does not exist, an error of
+ *         awaitHandshake() or -EIO otherwise.
+ */
+static int statOnDevice(const char *pcPath, struct stat* pStatBuf)
+{
+    // no output without netcat must not be remembered as missing
+    const int iHandshake(awaitHandshake(hpNetCat));
+    if (iHandshake)
+        return(iHandshake);
+
+    string strCommand("stat -t '");
+    strCommand.append(pcPath);
+    strCommand.append("'");
+
+    const int iRes(parseStatOutput(sharedShell(strCommand), pStatBuf));
+    if (!iRes)
+        fileCache.putStat(pcPath, *pStatBuf);
+    else if (iRes == -ENOENT)
+        fileCache.putMissing(pcPath);
+
+    return(iRes);
+}
+
+/**
+ * Queues stale or restored attributes for #refreshThread.
+ *
+ * @param pcPath the pathname of the file.
+ * @param fListing true to refresh the attributes of all entries of the
+ *        directory pcPath with a single listing, false to refresh the
+ *        attributes of pcPath.
+ *
+ * @return false if the queue is full or #refreshThread is not running, the
+ *         caller has to retrieve the attributes itself then.
+ */
+static bool requestRefresh(const char *pcPath, const bool fListing)
+{
+    ::pthread_mutex_lock(&refreshMutex);
+
+    const bool fRes(fRefreshThreadStarted && refreshQueue.size() < uiMaxRefreshQueue);
+    if (fRes)
+    {
+        refreshQueue.push_back(make_pair(string(pcPath), fListing));
+        ::pthread_cond_signal(&refreshCond);
+    }
+
+    ::pthread_mutex_unlock(&refreshMutex);
+
+    return(fRes);
+}
+
+/**
+ * Start routine of #refreshThread.
+ *
+ * Retrieves the attributes of the paths and lists the directories queued by
+ * requestRefresh(), so lookups of frequently used or restored paths are
+ * answered from #fileCache while their attributes are refreshed.
+ *
+ * @param pvArg not used.
+ *
+ * @return NULL once #fStopRefresh is set.
+ */
+static void* refreshThreadMain(void* /*pvArg*/)
+{
+    ::pthread_mutex_lock(&refreshMutex);
+
+    while (!fStopRefresh)
+    {
+        if (refreshQueue.empty())
+            ::pthread_cond_wait(&refreshCond, &refreshMutex);
+        else
+        {
+            const pair<string, bool> request(refreshQueue.front());
+            refreshQueue.pop_front();
+
+            ::pthread_mutex_unlock(&refreshMutex);
+
+            if (request.second)
+            {
+                deque<string> names;
+                listOnDevice(request.first.c_str(), &names);
+            }
+            else
+            {
+                struct stat statBuf;
+                statOnDevice(request.first.c_str(), &statBuf);
+            }
+            DBG("refreshed " << request.first);
+            ulRefreshes++;
+
+            ::pthread_mutex_lock(&refreshMutex);
+        }
+    }
+
+    ::pthread_mutex_unlock(&refreshMutex);
+
+    return(NULL);
+}
+
+/**
+ * Execute a stat command on android file or directory denoted by pcPath.
+ *
+ * The parsed attributes are cached in #fileCache, paths not found in its
+ * negative cache. Stale and restored attributes are answered from the cache
+ * while #refreshThread retrieves them again, if it cannot take them they are
+ * retrieved right away.
+ *
+ * @param pcPath pathname of file or directory on android device.
+ * @param pStatBuf if not NULL receives the attributes of the file, st_mode is
+ *        the raw mode as reported by the device.
+ *
+ * @return -ENOENT if pcPath does not exists, -EIO if the output of the stat
+ *         command could not be parsed, zero otherwise.
+ */
+static int doStat(const char *pcPath, struct stat* pStatBuf)
+{
+    int iRes(0);
+
+    struct stat statBuf;
+
+    bool fRefresh;
+    if (fileCache.getStat(pcPath, &statBuf, &fRefresh) && (!fRefresh || requestRefresh(pcPath, false)))
+    {
+        DBG("from cache " << pcPath);
+    }
+    else if (fileCache.isMissing(pcPath))
+    {
+        DBG("from cache " << pcPath << " MISSING");
+        iRes = -ENOENT;
+    }
+    else
+        iRes = statOnDevice(pcPath, &statBuf);
+
+    if (!iRes && pStatBuf)
+        *pStatBuf = statBuf;
+
+    return(iRes);
+}
+
+/**
+ * Records size and modification time of a just pushed remote file in
+ * #localCache, so the next adbnc_open() can reuse the cached copy.
+ *
+ * @param pcPath pathname of file on android device.
+ */
+static void recordRemoteVersion(const char *pcPath)
+{
+    fileCache.invalidate(pcPath);
+
+    struct stat statBuf;
+    if (!doStat(pcPath, &statBuf))
+        localCache.remoteVersion(pcPath, statBuf.st_size, statBuf.st_mtime);
+}
+
+/**
+ * Return the command line used to start netcat process on android device.
+ *
+ * @return nc -ll -p forwardport -e /system/xbin/bash
+ * @see androidStartNetcat
+ */
+static const string androidNetCatStartCommand()
+{
+    ostringstream strCmdStream;
+    strCmdStream << "nc -ll -p " << iForwardPort << " -e /system/xbin/bash";
+
+    return(strCmdStream.str());
+}
+
+/**
+ * Test if netcat is started on the android device.
+ *
+ * @return pid of netcat or 0 if not started.
+ */
+static int androidNetcatStarted()
+{
+    int iPid(0);
+
+    const char* const argv[] = { "adb", "shell", "su", "-c", "busybox", "ps", "|", "grep", androidNetCatStartCommand().c_str(), NULL };
+
+    deque<string> output(execProg(argv));
+
+    while (output.size() > 0)
+    {
+        if (output.front().find("grep") == string::npos)
+        {
+            vector<string> tokens(tokenize(output.front()));
+            iPid = stoi(tokens[0].c_str());
+            break;
+        }
+        else
+            output.pop_front();
+    }
+
+    return(iPid);
+}
+
+/**
+ * Kills the running netcat process on android device.
+ *
+ * netcat is not looked up again afterwards, killing the process found does
+ * not fail.
+ *
+ * @return 0 if netcat was found and killed, 1 otherwise.
+ *
+ * @see androidStartNetcat.
+ */
+static int androidKillNetCat()
+{
+    const int iPid(androidNetcatStarted());
+
+    if (iPid > 0)
+    {
+        const string strPid(to_string(iPid));
+        const char* const argv[] = { "adb", "shell", "su", "-c", "busybox", "kill", strPid.c_str(), NULL };
+        execProg(argv);
+
+        INF("Netcat successfully stopped on android device");
+    }
+    else
+        INF("Failed to kill NetCat on android device");
+
+    return(iPid > 0 ? 0 : 1);
+}
+
+/**
+ * Starts a netcat process on the android device.
+ *
+ * netcat is started without checking for one left running by an earlier
+ * mount first, if there is one the new one cannot listen on the port and
+ * exits, the one running is used then.
+ *
+ * @return 0 if netcat could successfully be started, 3 otherwise.
+ *
+ * @see androidNetCatStartCommand.
+ */
+static int androidStartNetcat()
+{
+    const string strStartCommand(androidNetCatStartCommand());
+    const char* const argv[] = { "adb", "shell", "su", "-c", "busybox", "nohup", strStartCommand.c_str(), "2>/dev/null",  "1>/dev/null", "&", NULL };
+    execProg(argv);
+
+    const int iStarted(androidNetcatStarted());
+    if (!iStarted)
+        INF("error: could not start netcat on android device");
+    else
+        INF("Netcat successfully started on android device");
+
+    return(iStarted ? 0 : 3);
+}
+
+/**
+ * Tests if any android device is connected to a local host's usb port.
+ *
+ * @return 0 if a device is connected; 1 otherwise.
+ */
+static int isAndroidDeviceConnected()
+{
+    int iRes(1);
+
+    // check if a android device is connected
+    int iError(0);
+
+    const char* const argv[] = { "adb", "devices", NULL };
+    deque<string> output(execProg(argv, false, &iError));
+
+    if (!iError)
+    {
+        if (output.size() > 2)
+        {
+            const string strDeviceId(output[output.size() - 2].substr(0, 8));
+
+            if (strDeviceId != "List of ")
+            {
+                const string& strLine(output[output.size() - 2]);
+                strDeviceSerial.assign(strLine.substr(0, strLine.find_first_of(" \t\n")));
+
+                INF("Using android device " << strDeviceId);
+                iRes = 0;
+            } // error message already written by adb
+         }  // error message already written by adb
+    }
+
+    return(iRes);
+}
+
+/**
+ * Tests if tcp socket connections from local port to remote port on the android
+ * device is in place.
+ *
+ * @param strForwardArg the local and remote port to be used for testing.
+ *        e.g. "tcp:4444 tcp:4444"
+ *
+ * @return true if and only if adb port forwarding is in place; false otherwise.
+ *
+ * @see setAndroidPortForwarding
+ */
+static bool isAndroidPortForwarded(const string& strForwardArg)
+{
+    bool fRes(false);
+
+    const char* const argv[] = { "adb", "forward", "--list", NULL };
+    deque<string> output(execProg(argv));
+
+    for(deque<string>::iterator it = output.begin(); it != output.end(); ++it)
+    {
+        if((*it).find(strForwardArg) != string::npos)
+        {
+            fRes = true;
+            break;
+        }
+    }
+
+    return(fRes);
+}
+
+/**
+ * Enable adb port forwarding for our local and remote port.
+ *
+ * adb replaces a forwarding of the local port already in place, so it is not
+ * checked for before.
+ *
+ * @return 0 if port forwarding could be enabled, 2 otherwise.
+ */
+static int setAndroidPortForwarding()
+{
+    int iRes(2);
+
+    ostringstream strForwardPort;
+    strForwardPort << "tcp:" << iForwardPort;
+
+    ostringstream strForwardArg;
+    strForwardArg << strForwardPort.str() << " " << strForwardPort.str();
+
+    const string strPort(strForwardPort.str());
+    const char* const argv[] = { "adb", "forward", strPort.c_str(), strPort.c_str(), NULL };
+    execProg(argv);
+
+    if (isAndroidPortForwarded(strForwardArg.str()))
+    {
+        INF("Port " << strForwardPort.str() << " successfully forwarded to android device");
+        iRes = 0;
+    }
+    else
+        INF("Failed to forward Port " << strForwardPort.str() << " to android device");
+
+    return(iRes);
+}
+
+/**
+ * Tries to remove android port forwarding.
+ *
+ * Removing a forwarding not in place fails harmlessly, so it is not checked
+ * for before.
+ *
+ * @return 0 if and only if adb port forwarding for our local and remote
+ *         port is removed; 2 otherwise.
+ *
+ * @see setAndroidPortForwarding.
+ */
+static int removeAndroidPortForwarding()
+{
+    ostringstream strForwardPort;
+    strForwardPort << "tcp:" << iForwardPort;
+
+    ostringstream strForwardArg;
+    strForwardArg << strForwardPort.str() << " " << strForwardPort.str();
+
+    const string strPort(strForwardPort.str());
+    const char* const argv[] = { "adb", "forward", "--remove", strPort.c_str(), NULL };
+    execProg(argv);
+
+    bool fRet(!isAndroidPortForwarded(strForwardArg.str()));
+    if (fRet)
+        INF("Forward port " << strForwardPort.str() << " to android device successfully removed");
+    else
+        INF("Failed to remove forward port " << strForwardPort.str() << " from android device");
+
+    return(fRet ? 0 : 2);
+}
+
+/**
+ * Recursively deletes the temporary directory created in makeTempDir().
+ *
+ * @return 0.
+ */
+static int cleanupTempDir(void)
+{
+    const char* const argv[] = { "rm", "-rf", strTempDirPath.c_str(), NULL };
+    execProg(argv);
+
+    return(0);
+}
+
+/**
+ * Create a temporary directory and stores the path in #strTempDirPath variable.
+ *
+ * Also creates the blob store and the root of #localCache within the temporary
+ * directory.
+ *
+ * @return errno if an error occurred or 0 otherwise.
+ *
+ * @see acTempDirTemplate
+ */
+static int makeTempDir(void)
+{
+    char acTempDirTemplate[::strlen(pcTempDirTemplate) + 1];
+    ::strncpy(acTempDirTemplate, pcTempDirTemplate, sizeof(acTempDirTemplate));
+    const char * pcTempDir = ::mkdtemp(&acTempDirTemplate[0]);
+
+    int iRes(pcTempDir ? 0 : errno);
+
+    if (!iRes)
+    {
+        strTempDirPath.assign(pcTempDir);
+        strTempDirPath.append("/");
+
+        if (::mkdir(blobPath("").c_str(), 0700) == -1)
+            iRes = errno;
+        else
+            localCache.rootDir(strTempDirPath);
+    }
+
+    return(iRes);
+}
+
+/**
+ * Returns the path of a file kept per device serial number in adbncfs within
+ * $XDG_CACHE_HOME or ~/.cache, the directories are created if needed.
+ *
+ * @param pcExtension the extension of the file, e.g. ".snapshot".
+ *
+ * @return the path, empty if the serial number or the home directory is not
+ *         known.
+ */
+static string deviceCachePath(const char* pcExtension)
+{
+    const char* pcCacheHome(::getenv("XDG_CACHE_HOME"));
+    const char* pcHome(::getenv("HOME"));
+    if (strDeviceSerial.empty() || (!pcCacheHome && !pcHome))
+        return("");
+
+    string strDir(pcCacheHome ? pcCacheHome : string(pcHome) + "/.cache");
+    ::mkdir(strDir.c_str(), 0700);
+    strDir.append("/adbncfs");
+    ::mkdir(strDir.c_str(), 0700);
+
+    string strSerial(strDeviceSerial);
+    replace(strSerial.begin(), strSerial.end(), '/', '_');
+
+    return(strDir + "/" + strSerial + pcExtension);
+}
+
+/**
+ * Restores #fileCache and #dirCache from the snapshot saved when the device
+ * was last unmounted, see saveSnapshot().
+ *
+ * Snapshots are kept in deviceCachePath().
+ */
+static void loadSnapshot()
+{
+    if (!options.iSnapshot)
+        return;
+
+    strSnapshotPath = deviceCachePath(".snapshot");
+    if (strSnapshotPath.empty())
+        return;
+
+    if (CacheSnapshot::load(strSnapshotPath.c_str(), &fileCache, &dirCache))
+        INF("Restored attributes of " << fileCache.entries() << " paths from " << strSnapshotPath);
+}
+
+/**
+ * Saves #fileCache and #dirCache for the next mount of the device, see
+ * loadSnapshot().
+ */
+static void saveSnapshot()
+{
+    if (!strSnapshotPath.empty())
+    {
+        if (CacheSnapshot::save(strSnapshotPath.c_str(), fileCache, dirCache))
+            INF("Saved attributes of " << fileCache.entries() << " paths to " << strSnapshotPath);
+        else
+            INF("Failed to save " << strSnapshotPath);
+    }
+}
+
+/**
+ * Returns the path of the file on the device holding the identity token of a
+ * session kept by saveSession().
+ */
+static string deviceSessionPath()
+{
+    ostringstream strPath;
+    strPath << pcDeviceSessionDir << "/adbncfs." << iForwardPort << ".session";
+
+    return(strPath.str());
+}
+
+/**
+ * Keeps the session with the device for the next mount, see
+ * reattachSession().
+ *
+ * A random identity token is written to deviceSessionPath() on the device
+ * via netcat, and together with the output of busybox id and busybox mount
+ * to deviceCachePath(".session") on the local host.
+ *
+ * @return true if the session is kept, netcat on the device and port
+ *         forwarding must be left running then.
+ */
+static bool saveSession()
+{
+    const string strPath(deviceCachePath(".session"));
+    if (strPath.empty() || !pUserInfo || !pMountInfo)
+        return(false);
+
+    unsigned char aucRandom[16];
+    ifstream random("/dev/urandom", ios::binary);
+    if (!random.read(reinterpret_cast<char*>(aucRandom), sizeof(aucRandom)))
+        return(false);
+
+    ostringstream strToken;
+    strToken << hex << setfill('0');
+    for (size_t i = 0; i < sizeof(aucRandom); i++)
+        strToken << setw(2) << (unsigned int)aucRandom[i];
+
+    const deque<string> output(adbncShell("echo '" + strToken.str() + "' > '" + deviceSessionPath() + "' && echo ok"));
+    if (output.empty() || output.back() != "ok")
+        return(false);
+
+    const string strTmpPath(strPath + ".tmp");
+    ofstream session(strTmpPath.c_str(), ios::trunc);
+    session << pcSessionMagic << endl << strToken.str() << endl << strUserInfoOutput << endl;
+    for (deque<string>::const_iterator it(mountInfoOutput.begin()); it != mountInfoOutput.end(); ++it)
+        session << *it << endl;
+    session.close();
+
+    if (!session || ::rename(strTmpPath.c_str(), strPath.c_str()) == -1)
+    {
+        ::unlink(strTmpPath.c_str());
+        return(false);
+    }
+
+    INF("Kept session with android device in " << strPath);
+
+    return(true);
+}
+
+/**
+ * Reattaches to a session kept by saveSession() on the last unmount.
+ *
+ * initNetCat() is called and the identity token is read from the device in a
+ * single round trip. If it matches the one kept on the local host, netcat on
+ * the device and port forwarding are in place and #pUserInfo and #pMountInfo
+ * are restored from the local host. Otherwise netcat is destroyed again, the
+ * full handshake is needed.
+ *
+ * @return true if reattached.
+ */
+static bool reattachSession()
+{
+    const string strPath(deviceCachePath(".session"));
+    if (strPath.empty())
+        return(false);
+
+    ifstream session(strPath.c_str());
+    string strMagic, strToken, strUserInfo;
+    if (!getline(session, strMagic) || strMagic != pcSessionMagic || !getline(session, strToken) || !getline(session, strUserInfo))
+        return(false);
+
+    deque<string> mountOutput;
+    string strLine;
+    while (getline(session, strLine))
+        mountOutput.push_back(strLine);
+
+    initNetCat();
+    const deque<string> output(execCommandDirectly(pNetCat, "busybox cat '" + deviceSessionPath() + "' 2>/dev/null"));
+    if (output.size() != 1 || output.front() != strToken)
+    {
+        INF("Session kept in " << strPath << " is gone");
+        destroyNetCat();
+        return(false);
+    }
+
+    strUserInfoOutput = strUserInfo;
+    pUserInfo = new UserInfo(strUserInfo.c_str());
+
+    mountInfoOutput = mountOutput;
+    mountOutput.push_back(pcSdCardMountEntry); // see queryMountInfo()
+    pMountInfo = new MountInfo(mountOutput);
+
+    return(true);
+}
+
+/**
+ * Removes the session file written by saveSession(), the session is torn
+ * down.
+ */
+static void forgetSession()
+{
+    const string strPath(deviceCachePath(".session"));
+    if (!strPath.empty())
+        ::unlink(strPath.c_str());
+}
+
+/**
+ * Query user information (uid, gid, groups) form android device.
+ *
+ * A "adb shell busybox id" command is executed and the output is stored in
+ * a UserInfo instance for later retrieval. A pointer to the UserInfo object
+ * is stored in #pUserInfo.
+ *
+ * If command failed en error message is written to stdout
+ *
+ * @return 0 if user information is obtained, 1 otherwise.
+ */
+static int queryUserInfo()
+{
+    const char* const argv[] = { "adb", "shell", "busybox id", NULL };
+    deque<string> output(execProg(argv));
+
+    int iRes(!(output.size() == 1));
+    if (!iRes && output.front().length() > 5 && output.front()[0] == 'u')
+    {
+        strUserInfoOutput = output.front();
+        pUserInfo = new UserInfo(output.front().c_str());
+    }
+    else
+        INF("Failed to query user info from device");
+
+    return(iRes);
+}
+
+/**
+ * Query mount information form android device.
+ *
+ * A "adb shell busybox mount" command is executed and the output is stored in
+ * a MontInfo instance for later retrieval. A pointer to the MontInfo object
+ * is stored in #pMountInfo.
+ *
+ * If command failed en error message is written to stdout
+ *
+ * @return 0 if mount information is obtained, 1 otherwise.
+ */
+static int queryMountInfo()
+{
+    const char* const argv[] = { "adb", "shell", "busybox mount", NULL };
+    deque<string> output(execProg(argv));
+
+    int iRes(!(output.size() > 0));
+    if (!iRes)
+    {
+        mountInfoOutput = output;
+
+        /*
+         * Big Hack, coz. I don't know how to get mount info for sdcard from device.
+         *
+         * @todo get rid of that
+         */
+        output.push_back(pcSdCardMountEntry);
+        pMountInfo = new MountInfo(output);
+    }
+    else
+        INF("Failed to query mount info from device");
+
+    return(iRes);
+}
+
+/**
+ * Tests if a FUSE option is given on the command line.
+ *
+ * @param pArgs the command line arguments.
+ * @param pcName the name of the option, e.g. attr_timeout.
+ *
+ * @return true if and only if pcName is given, with or without a value, in
+ *         one of the -o options.
+ */
+static bool hasFuseOption(const struct fuse_args* pArgs, const char *pcName)
+{
+    const size_t uiNameLen(::strlen(pcName));
+
+    for (int i = 1; i < pArgs->argc; i++)
+    {
+        const char* pcOptions(NULL);
+        if (::strcmp(pArgs->argv[i], "-o") == 0 && i + 1 < pArgs->argc)
+            pcOptions = pArgs->argv[++i];
+        else if (::strncmp(pArgs->argv[i], "-o", 2) == 0)
+            pcOptions = pArgs->argv[i] + 2;
+
+        const char* pc(pcOptions);
+        while (pc)
+        {
+            if (::strncmp(pc, pcName, uiNameLen) == 0 && (pc[uiNameLen] == '\0' || pc[uiNameLen] == '=' || pc[uiNameLen] == ','))
+                return(true);
+
+            pc = ::strchr(pc, ',');
+            if (pc)
+                pc++;
+        }
+    }
+
+    return(false);
+}
+
+/**
+ * Lets the kernel cache names and attributes for option kernel_timeout
+ * seconds instead of FUSE's default of one second, unless entry_timeout or
+ * attr_timeout are given. Without option kernel_timeout FUSE's defaults are
+ * kept.
+ *
+ * Every lookup the kernel does not answer itself is an adbnc_getattr() call,
+ * answered from #fileCache anyway as long as the attributes are valid.
+ * Nothing invalidates the kernel's caches, changes made on the device, also
+ * those reported by #watcherThread, are seen by the kernel up to
+ * kernel_timeout seconds later than by #fileCache. Paths found missing are
+ * therefore not cached by the kernel unless negative_timeout is given.
+ *
+ * @param pArgs the command line arguments passed to fuse_main().
+ */
+static void addKernelTimeouts(struct fuse_args* pArgs)
+{
+    if (!options.uiKernelTimeout)
+        return;
+
+    ostringstream strOption;
+
+    if (!hasFuseOption(pArgs, "entry_timeout"))
+    {
+        strOption << "-oentry_timeout=" << options.uiKernelTimeout;
+        ::fuse_opt_add_arg(pArgs, strOption.str().c_str());
+    }
+
+    if (!hasFuseOption(pArgs, "attr_timeout"))
+    {
+        strOption.str("");
+        strOption << "-oattr_timeout=" << options.uiKernelTimeout;
+        ::fuse_opt_add_arg(pArgs, strOption.str().c_str());
+    }
+}
+
+/**
+ * A step of the handshake with the device or of the teardown run by
+ * runDeviceSteps().
+ */
+struct DeviceStep
+{
+    /**
+     * Constructor.
+     *
+     * @param pcName name written to the log.
+     * @param pfnStep the step, returns 0 on success.
+     * @param uiParts HandshakePart flags marked done with the step, 0 for
+     *        none.
+     */
+    DeviceStep(const char* pcName, int (*pfnStep)(), const unsigned int uiParts) : pcName(pcName), pfnStep(pfnStep), uiParts(uiParts), iRes(0), ulMillis(0), thread(), fStarted(false) {}
+
+    /** Name written to the log */
+    const char* pcName;
+
+    /** The step, returns 0 on success */
+    int (*pfnStep)();
+
+    /** HandshakePart flags marked done with the step, see handshakeDone() */
+    unsigned int uiParts;
+
+    /** Result of #pfnStep */
+    int iRes;
+
+    /** Milliseconds #pfnStep took */
+    unsigned long ulMillis;
+
+    /** Thread running #pfnStep */
+    pthread_t thread;
+
+    /** true if and only if #thread is started */
+    bool fStarted;
+};
+
+/**
+ * Returns the milliseconds elapsed since the given time.
+ *
+ * @param pStart the time as returned by clock_gettime(CLOCK_MONOTONIC).
+ */
+static unsigned long millisSince(const struct timespec* pStart)
+{
+    struct timespec now;
+    ::clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return((now.tv_sec - pStart->tv_sec) * 1000UL + now.tv_nsec / 1000000 - pStart->tv_nsec / 1000000);
+}
+
+/**
+ * Start routine of the threads started by runDeviceSteps().
+ *
+ * @param pvArg the DeviceStep to run.
+ *
+ * @return NULL.
+ */
+static void* deviceStepMain(void* pvArg)
+{
+    DeviceStep* pStep(static_cast<DeviceStep*>(pvArg));
+
+    struct timespec start;
+    ::clock_gettime(CLOCK_MONOTONIC, &start);
+    pStep->iRes = pStep->pfnStep();
+    pStep->ulMillis = millisSince(&start);
+
+    if (pStep->uiParts)
+        handshakeDone(pStep->uiParts, !pStep->iRes);
+
+    return(NULL);
+}
+
+/**
+ * Runs independent steps of the handshake with the device or of the teardown
+ * at the same time and waits for all of them, each one is run by its own
+ * thread.
+ *
+ * Writes the time each step took to stdout.
+ *
+ * @param pcPhase the phase the steps belong to, for the log.
+ * @param pSteps the steps.
+ * @param iSteps the number of steps.
+ *
+ * @return the result of the first step that failed, 0 if all succeeded.
+ */
+static int runDeviceSteps(const char* pcPhase, DeviceStep* pSteps, int iSteps)
+{
+    for (int i = 0; i < iSteps; i++)
+        pSteps[i].fStarted = (::pthread_create(&pSteps[i].thread, NULL, deviceStepMain, &pSteps[i]) == 0);
+
+    int iRes(0);
+    for (int i = 0; i < iSteps; i++)
+    {
+        if (pSteps[i].fStarted)
+            ::pthread_join(pSteps[i].thread, NULL);
+        else
+            deviceStepMain(&pSteps[i]);
+
+        INF(pcPhase << ": " << pSteps[i].pcName << " took " << pSteps[i].ulMillis << " ms");
+
+        if (!iRes)
+            iRes = pSteps[i].iRes;
+    }
+
+    return(iRes);
+}
+
+/**
+ * Runs the handshake with the device.
+ *
+ * - isAndroidDeviceConnected() is called, adb starts its server if needed
+ * - if option keep_session is given reattachSession() is called, if it
+ *   succeeds loadSnapshot() is called and the handshake is done
+ * - setAndroidPortForwarding(), androidStartNetcat(), queryUserInfo() and
+ *   queryMountInfo() are called at the same time by runDeviceSteps(), they
+ *   only depend on the device being connected
+ * - initNetCat() and loadSnapshot() are called
+ *
+ * Each part is marked done by handshakeDone() as soon as it is, except that
+ * netcat is only marked done by startNetCatThreads().
+ *
+ * @return 0 if a device is connected and no other error occurred;
+ *         a value != 0 otherwise.
+ */
+static int deviceHandshake()
+{
+    struct timespec start;
+    ::clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int iRes(isAndroidDeviceConnected());
+    handshakeDone(hpDevice, !iRes);
+
+    if (!iRes && options.iKeepSession && reattachSession())
+    {
+        handshakeDone(hpUserInfo | hpMountInfo, true);
+        loadSnapshot();
+        INF("Startup: reattached to kept session");
+    }
+    else if (!iRes)
+    {
+        INF("Startup: device found after " << millisSince(&start) << " ms");
+
+        DeviceStep steps[] =
+        {
+            DeviceStep("port forwarding", setAndroidPortForwarding, 0),
+            DeviceStep("netcat on device", androidStartNetcat, 0),
+            DeviceStep("user info", queryUserInfo, hpUserInfo),
+            DeviceStep("mount info", queryMountInfo, hpMountInfo)
+        };
+
+        iRes = runDeviceSteps("Startup", steps, sizeof(steps) / sizeof(*steps));
+
+        // failing to query mount info does not keep netcat from being used
+        if (!steps[0].iRes && !steps[1].iRes && !steps[2].iRes)
+        {
+            initNetCat();
+            loadSnapshot();
+        }
+    }
+
+    INF("Startup: took " << millisSince(&start) << " ms");
+
+    return(iRes);
+}
+
+/**
+ * Starts #ncReaderThread and, if option watch is given, #watcherThread, then
+ * marks netcat ready. Marks netcat failed if initNetCat() did not spawn it.
+ */
+static void startNetCatThreads()
+{
+    if (pNetCat)
+    {
+        ::pthread_mutex_lock(&ncCmdMutex);
+        fNcReaderThreadStarted = (::pthread_create(&ncReaderThread, NULL, ncReaderThreadMain, NULL) == 0);
+        ::pthread_mutex_unlock(&ncCmdMutex);
+    }
+
+    handshakeDone(hpNetCat, pNetCat != NULL);
+
+    if (pNetCat && options.pcWatch)
+    {
+        pWatcher = spawnNetCat();
+        fWatcherThreadStarted = (::pthread_create(&watcherThread, NULL, watcherThreadMain, NULL) == 0);
+    }
+}
+
+/**
+ * Start routine of #handshakeThread.
+ *
+ * Runs deviceHandshake() and startNetCatThreads(), parts of the handshake
+ * not done by then are marked failed.
+ *
+ * @param pvArg not used.
+ *
+ * @return NULL.
+ */
+static void* handshakeThreadMain(void* /*pvArg*/)
+{
+    if (deviceHandshake())
+        ERR("Handshake with android device failed");
+
+    startNetCatThreads();
+    handshakeDone(hpAll, false);
+
+    return(NULL);
+}
+
+/**
+ * Initialize the file system application
+ *
+ * - A segmentation fault signal handler() is installed, SIGPIPE is ignored.
+ * - SIGUSR1 is blocked, see statisticsThreadMain().
+ * - makeTempDir() is called.
+ * - deviceHandshake() is called, unless option lazy_handshake is given, then
+ *   it is called by #handshakeThread after mounting.
+ *
+ * Options specific to adbncfs (see #adbncOpts) are parsed into #options and
+ * removed from pArgs, addKernelTimeouts() adds the kernel's cache timeouts.
+ *
+ * @param pArgs the command line arguments, on return the arguments to pass to
+ *        fuse_main().
+ *
+ * @return 0 if a device is connected and no other error occurred;
+ *         a value != 0 otherwise.
+ */
+int initAdbncFs(struct fuse_args* pArgs)
+{
+    ::signal(SIGSEGV, sig11Handler);   // install our handler
+
+    // reattachSession() writes to netcat, it may have exited already
+    ::signal(SIGPIPE, SIG_IGN);
+
+    // SIGUSR1 is only taken by statisticsThreadMain()
+    sigset_t sigSet;
+    ::sigemptyset(&sigSet);
+    ::sigaddset(&sigSet, SIGUSR1);
+    ::pthread_sigmask(SIG_BLOCK, &sigSet, NULL);
+
+    bool fInitRequired(true);
+
+    // check if debug option is set or -h/--help or -V/--version
+    for (int i = 1; i < pArgs->argc; i++)
+    {
+        if (::strcmp(pArgs->argv[i], "-d") == 0)
+            fDebug = true;
+
+        if (::strcmp(pArgs->argv[i], "-h") == 0)
+            fInitRequired = false;
+
+        if (::strcmp(pArgs->argv[i], "--help") == 0)
+            fInitRequired = false;
+
+        if (::strcmp(pArgs->argv[i], "-V") == 0)
+            fInitRequired = false;
+
+        if (::strcmp(pArgs->argv[i], "--version") == 0)
+            fInitRequired = false;
+    }
+
+    // consume our own options, all others are passed on to fuse_main()
+    int iRes(::fuse_opt_parse(pArgs, &options, adbncOpts, NULL) == -1 ? 1 : 0);
+
+    fileCache.negativeTimeout(options.uiNegativeCacheTimeout);
+    dirCache.timeout(options.uiDirCacheTimeout);
+    fileCache.limits(options.uiAttrCacheEntries, options.uiAttrCacheSizeMb * 1024ULL * 1024ULL);
+    fileCache.watchedTimeout(options.uiWatchTimeout);
+    fileCache.staleTimeout(options.uiAttrStaleTimeout);
+    spawnQueue.limit(options.uiAdbProcesses);
+
+    if (!iRes)
+        addKernelTimeouts(pArgs);
+
+    if (!iRes && fInitRequired)
+    {
+        iRes =makeTempDir();
+
+        if (!iRes && !options.iLazyHandshake)
+            iRes = deviceHandshake();
+    }
+
+    return(iRes);
+}
+
+/**
+ * FUSE callback function to initialize the file system.
+ *
+ * One-time setup of #cmdMutex, #ncPendingMutex, #openMutex, #evictionMutex,
+ * #evictionCond, #sweepMutex, #sweepCond, #refreshMutex and #refreshCond and
+ * start of #statisticsThread, #sweepThread, if option cache_size is not 0,
+ * #evictionThread, if option attr_stale_timeout is not 0 or option snapshot
+ * is given, #refreshThread and either startNetCatThreads() or, if option
+ * lazy_handshake is given, #handshakeThread.
+ *
+ * Threads must not be started before, fuse_main() forks when it daemonizes.
+ *
+ * @param pConn gives information about what features are supported by FUSE.
+ *
+ * @return NULL.
+ */
+void* adbnc_init(struct fuse_conn_info *pConn)
+{
+    DBG("adbnc_init()");
+
+//    pConn->async_read = 0;
+//    pConn->want &= ~ FUSE_CAP_ASYNC_READ; // clear async read flag
+    pConn->want |= FUSE_CAP_EXPORT_SUPPORT; // set . and .. not handled by us
+
+    ::pthread_mutex_init(&ncCmdMutex, NULL);
+    ::pthread_mutex_init(&ncPendingMutex, NULL);
+    ::pthread_mutex_init(&openMutex, NULL);
+    ::pthread_mutex_init(&evictionMutex, NULL);
+    ::pthread_cond_init (&evictionCond, NULL);
+    ::pthread_mutex_init(&sweepMutex, NULL);
+    ::pthread_cond_init (&sweepCond, NULL);
+    ::pthread_mutex_init(&refreshMutex, NULL);
+    ::pthread_cond_init (&refreshCond, NULL);
+
+    if (options.iLazyHandshake)
+    {
+        fHandshakeThreadStarted = (::pthread_create(&handshakeThread, NULL, handshakeThreadMain, NULL) == 0);
+        if (!fHandshakeThreadStarted)
+            handshakeDone(hpAll, false);
+    }
+    else
+        startNetCatThreads();
+
+    fStatisticsThreadStarted = (::pthread_create(&statisticsThread, NULL, statisticsThreadMain, NULL) == 0);
+    fSweepThreadStarted = (::pthread_create(&sweepThread, NULL, sweepThreadMain, NULL) == 0);
+
+    if (cacheBudget())
+        fEvictionThreadStarted = (::pthread_create(&evictionThread, NULL, evictionThreadMain, NULL) == 0);
+
+    if (options.uiAttrStaleTimeout || options.iSnapshot)
+    {
+        ::pthread_mutex_lock(&refreshMutex);
+        fRefreshThreadStarted = (::pthread_create(&refreshThread, NULL, refreshThreadMain, NULL) == 0);
+        ::pthread_mutex_unlock(&refreshMutex);
+    }
+
+    return(NULL);
+}
+
+/**
+ * FUSE callback function, called when the file system exits.
+ *
+ * - termination of #handshakeThread
+ * - destruction of #openMutex.
+ * - logStatistics() and cancellation of #statisticsThread
+ * - termination of #evictionThread and destruction of #evictionMutex and
+ *   #evictionCond
+ * - termination of #sweepThread and destruction of #sweepMutex and
+ *   #sweepCond
+ * - termination of #refreshThread and destruction of #refreshMutex and
+ *   #refreshCond
+ * - termination of inotifyd on the device, #watcherThread and #pWatcher
+ * - saveSnapshot()
+ * - saveSession() if option keep_session is given
+ * - destroyNetCat() and destruction of #cmdMutex and #ncPendingMutex
+ * - cleanupTempDir(), unless the session is kept at the same time as
+ *   androidKillNetCat() and removeAndroidPortForwarding() by runDeviceSteps()
+ * - delete #pMountInfo and pUserInfo
+ *
+ * @param private_data comes from the return value of adbnc_init().
+ */
+void adbnc_destroy(void* private_data)
+{
+    DBG("adbnc_destroy()");
+
+    if (fHandshakeThreadStarted)
+    {
+        ::pthread_join(handshakeThread, NULL);
+        fHandshakeThreadStarted = false;
+    }
+
+    ::pthread_mutex_destroy(&openMutex);
+
+    if (fStatisticsThreadStarted)
+    {
+        ::pthread_cancel(statisticsThread);
+        ::pthread_join(statisticsThread, NULL);
+        fStatisticsThreadStarted = false;
+        logStatistics();
+    }
+
+    if (fEvictionThreadStarted)
+    {
+        ::pthread_mutex_lock(&evictionMutex);
+        fStopEviction = true;
+        ::pthread_cond_signal(&evictionCond);
+        ::pthread_mutex_unlock(&evictionMutex);
+
+        ::pthread_join(evictionThread, NULL);
+        fEvictionThreadStarted = false;
+    }
+
+    ::pthread_mutex_destroy(&evictionMutex);
+    ::pthread_cond_destroy(&evictionCond);
+
+    if (fSweepThreadStarted)
+    {
+        ::pthread_mutex_lock(&sweepMutex);
+        fStopSweep = true;
+        ::pthread_cond_signal(&sweepCond);
+        ::pthread_mutex_unlock(&sweepMutex);
+
+        ::pthread_join(sweepThread, NULL);
+        fSweepThreadStarted = false;
+    }
+
+    ::pthread_mutex_destroy(&sweepMutex);
+    ::pthread_cond_destroy(&sweepCond);
+
+    ::pthread_mutex_lock(&refreshMutex);
+    const bool fRefreshing(fRefreshThreadStarted);
+    fStopRefresh = true;
+    fRefreshThreadStarted = false;
+    ::pthread_cond_signal(&refreshCond);
+    ::pthread_mutex_unlock(&refreshMutex);
+
+    if (fRefreshing)
+        ::pthread_join(refreshThread, NULL);
+
+    ::pthread_mutex_destroy(&refreshMutex);
+    ::pthread_cond_destroy(&refreshCond);
+
+    if (pWatcher)
+    {
+        // inotifyd is the last background job of the watcher's shell
+        pWatcher->outStream() << "kill $! ; exit" << endl;
+        pWatcher->sendEof();
+
+        if (fWatcherThreadStarted)
+        {
+            ::pthread_join(watcherThread, NULL);
+            fWatcherThreadStarted = false;
+        }
+
+        INF("Watcher status: " << pWatcher->wait());
+        delete pWatcher;
+        pWatcher = NULL;
+    }
+
+    saveSnapshot();
+
+    const bool fKeepSession(options.iKeepSession && pNetCat && saveSession());
+
+    destroyNetCat();
+    ::pthread_mutex_destroy(&ncCmdMutex);
+    ::pthread_mutex_destroy(&ncPendingMutex);
+
+    if (fKeepSession)
+        cleanupTempDir();
+    else
+    {
+        forgetSession();
+
+        DeviceStep steps[] =
+        {
+            DeviceStep("netcat on device", androidKillNetCat, 0),
+            DeviceStep("port forwarding", removeAndroidPortForwarding, 0),
+            DeviceStep("temporary directory", cleanupTempDir, 0)
+        };
+
+        runDeviceSteps("Teardown", steps, sizeof(steps) / sizeof(*steps));
+    }
+
+    if (pMountInfo)
+    {
+        delete pMountInfo;
+        pMountInfo = NULL;
+    }
+
+    if (pUserInfo)
+    {
+        delete pUserInfo;
+        pUserInfo = NULL;
+    }
+}
+
+/**
+ * Parses the output of a stat -f command as run by statFsOnDevice().
+ *
+ * @code
+ * 4096 4096 3092043 1524383 1524383 786432 770345 255
+ * @endcode
+ *
+ * fundamental block size, preferred block size, total, free and available
+ * blocks, total and free inodes and maximum length of a file name.
+ *
+ * @param output the output of the stat -f command.
+ * @param pFst receives the statistics.
+ *
+ * @return zero on success, -EIO otherwise.
+ */
+static int parseStatFsOutput(const deque<string>& output, struct statvfs* pFst)
+{
+    int iRes(-EIO);
+
+    if (!output.empty())
+    {
+        const vector<string> tokens(tokenize(output.front()));
+        if (tokens.size() >= 8)
+        {
+            try
+            {
+                pFst->f_frsize = stoul(tokens[0]);      // Fundamental file system block size (fragment size).
+                pFst->f_bsize = stoul(tokens[1]);       // Preferred block size for transfers.
+                pFst->f_blocks = stoull(tokens[2]);     // Total number of blocks on the file system, in f_frsize units.
+                pFst->f_bfree = stoull(tokens[3]);      // Total number of free blocks.
+                pFst->f_bavail = stoull(tokens[4]);     // Total number of free blocks available to non-privileged processes.
+                pFst->f_files = stoull(tokens[5]);      // Total number of file nodes (inodes) on the file system.
+                pFst->f_ffree = stoull(tokens[6]);      // Total number of free file nodes (inodes).
+                pFst->f_favail = pFst->f_ffree;         // Total number of free file nodes (inodes) available to non-privileged processes.
+                pFst->f_namemax = stoul(tokens[7]);     // Maximum length of a file name (path element).
+                iRes = 0;
+            }
+            catch (const exception& e)
+            {
+                ERR("Exception thrown in parseStatFsOutput(): " << e.what());
+
+                for (int i = 0; i < tokens.size(); i++)
+                    ERR("Token[" << i << "] :" << tokens[i]);
+            }
+        }
+    }
 
-    return(NULL);
+    return(iRes);
 }
 
 /**
- * FUSE callback function, called when the file system exits.
+ * Retrieves the statistics of the file system a path on the device is
+ * located on with a single busybox stat -f command, instead of one df command
+ * for the blocks and another one for the inodes.
  *
- * - destruction of #cmdMutex, #openMutex, #inReleaseDirMutex and
- *   #inReleaseDirCond.
- * - destroyNetCat()
- * - androidKillNetCat()
- * - removeAndroidPortForwarding()
- * - delete #pMountInfo and pUserInfo
+ * @param pcPath the path on the device.
+ * @param pFst receives the statistics.
  *
- * @param private_data comes from the return value of adbnc_init().
+ * @return zero on success, -EIO otherwise.
  */
-void adbnc_destroy(void* private_data)
+static int statFsOnDevice(const char *pcPath, struct statvfs* pFst)
 {
-    DBG("adbnc_destroy()");
-
-    ::pthread_mutex_destroy(&ncCmdMutex);
-    ::pthread_mutex_destroy(&openMutex);
-    ::pthread_mutex_destroy(&inReleaseDirMutex);
-    ::pthread_cond_destroy(&inReleaseDirCond);
-
-    destroyNetCat();
-    androidKillNetCat();
-    removeAndroidPortForwarding();
-    cleanupTempDir();
-
-    if (pMountInfo)
-    {
-        delete pMountInfo;
-        pMountInfo = NULL;
-    }
+    string strCommand("stat -f -c '%S %s %b %f %a %c %d %l' '");
+    strCommand.append(pcPath);
+    strCommand.append("'");
 
-    if (pUserInfo)
-    {
-        delete pUserInfo;
-        pUserInfo = NULL;
-    }
+    return(parseStatFsOutput(sharedShell(strCommand), pFst));
 }
 
 /**
@@ -1031,6 +3547,10 @@ void adbnc_destroy(void* private_data)
  *
  * this is how programs like df determine the free space.
  *
+ * The statistics are cached in #statFsCache for option statfs_timeout
+ * seconds per mount point on the device, so all paths on the same volume
+ * share them. Pushing a large file drops them, see adbncPushPullCmd().
+ *
  * @param pcPath statistic is retrieved for the file system containing this
  *        path.
  * @param pFst See statvfs(2) for a description of the structure contents.
@@ -1047,84 +3567,54 @@ int adbnc_statfs(const char *pcPath, struct statvfs* pFst)
 
     if (::strcmp(pcPath, "/") != 0)
     {
-        // fist get block info
-        string strCommand("df -P -B 4096 '");
-        strCommand.append(pcPath);
-        strCommand.append("'");
-        deque<string> output(adbncShell(strCommand));
-
-        iRes = (output.size() > 1 ? 0 : -EIO);
-        if (!iRes)
+        // without mount info the statistics are cached per path
+        awaitHandshake(hpMountInfo);
+        const string strKey(statFsKey(pcPath));
+
+        ::pthread_mutex_lock(&statFsMutex);
+        const auto it(statFsCache.find(strKey));
+        const bool fCached(it != statFsCache.end() && millisSince(&it->second.fetched) < options.uiStatfsTimeout * 1000UL);
+        if (fCached)
+            *pFst = it->second.fst;
+        const unsigned long ulGeneration(ulStatFsGeneration);
+        ::pthread_mutex_unlock(&statFsMutex);
+
+        if (fCached)
+            ulStatFsCacheHits++;
+        else
         {
-            /*
-                Filesystem           4K-blocks      Used Available Use% Mounted on
-                tmpfs                   355740        35    355705   0% /dev
-            */
-            output.pop_front(); // remove header
-            vector<string> tokens(tokenize(output.front()));
-            if (tokens.size() >= 6)
-            {
-                try
-                {
-                    pFst->f_bsize = 4096;
-                    pFst->f_blocks = stoul(tokens[1]);      // Total number of blocks on the file system
-                    pFst->f_frsize = pFst->f_bsize;         // Fundamental file system block size (fragment size).
-                    pFst->f_bfree =  stoul(tokens[3]);      // Total number of free blocks.
-                    pFst->f_bavail = pFst->f_bfree;         // Total number of free blocks available to non-privileged processes.
-                }
-                catch (const exception& e)
-                {
-                    ERR("Exception thrown in adbnc_statfs(" << pcPath << ")" << ": " << e.what());
+            StatFsEntry entry;
+            ::clock_gettime(CLOCK_MONOTONIC, &entry.fetched);
 
-                    for (int i = 0; i < tokens.size(); i++)
-                        ERR("Token[" << i << "] :" << tokens[i]);
+            iRes = statFsOnDevice(pcPath, pFst);
+            if (!iRes && options.uiStatfsTimeout)
+            {
+                entry.fst = *pFst;
 
-                    iRes = -EIO;
-                }
+                ::pthread_mutex_lock(&statFsMutex);
+                if (ulGeneration == ulStatFsGeneration)
+                    statFsCache[strKey] = entry;
+                ::pthread_mutex_unlock(&statFsMutex);
             }
         }
+    }
 
-        if (!iRes)
-        {
-            // now get inode info
-            strCommand.assign("df -P -i '");
-            strCommand.append(pcPath);
-            strCommand.append("'");
-            output = adbncShell(strCommand);
-
-            iRes = (output.size() > 1 ? 0 : -EIO);
-            if (!iRes)
-            {
-                /*
-                    Filesystem              Inodes      Used Available Capacity Mounted on
-                    /dev/block/platform/msm_sdcc.1/by-name/efs                             896        99       797  11% /efs
-                */
-                output.pop_front(); // remove header
-                vector<string> tokens(tokenize(output.front()));
-                if (tokens.size() >= 6)
-                {
-                    try
-                    {
-                        pFst->f_files = stoul(tokens[1]);   // Total number of file nodes (inodes) on the file system.
-                        pFst->f_ffree = stoul(tokens[3]);   // Total number of free file nodes (inodes).
-                        pFst->f_favail = pFst->f_ffree;     // Total number of free file nodes (inodes) available to non-privileged processes.
-                    }
-                    catch (const exception& e)
-                    {
-                        ERR("Exception thrown in adbnc_statfs(" << pcPath << ")" << ": " << e.what());
-
-                        for (int i = 0; i < tokens.size(); i++)
-                            ERR("Token[" << i << "] :" << tokens[i]);
-
-                        iRes = -EIO;
-                    }
-                }
-            }
+    return(iRes);
+}
 
-            // global / guessed info
-            pFst->f_namemax = 1024; // Maximum length of a file name (path element).
-        }
-    }
+/**
+ * Retrieves file attributes as presented to the kernel.
+ *
+ * @param pcPath the pathname of the file.
+ * @param pStatBuf receives the attributes.
+ *
+ * @return 0 on success, a negative errno otherwise.
+ */
+static int fileAttributes(const char *pcPath, struct stat *pStatBuf)
+{
+    const int iRes(doStat(pcPath, pStatBuf));
+    if (!iRes)
+        pStatBuf->st_mode |= 0700;
 
     return(iRes);
 }
@@ -1142,73 +3632,24 @@ int adbnc_statfs(const char *pcPath, struct statvfs* pFst)
 int adbnc_getattr(const char *pcPath, struct stat *pStatBuf)
 {
     DBG("adbnc_getattr(" << pcPath << ")");
+    ulGetattrCalls++;
 
-    int iRes(0);
-    ::memset(pStatBuf, 0, sizeof(struct stat));
-    vector<string> tokens;
-    iRes = doStat(pcPath, &tokens);
-
-    if (!iRes)
-    {
-        /*
-           stat -t Explained:
-           file name (%n)
-           total size (%s)
-           number of blocks (%b)
-           raw mode in hex (%f)
-           UID of owner (%u)
-           GID of file (%g)
-           device number in hex (%D)
-           inode number (%i)
-           number of hard links (%h)
-           major device type in hex (%t)
-           minor device type in hex (%T)
-           last access time as seconds since the Unix Epoch (%X)
-           last modification as seconds since the Unix Epoch (%Y)
-           last change as seconds since the Unix Epoch (%Z)
-           I/O block size (%o)
-           */
-
-        try
-        {
-            pStatBuf->st_ino = stoul(tokens[7].c_str());    /* inode number */
-            const unsigned int uiRawMode(stoul(tokens[3], NULL, 16));
-            pStatBuf->st_mode = uiRawMode | 0700;    /* protection */
-            pStatBuf->st_nlink = 1;   /* number of hard links */
-            pStatBuf->st_uid = stoul(tokens[4].c_str());    /* user ID of owner */
-            pStatBuf->st_gid = stoul(tokens[5].c_str());    /* group ID of owner */
-
-            const unsigned int uiDeviceId(stoul(tokens[6], NULL, 16));
-            pStatBuf->st_rdev = uiDeviceId;    // device ID (if special file)
-
-            pStatBuf->st_size = stoul(tokens[1].c_str());    /* total size, in bytes */
-            pStatBuf->st_blksize = stol(tokens[14].c_str()); /* blocksize for filesystem I/O */
-            pStatBuf->st_blocks = stoul(tokens[2].c_str());  /* number of blocks allocated */
-            pStatBuf->st_atime = stol(tokens[11].c_str());   /* time of last access */
-            pStatBuf->st_mtime = stol(tokens[12].c_str());   /* time of last modification */
-            pStatBuf->st_ctime = stol(tokens[13].c_str());   /* time of last status change */
-        }
-        catch (const exception& e)
-        {
-            ERR("Exception thrown in adbnc_getattr(" << pcPath << ")" << ": " << e.what());
-
-            for (int i = 0; i < tokens.size(); i++)
-                ERR("Token[" << i << "] :" << tokens[i]);
-
-            iRes = -EIO;
-        }
-    }
-
-    return(iRes);
+    return(fileAttributes(pcPath, pStatBuf));
 }
 
 /**
  * FUSE callback to open a file.
  *
- * Calls adbncPull() to copy the file from the android device to local host and
- * opens the file on local host. The file handle obtained from local open is set
+ * Calls pullToCache() to copy the file from the android device to local host and
+ * opens the file on local host. A file opened for writing is unshared from the
+ * blob store before. The file handle obtained from local open is set
  * to pFi->fh;
  *
+ * The file is not pulled again if the cached copy is current, i.e. size and
+ * modification time of the remote file as reported by the (cached) stat are
+ * those recorded when the copy was pulled or pushed. In this case
+ * pFi->keep_cache is set, so the kernel serves reads from its page cache.
+ *
  * @param pcPath path to the filename to open.
  *
  * @param pFi pFi->fh receives the file handle if file could be opened
@@ -1226,15 +3667,38 @@ int adbnc_open(const char *pcPath, struct fuse_file_info *pFi)
 
     string strLocalPath(makeLocalPath(pcPath));
 
+    const bool fForWrite((pFi->flags & O_ACCMODE) != O_RDONLY);
+
+    // keep the file from being evicted while pulled and open
+    localCache.opened(pcPath);
+
     if (!fileStatus.truncated(pcPath))
     {
-        iRes = doStat(pcPath);
-        if (!iRes && !fileExists(pcPath))
-            iRes = adbncPull(pcPath, strLocalPath);
+        struct stat statBuf;
+        iRes = doStat(pcPath, &statBuf);
+        if (!iRes)
+        {
+            if (localCache.isCurrent(pcPath, statBuf.st_size, statBuf.st_mtime))
+            {
+                DBG("reusing cached " << strLocalPath);
+
+                ulOpenCacheHits++;
+                pFi->keep_cache = 1;
+            }
+            else
+            {
+                iRes = pullToCache(pcPath, strLocalPath, fForWrite);
+                if (!iRes)
+                    localCache.remoteVersion(pcPath, statBuf.st_size, statBuf.st_mtime);
+            }
+        }
     }
     else
         fileStatus.truncated(pcPath, false);
 
+    if (!iRes && fForWrite)
+        iRes = unshareLocalFile(strLocalPath);
+
     if (!iRes)
     {
         pFi->fh = ::open(strLocalPath.c_str(), pFi->flags);
@@ -1242,19 +3706,217 @@ int adbnc_open(const char *pcPath, struct fuse_file_info *pFi)
             iRes = -errno;
     }
 
+    if (iRes)
+        localCache.released(pcPath);
+
     ::pthread_mutex_unlock(&openMutex);
 
     return(iRes);
 }
 
+/**
+ * Sets the modification time of a directory in #dirCache to the current one
+ * after it has been changed through this file system.
+ *
+ * @param strDir the pathname of the directory.
+ */
+static void adoptDirMtime(const string& strDir)
+{
+    fileCache.invalidate(strDir.c_str());
+
+    struct stat statBuf;
+    if (!doStat(strDir.c_str(), &statBuf))
+        dirCache.mtime(strDir.c_str(), statBuf.st_mtime);
+}
+
+/**
+ * Returns the pathname of an entry of a directory.
+ *
+ * @param pcDir pathname of the directory.
+ * @param strName name of the entry.
+ */
+static string childPath(const char *pcDir, const string& strName)
+{
+    string strPath(pcDir);
+    if (strPath != "/")
+        strPath.append("/");
+
+    return(strPath.append(strName));
+}
+
+/**
+ * Checks whether #fileCache still holds the attributes of all entries of a
+ * directory listing, stale and restored ones included.
+ *
+ * @param pcPath pathname of the directory.
+ * @param names the listing, dot and dot-dot first.
+ * @param pfRefresh set to true if any of the attributes has to be refreshed,
+ *        unchanged otherwise.
+ */
+static bool attributesCached(const char *pcPath, const deque<string>& names, bool* pfRefresh)
+{
+    struct stat statBuf;
+    bool fRefresh;
+    for (deque<string>::size_type i = 2; i < names.size(); i++)
+    {
+        if (!fileCache.getStat(childPath(pcPath, names[i]).c_str(), &statBuf, &fRefresh))
+            return(false);
+
+        if (fRefresh)
+            *pfRefresh = true;
+    }
+
+    return(true);
+}
+
+/**
+ * Lists a directory on the device and caches the listing in #dirCache and
+ * the attributes of its entries in #fileCache.
+ *
+ * The directory is listed with a single stat command, so adbnc_readdir() and
+ * the lookups following it do not need a round trip per entry. A directory
+ * too large for that is listed with ls -1a and stat'ed in batches, see
+ * statListingCommands().
+ *
+ * @param pcPath pathname of the directory.
+ * @param pNames receives the names like ls -1a lists them, empty on failure.
+ *
+ * @return 0 on success, -ENOENT if the directory could not be listed.
+ */
+static int listOnDevice(const char *pcPath, deque<string>* pNames)
+{
+    // the entries are named with the directory in front, sharedShell() runs
+    // the command as busybox applet, so it cannot change into the directory
+    string strPrefix(pcPath);
+    if (strPrefix.empty() || strPrefix[strPrefix.length() - 1] != '/')
+        strPrefix.append("/");
+
+    // .* may or may not match dot and dot-dot, duplicates are dropped
+    string strCommand("stat -t --");
+    const char* const apcPatterns[] = { ".", "..", ".*", "*", NULL };
+    for (int i = 0; apcPatterns[i]; i++)
+        strCommand.append(" '").append(strPrefix).append("'").append(apcPatterns[i]);
+    strCommand.append(" 2>/dev/null");
+
+    map<string, struct stat> attributes;
+    int iRes(parseStatListing(strPrefix, sharedShell(strCommand), pNames, &attributes));
+    if (iRes)
+    {
+        // the names may not fit into one argument list, the shell fails with
+        // E2BIG then, list them and stat them in batches instead
+        const deque<string> names(sharedShell("ls -1a '" + string(pcPath) + "' 2>/dev/null"));
+        if (!names.empty())
+        {
+            deque<string> output;
+            const deque<string> commands(statListingCommands(strPrefix, names));
+            for (deque<string>::const_iterator it(commands.begin()); it != commands.end(); ++it)
+            {
+                const deque<string> part(sharedShell(*it));
+                output.insert(output.end(), part.begin(), part.end());
+            }
+
+            iRes = parseStatListing(strPrefix, output, pNames, &attributes);
+            DBG("listed " << pcPath << " in " << commands.size() << " batches");
+        }
+    }
+
+    if (!iRes)
+    {
+        for (map<string, struct stat>::const_iterator it(attributes.begin()); it != attributes.end(); ++it)
+        {
+            if (it->first == ".")
+                fileCache.putStat(pcPath, it->second);
+            else if (it->first != "..")
+                fileCache.putStat(childPath(pcPath, it->first).c_str(), it->second);
+        }
+
+        dirCache.put(pcPath, *pNames, attributes["."].st_mtime);
+    }
+    else
+        dirCache.invalidate(pcPath);
+
+    return(iRes);
+}
+
+/**
+ * Retrieves the listing of a directory, from #dirCache if possible.
+ *
+ * An expired listing is revalidated with the modification time of the
+ * directory, only if it changed or the attributes of its entries expired
+ * the directory is listed again by listOnDevice(). If some of the attributes
+ * are stale or restored from a snapshot, the revalidated listing is used and
+ * #refreshThread lists the directory again in the background.
+ *
+ * @param pcPath pathname of the directory.
+ * @param pNames receives the names like ls -1a lists them, empty on failure.
+ */
+static void listDirectory(const char *pcPath, deque<string>* pNames)
+{
+    if (dirCache.get(pcPath, pNames))
+    {
+        DBG("listing from cache " << pcPath);
+        ulDirCacheHits++;
+        return;
+    }
+
+    struct stat statBuf;
+    if (dirCache.contains(pcPath))
+    {
+        // need the current modification time to revalidate, a watched one
+        // in #fileCache is current unless restored from a snapshot
+        if (!fileCache.isWatched(pcPath) || !fileCache.getStat(pcPath, &statBuf))
+            fileCache.invalidate(pcPath);
+
+        bool fRefresh(false);
+        if (!doStat(pcPath, &statBuf) && dirCache.revalidate(pcPath, statBuf.st_mtime) && dirCache.get(pcPath, pNames) && attributesCached(pcPath, *pNames, &fRefresh) && (!fRefresh || requestRefresh(pcPath, true)))
+        {
+            DBG("revalidated listing " << pcPath);
+            ulDirCacheHits++;
+            ulDirCacheRevalidations++;
+            return;
+        }
+    }
+
+    listOnDevice(pcPath, pNames);
+}
+
+/**
+ * Records a file created or removed through this file system in the cached
+ * listing of its parent directory.
+ *
+ * The parent's new modification time is adopted, so the listing stays valid
+ * when revalidated.
+ *
+ * @param pcPath the pathname of the created or removed file.
+ * @param fCreated true if pcPath was created, false if it was removed.
+ */
+static void updateDirCache(const char *pcPath, const bool fCreated)
+{
+    if (fCreated ? dirCache.add(pcPath) : dirCache.remove(pcPath))
+        adoptDirMtime(parent(pcPath));
+}
+
+/**
+ * Returns the listing adbnc_opendir() stored in a directory handle.
+ *
+ * @param pFi the directory handle.
+ *
+ * @return the listing or NULL if the handle has none.
+ */
+static deque<string>* openDirListing(const struct fuse_file_info *pFi)
+{
+    return(reinterpret_cast<deque<string>*>(static_cast<uintptr_t>(pFi->fh)));
+}
+
 /**
  * FUSE callback to open a directory for reading.
  *
- * Stores directory content retrieved from android device in #openDirs map
- * for retrieval in adbnc_readdir().
+ * Stores directory content retrieved by listDirectory() in the directory
+ * handle pFi->fh for retrieval in adbnc_readdir(), so every open has its own
+ * listing and opens of different directories do not wait for each other.
  *
  * @param pcPath pathname of the directory to open.
- * @param pFi not used here.
+ * @param pFi receives the listing in fh.
  *
  * @return -EIO if failed to retrieve directory from android device, zero
  *         otherwise.
@@ -1263,29 +3925,18 @@ int adbnc_opendir(const char *pcPath, struct fuse_file_info *pFi)
 {
     int iRes(0);
 
-    ::pthread_mutex_lock(&inReleaseDirMutex);
-
-    /* wait until directory is released */
-    while (fInReleaseDirCond)
-        ::pthread_cond_wait(&inReleaseDirCond, &inReleaseDirMutex);
-
     DBG("adbnc_opendir(" << pcPath << ")");
 
-    string strCommand("ls -1a '");
-    strCommand.append(pcPath);
-    strCommand.append("'");
-    deque<string> output(adbncShell(strCommand));
+    deque<string>* const pNames(new deque<string>());
+    listDirectory(pcPath, pNames);
 
-    if (!output.empty())
-    {
-        const map<string, deque<string> >::iterator it(openDirs.find(pcPath));
-        if (it == openDirs.end())
-            openDirs.insert(make_pair(pcPath, output));
-    }
+    if (!pNames->empty())
+        pFi->fh = reinterpret_cast<uintptr_t>(pNames);
     else
+    {
+        delete pNames;
         iRes = -EIO; // could also be EACCES
-
-    ::pthread_mutex_unlock(&inReleaseDirMutex);
+    }
 
     return(iRes);
 }
@@ -1293,18 +3944,17 @@ int adbnc_opendir(const char *pcPath, struct fuse_file_info *pFi)
 /**
  * FUSE callback to retrieve directory entries.
  *
- * #openDirs, filled by adbnc_opendir(), is supposed to hold the directory
- * listing.
+ * The directory handle pFi->fh, filled by adbnc_opendir(), is supposed to
+ * hold the directory listing.
  *
  * @param pcPath pathname of the directory get the listing from.
  * @param vpBuf buffer where result is returned.
  * @param filler FUSE provided helper function for putting directory entries
  *        into the result buffer.
  * @param iOffset start reading form this directory entry.
- * @param pFi not used here.
+ * @param pFi the directory handle.
  *
- * @return -EBADF if directory listing was not found in #openDirs, zero
- *         otherwise.
+ * @return -EBADF if the directory handle holds no listing, zero otherwise.
  *
  */
 int adbnc_readdir(const char *pcPath, void *vpBuf, fuse_fill_dir_t filler, off_t iOffset, struct fuse_file_info *pFi)
@@ -1313,35 +3963,27 @@ int adbnc_readdir(const char *pcPath, void *vpBuf, fuse_fill_dir_t filler, off_t
 
     DBG("adbnc_readdir(" << pcPath << ")");
 
-    const map<string, deque<string> >::const_iterator it(openDirs.find(pcPath));
-    if (it != openDirs.end())
+    const deque<string>* const pNames(openDirListing(pFi));
+    if (pNames)
     {
-        int iNumDirectoryEntries(it->second.size());
-        for (int i(0); i < iNumDirectoryEntries; i++)
-        {
-            // Skip dot and dot-dot entries
-            if (i < 2)
-                continue;
-
-            /* Skip this entry if we weren't asked for it */
-            if (i < iOffset)
-                continue;
-
-            DBG("entry: " << it->second[i]);
+        const deque<string>& names(*pNames);
+        int iNumDirectoryEntries(names.size());
 
-            string strFullEntryPath(pcPath);
-            if (strFullEntryPath != "/")
-                strFullEntryPath.append("/");
+        // Skip dot and dot-dot entries and the ones we weren't asked for
+        for (int i(max(iOffset, (off_t)2)); i < iNumDirectoryEntries; i++)
+        {
+            DBG("entry: " << names[i]);
 
-            strFullEntryPath.append(it->second[i]);
+            const string strFullEntryPath(childPath(pcPath, names[i]));
 
-            /* Skip this entry if file no longer exists */
+            /* Skip this entry if file no longer exists, attributes are
+               usually cached by listDirectory() */
             struct stat statBuf;
-            if (adbnc_getattr(strFullEntryPath.c_str(), &statBuf) != 0)
+            if (fileAttributes(strFullEntryPath.c_str(), &statBuf) != 0)
                 continue;
 
             /* Add this to our response until we are asked to stop */
-            if (filler(vpBuf, it->second[i].c_str(), &statBuf, i+1))
+            if (filler(vpBuf, names[i].c_str(), &statBuf, i+1))
                 break;
         }
         /* All done because we were asked to stop or because we finished */
@@ -1355,10 +3997,11 @@ int adbnc_readdir(const char *pcPath, void *vpBuf, fuse_fill_dir_t filler, off_t
 /**
  * FUSE callback to release given directory.
  *
- * Erases the directory listing entry in #openDirs.
+ * Deletes the directory listing stored in the directory handle by
+ * adbnc_opendir().
  *
  * @param pcPath pathname to the directory to release.
- * @param pFi not used here.
+ * @param pFi the directory handle.
  *
  * @return always zero;
  */
@@ -1366,20 +4009,10 @@ int adbnc_releasedir(const char *pcPath, struct fuse_file_info *pFi)
 {
     int iRes(0);
 
-    ::pthread_mutex_lock(&inReleaseDirMutex);
-
-    fInReleaseDirCond = true;
-
     DBG("adbnc_releasedir(" << pcPath << ")");
 
-    openDirs.erase(pcPath);
-
-    /* signal waiting thread directory is released */
-    ::pthread_cond_signal(&inReleaseDirCond);
-
-    fInReleaseDirCond = false;
-
-    ::pthread_mutex_unlock(&inReleaseDirMutex);
+    delete openDirListing(pFi);
+    pFi->fh = 0;
 
     return(iRes);
 }
@@ -1401,22 +4034,20 @@ int adbnc_readlink(const char *pcPath, char *pcBuf, size_t iSize)
     DBG("adbnc_readlink(" << pcPath << ")");
 
     deque<string> output;
-    const deque<string>* pOutput(fileCache.getReadLink(pcPath));
 
-    if (!pOutput)
+    if (!fileCache.getReadLink(pcPath, &output))
     {
         string strCommand("readlink -f '");
         strCommand.append(pcPath);
         strCommand.append("'");
 
-        output = adbncShell(strCommand);
+        output = sharedShell(strCommand);
 
         fileCache.putReadLink(pcPath, output);
     }
     else
     {
         // from cache
-        output = *pOutput;
         if (!output.empty())
             DBG("from cache " << output.front());
         else
@@ -1475,37 +4106,20 @@ int adbnc_access(const char *pcPath, int iMask)
     DBG("adbnc_access(" << pcPath << ")");
 
     /* Does it exist */
-    vector<string> tokens;
-    int iRes(doStat(pcPath, &tokens));
+    struct stat statBuf;
+    int iRes(doStat(pcPath, &statBuf));
     if (iRes && iMask == F_OK)
         iRes = -ENOENT;
 
     if (!iRes && (iMask != F_OK))
-    {
-        unsigned int uiRawMode(0);
-        int iUid(0);
-        int iGid(0);
-
-        try
-        {
-            /* Has it the right permission ?*/
-            uiRawMode = stoul(tokens[3], NULL, 16);
-            iUid = stoi(tokens[4].c_str());
-            iGid = stoi(tokens[5].c_str());
-        }
-        catch (const exception& e)
-        {
-            ERR("Exception thrown in adbnc_access(" << pcPath << ")" << ": " << e.what());
-
-            for (int i = 0; i < tokens.size(); i++)
-                ERR("Token[" << i << "] :" << tokens[i]);
-
-            iRes = -EIO;
-        }
+        iRes = awaitHandshake(hpUserInfo | hpMountInfo);
 
-        if (!iRes && pUserInfo)
+    if (!iRes && (iMask != F_OK))
+    {
+        /* Has it the right permission ?*/
+        if (pUserInfo)
         {
-            iRes = -pUserInfo->access(iUid, iGid, uiRawMode, iMask);
+            iRes = -pUserInfo->access(statBuf.st_uid, statBuf.st_gid, statBuf.st_mode, iMask);
             if (!iRes && pMountInfo)
             {
                 if (iMask & W_OK)
@@ -1554,7 +4168,15 @@ int adbnc_flush(const char *pcPath, struct fuse_file_info *pFi)
         if (fileStatus.pendingOpen(pcPath))
             fileCache.invalidate(pcPath);
 
+        const bool fDirty(localCache.dirty(pcPath));
+
         iRes = fileStatus.flush(pcPath, strLocalPath);
+        if (!iRes)
+        {
+            localCache.dirty(pcPath, false);
+            if (fDirty)
+                recordRemoteVersion(pcPath);
+        }
     }
     else
         iRes = -errno;
@@ -1574,6 +4196,12 @@ int adbnc_fsync(const char* pcPath, int iIsdatasync, struct fuse_file_info* pFi)
             iRes = adbncPush(makeLocalPath(pcPath), pcPath);
             fileStatus.pendingOpen(pcPath, false, false);
             fileCache.invalidate(pcPath);
+
+            if (!iRes)
+            {
+                localCache.dirty(pcPath, false);
+                recordRemoteVersion(pcPath);
+            }
         }
     }
     else
@@ -1585,7 +4213,8 @@ int adbnc_fsync(const char* pcPath, int iIsdatasync, struct fuse_file_info* pFi)
 /**
  * FUSE callback called when FUSE is completely done with a file.
  *
- * Closes the file handle.
+ * Closes the file handle. Wakes up #evictionThread if #localCache exceeds
+ * its budget now that the file may be evicted.
  *
  * @param pcPath path of the filename close.
  * @param pFi pFi->fh the file handle of the file to close
@@ -1598,7 +4227,17 @@ int adbnc_release(const char *pcPath, struct fuse_file_info *pFi)
 {
     DBG("adbnc_release(" << pcPath << ")");
 
-    return(fileStatus.release(pcPath, pFi->fh));
+    const int iRes(fileStatus.release(pcPath, pFi->fh));
+
+    localCache.released(pcPath);
+    if (cacheBudget() && localCache.bytes() > cacheBudget())
+    {
+        ::pthread_mutex_lock(&evictionMutex);
+        ::pthread_cond_signal(&evictionCond);
+        ::pthread_mutex_unlock(&evictionMutex);
+    }
+
+    return(iRes);
 }
 
 /**
@@ -1638,6 +4277,7 @@ int adbnc_write(const char *pcPath, const char *pcBuf, size_t iSize, off_t iOffs
     DBG("adbnc_write(" << pcPath << ")");
 
     fileStatus.pendingOpen(pcPath, true, true);
+    localCache.dirty(pcPath, true);
 
     int iRes(::pwrite(pFi->fh, pcBuf, iSize, iOffset));
 
@@ -1654,6 +4294,7 @@ int adbnc_utimens(const char *pcPath, const struct timespec ts[2])
     command.append(pcPath);
     command.append("\"");
 
+    singleFlight.forget();
     adbncShell(command);
 
     return(0);
@@ -1668,16 +4309,19 @@ int adbnc_truncate(const char *pcPath, off_t iSize)
     {
         const string strLocalPath(makeLocalPath(pcPath));
 
-        iRes = ::truncate(strLocalPath.c_str(), iSize);
+        iRes = unshareLocalFile(strLocalPath);
+        if (!iRes && ::truncate(strLocalPath.c_str(), iSize) != 0)
+            iRes = -errno;
+
         if (!iRes)
         {
             DBG("truncate[path=" << strLocalPath << "][size=" << iSize << "]");
 
+            // not pushed until the file is flushed, don't evict it meanwhile
+            localCache.dirty(pcPath, true);
             fileStatus.truncated(pcPath, true);
             fileCache.invalidate(pcPath);
         }
-        else
-            iRes = -errno;
     }
 
     return(iRes);
@@ -1696,9 +4340,15 @@ int adbnc_mknod(const char *pcPath, mode_t mode, dev_t rdev)
     {
         iRes = adbncPush(strLocalPath, pcPath);
         if (!iRes)
+        {
+            singleFlight.forget();
             adbncShell("sync");
+        }
 
         fileCache.invalidate(pcPath);
+
+        if (!iRes)
+            updateDirCache(pcPath, true);
     }
     else
         iRes = -errno;
@@ -1717,8 +4367,17 @@ int adbnc_mkdir(const char *pcPath, mode_t mode)
 
     DBG("Making directory " << pcPath);
 
-    adbncShell(strCommand);
-    return(0);
+    const int iRes(modifyOnDevice(strCommand));
+
+    // a lookup during mkdir may have found it missing
+    fileCache.invalidate(pcPath);
+
+    if (!iRes)
+        updateDirCache(pcPath, true);
+    else
+        dirCache.invalidate(parent(pcPath).c_str());
+
+    return(iRes);
 }
 
 int adbnc_rename(const char *pcFrom, const char *pcTo)
@@ -1733,13 +4392,19 @@ int adbnc_rename(const char *pcFrom, const char *pcTo)
 
     DBG("Renaming " << pcFrom << " to " << pcTo);
 
-    adbncShell(strCommand);
+    const int iRes(modifyOnDevice(strCommand));
+    if (iRes)
+    {
+        fileCache.invalidate(pcFrom);
+        fileCache.invalidate(pcTo);
+        dirCache.invalidate(parent(pcFrom).c_str());
+        dirCache.invalidate(parent(pcTo).c_str());
 
-    // invalidate to cache I don't check here if from File is different to toFile
-    fileCache.invalidate(pcTo);
+        return(iRes);
+    }
 
-    // from file no longer exists -> invalidate in cache
-    fileCache.invalidate(pcFrom);
+    // moves what is cached below a renamed directory along
+    fileCache.rename(pcFrom, pcTo);
 
     if (fileStatus.pendingOpen(pcFrom))
     {
@@ -1747,6 +4412,16 @@ int adbnc_rename(const char *pcFrom, const char *pcTo)
         fileStatus.pendingOpen(pcTo, makeLocalPath(pcFrom));
     }
 
+    // the cached copy stays valid, mv keeps the modification time
+    localCache.rename(pcFrom, pcTo);
+
+    if (dirCache.rename(pcFrom, pcTo))
+    {
+        adoptDirMtime(parent(pcFrom));
+        if (parent(pcTo) != parent(pcFrom))
+            adoptDirMtime(parent(pcTo));
+    }
+
     return(0);
 }
 
@@ -1754,16 +4429,21 @@ int adbnc_rmdir(const char *pcPath)
 {
     DBG("adbnc_rmdir(" << pcPath << ")");
 
-    fileCache.invalidate(pcPath);
+    // paths below may be remembered as missing
+    fileCache.invalidateTree(pcPath);
     string strCommand("rmdir '");
     strCommand.append(pcPath);
     strCommand.append("'");
 
     DBG("Removing directory " << pcPath);
 
-    adbncShell(strCommand);
+    const int iRes(modifyOnDevice(strCommand));
+    if (!iRes)
+        updateDirCache(pcPath, false);
+    else
+        dirCache.invalidate(parent(pcPath).c_str());
 
-    return(0);
+    return(iRes);
 }
 
 /**
@@ -1789,9 +4469,15 @@ int adbnc_unlink(const char *pcPath)
 
     DBG("Deleting " << pcPath);
 
-    ::unlink(makeLocalPath(pcPath).c_str());
-    adbncShell(strCommand);
+    const int iRes(modifyOnDevice(strCommand));
+    if (!iRes)
+    {
+        localCache.remove(pcPath);
+        updateDirCache(pcPath, false);
+    }
+    else
+        dirCache.invalidate(parent(pcPath).c_str());
 
-    return(0);
+    return(iRes);
 }
 
@@ -59,7 +59,7 @@ int adbnc_unlink(const char *pcPath);
 int adbnc_fsync(const char* pcPath, int iIsdatasync, struct fuse_file_info* pFi);
 void*adbnc_init(struct fuse_conn_info *pConn);
 void adbnc_destroy(void* private_data);
-int initAdbncFs(const int argc, char** const argv);
+int initAdbncFs(struct fuse_args* pArgs);
 
 #endif /* ADBNCFS_H */
 
@@ -26,36 +26,107 @@
 #define FILEINFOCACHE_H
 
 #include <string>
+#include <ostream>
 #include <queue>
 #include <map>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include <time.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 using namespace std;
 
 /**
  * A cache for file attributes and resolved links.
+ *
+ * File attributes are cached parsed, as struct stat, so a cache hit is a
+ * fixed-size copy.
+ *
+ * Paths known not to exist are kept apart from the attributes, in a negative
+ * cache with its own, usually shorter, timeout.
+ *
+ * The cache is split into shards by the hash of the last path component,
+ * each with its own lock, so threads looking up different paths rarely
+ * contend. Within a shard entries are stored in a trie of path components, a
+ * common prefix like /storage/emulated/0/DCIM is stored once per shard, and
+ * since the last component of a path below a renamed directory does not
+ * change, rename() and invalidateTree() move or drop a whole subtree shard
+ * by shard without scanning the cache. A lookup walks one node per path
+ * component under the reader lock of its shard. Getters copy the cached
+ * data, never hand out pointers into an entry another thread may replace.
+ *
+ * The memory used is bounded by a maximum number of entries and bytes, split
+ * evenly over the shards. A shard exceeding its share first drops the paths
+ * longest known to be missing, then the least recently used attributes. The
+ * recency is approximated the CLOCK way: a lookup only marks its entry as
+ * referenced, which lets it survive the eviction hand passing by once, so
+ * lookups can keep holding the read lock. Entries are kept in the order they
+ * were put, so sweep() finds the expired ones in front of each shard without
+ * scanning.
+ *
+ * Entries of a directory marked by watch() and of the paths directly in it
+ * use a separate, usually much longer, timeout. The caller has to invalidate
+ * them when notified of a change.
+ *
+ * An expired entry may still be served for a bounded stale timeout while the
+ * caller refreshes it in the background, see getStat(). The first lookup of
+ * a stale entry is asked to refresh it, the others get the stale attributes
+ * until the refreshed ones are put. Entries restored from a snapshot are
+ * served the same way, however old, until they are put again.
+ *
+ * All methods are thread safe.
  */
 class FileCache
 {
 public:
-   /** Default constructor. */
-   FileCache() : m_Entries() {}
-
-   /** Virtual destructor. */
-   virtual ~FileCache() {}
+   FileCache();
+   virtual ~FileCache();
 
    // setters
-   void putStat(const char *pcPath, const deque<string>& statOutput);
+   void putStat(const char *pcPath, const struct stat& statBuf);
    void putReadLink(const char *pcPath, const deque<string>& readLinkOutput);
+   void putMissing(const char *pcPath);
+   void timeout(const int iSeconds);
+   void negativeTimeout(const int iSeconds);
+   void watchedTimeout(const int iSeconds);
+   void staleTimeout(const int iSeconds);
+   void watch(const char *pcDir, const bool fWatched);
+   void limits(const unsigned long ulMaxEntries, const unsigned long long ullMaxBytes);
 
    // getters
-   const deque<string>* getStat(const char *pcPath) const ;
-   const deque<string>* getReadLink(const char *pcPath) const;
+   bool getStat(const char *pcPath, struct stat* pStatBuf, bool* pfRefresh = NULL) const;
+   bool getReadLink(const char *pcPath, deque<string>* pReadLinkOutput) const;
+   bool isMissing(const char *pcPath) const;
+   bool isWatched(const char *pcPath) const;
+   unsigned long negativeHits() const { return(m_ulNegativeHits); }
+   unsigned long negativeEntries() const { return(m_ulNegativeEntries); }
+   unsigned long staleHits() const { return(m_ulStaleHits); }
+   unsigned long entries() const { return(m_ulEntries); }
+   unsigned long long bytes() const { return(m_ullBytes); }
+   unsigned long bytesPerEntry() const { const unsigned long ulEntries(m_ulEntries); return(ulEntries ? m_ullBytes / ulEntries : 0); }
+   unsigned long evictions() const { return(m_ulEvictions); }
+   unsigned long expirations() const { return(m_ulExpirations); }
 
    //operations
    void invalidate(const char *pcPath);
+   void invalidateTree(const char *pcPath);
+   void rename(const char *pcFrom, const char *pcTo);
+   unsigned long sweep(const unsigned long ulMaxEntries);
+   void save(ostream& out) const;
+   bool load(const char **ppcPos, const char *pcEnd);
+
+   /** Number of shards, a power of two */
+   static const size_t uiNumShards = 64;
 
 private:
+   class Node;
+
    /**
     * Represents an entry of FileCache.
     */
@@ -63,7 +134,7 @@ private:
    {
    public:
       /** Default constructor. */
-      Entry() : m_Timestamp(::time(NULL)), m_pStatOutput(NULL), m_pReadLinkOutput(NULL) {}
+      Entry() : m_Timestamp(::time(NULL)), m_fHasAttributes(false), m_fRestored(false), m_Attributes(), m_pReadLinkOutput(NULL), m_fReferenced(false), m_fRefreshing(false), m_LruPos() {}
       Entry(const Entry& orig);
       Entry& operator=(const Entry& orig);
       virtual ~Entry();
@@ -73,19 +144,135 @@ private:
        *
        * @param time the time stamp to set.
        */
-      void timeStamp(const time_t& time) { m_Timestamp = time; }
-      void statOutput(const deque<string>& output);
+      void timeStamp(const time_t& time) { m_Timestamp = time; m_fRefreshing = false; }
+      void attributes(const struct stat& statBuf) { m_fHasAttributes = true; m_Attributes = statBuf; }
+      void restored(const bool fRestored) { m_fRestored = fRestored; }
       void readLinkOutput(const deque<string>& output);
+      void referenced(const bool fReferenced) const { m_fReferenced.store(fReferenced, memory_order_relaxed); }
+      void lruPos(const list<Node*>::iterator& pos) { m_LruPos = pos; }
 
       // getters
       const time_t timeStamp() const { return(m_Timestamp); }
-      const deque<string> *statOutput() const { return(m_pStatOutput); }
+      bool hasAttributes() const { return(m_fHasAttributes); }
+      bool restored() const { return(m_fRestored); }
+      const struct stat& attributes() const { return(m_Attributes); }
       const deque<string> *readLinkOutput() const { return(m_pReadLinkOutput); }
+      bool referenced() const { return(m_fReferenced.load(memory_order_relaxed)); }
+      bool claimRefresh() const { return(!m_fRefreshing.exchange(true)); }
+      const list<Node*>::iterator& lruPos() const { return(m_LruPos); }
+      size_t bytes() const;
 
    private:
       time_t m_Timestamp;
-      deque<string> *m_pStatOutput;
+
+      /** true if attributes() has been set */
+      bool m_fHasAttributes;
+
+      /** true if loaded from a snapshot and not put again since */
+      bool m_fRestored;
+
+      struct stat m_Attributes;
        deque<string> *m_pReadLinkOutput;
+
+      /** Set by lookups holding the read lock, cleared by evictOne() */
+      mutable atomic<bool> m_fReferenced;
+
+      /** Set by the lookup asked to refresh the stale entry */
+      mutable atomic<bool> m_fRefreshing;
+
+      /** Position in Shard::m_Lru */
+      list<Node*>::iterator m_LruPos;
+   };
+
+   /**
+    * Represents a path known not to exist.
+    */
+   struct Missing
+   {
+      /** The time the path was found missing */
+      time_t m_Timestamp;
+
+      /** Position in Shard::m_MissingOrder */
+      list<Node*>::iterator m_OrderPos;
+   };
+
+   /**
+    * A path component in the trie, owned by its parent.
+    */
+   class Node
+   {
+   public:
+      /** Constructor. */
+      Node(Node* pParent) : m_pParent(pParent), m_pName(NULL), m_pChildren(NULL), m_pEntry(NULL), m_pMissing(NULL), m_fWatched(false) {}
+
+      /** Not virtual, there are many nodes and no subclasses */
+      ~Node() {}
+
+      /** NULL for the root */
+      Node* m_pParent;
+
+      /** The key in the parent's m_pChildren, NULL for the root */
+      const string* m_pName;
+
+      /** Child components by name, NULL if there are none */
+      unordered_map<string, Node*>* m_pChildren;
+
+      /** Cached attributes and resolved link, NULL if there are none */
+      Entry* m_pEntry;
+
+      /** Set if the path is known not to exist */
+      Missing* m_pMissing;
+
+      /** true if changes in this directory are notified, see watch() */
+      bool m_fWatched;
+
+   private:
+      /** Prevent copy-construction */
+      Node(const Node& orig);
+
+      /** Prevent assignment */
+      Node& operator=(const Node& orig);
+   };
+
+   /**
+    * A part of FileCache with its own lock and trie.
+    */
+   class Shard
+   {
+   public:
+      /** Default constructor. */
+      Shard() : m_Root(NULL), m_Lru(), m_Hand(), m_MissingOrder(), m_ulEntries(0), m_ullBytes(0) { m_Hand = m_Lru.end(); ::pthread_rwlock_init(&m_Lock, NULL); }
+
+      /** Virtual destructor. */
+      virtual ~Shard() { ::pthread_rwlock_destroy(&m_Lock); }
+
+      /** Guards all members */
+      mutable pthread_rwlock_t m_Lock;
+
+      /** The root directory */
+      Node m_Root;
+
+      /** Nodes with an Entry, in the order they were put */
+      list<Node*> m_Lru;
+
+      /** The node the eviction hand points to in m_Lru */
+      list<Node*>::iterator m_Hand;
+
+      /** Nodes with a Missing, in the order they were found missing */
+      list<Node*> m_MissingOrder;
+
+      /** Number of entries of this shard, including negative ones */
+      unsigned long m_ulEntries;
+
+      /** Approximate memory used by the entries and trie nodes of this shard */
+      unsigned long long m_ullBytes;
+
+   private:
+      /** Prevent copy-construction */
+      Shard(const Shard& orig);
+
+      /** Prevent assignment */
+      Shard& operator=(const Shard& orig);
    };
 
    /** Prevent copy-construction */
@@ -94,9 +281,232 @@ private:
    /** Prevent assignment */
    FileCache operator=(const FileCache& orig);
 
-   bool isValid(const Entry& entry) const;
+   void putStat(const char *pcPath, const struct stat& statBuf, const bool fRestored);
+   void putReadLink(const char *pcPath, const deque<string>& readLinkOutput, const bool fRestored);
+   Shard& shard(const char *pcPath) const;
+   static Node* find(const Shard& s, const char *pcPath);
+   Node* findOrCreate(Shard& s, const char *pcPath);
+   Node* attach(Shard& s, Node* pParent, const string& strName, Node* pNode);
+   Node* detach(Shard& s, Node* pNode);
+   void prune(Shard& s, Node* pNode);
+   void eraseTree(Shard& s, Node* pNode);
+   void eraseEntry(Shard& s, Node* pNode);
+   void eraseMissing(Shard& s, Node* pNode);
+   static void unwatchTree(Node* pNode);
+   static bool isWatched(const Node* pNode);
+   static string path(const Node* pNode);
+   bool isValid(const Node* pNode, const Entry& entry) const;
+   bool isValid(const Node* pNode, const Missing& missing) const;
+   bool isStale(const Node* pNode, const Entry& entry) const;
+   bool isExpiring(const time_t& timestamp, const int iSecondsValid) const;
+   static size_t nodeBytes(const string& strName);
+   unsigned long sweep(Shard& s, const unsigned long ulMaxEntries, unsigned long* pulVisited);
+   void enforceLimits(Shard& s);
+   bool evictOne(Shard& s);
+
+   /** mutable, a lookup needs to lock its shard */
+   mutable Shard m_Shards[uiNumShards];
+
+   /** Seconds an entry is valid */
+   atomic<int> m_iSecondsValid;
+
+   /** Seconds a negative entry is valid, 0 disables the negative cache */
+   atomic<int> m_iNegativeSecondsValid;
+
+   /** Seconds an entry of a watched path is valid, see watch() */
+   atomic<int> m_iWatchedSecondsValid;
+
+   /** Seconds an expired entry may be served while refreshed, see getStat() */
+   atomic<int> m_iStaleSecondsValid;
+
+   /** Number of lookups answered by the negative cache */
+   mutable atomic<unsigned long> m_ulNegativeHits;
+
+   /** Number of lookups answered with stale attributes */
+   mutable atomic<unsigned long> m_ulStaleHits;
+
+   /** Number of paths put into the negative cache */
+   atomic<unsigned long> m_ulNegativeEntries;
+
+   /** Maximum number of entries, including negative ones, 0 for no limit */
+   atomic<unsigned long> m_ulMaxEntries;
+
+   /** Maximum approximate memory used by all shards, 0 for no limit */
+   atomic<unsigned long long> m_ullMaxBytes;
+
+   /** Number of entries of all shards, including negative ones */
+   atomic<unsigned long> m_ulEntries;
+
+   /** Approximate memory used by all shards */
+   atomic<unsigned long long> m_ullBytes;
+
+   /** Number of entries dropped to stay within the limits */
+   atomic<unsigned long> m_ulEvictions;
+
+   /** Number of expired entries dropped by sweep() */
+   atomic<unsigned long> m_ulExpirations;
+
+   /** The shard the next sweep() starts with */
+   atomic<unsigned int> m_uiNextSweepShard;
+};
 
+/**
+ * A cache for directory listings.
+ *
+ * A listing is used without asking the device for #m_iSecondsValid seconds
+ * after it has been listed or revalidated. After that it can be revalidated
+ * with the modification time of the directory.
+ *
+ * Files created, removed or renamed through this file system are added to
+ * or removed from the cached listing of their parent directory in place.
+ *
+ * All methods are thread safe.
+ */
+class DirCache
+{
+public:
+   DirCache();
+   virtual ~DirCache();
+
+   // setters
+   void put(const char *pcDir, const deque<string>& names, const time_t mtime);
+   void mtime(const char *pcDir, const time_t mtime);
+   void timeout(const int iSeconds);
+
+   // getters
+   bool get(const char *pcDir, deque<string>* pNames) const;
+   bool contains(const char *pcDir) const;
+
+   // operations
+   bool revalidate(const char *pcDir, const time_t mtime);
+   bool add(const char *pcPath);
+   bool remove(const char *pcPath);
+   bool rename(const char *pcFrom, const char *pcTo);
+   void invalidate(const char *pcDir);
+   void save(ostream& out) const;
+   bool load(const char **ppcPos, const char *pcEnd);
+
+private:
+   /**
+    * Represents an entry of DirCache.
+    */
+   class Entry
+   {
+   public:
+      Entry(const deque<string>& names, const time_t mtime) : m_Names(names), m_Mtime(mtime), m_Timestamp(::time(NULL)) {}
+
+      /** Virtual destructor. */
+      virtual ~Entry() {}
+
+      /** Names as listed by ls -1a, . and .. first */
+      deque<string> m_Names;
+
+      /** Modification time of the directory when listed */
+      time_t m_Mtime;
+
+      /** Time listed or last revalidated */
+      time_t m_Timestamp;
+   };
+
+   /** Prevent copy-construction */
+   DirCache(const DirCache& orig);
+
+   /** Prevent assignment */
+   DirCache operator=(const DirCache& orig);
+
+   static bool split(const char *pcPath, string* pstrDir, string* pstrName);
+   bool insertName(const string& strDir, const string& strName);
+   bool eraseName(const string& strDir, const string& strName);
+
+   /** Key is the directory path */
    map<string, Entry> m_Entries;
+
+   int m_iSecondsValid;
+
+   mutable pthread_mutex_t m_Mutex;
+};
+
+/**
+ * Lets concurrent identical requests to the device share one round trip.
+ *
+ * The first caller of run() for a key executes the request, callers with the
+ * same key arriving while it is in flight wait for it and get a copy of its
+ * result. Only requests without side effects may be run this way, and a
+ * request changing the device has to call forget() first, so no later
+ * caller gets a result retrieved before the change.
+ *
+ * All methods are thread safe.
+ */
+class SingleFlight
+{
+public:
+   SingleFlight();
+   virtual ~SingleFlight();
+
+   // getters
+   unsigned long shared() const { return(m_ulShared); }
+
+   // operations
+   deque<string> run(const string& strKey, deque<string> (*pfnRequest)(const string& strKey));
+   void forget();
+
+private:
+   /**
+    * A request in flight.
+    */
+   struct Call
+   {
+      /** Constructor. */
+      Call() : m_Result(), m_fDone(false) {}
+
+      /** The result, valid once m_fDone is set */
+      deque<string> m_Result;
+
+      /** Set when the request returned */
+      bool m_fDone;
+   };
+
+   /** Prevent copy-construction */
+   SingleFlight(const SingleFlight& orig);
+
+   /** Prevent assignment */
+   SingleFlight operator=(const SingleFlight& orig);
+
+   /** Requests in flight joinable by key */
+   map<string, shared_ptr<Call> > m_Calls;
+
+   /** Number of callers that got the result of another caller's request */
+   atomic<unsigned long> m_ulShared;
+
+   /** Guards #m_Calls and the calls */
+   pthread_mutex_t m_Mutex;
+
+   /** Broadcast when a request returned */
+   pthread_cond_t m_Done;
+};
+
+/**
+ * Saves the content of a FileCache and a DirCache to a file and restores it,
+ * so a later mount of the same device does not start with empty caches.
+ *
+ * The file starts with a header identifying the format, followed by the
+ * records of FileCache::save() and DirCache::save(). It is mapped into
+ * memory when loaded, the records are parsed in place without reading the
+ * file into a buffer first.
+ *
+ * Restored attributes are never valid, FileCache::getStat() serves them as
+ * stale until they are refreshed. Restored listings are expired, so the first
+ * use revalidates them with the modification time of the directory.
+ */
+class CacheSnapshot
+{
+public:
+   static bool save(const char *pcFile, const FileCache& fileCache, const DirCache& dirCache);
+   static bool load(const char *pcFile, FileCache* pFileCache, DirCache* pDirCache);
+
+private:
+   /** Prevent construction, there are only static methods */
+   CacheSnapshot();
 };
 
 /**
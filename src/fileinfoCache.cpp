@@ -21,181 +21,1795 @@
  */
 #include "fileInfoCache.h"
 #include <errno.h>
+#include <string.h>
+#include <functional>
+#include <algorithm>
+#include <vector>
+#include <fstream>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
-/** Keep cache entries valid for 120 seconds */
-static const int iFileDataCacheSecondsValid(120);
+int adbncPush(const string& strLocalSource, const string& strRemoteDestination);
+int adbncShell(const string& strCommand);
+
+/** Identifies a file written by CacheSnapshot::save() */
+static const char acSnapshotMagic[8] = { 'A', 'D', 'B', 'N', 'C', 'S', 'N', '1' };
+
+/** Flags of a FileCache record in a snapshot */
+enum { SNAPSHOT_ATTRIBUTES = 1, SNAPSHOT_READLINK = 2 };
+
+/**
+ * Writes a value as it is in memory to a snapshot.
+ *
+ * @param out the stream to write to.
+ * @param value the value to write.
+ */
+template<class T> static void writeValue(ostream& out, const T& value)
+{
+    out.write((const char*)&value, sizeof(value));
+}
+
+/**
+ * Writes a string, preceded by its length, to a snapshot.
+ *
+ * @param out the stream to write to.
+ * @param str the string to write.
+ */
+static void writeString(ostream& out, const string& str)
+{
+    writeValue(out, (uint32_t)str.length());
+    out.write(str.data(), str.length());
+}
+
+/**
+ * Reads a value written by writeValue().
+ *
+ * @param ppcPos the position to read from, advanced past the value.
+ * @param pcEnd the end of the snapshot.
+ * @param pValue receives the value.
+ *
+ * @return false if the snapshot ends before the value.
+ */
+template<class T> static bool readValue(const char **ppcPos, const char *pcEnd, T* pValue)
+{
+    if ((size_t)(pcEnd - *ppcPos) < sizeof(T))
+        return(false);
+
+    ::memcpy(pValue, *ppcPos, sizeof(T));
+    *ppcPos += sizeof(T);
+
+    return(true);
+}
+
+/**
+ * Reads a string written by writeString().
+ *
+ * @param ppcPos the position to read from, advanced past the string.
+ * @param pcEnd the end of the snapshot.
+ * @param pstr receives the string.
+ *
+ * @return false if the snapshot ends before the string.
+ */
+static bool readString(const char **ppcPos, const char *pcEnd, string* pstr)
+{
+    uint32_t uiLength;
+    if (!readValue(ppcPos, pcEnd, &uiLength) || (size_t)(pcEnd - *ppcPos) < uiLength)
+        return(false);
+
+    pstr->assign(*ppcPos, uiLength);
+    *ppcPos += uiLength;
+
+    return(true);
+}
+
+/**
+ * Copy constructor.
+ */
+FileCache::Entry::Entry(const Entry& orig) : m_Timestamp(orig.m_Timestamp), m_fHasAttributes(orig.m_fHasAttributes), m_fRestored(orig.m_fRestored), m_Attributes(orig.m_Attributes), m_pReadLinkOutput(NULL), m_fReferenced(orig.referenced()), m_fRefreshing(false), m_LruPos(orig.m_LruPos)
+{
+    if (orig.m_pReadLinkOutput)
+        m_pReadLinkOutput = new deque<string>(*orig.m_pReadLinkOutput);
+}
+
+/**
+ * Assignment operator.
+ *
+ * @param orig reference to right hand object.
+ *
+ * @return a reference to the assignee.
+ */
+FileCache::Entry& FileCache::Entry::operator=(const Entry& orig)
+{
+    if(this != &orig) // protect against invalid self-assignment
+    {
+        if (m_pReadLinkOutput)
+            delete m_pReadLinkOutput;
+
+        m_pReadLinkOutput = NULL;
+
+        m_fHasAttributes = orig.m_fHasAttributes;
+        m_fRestored = orig.m_fRestored;
+        m_Attributes = orig.m_Attributes;
+
+        if (orig.m_pReadLinkOutput)
+            m_pReadLinkOutput = new deque<string>(*orig.m_pReadLinkOutput);
+
+        m_Timestamp = orig.m_Timestamp;
+        m_fReferenced = orig.referenced();
+        m_LruPos = orig.m_LruPos;
+    }
+
+    return(*this);
+}
+
+/**
+ * Virtual destructor.
+ */
+FileCache::Entry::~Entry()
+{
+    if (m_pReadLinkOutput)
+        delete m_pReadLinkOutput;
+}
+
+void FileCache::Entry::readLinkOutput(const deque<string>& output)
+{
+    if (m_pReadLinkOutput)
+        delete m_pReadLinkOutput;
+
+  m_pReadLinkOutput = new deque<string>(output);
+}
+
+/**
+ * Returns the approximate memory used by the entry.
+ */
+size_t FileCache::Entry::bytes() const
+{
+    // the entry and its node in Shard::m_Lru
+    size_t uiBytes(sizeof(Entry) + 3 * sizeof(void*));
+
+    if (m_pReadLinkOutput)
+    {
+        uiBytes += sizeof(deque<string>);
+        for (deque<string>::const_iterator it(m_pReadLinkOutput->begin()); it != m_pReadLinkOutput->end(); ++it)
+            uiBytes += sizeof(string) + it->capacity() + 1;
+    }
+
+    return(uiBytes);
+}
+
+/**
+ * Default constructor.
+ */
+FileCache::FileCache() : m_iSecondsValid(120), m_iNegativeSecondsValid(30), m_iWatchedSecondsValid(3600), m_iStaleSecondsValid(0), m_ulNegativeHits(0), m_ulStaleHits(0), m_ulNegativeEntries(0), m_ulMaxEntries(0), m_ullMaxBytes(0), m_ulEntries(0), m_ullBytes(0), m_ulEvictions(0), m_ulExpirations(0), m_uiNextSweepShard(0)
+{
+}
+
+/**
+ * Virtual destructor.
+ */
+FileCache::~FileCache()
+{
+    for (size_t i = 0; i < uiNumShards; i++)
+        eraseTree(m_Shards[i], &m_Shards[i].m_Root);
+}
+
+/**
+ * Caches the file attributes retrieved by doStat().
+ *
+ * @param pcPath the pathname of the file thats data to cache.
+ *
+ * @param statBuf the attributes to cache.
+ */
+void FileCache::putStat(const char *pcPath, const struct stat& statBuf)
+{
+    putStat(pcPath, statBuf, false);
+}
+
+/**
+ * Caches the file attributes retrieved by doStat().
+ *
+ * @param pcPath the pathname of the file thats data to cache.
+ *
+ * @param statBuf the attributes to cache.
+ * @param fRestored true if the attributes are loaded from a snapshot.
+ */
+void FileCache::putStat(const char *pcPath, const struct stat& statBuf, const bool fRestored)
+{
+    Shard& s(shard(pcPath));
+
+    ::pthread_rwlock_wrlock(&s.m_Lock);
+
+    Node* pNode(findOrCreate(s, pcPath));
+    eraseMissing(s, pNode);
+
+    if (pNode->m_pEntry)
+    {
+        if (s.m_Hand == pNode->m_pEntry->lruPos())
+            ++s.m_Hand;
+        s.m_Lru.splice(s.m_Lru.end(), s.m_Lru, pNode->m_pEntry->lruPos());
+    }
+    else
+    {
+        pNode->m_pEntry = new Entry();
+        pNode->m_pEntry->lruPos(s.m_Lru.insert(s.m_Lru.end(), pNode));
+        s.m_ullBytes += pNode->m_pEntry->bytes();
+        m_ullBytes += pNode->m_pEntry->bytes();
+        s.m_ulEntries++;
+        m_ulEntries++;
+    }
+
+    pNode->m_pEntry->attributes(statBuf);
+    pNode->m_pEntry->restored(fRestored);
+    pNode->m_pEntry->timeStamp(::time(NULL));
+
+    enforceLimits(s);
+
+    ::pthread_rwlock_unlock(&s.m_Lock);
+}
+
+/**
+ * Caches the output of adbnc_readlink().
+ *
+ * @param pcPath the pathname of the file thats resolved link to cache.
+ *
+ * @param readLinkOutput a reference to resolved link name.
+ */
+void FileCache::putReadLink(const char *pcPath, const deque<string>& readLinkOutput)
+{
+    putReadLink(pcPath, readLinkOutput, false);
+}
+
+/**
+ * Caches the output of adbnc_readlink().
+ *
+ * @param pcPath the pathname of the file thats resolved link to cache.
+ *
+ * @param readLinkOutput a reference to resolved link name.
+ * @param fRestored true if the link is loaded from a snapshot.
+ */
+void FileCache::putReadLink(const char *pcPath, const deque<string>& readLinkOutput, const bool fRestored)
+{
+    Shard& s(shard(pcPath));
+
+    ::pthread_rwlock_wrlock(&s.m_Lock);
+
+    Node* pNode(findOrCreate(s, pcPath));
+
+    if (pNode->m_pEntry)
+    {
+        if (s.m_Hand == pNode->m_pEntry->lruPos())
+            ++s.m_Hand;
+        s.m_Lru.splice(s.m_Lru.end(), s.m_Lru, pNode->m_pEntry->lruPos());
+        s.m_ullBytes -= pNode->m_pEntry->bytes();
+        m_ullBytes -= pNode->m_pEntry->bytes();
+    }
+    else
+    {
+        pNode->m_pEntry = new Entry();
+        pNode->m_pEntry->lruPos(s.m_Lru.insert(s.m_Lru.end(), pNode));
+        s.m_ulEntries++;
+        m_ulEntries++;
+    }
+
+    pNode->m_pEntry->readLinkOutput(readLinkOutput);
+    pNode->m_pEntry->restored(fRestored);
+    pNode->m_pEntry->timeStamp(::time(NULL));
+    s.m_ullBytes += pNode->m_pEntry->bytes();
+    m_ullBytes += pNode->m_pEntry->bytes();
+
+    enforceLimits(s);
+
+    ::pthread_rwlock_unlock(&s.m_Lock);
+}
+
+/**
+ * Notes in the negative cache that the given path does not exist.
+ *
+ * Attributes cached for the path are dropped.
+ *
+ * @param pcPath the pathname found missing.
+ */
+void FileCache::putMissing(const char *pcPath)
+{
+    if (m_iNegativeSecondsValid > 0)
+    {
+        Shard& s(shard(pcPath));
+
+        ::pthread_rwlock_wrlock(&s.m_Lock);
+
+        Node* pNode(findOrCreate(s, pcPath));
+        eraseEntry(s, pNode);
+
+        if (pNode->m_pMissing)
+            s.m_MissingOrder.splice(s.m_MissingOrder.end(), s.m_MissingOrder, pNode->m_pMissing->m_OrderPos);
+        else
+        {
+            pNode->m_pMissing = new Missing();
+            pNode->m_pMissing->m_OrderPos = s.m_MissingOrder.insert(s.m_MissingOrder.end(), pNode);
+            s.m_ullBytes += sizeof(Missing) + 3 * sizeof(void*);
+            m_ullBytes += sizeof(Missing) + 3 * sizeof(void*);
+            s.m_ulEntries++;
+            m_ulEntries++;
+        }
+
+        pNode->m_pMissing->m_Timestamp = ::time(NULL);
+
+        enforceLimits(s);
+
+        ::pthread_rwlock_unlock(&s.m_Lock);
+
+        m_ulNegativeEntries++;
+    }
+}
+
+/**
+ * Set the number of seconds cached attributes and resolved links are valid.
+ *
+ * @param iSeconds the timeout.
+ */
+void FileCache::timeout(const int iSeconds)
+{
+    m_iSecondsValid = iSeconds;
+}
+
+/**
+ * Set the number of seconds a path stays in the negative cache.
+ *
+ * @param iSeconds the timeout, 0 disables the negative cache.
+ */
+void FileCache::negativeTimeout(const int iSeconds)
+{
+    m_iNegativeSecondsValid = iSeconds;
+}
+
+/**
+ * Set the number of seconds entries of watched paths are valid.
+ *
+ * @param iSeconds the timeout.
+ */
+void FileCache::watchedTimeout(const int iSeconds)
+{
+    m_iWatchedSecondsValid = iSeconds;
+}
+
+/**
+ * Set the number of seconds expired attributes may still be retrieved while
+ * they are refreshed, see getStat().
+ *
+ * @param iSeconds the timeout, 0 to never serve expired attributes.
+ */
+void FileCache::staleTimeout(const int iSeconds)
+{
+    m_iStaleSecondsValid = iSeconds;
+}
+
+/**
+ * Marks a directory as watched or not.
+ *
+ * The attributes of a watched directory and of all paths directly in it are
+ * valid for the watched timeout, the caller has to invalidate them when
+ * notified of a change. A directory stays watched until unmarked, renamed or
+ * invalidated with invalidateTree().
+ *
+ * The paths in the directory may be in any shard, so the directory is marked
+ * in the trie of every shard.
+ *
+ * @param pcDir the pathname of the directory.
+ * @param fWatched true to mark the directory as watched.
+ */
+void FileCache::watch(const char *pcDir, const bool fWatched)
+{
+    for (size_t i = 0; i < uiNumShards; i++)
+    {
+        Shard& s(m_Shards[i]);
+
+        ::pthread_rwlock_wrlock(&s.m_Lock);
+
+        Node* const pNode(fWatched ? findOrCreate(s, pcDir) : find(s, pcDir));
+        if (pNode)
+        {
+            pNode->m_fWatched = fWatched;
+            prune(s, pNode);
+        }
+
+        ::pthread_rwlock_unlock(&s.m_Lock);
+    }
+}
+
+/**
+ * Set the maximum number of entries and memory the cache may use.
+ *
+ * The limits are split evenly over the shards and enforced when an entry is
+ * put, at least one entry per shard is kept.
+ *
+ * @param ulMaxEntries maximum number of entries, including negative ones, 0
+ *        for no limit.
+ * @param ullMaxBytes maximum approximate memory used by the cache, 0 for no
+ *        limit.
+ */
+void FileCache::limits(const unsigned long ulMaxEntries, const unsigned long long ullMaxBytes)
+{
+    m_ulMaxEntries = ulMaxEntries;
+    m_ullMaxBytes = ullMaxBytes;
+}
+
+/**
+ * Retrieves the cached file attributes.
+ *
+ * @param pcPath the pathname of the file.
+ * @param pStatBuf receives a copy of the cached attributes.
+ * @param pfRefresh if not NULL, attributes expired less than the stale
+ *        timeout ago and restored ones are retrieved too, the first time
+ *        set to true to ask the caller to refresh them in the background;
+ *        false otherwise.
+ *
+ * @return true if valid data was cached for pcPath, false otherwise.
+ */
+bool FileCache::getStat(const char *pcPath, struct stat* pStatBuf, bool* pfRefresh) const
+{
+    bool fRes(false);
+
+    if (pfRefresh)
+        *pfRefresh = false;
+
+    const Shard& s(shard(pcPath));
+
+    ::pthread_rwlock_rdlock(&s.m_Lock);
+
+    const Node* const pNode(find(s, pcPath));
+    if (pNode && pNode->m_pEntry && pNode->m_pEntry->hasAttributes())
+    {
+        if (isValid(pNode, *pNode->m_pEntry))
+            fRes = true;
+        else if (pfRefresh && isStale(pNode, *pNode->m_pEntry))
+        {
+            *pfRefresh = pNode->m_pEntry->claimRefresh();
+            m_ulStaleHits++;
+            fRes = true;
+        }
+
+        if (fRes)
+        {
+            *pStatBuf = pNode->m_pEntry->attributes();
+            pNode->m_pEntry->referenced(true);
+        }
+    }
+
+    ::pthread_rwlock_unlock(&s.m_Lock);
+
+    return(fRes);
+}
+
+/**
+ * Retrieves the cached output of adbnc_readlink().
+ *
+ * @param pcPath the pathname of the link.
+ * @param pReadLinkOutput receives a copy of the cached data.
+ *
+ * @return true if valid data was cached for pcPath, false otherwise.
+ */
+bool FileCache::getReadLink(const char *pcPath, deque<string>* pReadLinkOutput) const
+{
+    bool fRes(false);
+
+    const Shard& s(shard(pcPath));
+
+    ::pthread_rwlock_rdlock(&s.m_Lock);
+
+    const Node* const pNode(find(s, pcPath));
+    if (pNode && pNode->m_pEntry && isValid(pNode, *pNode->m_pEntry) && pNode->m_pEntry->readLinkOutput())
+    {
+        *pReadLinkOutput = *pNode->m_pEntry->readLinkOutput();
+        pNode->m_pEntry->referenced(true);
+        fRes = true;
+    }
+
+    ::pthread_rwlock_unlock(&s.m_Lock);
+
+    return(fRes);
+}
+
+/**
+ * Tests if the given path is in the negative cache.
+ *
+ * @param pcPath the pathname to test.
+ *
+ * @return true if pcPath has been found missing less than the negative
+ *         timeout ago.
+ */
+bool FileCache::isMissing(const char *pcPath) const
+{
+    const Shard& s(shard(pcPath));
+
+    ::pthread_rwlock_rdlock(&s.m_Lock);
+
+    const Node* const pNode(find(s, pcPath));
+    const bool fRes(pNode && pNode->m_pMissing && isValid(pNode, *pNode->m_pMissing));
+
+    ::pthread_rwlock_unlock(&s.m_Lock);
+
+    if (fRes)
+        m_ulNegativeHits++;
+
+    return(fRes);
+}
+
+/**
+ * Tests if the given path is a watched directory or directly in one.
+ *
+ * @param pcPath the pathname to test.
+ */
+bool FileCache::isWatched(const char *pcPath) const
+{
+    const Shard& s(shard(pcPath));
+
+    ::pthread_rwlock_rdlock(&s.m_Lock);
+
+    const Node* const pNode(find(s, pcPath));
+    const bool fRes(pNode && isWatched(pNode));
+
+    ::pthread_rwlock_unlock(&s.m_Lock);
+
+    return(fRes);
+}
+
+/**
+ * Renders the cashed data for the given file as invalid.
+ *
+ * Removes the path from the negative cache too, so it has to be called
+ * whenever a file is created.
+ *
+ * @param pcPath the pathname to the file.
+ */
+void FileCache::invalidate(const char *pcPath)
+{
+    Shard& s(shard(pcPath));
+
+    ::pthread_rwlock_wrlock(&s.m_Lock);
+
+    Node* const pNode(find(s, pcPath));
+    if (pNode)
+    {
+        eraseEntry(s, pNode);
+        eraseMissing(s, pNode);
+        prune(s, pNode);
+    }
+
+    ::pthread_rwlock_unlock(&s.m_Lock);
+}
+
+/**
+ * Renders the cashed data for the given path and every path below it as
+ * invalid, the directories are no longer watched.
+ *
+ * The shards are locked one after another, a lookup in a shard not yet
+ * visited may still find data of the subtree.
+ *
+ * @param pcPath the pathname to the directory.
+ */
+void FileCache::invalidateTree(const char *pcPath)
+{
+    for (size_t i = 0; i < uiNumShards; i++)
+    {
+        Shard& s(m_Shards[i]);
+
+        ::pthread_rwlock_wrlock(&s.m_Lock);
+
+        Node* const pNode(find(s, pcPath));
+        if (pNode)
+        {
+            pNode->m_fWatched = false;
+            eraseTree(s, pNode);
+            prune(s, pNode);
+        }
+
+        ::pthread_rwlock_unlock(&s.m_Lock);
+    }
+}
+
+/**
+ * Moves the cached data of a renamed file or directory, including every path
+ * below it, to the new name.
+ *
+ * Data cached for the new name and below it is dropped. The attributes of
+ * the renamed path itself are dropped too, its status change time changed.
+ * The attributes of the parent directories are not touched. The moved
+ * directories are no longer watched, notifications would name their old
+ * paths.
+ *
+ * The last component of a path below the renamed one stays the same, so its
+ * data stays in its shard, the subtree is moved in each shard one after
+ * another.
+ *
+ * @param pcFrom the old pathname.
+ * @param pcTo the new pathname.
+ */
+void FileCache::rename(const char *pcFrom, const char *pcTo)
+{
+    const string strTo(pcTo);
+    const size_t uiPos(strTo.rfind('/'));
+    if (uiPos == string::npos || uiPos + 1 == strTo.length() || strTo == pcFrom)
+        return;
+
+    const string strToDir(strTo.substr(0, uiPos));
+    const string strToName(strTo.substr(uiPos + 1));
+
+    for (size_t i = 0; i < uiNumShards; i++)
+    {
+        Shard& s(m_Shards[i]);
+
+        ::pthread_rwlock_wrlock(&s.m_Lock);
+
+        Node* const pTo(find(s, pcTo));
+        if (pTo)
+        {
+            pTo->m_fWatched = false;
+            eraseTree(s, pTo);
+            prune(s, pTo);
+        }
+
+        Node* const pFrom(find(s, pcFrom));
+        if (pFrom && pFrom != &s.m_Root)
+        {
+            eraseEntry(s, pFrom);
+            eraseMissing(s, pFrom);
+            unwatchTree(pFrom);
+
+            Node* const pOldParent(pFrom->m_pParent);
+            detach(s, pFrom);
+            prune(s, pOldParent);
+
+            if (pFrom->m_pChildren)
+                attach(s, findOrCreate(s, strToDir.c_str()), strToName, pFrom);
+            else
+                delete pFrom;
+        }
+
+        ::pthread_rwlock_unlock(&s.m_Lock);
+    }
+}
+
+/**
+ * Drops expired entries.
+ *
+ * Called periodically, so the cache does not keep every path ever looked up.
+ * Entries are ordered by the time they were put, the expired ones are in
+ * front of each shard, so a call only costs the entries dropped. Entries of
+ * watched paths outliving the ordinary timeout and entries that may still be
+ * served stale are moved to the back on the way. The shards are locked one
+ * after another, each call starts with the next one.
+ *
+ * @param ulMaxEntries the maximum number of entries to visit in this call,
+ *        to bound the time spent.
+ *
+ * @return the number of entries dropped.
+ */
+unsigned long FileCache::sweep(const unsigned long ulMaxEntries)
+{
+    unsigned long ulExpired(0);
+    unsigned long ulVisited(0);
+
+    const unsigned int uiFirst(m_uiNextSweepShard++);
+    for (size_t i = 0; i < uiNumShards && ulVisited < ulMaxEntries; i++)
+        ulExpired += sweep(m_Shards[(uiFirst + i) & (uiNumShards - 1)], ulMaxEntries, &ulVisited);
+
+    m_ulExpirations += ulExpired;
+
+    return(ulExpired);
+}
+
+/**
+ * Writes the cached attributes and resolved links to a snapshot, shard by
+ * shard, least recently put first.
+ *
+ * Entries listed together are put one after another, so each path is written
+ * as the length of the prefix it shares with the path before and the rest.
+ * Negative entries are not written, they would expire long before the
+ * snapshot is loaded.
+ *
+ * @param out the stream to write to.
+ */
+void FileCache::save(ostream& out) const
+{
+    // in index order, like every caller locking more than one shard
+    uint32_t uiCount(0);
+    for (size_t i = 0; i < uiNumShards; i++)
+    {
+        ::pthread_rwlock_rdlock(&m_Shards[i].m_Lock);
+        uiCount += m_Shards[i].m_Lru.size();
+    }
+
+    writeValue(out, uiCount);
+
+    string strPrevious;
+    for (size_t i = 0; i < uiNumShards; i++)
+    {
+        const Shard& s(m_Shards[i]);
+        for (list<Node*>::const_iterator it(s.m_Lru.begin()); it != s.m_Lru.end(); ++it)
+        {
+            const Entry& entry(*(*it)->m_pEntry);
+
+            const string strPath(path(*it));
+            const pair<string::const_iterator, string::const_iterator> mismatch(::mismatch(strPrevious.begin(), strPrevious.end(), strPath.begin()));
+            const uint32_t uiPrefix(mismatch.first - strPrevious.begin());
+            writeValue(out, uiPrefix);
+            writeString(out, strPath.substr(uiPrefix));
+            strPrevious = strPath;
+            writeValue(out, (uint8_t)((entry.hasAttributes() ? SNAPSHOT_ATTRIBUTES : 0) | (entry.readLinkOutput() ? SNAPSHOT_READLINK : 0)));
+
+            if (entry.hasAttributes())
+                writeValue(out, entry.attributes());
+
+            if (entry.readLinkOutput())
+            {
+                writeValue(out, (uint32_t)entry.readLinkOutput()->size());
+                for (deque<string>::const_iterator itLine(entry.readLinkOutput()->begin()); itLine != entry.readLinkOutput()->end(); ++itLine)
+                    writeString(out, *itLine);
+            }
+        }
+    }
+
+    for (size_t i = uiNumShards; i > 0; i--)
+        ::pthread_rwlock_unlock(&m_Shards[i - 1].m_Lock);
+}
+
+/**
+ * Puts the records written by save() into the cache as restored.
+ *
+ * The device may have changed since the snapshot was saved, so restored
+ * entries are not valid, getStat() serves them like stale ones, however long
+ * ago they were loaded, and asks its caller to refresh them on first access.
+ * They stay restored until put again.
+ *
+ * @param ppcPos the position of the records, advanced past them.
+ * @param pcEnd the end of the snapshot.
+ *
+ * @return false if the records are truncated, the ones before are put.
+ */
+bool FileCache::load(const char **ppcPos, const char *pcEnd)
+{
+    uint32_t uiCount;
+    if (!readValue(ppcPos, pcEnd, &uiCount))
+        return(false);
+
+    string strPath;
+    string strRest;
+    struct stat statBuf;
+    deque<string> readLinkOutput;
+    for (uint32_t i = 0; i < uiCount; i++)
+    {
+        uint32_t uiPrefix;
+        uint8_t uiFlags;
+        if (!readValue(ppcPos, pcEnd, &uiPrefix) || uiPrefix > strPath.length() || !readString(ppcPos, pcEnd, &strRest) || !readValue(ppcPos, pcEnd, &uiFlags))
+            return(false);
+
+        strPath.resize(uiPrefix);
+        strPath.append(strRest);
+
+        if (uiFlags & SNAPSHOT_ATTRIBUTES)
+        {
+            if (!readValue(ppcPos, pcEnd, &statBuf))
+                return(false);
+
+            putStat(strPath.c_str(), statBuf, true);
+        }
+
+        if (uiFlags & SNAPSHOT_READLINK)
+        {
+            uint32_t uiLines;
+            if (!readValue(ppcPos, pcEnd, &uiLines))
+                return(false);
+
+            readLinkOutput.resize(uiLines);
+            for (uint32_t j = 0; j < uiLines; j++)
+                if (!readString(ppcPos, pcEnd, &readLinkOutput[j]))
+                    return(false);
+
+            putReadLink(strPath.c_str(), readLinkOutput, true);
+        }
+    }
+
+    return(true);
+}
+
+/**
+ * Selects the shard of a path by the hash of its last component, which does
+ * not change when a directory above it is renamed.
+ *
+ * @param pcPath the pathname.
+ *
+ * @return the shard.
+ */
+FileCache::Shard& FileCache::shard(const char *pcPath) const
+{
+    const char* pcEnd(pcPath + ::strlen(pcPath));
+    while (pcEnd > pcPath && pcEnd[-1] == '/')
+        pcEnd--;
+
+    const char* pcName(pcEnd);
+    while (pcName > pcPath && pcName[-1] != '/')
+        pcName--;
+
+    return(m_Shards[hash<string>()(string(pcName, pcEnd - pcName)) & (uiNumShards - 1)]);
+}
+
+/**
+ * Looks up the node of a path in a shard, must be called with the shard
+ * locked.
+ *
+ * @param s the shard.
+ * @param pcPath the pathname, components are separated by one or more
+ *        slashes.
+ *
+ * @return the node or NULL if there is none.
+ */
+FileCache::Node* FileCache::find(const Shard& s, const char *pcPath)
+{
+    Node* pNode(const_cast<Node*>(&s.m_Root));
+
+    string strName;
+    const char* pc(pcPath);
+    while (pNode)
+    {
+        while (*pc == '/')
+            pc++;
+
+        if (!*pc)
+            break;
+
+        const char* pcEnd(::strchr(pc, '/'));
+        if (!pcEnd)
+            pcEnd = pc + ::strlen(pc);
+
+        strName.assign(pc, pcEnd - pc);
+        pc = pcEnd;
+
+        if (pNode->m_pChildren)
+        {
+            const unordered_map<string, Node*>::const_iterator it(pNode->m_pChildren->find(strName));
+            pNode = it != pNode->m_pChildren->end() ? it->second : NULL;
+        }
+        else
+            pNode = NULL;
+    }
+
+    return(pNode);
+}
+
+/**
+ * Looks up the node of a path in a shard and creates the missing ones on the
+ * way, must be called with the shard write locked.
+ *
+ * @param s the shard.
+ * @param pcPath the pathname.
+ *
+ * @return the node.
+ */
+FileCache::Node* FileCache::findOrCreate(Shard& s, const char *pcPath)
+{
+    Node* pNode(&s.m_Root);
+
+    string strName;
+    const char* pc(pcPath);
+    for (;;)
+    {
+        while (*pc == '/')
+            pc++;
+
+        if (!*pc)
+            break;
+
+        const char* pcEnd(::strchr(pc, '/'));
+        if (!pcEnd)
+            pcEnd = pc + ::strlen(pc);
+
+        strName.assign(pc, pcEnd - pc);
+        pc = pcEnd;
+
+        unordered_map<string, Node*>::const_iterator it;
+        if (pNode->m_pChildren && (it = pNode->m_pChildren->find(strName)) != pNode->m_pChildren->end())
+            pNode = it->second;
+        else
+            pNode = attach(s, pNode, strName, new Node(pNode));
+    }
+
+    return(pNode);
+}
+
+/**
+ * Makes a node a child of another, must be called with the shard write
+ * locked.
+ *
+ * @param s the shard of both nodes.
+ * @param pParent the new parent.
+ * @param strName the name of pNode, not used by another child of pParent.
+ * @param pNode the detached node.
+ *
+ * @return pNode.
+ */
+FileCache::Node* FileCache::attach(Shard& s, Node* pParent, const string& strName, Node* pNode)
+{
+    if (!pParent->m_pChildren)
+        pParent->m_pChildren = new unordered_map<string, Node*>();
+
+    const unordered_map<string, Node*>::iterator it(pParent->m_pChildren->insert(make_pair(strName, pNode)).first);
+
+    pNode->m_pParent = pParent;
+    pNode->m_pName = &it->first;
+    s.m_ullBytes += nodeBytes(strName);
+    m_ullBytes += nodeBytes(strName);
+
+    return(pNode);
+}
+
+/**
+ * Removes a node from its parent, must be called with the shard write
+ * locked.
+ *
+ * @param s the shard of the node.
+ * @param pNode the node, not the root.
+ *
+ * @return pNode.
+ */
+FileCache::Node* FileCache::detach(Shard& s, Node* pNode)
+{
+    Node* const pParent(pNode->m_pParent);
+
+    s.m_ullBytes -= nodeBytes(*pNode->m_pName);
+    m_ullBytes -= nodeBytes(*pNode->m_pName);
+    pParent->m_pChildren->erase(pParent->m_pChildren->find(*pNode->m_pName));
+    if (pParent->m_pChildren->empty())
+    {
+        delete pParent->m_pChildren;
+        pParent->m_pChildren = NULL;
+    }
+
+    pNode->m_pParent = NULL;
+    pNode->m_pName = NULL;
+
+    return(pNode);
+}
+
+/**
+ * Deletes a node and its ancestors as long as they hold neither data nor
+ * children, must be called with the shard write locked.
+ *
+ * @param s the shard of the node.
+ * @param pNode the node to start with.
+ */
+void FileCache::prune(Shard& s, Node* pNode)
+{
+    while (pNode != &s.m_Root && !pNode->m_pEntry && !pNode->m_pMissing && !pNode->m_pChildren && !pNode->m_fWatched)
+    {
+        Node* const pParent(pNode->m_pParent);
+        delete detach(s, pNode);
+        pNode = pParent;
+    }
+}
+
+/**
+ * Drops the data of a node and deletes all nodes below it, must be called
+ * with the shard write locked.
+ *
+ * @param s the shard of the node.
+ * @param pNode the node.
+ */
+void FileCache::eraseTree(Shard& s, Node* pNode)
+{
+    eraseEntry(s, pNode);
+    eraseMissing(s, pNode);
+
+    while (pNode->m_pChildren)
+    {
+        Node* const pChild(pNode->m_pChildren->begin()->second);
+        eraseTree(s, pChild);
+        delete detach(s, pChild);
+    }
+}
+
+/**
+ * Drops the attributes and resolved link of a node, must be called with the
+ * shard write locked.
+ *
+ * @param s the shard of the node.
+ * @param pNode the node.
+ */
+void FileCache::eraseEntry(Shard& s, Node* pNode)
+{
+    if (pNode->m_pEntry)
+    {
+        if (s.m_Hand == pNode->m_pEntry->lruPos())
+            ++s.m_Hand;
+
+        s.m_Lru.erase(pNode->m_pEntry->lruPos());
+        s.m_ullBytes -= pNode->m_pEntry->bytes();
+        m_ullBytes -= pNode->m_pEntry->bytes();
+        s.m_ulEntries--;
+        m_ulEntries--;
+
+        delete pNode->m_pEntry;
+        pNode->m_pEntry = NULL;
+    }
+}
+
+/**
+ * Drops the negative entry of a node, must be called with the shard write
+ * locked.
+ *
+ * @param s the shard of the node.
+ * @param pNode the node.
+ */
+void FileCache::eraseMissing(Shard& s, Node* pNode)
+{
+    if (pNode->m_pMissing)
+    {
+        s.m_MissingOrder.erase(pNode->m_pMissing->m_OrderPos);
+        s.m_ullBytes -= sizeof(Missing) + 3 * sizeof(void*);
+        m_ullBytes -= sizeof(Missing) + 3 * sizeof(void*);
+        s.m_ulEntries--;
+        m_ulEntries--;
+
+        delete pNode->m_pMissing;
+        pNode->m_pMissing = NULL;
+    }
+}
+
+/**
+ * Marks a node and all nodes below it as not watched, must be called with
+ * the shard write locked.
+ *
+ * @param pNode the node.
+ */
+void FileCache::unwatchTree(Node* pNode)
+{
+    pNode->m_fWatched = false;
+
+    if (pNode->m_pChildren)
+        for (unordered_map<string, Node*>::iterator it(pNode->m_pChildren->begin()); it != pNode->m_pChildren->end(); ++it)
+            unwatchTree(it->second);
+}
+
+/**
+ * Tests if a node is a watched directory or directly in one.
+ *
+ * @param pNode the node.
+ */
+bool FileCache::isWatched(const Node* pNode)
+{
+    return(pNode->m_fWatched || (pNode->m_pParent && pNode->m_pParent->m_fWatched));
+}
+
+/**
+ * Builds the pathname of a node, must be called with the shard locked.
+ *
+ * @param pNode the node.
+ *
+ * @return the pathname, / for the root.
+ */
+string FileCache::path(const Node* pNode)
+{
+    string strPath;
+    for (; pNode->m_pParent; pNode = pNode->m_pParent)
+        strPath.insert(0, "/" + *pNode->m_pName);
+
+    return(strPath.empty() ? "/" : strPath);
+}
+
+/**
+ * Tests if the given cache entry is valid, expired less than the stale
+ * timeout ago or restored.
+ *
+ * @param pNode the node holding the entry.
+ * @param entry the entry to test.
+ */
+bool FileCache::isStale(const Node* pNode, const Entry& entry) const
+{
+    return(entry.restored() || !isExpiring(entry.timeStamp(), (isWatched(pNode) ? m_iWatchedSecondsValid : m_iSecondsValid) + m_iStaleSecondsValid));
+}
+
+/**
+ * Tests if the given cache entry is valid, restored entries never are.
+ *
+ * @param pNode the node holding the entry.
+ * @param entry the entry to test.
+ */
+bool FileCache::isValid(const Node* pNode, const Entry& entry) const
+{
+    return(!entry.restored() && !isExpiring(entry.timeStamp(), isWatched(pNode) ? m_iWatchedSecondsValid : m_iSecondsValid));
+}
+
+/**
+ * Tests if the given negative cache entry is valid.
+ *
+ * @param pNode the node holding the entry.
+ * @param missing the entry to test.
+ */
+bool FileCache::isValid(const Node* pNode, const Missing& missing) const
+{
+    // a watched directory's notifications include created files
+    return(!isExpiring(missing.m_Timestamp, isWatched(pNode) ? m_iWatchedSecondsValid : m_iNegativeSecondsValid));
+}
+
+/**
+ * Tests if a time stamp is older than the given number of seconds.
+ *
+ * @param timestamp the time stamp of an entry.
+ * @param iSecondsValid the timeout.
+ */
+bool FileCache::isExpiring(const time_t& timestamp, const int iSecondsValid) const
+{
+    return(timestamp + iSecondsValid <= ::time(NULL));
+}
+
+/**
+ * Returns the approximate memory used by a node with the given name.
+ *
+ * @param strName the name of the node.
+ */
+size_t FileCache::nodeBytes(const string& strName)
+{
+    // the node, the hash node in the parent holding name and pointer, name buffer
+    return(sizeof(Node) + sizeof(string) + 3 * sizeof(void*) + strName.capacity() + 1);
+}
+
+/**
+ * Drops the expired entries in front of a shard.
+ *
+ * @param s the shard.
+ * @param ulMaxEntries the maximum number of entries to visit in this sweep().
+ * @param pulVisited the number of entries visited in this sweep(), advanced
+ *        by the entries visited in s.
+ *
+ * @return the number of entries dropped.
+ */
+unsigned long FileCache::sweep(Shard& s, const unsigned long ulMaxEntries, unsigned long* pulVisited)
+{
+    unsigned long ulExpired(0);
+
+    ::pthread_rwlock_wrlock(&s.m_Lock);
+
+    // each entry moved to the back is visited once
+    for (size_t uiLeft(s.m_Lru.size()); uiLeft > 0 && *pulVisited < ulMaxEntries && isExpiring(s.m_Lru.front()->m_pEntry->timeStamp(), m_iSecondsValid); uiLeft--)
+    {
+        Node* const pNode(s.m_Lru.front());
+        (*pulVisited)++;
+
+        if (isStale(pNode, *pNode->m_pEntry))
+        {
+            if (s.m_Hand == s.m_Lru.begin())
+                ++s.m_Hand;
+            s.m_Lru.splice(s.m_Lru.end(), s.m_Lru, s.m_Lru.begin());
+        }
+        else
+        {
+            eraseEntry(s, pNode);
+            prune(s, pNode);
+            ulExpired++;
+        }
+    }
 
-int adbncPush(const string& strLocalSource, const string& strRemoteDestination);
-int adbncShell(const string& strCommand);
+    for (size_t uiLeft(s.m_MissingOrder.size()); uiLeft > 0 && *pulVisited < ulMaxEntries && isExpiring(s.m_MissingOrder.front()->m_pMissing->m_Timestamp, m_iNegativeSecondsValid); uiLeft--)
+    {
+        Node* const pNode(s.m_MissingOrder.front());
+        (*pulVisited)++;
+
+        if (isValid(pNode, *pNode->m_pMissing))
+            s.m_MissingOrder.splice(s.m_MissingOrder.end(), s.m_MissingOrder, s.m_MissingOrder.begin());
+        else
+        {
+            eraseMissing(s, pNode);
+            prune(s, pNode);
+            ulExpired++;
+        }
+    }
+
+    ::pthread_rwlock_unlock(&s.m_Lock);
+
+    return(ulExpired);
+}
 
 /**
- * Copy constructor.
+ * Evicts entries until the shard is within its share of the limits, must be
+ * called with the shard write locked.
+ *
+ * @param s the shard.
  */
-FileCache::Entry::Entry(const Entry& orig) : m_Timestamp(orig.m_Timestamp), m_pStatOutput(NULL), m_pReadLinkOutput(NULL)
+void FileCache::enforceLimits(Shard& s)
 {
-    if (orig.m_pStatOutput)
-        m_pStatOutput = new deque<string>(*orig.m_pStatOutput);
+    const unsigned long ulMaxEntries(m_ulMaxEntries ? max(m_ulMaxEntries / uiNumShards, 1UL) : 0);
+    const unsigned long long ullMaxBytes(m_ullMaxBytes / uiNumShards);
 
-    if (orig.m_pReadLinkOutput)
-        m_pReadLinkOutput = new deque<string>(*orig.m_pReadLinkOutput);
+    while (s.m_ulEntries > 1 && ((ulMaxEntries && s.m_ulEntries > ulMaxEntries) || (ullMaxBytes && s.m_ullBytes > ullMaxBytes)) && evictOne(s))
+        ;
 }
 
 /**
- * Assignment operator.
+ * Evicts the negative entry of the shard found missing first or, if there
+ * are none, the first unreferenced entry at or after the eviction hand, must
+ * be called with the shard write locked.
  *
- * @param orig reference to right hand object.
+ * Referenced entries the hand passes by are marked unreferenced, so they are
+ * evicted the next time unless looked up again.
  *
- * @return a reference to the assignee.
+ * @param s the shard.
+ *
+ * @return true if an entry has been evicted.
  */
-FileCache::Entry& FileCache::Entry::operator=(const Entry& orig)
+bool FileCache::evictOne(Shard& s)
 {
-    if(this != &orig) // protect against invalid self-assignment
+    Node* pNode(NULL);
+
+    if (!s.m_MissingOrder.empty())
+    {
+        pNode = s.m_MissingOrder.front();
+        eraseMissing(s, pNode);
+    }
+    else
     {
-        if (m_pStatOutput)
-            delete m_pStatOutput;
+        while (!pNode && !s.m_Lru.empty())
+        {
+            if (s.m_Hand == s.m_Lru.end())
+                s.m_Hand = s.m_Lru.begin();
 
-        if (m_pReadLinkOutput)
-            delete m_pReadLinkOutput;
+            if ((*s.m_Hand)->m_pEntry->referenced())
+            {
+                (*s.m_Hand)->m_pEntry->referenced(false);
+                ++s.m_Hand;
+            }
+            else
+            {
+                pNode = *s.m_Hand;
+                eraseEntry(s, pNode);
+            }
+        }
+    }
 
-        m_pStatOutput = NULL;
-        m_pReadLinkOutput = NULL;
+    if (pNode)
+    {
+        prune(s, pNode);
+        m_ulEvictions++;
+    }
 
-        if (orig.m_pStatOutput)
-            m_pStatOutput = new deque<string>(*orig.m_pStatOutput);
+    return(pNode != NULL);
+}
 
+/**
+ * Default constructor.
+ */
+DirCache::DirCache() : m_Entries(), m_iSecondsValid(30)
+{
+    ::pthread_mutex_init(&m_Mutex, NULL);
+}
 
-        if (orig.m_pReadLinkOutput)
-            m_pReadLinkOutput = new deque<string>(*orig.m_pReadLinkOutput);
+/**
+ * Virtual destructor.
+ */
+DirCache::~DirCache()
+{
+    ::pthread_mutex_destroy(&m_Mutex);
+}
 
-        m_Timestamp = orig.m_Timestamp;
-    }
+/**
+ * Caches the listing of a directory.
+ *
+ * @param pcDir the pathname of the directory.
+ * @param names the output of ls -1a.
+ * @param mtime the modification time of the directory.
+ */
+void DirCache::put(const char *pcDir, const deque<string>& names, const time_t mtime)
+{
+    ::pthread_mutex_lock(&m_Mutex);
 
-    return(*this);
+    m_Entries.erase(pcDir);
+    m_Entries.insert(make_pair(pcDir, Entry(names, mtime)));
+
+    ::pthread_mutex_unlock(&m_Mutex);
 }
 
 /**
- * Virtual destructor.
+ * Set the modification time of a cached directory.
+ *
+ * Called after the directory has been changed through this file system and
+ * its cached listing has been updated accordingly, so the next revalidate()
+ * succeeds.
+ *
+ * @param pcDir the pathname of the directory.
+ * @param mtime the new modification time of the directory.
  */
-FileCache::Entry::~Entry()
+void DirCache::mtime(const char *pcDir, const time_t mtime)
 {
-    if (m_pStatOutput)
-        delete m_pStatOutput;
+    ::pthread_mutex_lock(&m_Mutex);
 
-    if (m_pReadLinkOutput)
-        delete m_pReadLinkOutput;
+    const map<string, Entry>::iterator it(m_Entries.find(pcDir));
+    if (it != m_Entries.end())
+        it->second.m_Mtime = mtime;
+
+    ::pthread_mutex_unlock(&m_Mutex);
+}
+
+/**
+ * Set the number of seconds a listing is used without revalidation.
+ *
+ * @param iSeconds the timeout.
+ */
+void DirCache::timeout(const int iSeconds)
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    m_iSecondsValid = iSeconds;
+
+    ::pthread_mutex_unlock(&m_Mutex);
 }
 
-void FileCache::Entry::statOutput(const deque<string>& output)
+/**
+ * Retrieves a cached listing not older than the timeout.
+ *
+ * @param pcDir the pathname of the directory.
+ * @param pNames receives a copy of the cached listing.
+ *
+ * @return true if a valid listing was cached, false otherwise.
+ */
+bool DirCache::get(const char *pcDir, deque<string>* pNames) const
 {
-    if (m_pStatOutput)
-        delete m_pStatOutput;
+    ::pthread_mutex_lock(&m_Mutex);
+
+    const map<string, Entry>::const_iterator it(m_Entries.find(pcDir));
+    const bool fRes(it != m_Entries.end() && it->second.m_Timestamp + m_iSecondsValid > ::time(NULL));
+    if (fRes)
+        *pNames = it->second.m_Names;
+
+    ::pthread_mutex_unlock(&m_Mutex);
 
-  m_pStatOutput = new deque<string>(output);
+    return(fRes);
 }
 
-void FileCache::Entry::readLinkOutput(const deque<string>& output)
+/**
+ * Tests if a listing, valid or not, is cached for a directory.
+ *
+ * @param pcDir the pathname of the directory.
+ *
+ * @return true if and only if a listing is cached.
+ */
+bool DirCache::contains(const char *pcDir) const
 {
-    if (m_pReadLinkOutput)
-        delete m_pReadLinkOutput;
+    ::pthread_mutex_lock(&m_Mutex);
 
-  m_pReadLinkOutput = new deque<string>(output);
+    const bool fRes(m_Entries.find(pcDir) != m_Entries.end());
+
+    ::pthread_mutex_unlock(&m_Mutex);
+
+    return(fRes);
 }
 
 /**
- * Caches the output of doStat().
+ * Revalidates an expired listing.
  *
- * @param pcPath the pathname of the file thats data to cache.
+ * @param pcDir the pathname of the directory.
+ * @param mtime the current modification time of the directory.
  *
- * @param statOutput a reference to the data to cache.
+ * @return true if the directory has not been modified since listed, the
+ *         listing is valid for another timeout then; false otherwise.
  */
-void FileCache::putStat(const char *pcPath, const deque<string>& statOutput)
+bool DirCache::revalidate(const char *pcDir, const time_t mtime)
 {
-    const map<string, Entry>::iterator it(m_Entries.find(pcPath));
-    if (it == m_Entries.end())
+    ::pthread_mutex_lock(&m_Mutex);
+
+    const map<string, Entry>::iterator it(m_Entries.find(pcDir));
+    const bool fRes(it != m_Entries.end() && it->second.m_Mtime == mtime);
+    if (fRes)
+        it->second.m_Timestamp = ::time(NULL);
+
+    ::pthread_mutex_unlock(&m_Mutex);
+
+    return(fRes);
+}
+
+/**
+ * Adds a created file or directory to the cached listing of its parent.
+ *
+ * @param pcPath the pathname of the created file.
+ *
+ * @return true if the listing of the parent is cached.
+ */
+bool DirCache::add(const char *pcPath)
+{
+    string strDir, strName;
+    bool fRes(false);
+
+    if (split(pcPath, &strDir, &strName))
     {
-        Entry entry;
-        entry.statOutput(statOutput);
-        m_Entries[pcPath] = entry;
+        ::pthread_mutex_lock(&m_Mutex);
+
+        fRes = insertName(strDir, strName);
+
+        ::pthread_mutex_unlock(&m_Mutex);
     }
-    else
+
+    return(fRes);
+}
+
+/**
+ * Removes a deleted file or directory from the cached listing of its parent.
+ *
+ * The listing of a removed directory itself is dropped.
+ *
+ * @param pcPath the pathname of the deleted file.
+ *
+ * @return true if the listing of the parent is cached.
+ */
+bool DirCache::remove(const char *pcPath)
+{
+    string strDir, strName;
+    bool fRes(false);
+
+    if (split(pcPath, &strDir, &strName))
     {
-        it->second.statOutput(statOutput);
-        it->second.timeStamp(::time(NULL));
+        ::pthread_mutex_lock(&m_Mutex);
+
+        fRes = eraseName(strDir, strName);
+        m_Entries.erase(pcPath);
+
+        ::pthread_mutex_unlock(&m_Mutex);
     }
+
+    return(fRes);
 }
 
 /**
- * Caches the output of adbnc_readlink().
+ * Moves a renamed file or directory between the cached listings of its old
+ * and new parent.
  *
- * @param pcPath the pathname of the file thats resolved link to cache.
+ * Cached listings of a renamed directory and its subdirectories are moved
+ * to their new paths.
  *
- * @param readLinkOutput a reference to resolved link name.
+ * @param pcFrom the old pathname.
+ * @param pcTo the new pathname.
+ *
+ * @return true if the listings of both parents are cached.
  */
-void FileCache::putReadLink(const char *pcPath, const deque<string>& readLinkOutput)
+bool DirCache::rename(const char *pcFrom, const char *pcTo)
 {
-    const map<string, Entry>::iterator it(m_Entries.find(pcPath));
-    if (it == m_Entries.end())
+    string strFromDir, strFromName, strToDir, strToName;
+    bool fRes(false);
+
+    if (split(pcFrom, &strFromDir, &strFromName) && split(pcTo, &strToDir, &strToName))
     {
-        Entry entry;
-        entry.readLinkOutput(readLinkOutput);
-        m_Entries[pcPath] = entry;
+        ::pthread_mutex_lock(&m_Mutex);
+
+        fRes = eraseName(strFromDir, strFromName);
+        fRes = insertName(strToDir, strToName) && fRes;
+
+        // the renamed directory and its subdirectories
+        const string strFrom(pcFrom);
+        const string strFromPrefix(strFrom + "/");
+        vector<pair<string, Entry> > moved;
+
+        map<string, Entry>::iterator it(m_Entries.find(strFrom));
+        if (it != m_Entries.end())
+        {
+            moved.push_back(make_pair(pcTo, it->second));
+            m_Entries.erase(it);
+        }
+
+        it = m_Entries.lower_bound(strFromPrefix);
+        while (it != m_Entries.end() && it->first.compare(0, strFromPrefix.length(), strFromPrefix) == 0)
+        {
+            moved.push_back(make_pair(pcTo + it->first.substr(strFrom.length()), it->second));
+            m_Entries.erase(it++);
+        }
+
+        for (vector<pair<string, Entry> >::const_iterator itMoved(moved.begin()); itMoved != moved.end(); ++itMoved)
+        {
+            m_Entries.erase(itMoved->first);
+            m_Entries.insert(*itMoved);
+        }
+
+        ::pthread_mutex_unlock(&m_Mutex);
     }
-    else
+
+    return(fRes);
+}
+
+/**
+ * Drops the cached listing of a directory.
+ *
+ * @param pcDir the pathname of the directory.
+ */
+void DirCache::invalidate(const char *pcDir)
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    m_Entries.erase(pcDir);
+
+    ::pthread_mutex_unlock(&m_Mutex);
+}
+
+/**
+ * Writes the cached listings with the modification times of their
+ * directories to a snapshot.
+ *
+ * @param out the stream to write to.
+ */
+void DirCache::save(ostream& out) const
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    writeValue(out, (uint32_t)m_Entries.size());
+
+    for (map<string, Entry>::const_iterator it(m_Entries.begin()); it != m_Entries.end(); ++it)
     {
-        it->second.readLinkOutput(readLinkOutput);
-        it->second.timeStamp(::time(NULL));
+        writeString(out, it->first);
+        writeValue(out, (int64_t)it->second.m_Mtime);
+        writeValue(out, (uint32_t)it->second.m_Names.size());
+        for (deque<string>::const_iterator itName(it->second.m_Names.begin()); itName != it->second.m_Names.end(); ++itName)
+            writeString(out, *itName);
     }
+
+    ::pthread_mutex_unlock(&m_Mutex);
 }
 
-const deque<string>* FileCache::getStat(const char *pcPath) const
+/**
+ * Caches the listings written by save() as expired, the first get() after
+ * revalidate() uses them.
+ *
+ * @param ppcPos the position of the records, advanced past them.
+ * @param pcEnd the end of the snapshot.
+ *
+ * @return false if the records are truncated, the ones before are cached.
+ */
+bool DirCache::load(const char **ppcPos, const char *pcEnd)
 {
-    const deque<string>* pOut(NULL);
+    uint32_t uiCount;
+    if (!readValue(ppcPos, pcEnd, &uiCount))
+        return(false);
 
-    const map<string, Entry>::const_iterator it(m_Entries.find(pcPath));
-    if (it != m_Entries.end())
+    string strDir;
+    deque<string> names;
+    for (uint32_t i = 0; i < uiCount; i++)
     {
-        if (isValid(it->second))
-            pOut = it->second.statOutput();
+        int64_t iMtime;
+        uint32_t uiNames;
+        if (!readString(ppcPos, pcEnd, &strDir) || !readValue(ppcPos, pcEnd, &iMtime) || !readValue(ppcPos, pcEnd, &uiNames))
+            return(false);
+
+        names.resize(uiNames);
+        for (uint32_t j = 0; j < uiNames; j++)
+            if (!readString(ppcPos, pcEnd, &names[j]))
+                return(false);
+
+        Entry entry(names, (time_t)iMtime);
+        entry.m_Timestamp = 0;
+
+        ::pthread_mutex_lock(&m_Mutex);
+
+        m_Entries.erase(strDir);
+        m_Entries.insert(make_pair(strDir, entry));
+
+        ::pthread_mutex_unlock(&m_Mutex);
     }
 
-    return(pOut);
+    return(true);
 }
 
-const deque<string>* FileCache::getReadLink(const char *pcPath) const
+/**
+ * Splits a pathname into the directory and the name.
+ *
+ * @param pcPath the pathname to split, e.g. /sdcard/a.txt
+ * @param pstrDir receives the directory, e.g. /sdcard
+ * @param pstrName receives the name, e.g. a.txt
+ *
+ * @return false if pcPath has no name part.
+ */
+bool DirCache::split(const char *pcPath, string* pstrDir, string* pstrName)
 {
-    const deque<string>* pOut(NULL);
+    const string strPath(pcPath);
+    const size_t uiPos(strPath.rfind('/'));
 
-    const map<string, Entry>::const_iterator it(m_Entries.find(pcPath));
-    if (it != m_Entries.end())
+    const bool fRes(uiPos != string::npos && uiPos + 1 < strPath.length());
+    if (fRes)
     {
-        if (isValid(it->second))
-            pOut = it->second.readLinkOutput();
+        pstrDir->assign(uiPos == 0 ? "/" : strPath.substr(0, uiPos));
+        pstrName->assign(strPath.substr(uiPos + 1));
     }
 
-    return(pOut);
+    return(fRes);
 }
 
 /**
- * Renders the cashed data for the given file as invalid.
+ * Adds a name to a cached listing, must be called with m_Mutex locked.
  *
- * @param pcPath the pathname to the file.
+ * @return true if the listing of strDir is cached.
  */
-void FileCache::invalidate(const char *pcPath)
+bool DirCache::insertName(const string& strDir, const string& strName)
 {
-    const map<string, Entry>::iterator it(m_Entries.find(pcPath));
-    if (it != m_Entries.end())
-        m_Entries.erase(it);
+    const map<string, Entry>::iterator it(m_Entries.find(strDir));
+    const bool fRes(it != m_Entries.end());
+    if (fRes)
+    {
+        deque<string>& names(it->second.m_Names);
+        if (find(names.begin(), names.end(), strName) == names.end())
+            names.push_back(strName);
+    }
+
+    return(fRes);
 }
 
 /**
- * Tests if the given cache entry is valid.
+ * Removes a name from a cached listing, must be called with m_Mutex locked.
  *
- * @param entry the entry to test.
+ * @return true if the listing of strDir is cached.
+ */
+bool DirCache::eraseName(const string& strDir, const string& strName)
+{
+    const map<string, Entry>::iterator it(m_Entries.find(strDir));
+    const bool fRes(it != m_Entries.end());
+    if (fRes)
+    {
+        deque<string>& names(it->second.m_Names);
+        const deque<string>::iterator itName(find(names.begin(), names.end(), strName));
+        if (itName != names.end())
+            names.erase(itName);
+    }
+
+    return(fRes);
+}
+
+/**
+ * Constructor.
+ */
+SingleFlight::SingleFlight() : m_Calls(), m_ulShared(0)
+{
+    ::pthread_mutex_init(&m_Mutex, NULL);
+    ::pthread_cond_init(&m_Done, NULL);
+}
+
+/**
+ * Destructor.
+ */
+SingleFlight::~SingleFlight()
+{
+    ::pthread_cond_destroy(&m_Done);
+    ::pthread_mutex_destroy(&m_Mutex);
+}
+
+/**
+ * Executes a request unless an identical one is in flight.
+ *
+ * @param strKey identifies the request, passed to pfnRequest.
+ * @param pfnRequest executes the request.
+ *
+ * @return the result of pfnRequest, called by this or a concurrent caller.
+ */
+deque<string> SingleFlight::run(const string& strKey, deque<string> (*pfnRequest)(const string& strKey))
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    const map<string, shared_ptr<Call> >::iterator it(m_Calls.find(strKey));
+    if (it != m_Calls.end())
+    {
+        const shared_ptr<Call> pCall(it->second);
+        while (!pCall->m_fDone)
+            ::pthread_cond_wait(&m_Done, &m_Mutex);
+
+        m_ulShared++;
+
+        ::pthread_mutex_unlock(&m_Mutex);
+
+        return(pCall->m_Result);
+    }
+
+    const shared_ptr<Call> pCall(new Call());
+    m_Calls.insert(make_pair(strKey, pCall));
+
+    ::pthread_mutex_unlock(&m_Mutex);
+
+    const deque<string> result(pfnRequest(strKey));
+
+    ::pthread_mutex_lock(&m_Mutex);
+
+    pCall->m_Result = result;
+    pCall->m_fDone = true;
+
+    // forget() may have dropped it and a new call taken its place
+    const map<string, shared_ptr<Call> >::iterator itOwn(m_Calls.find(strKey));
+    if (itOwn != m_Calls.end() && itOwn->second == pCall)
+        m_Calls.erase(itOwn);
+
+    ::pthread_cond_broadcast(&m_Done);
+    ::pthread_mutex_unlock(&m_Mutex);
+
+    return(result);
+}
+
+/**
+ * Lets later callers of run() execute their requests again instead of
+ * joining the ones in flight, the callers already waiting still get their
+ * results.
+ */
+void SingleFlight::forget()
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    m_Calls.clear();
+
+    ::pthread_mutex_unlock(&m_Mutex);
+}
+
+/**
+ * Writes a snapshot of the caches.
+ *
+ * The snapshot is written to a temporary file first, which then replaces
+ * pcFile, so an interrupted write never leaves a truncated snapshot behind.
+ *
+ * @param pcFile the pathname of the snapshot.
+ * @param fileCache the attributes to save.
+ * @param dirCache the listings to save.
+ *
+ * @return true if the snapshot has been written.
+ */
+bool CacheSnapshot::save(const char *pcFile, const FileCache& fileCache, const DirCache& dirCache)
+{
+    const string strTemp(string(pcFile) + ".tmp");
+
+    ofstream out(strTemp.c_str(), ios::out | ios::binary | ios::trunc);
+
+    out.write(acSnapshotMagic, sizeof(acSnapshotMagic));
+    writeValue(out, (uint32_t)sizeof(struct stat));
+    fileCache.save(out);
+    dirCache.save(out);
+    out.close();
+
+    const bool fRes(!out.fail() && ::rename(strTemp.c_str(), pcFile) == 0);
+    if (!fRes)
+        ::unlink(strTemp.c_str());
+
+    return(fRes);
+}
+
+/**
+ * Restores the caches from a snapshot written by save().
+ *
+ * @param pcFile the pathname of the snapshot.
+ * @param pFileCache receives the attributes.
+ * @param pDirCache receives the listings.
+ *
+ * @return false if there is no snapshot or it is not compatible or
+ *         truncated, records read up to the error are kept.
  */
-bool FileCache::isValid(const Entry& entry) const
+bool CacheSnapshot::load(const char *pcFile, FileCache* pFileCache, DirCache* pDirCache)
 {
-    const time_t current = ::time(NULL);
-    return(entry.timeStamp() + iFileDataCacheSecondsValid > current);
+    bool fRes(false);
+
+    const int iFd(::open(pcFile, O_RDONLY));
+    if (iFd != -1)
+    {
+        struct stat statBuf;
+        if (::fstat(iFd, &statBuf) == 0 && statBuf.st_size > 0)
+        {
+            void* const pvData(::mmap(NULL, statBuf.st_size, PROT_READ, MAP_PRIVATE, iFd, 0));
+            if (pvData != MAP_FAILED)
+            {
+                ::madvise(pvData, statBuf.st_size, MADV_SEQUENTIAL);
+
+                const char* pcPos((const char*)pvData);
+                const char* const pcEnd(pcPos + statBuf.st_size);
+
+                uint32_t uiStatSize;
+                if ((size_t)(pcEnd - pcPos) >= sizeof(acSnapshotMagic) && ::memcmp(pcPos, acSnapshotMagic, sizeof(acSnapshotMagic)) == 0)
+                {
+                    pcPos += sizeof(acSnapshotMagic);
+                    fRes = readValue(&pcPos, pcEnd, &uiStatSize) && uiStatSize == sizeof(struct stat) && pFileCache->load(&pcPos, pcEnd) && pDirCache->load(&pcPos, pcEnd);
+                }
+
+                ::munmap(pvData, statBuf.st_size);
+            }
+        }
+
+        ::close(iFd);
+    }
+
+    return(fRes);
 }
 
  int FileStatus::Entry::release(const int iFh)
@@ -359,6 +1973,3 @@ int FileStatus::release(const char *pcPath, const int iFh)
 
     return(iRet);
 }
-
-
-
@@ -0,0 +1,505 @@
+/*
+ * $Id$
+ *
+ * File:   localCache.cpp
+ * Author: Werner Jaeger
+ *
+ * Copyright 2015 Werner Jaeger.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "localCache.h"
+
+/** Name of the directory below the root directory holding the cached files */
+static const char* pcFilesDir = "files/";
+
+/** Number of subdirectories, 256 on each of the two levels */
+static const size_t uiNumDirs(256 * 256);
+
+/**
+ * Default constructor.
+ */
+LocalCache::LocalCache() : m_strRootDir(), m_Index(), m_Lru(), m_LocalPaths(), m_CreatedDirs(uiNumDirs, false), m_ullBytes(0), m_ulEvictions(0)
+{
+    ::pthread_mutex_init(&m_Mutex, NULL);
+}
+
+/**
+ * Virtual destructor.
+ */
+LocalCache::~LocalCache()
+{
+    ::pthread_mutex_destroy(&m_Mutex);
+}
+
+/**
+ * Set the directory on the local host the cached files are stored in.
+ *
+ * @param strRootDir path of an existing directory, must end with a slash.
+ */
+void LocalCache::rootDir(const string& strRootDir)
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    m_strRootDir.assign(strRootDir);
+    ::mkdir((m_strRootDir + pcFilesDir).c_str(), 0700);
+
+    ::pthread_mutex_unlock(&m_Mutex);
+}
+
+/**
+ * Returns the path of the local file caching the content of the given remote
+ * file.
+ *
+ * If the remote path is not yet in the index a unique local path is assigned
+ * and its subdirectories are created. The local file itself is not created.
+ *
+ * @param pcPath the path as used on the android device.
+ *
+ * @return the path used on the local host.
+ */
+string LocalCache::localPath(const char* pcPath)
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    const unordered_map<string, Entry>::iterator it(find(pcPath));
+    const string strLocalPath(it->second.localPath());
+    touch(it->second);
+
+    ::pthread_mutex_unlock(&m_Mutex);
+
+    return(strLocalPath);
+}
+
+/**
+ * Tests if a local path has been assigned to the given remote path.
+ *
+ * @param pcPath the path as used on the android device.
+ *
+ * @return true if and only if pcPath is in the index.
+ */
+bool LocalCache::contains(const char* pcPath) const
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    const bool fRes(m_Index.find(pcPath) != m_Index.end());
+
+    ::pthread_mutex_unlock(&m_Mutex);
+
+    return(fRes);
+}
+
+/**
+ * Deletes the local file caching the given remote file and removes it from
+ * the index.
+ *
+ * @param pcPath the path as used on the android device.
+ */
+void LocalCache::remove(const char* pcPath)
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    const unordered_map<string, Entry>::iterator it(m_Index.find(pcPath));
+    if (it != m_Index.end())
+        erase(it);
+
+    ::pthread_mutex_unlock(&m_Mutex);
+}
+
+/**
+ * Moves the index entry of a renamed remote file.
+ *
+ * The local file keeps its path, a cached file previously assigned to pcTo is
+ * deleted.
+ *
+ * @param pcFrom the old path as used on the android device.
+ * @param pcTo the new path as used on the android device.
+ */
+void LocalCache::rename(const char* pcFrom, const char* pcTo)
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    const unordered_map<string, Entry>::iterator itFrom(m_Index.find(pcFrom));
+    if (itFrom != m_Index.end() && ::strcmp(pcFrom, pcTo) != 0)
+    {
+        const unordered_map<string, Entry>::iterator itTo(m_Index.find(pcTo));
+        if (itTo != m_Index.end())
+            erase(itTo);
+
+        const unordered_map<string, Entry>::iterator it(m_Index.insert(make_pair(pcTo, itFrom->second)).first);
+        it->second.lruPos()->assign(pcTo);
+        m_Index.erase(itFrom);
+    }
+
+    ::pthread_mutex_unlock(&m_Mutex);
+}
+
+/**
+ * Notes that a file handle to the given cached file has been opened.
+ *
+ * A cached file is never evicted while open, so call it before the file is
+ * pulled.
+ *
+ * @param pcPath the path as used on the android device.
+ */
+void LocalCache::opened(const char* pcPath)
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    const unordered_map<string, Entry>::iterator it(find(pcPath));
+    it->second.openCount(it->second.openCount() + 1);
+    touch(it->second);
+
+    ::pthread_mutex_unlock(&m_Mutex);
+}
+
+/**
+ * Notes that a file handle to the given cached file has been closed.
+ *
+ * Counterpart of opened(), also updates the size of the cached file.
+ *
+ * @param pcPath the path as used on the android device.
+ */
+void LocalCache::released(const char* pcPath)
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    const unordered_map<string, Entry>::iterator it(m_Index.find(pcPath));
+    if (it != m_Index.end())
+    {
+        if (it->second.openCount() > 0)
+            it->second.openCount(it->second.openCount() - 1);
+
+        updateSize(it->second);
+        touch(it->second);
+    }
+
+    ::pthread_mutex_unlock(&m_Mutex);
+}
+
+/**
+ * Marks the given cached file as modified or as saved.
+ *
+ * Modified files are never evicted.
+ *
+ * @param pcPath the path as used on the android device.
+ * @param fDirty true if the file has been modified and is not yet pushed to
+ *        the device, false once it has been pushed.
+ */
+void LocalCache::dirty(const char* pcPath, const bool fDirty)
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    const unordered_map<string, Entry>::iterator it(fDirty ? find(pcPath) : m_Index.find(pcPath));
+    if (it != m_Index.end())
+        it->second.dirty(fDirty);
+
+    ::pthread_mutex_unlock(&m_Mutex);
+}
+
+/**
+ * Tests if the given cached file has been modified and not yet pushed.
+ *
+ * @param pcPath the path as used on the android device.
+ *
+ * @return true if and only if the file is marked dirty.
+ */
+bool LocalCache::dirty(const char* pcPath) const
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    const unordered_map<string, Entry>::const_iterator it(m_Index.find(pcPath));
+    const bool fRes(it != m_Index.end() && it->second.dirty());
+
+    ::pthread_mutex_unlock(&m_Mutex);
+
+    return(fRes);
+}
+
+/**
+ * Notes that the given cached file is hard linked to a blob of the blob store.
+ *
+ * The blob is deleted along with the last cached file linked to it.
+ *
+ * @param pcPath the path as used on the android device.
+ * @param strBlobPath path of the blob.
+ */
+void LocalCache::blob(const char* pcPath, const string& strBlobPath)
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    find(pcPath)->second.blobPath(strBlobPath);
+
+    ::pthread_mutex_unlock(&m_Mutex);
+}
+
+/**
+ * Records size and modification time of the remote file the given cached
+ * file is identical to.
+ *
+ * Call it after the file has been pulled or pushed.
+ *
+ * @param pcPath the path as used on the android device.
+ * @param ullSize size of the remote file.
+ * @param mtime modification time of the remote file.
+ */
+void LocalCache::remoteVersion(const char* pcPath, const unsigned long long ullSize, const time_t mtime)
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    find(pcPath)->second.remoteVersion(ullSize, mtime);
+
+    ::pthread_mutex_unlock(&m_Mutex);
+}
+
+/**
+ * Tests if the given cached file can be used instead of pulling the remote
+ * file again.
+ *
+ * That's the case if the remote file still has the size and modification
+ * time recorded by remoteVersion() or if the cached file has been modified
+ * and not yet pushed.
+ *
+ * @param pcPath the path as used on the android device.
+ * @param ullSize current size of the remote file.
+ * @param mtime current modification time of the remote file.
+ *
+ * @return true if the cached file is up to date.
+ */
+bool LocalCache::isCurrent(const char* pcPath, const unsigned long long ullSize, const time_t mtime) const
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    bool fRes(false);
+
+    const unordered_map<string, Entry>::const_iterator it(m_Index.find(pcPath));
+    if (it != m_Index.end() && (it->second.dirty() || it->second.isRemoteVersion(ullSize, mtime)))
+    {
+        struct stat statBuf;
+        fRes = (::stat(it->second.localPath().c_str(), &statBuf) == 0);
+    }
+
+    ::pthread_mutex_unlock(&m_Mutex);
+
+    return(fRes);
+}
+
+/**
+ * Deletes least recently used cached files until the sum of the sizes of all
+ * cached files is not more than the given budget.
+ *
+ * Open or modified files are skipped.
+ *
+ * @param ullMaxBytes the budget in bytes.
+ *
+ * @return the number of deleted files.
+ */
+unsigned long LocalCache::evict(const unsigned long long ullMaxBytes)
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    unsigned long ulEvicted(0);
+
+    list<string>::iterator itLru(m_Lru.begin());
+    while (m_ullBytes > ullMaxBytes && itLru != m_Lru.end())
+    {
+        const unordered_map<string, Entry>::iterator it(m_Index.find(*itLru++));
+        if (it->second.evictable() && it->second.size() > 0)
+        {
+            erase(it);
+            ulEvicted++;
+        }
+    }
+
+    m_ulEvictions += ulEvicted;
+
+    ::pthread_mutex_unlock(&m_Mutex);
+
+    return(ulEvicted);
+}
+
+/**
+ * Returns the sum of the sizes of all cached files.
+ *
+ * Content shared through the blob store is counted once per cached file.
+ *
+ * @return number of bytes.
+ */
+unsigned long long LocalCache::bytes() const
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    const unsigned long long ullBytes(m_ullBytes);
+
+    ::pthread_mutex_unlock(&m_Mutex);
+
+    return(ullBytes);
+}
+
+/**
+ * Returns the number of cached files deleted by evict() so far.
+ *
+ * @return number of evicted files.
+ */
+unsigned long LocalCache::evictions() const
+{
+    ::pthread_mutex_lock(&m_Mutex);
+
+    const unsigned long ulEvictions(m_ulEvictions);
+
+    ::pthread_mutex_unlock(&m_Mutex);
+
+    return(ulEvictions);
+}
+
+/**
+ * Computes the 64 bit FNV-1a hash of the given path.
+ *
+ * @param pcPath the path to hash.
+ *
+ * @return the hash value.
+ */
+uint64_t LocalCache::hash(const char* pcPath)
+{
+    uint64_t ulHash(0xcbf29ce484222325ULL);
+
+    for (const unsigned char* pc = reinterpret_cast<const unsigned char*>(pcPath); *pc; pc++)
+    {
+        ulHash ^= *pc;
+        ulHash *= 0x100000001b3ULL;
+    }
+
+    return(ulHash);
+}
+
+/**
+ * Assigns a new local path to the given remote path.
+ *
+ * Must be called with m_Mutex locked.
+ *
+ * @param pcPath the path as used on the android device.
+ *
+ * @return a local path not used by any other remote path.
+ */
+string LocalCache::makeLocalPath(const char* pcPath)
+{
+    const uint64_t ulHash(hash(pcPath));
+    const unsigned int uiDir(ulHash >> 48);
+
+    char acName[40];
+    ::snprintf(acName, sizeof(acName), "%02x/%02x/", uiDir >> 8, uiDir & 0xff);
+
+    string strDir(m_strRootDir);
+    strDir.append(pcFilesDir);
+    strDir.append(acName);
+
+    if (!m_CreatedDirs[uiDir])
+    {
+        ::mkdir(strDir.substr(0, strDir.length() - 3).c_str(), 0700);
+        ::mkdir(strDir.c_str(), 0700);
+        m_CreatedDirs[uiDir] = true;
+    }
+
+    ::snprintf(acName, sizeof(acName), "%016llx", static_cast<unsigned long long>(ulHash));
+    string strLocalPath(strDir + acName);
+
+    // resolve hash collisions
+    for (int i(1); m_LocalPaths.find(strLocalPath) != m_LocalPaths.end(); i++)
+    {
+        ::snprintf(acName, sizeof(acName), "%016llx-%d", static_cast<unsigned long long>(ulHash), i);
+        strLocalPath = strDir + acName;
+    }
+
+    return(strLocalPath);
+}
+
+/**
+ * Returns the index entry of the given remote path, creates it if necessary.
+ *
+ * Must be called with m_Mutex locked.
+ *
+ * @param pcPath the path as used on the android device.
+ *
+ * @return iterator pointing to the entry.
+ */
+unordered_map<string, LocalCache::Entry>::iterator LocalCache::find(const char* pcPath)
+{
+    unordered_map<string, Entry>::iterator it(m_Index.find(pcPath));
+    if (it == m_Index.end())
+    {
+        const string strLocalPath(makeLocalPath(pcPath));
+        it = m_Index.insert(make_pair(pcPath, Entry(strLocalPath, m_Lru.insert(m_Lru.end(), pcPath)))).first;
+        m_LocalPaths.insert(strLocalPath);
+    }
+
+    return(it);
+}
+
+/**
+ * Makes the given entry the most recently used one.
+ *
+ * Must be called with m_Mutex locked.
+ *
+ * @param entry the entry accessed.
+ */
+void LocalCache::touch(Entry& entry)
+{
+    m_Lru.splice(m_Lru.end(), m_Lru, entry.lruPos());
+}
+
+/**
+ * Updates the size of the given entry from its local file.
+ *
+ * Must be called with m_Mutex locked.
+ *
+ * @param entry the entry to update.
+ */
+void LocalCache::updateSize(Entry& entry)
+{
+    struct stat statBuf;
+    const unsigned long long ullSize(::stat(entry.localPath().c_str(), &statBuf) == 0 ? statBuf.st_size : 0);
+
+    m_ullBytes = m_ullBytes - entry.size() + ullSize;
+    entry.size(ullSize);
+}
+
+/**
+ * Deletes the local file of the given entry and removes it from the index.
+ *
+ * If the file was linked to a blob and the blob is not linked to any other
+ * file, the blob is deleted too.
+ *
+ * Must be called with m_Mutex locked.
+ *
+ * @param it iterator pointing to the entry to remove.
+ */
+void LocalCache::erase(const unordered_map<string, Entry>::iterator& it)
+{
+    const Entry& entry(it->second);
+
+    ::unlink(entry.localPath().c_str());
+
+    struct stat statBuf;
+    if (!entry.blobPath().empty() && ::stat(entry.blobPath().c_str(), &statBuf) == 0 && statBuf.st_nlink == 1)
+        ::unlink(entry.blobPath().c_str());
+
+    m_ullBytes -= entry.size();
+    m_LocalPaths.erase(entry.localPath());
+    m_Lru.erase(entry.lruPos());
+    m_Index.erase(it);
+}
@@ -0,0 +1,184 @@
+/*
+ * $Id$
+ *
+ * File:   localCache.h
+ * Author: Werner Jaeger
+ *
+ * Copyright 2015 Werner Jaeger.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOCALCACHE_H
+#define LOCALCACHE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <list>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+using namespace std;
+
+/**
+ * Maps paths on the android device to the files caching their content on the
+ * local host.
+ *
+ * Cached files are fanned out over two levels of 256 subdirectories named
+ * by the first four hex digits of a 64 bit hash of the remote path, e.g.
+ * remote path /sdcard/a.txt is cached in root/files/3f/a2/3fa2c51b9e0d4471.
+ * Should two remote paths hash to the same value the later one gets a
+ * numeric suffix, an index maps each remote path to its local file.
+ *
+ * The index also keeps track of the size, the number of open file handles
+ * and unsaved modifications of every cached file and orders the files by
+ * last access, so evict() can delete the least recently used files that are
+ * closed and clean to stay within a disk budget.
+ *
+ * Size and modification time of the remote file a cached file was pulled
+ * from are recorded too, so isCurrent() tells if a cached file can be reused
+ * instead of being pulled again.
+ *
+ * All methods are thread safe.
+ */
+class LocalCache
+{
+public:
+   LocalCache();
+   virtual ~LocalCache();
+
+   void rootDir(const string& strRootDir);
+
+   string localPath(const char* pcPath);
+   bool contains(const char* pcPath) const;
+   void remove(const char* pcPath);
+   void rename(const char* pcFrom, const char* pcTo);
+
+   // file state
+   void opened(const char* pcPath);
+   void released(const char* pcPath);
+   void dirty(const char* pcPath, const bool fDirty);
+   bool dirty(const char* pcPath) const;
+   void blob(const char* pcPath, const string& strBlobPath);
+   void remoteVersion(const char* pcPath, const unsigned long long ullSize, const time_t mtime);
+   bool isCurrent(const char* pcPath, const unsigned long long ullSize, const time_t mtime) const;
+
+   // eviction
+   unsigned long evict(const unsigned long long ullMaxBytes);
+   unsigned long long bytes() const;
+   unsigned long evictions() const;
+
+   static uint64_t hash(const char* pcPath);
+
+private:
+   /**
+    * Represents an entry of LocalCache.
+    */
+   class Entry
+   {
+   public:
+      Entry(const string& strLocalPath, const list<string>::iterator& lruPos) : m_strLocalPath(strLocalPath), m_strBlobPath(), m_ullSize(0), m_uiOpenCount(0), m_fDirty(false), m_fVersionKnown(false), m_ullRemoteSize(0), m_RemoteMtime(0), m_LruPos(lruPos) {}
+
+      /** Virtual destructor. */
+      virtual ~Entry() {}
+
+      // setters
+      void blobPath(const string& strBlobPath) { m_strBlobPath.assign(strBlobPath); }
+      void size(const unsigned long long ullSize) { m_ullSize = ullSize; }
+      void openCount(const unsigned int uiOpenCount) { m_uiOpenCount = uiOpenCount; }
+      void dirty(const bool fDirty) { m_fDirty = fDirty; }
+      void lruPos(const list<string>::iterator& lruPos) { m_LruPos = lruPos; }
+      void remoteVersion(const unsigned long long ullSize, const time_t mtime) { m_fVersionKnown = true; m_ullRemoteSize = ullSize; m_RemoteMtime = mtime; }
+
+      // getters
+      const string& localPath() const { return(m_strLocalPath); }
+      const string& blobPath() const { return(m_strBlobPath); }
+      unsigned long long size() const { return(m_ullSize); }
+      unsigned int openCount() const { return(m_uiOpenCount); }
+      bool dirty() const { return(m_fDirty); }
+      const list<string>::iterator& lruPos() const { return(m_LruPos); }
+
+      /** true if and only if the remote file still has the recorded size and modification time */
+      bool isRemoteVersion(const unsigned long long ullSize, const time_t mtime) const { return(m_fVersionKnown && m_ullRemoteSize == ullSize && m_RemoteMtime == mtime); }
+
+      /** true if and only if the cached file may be deleted by evict() */
+      bool evictable() const { return(m_uiOpenCount == 0 && !m_fDirty); }
+
+   private:
+      string m_strLocalPath;
+
+      /** Blob the cached file is linked to, empty if none */
+      string m_strBlobPath;
+
+      /** Size of the local file when last closed */
+      unsigned long long m_ullSize;
+
+      unsigned int m_uiOpenCount;
+
+      /** true if modified and not yet pushed back to the device */
+      bool m_fDirty;
+
+      /** true if m_ullRemoteSize and m_RemoteMtime have been recorded */
+      bool m_fVersionKnown;
+
+      /** Size of the remote file when pulled or pushed */
+      unsigned long long m_ullRemoteSize;
+
+      /** Modification time of the remote file when pulled or pushed */
+      time_t m_RemoteMtime;
+
+      /** Position in m_Lru */
+      list<string>::iterator m_LruPos;
+   };
+
+   /** Prevent copy-construction */
+   LocalCache(const LocalCache& orig);
+
+   /** Prevent assignment */
+   LocalCache& operator=(const LocalCache& orig);
+
+   string makeLocalPath(const char* pcPath);
+   unordered_map<string, Entry>::iterator find(const char* pcPath);
+   void touch(Entry& entry);
+   void updateSize(Entry& entry);
+   void erase(const unordered_map<string, Entry>::iterator& it);
+
+   /** Directory holding the fanned out subdirectories, ends with a slash */
+   string m_strRootDir;
+
+   /** Key is the remote path */
+   unordered_map<string, Entry> m_Index;
+
+   /** Remote paths in m_Index, least recently used first */
+   list<string> m_Lru;
+
+   /** Paths of all local files in m_Index, used to resolve hash collisions */
+   unordered_set<string> m_LocalPaths;
+
+   /** Subdirectories created so far, index is the 16 bit hash prefix */
+   vector<bool> m_CreatedDirs;
+
+   /** Sum of the sizes of all cached files */
+   unsigned long long m_ullBytes;
+
+   /** Number of files deleted by evict() */
+   unsigned long m_ulEvictions;
+
+   mutable pthread_mutex_t m_Mutex;
+};
+
+#endif /* LOCALCACHE_H */
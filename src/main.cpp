@@ -33,7 +33,9 @@ static struct fuse_operations adbfs_oper;
  */
 int main(const int argc, char** const argv)
 {
-    int iRes(initAdbncFs(argc, argv));
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+    int iRes(initAdbncFs(&args));
 
     if (iRes == 0)
     {
@@ -60,12 +62,14 @@ int main(const int argc, char** const argv)
         adbfs_oper.readlink = adbnc_readlink;
         adbfs_oper.init = adbnc_init;
         adbfs_oper.destroy = adbnc_destroy;
-        iRes = fuse_main(argc, argv, &adbfs_oper, NULL);
+        iRes = fuse_main(args.argc, args.argv, &adbfs_oper, NULL);
     }
 
     if (iRes)
         adbnc_destroy(NULL);
 
+    fuse_opt_free_args(&args);
+
     return(iRes);
 }
 
@@ -28,15 +28,25 @@
 #include "spawn.h"
 
 #include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <spawn.h> // posix_spawn(), src must not be an include directory
 #include <unistd.h>
 #include <sys/wait.h>
 #include <stdexcept>
 
 using namespace std;
 
+/**
+ * Creates a pipe.
+ *
+ * Both ends are closed on exec, so a child process spawned by another thread
+ * at the same time does not inherit them and keep the pipe open, dup2() in
+ * the child's own Spawn clears the flag of its stdin and stdout.
+ */
 Cpipe::Cpipe()
 {
-  if (::pipe(m_aiFd))
+  if (::pipe2(m_aiFd, O_CLOEXEC))
   {
       string strErr("Failed to create pipe. Errno: ");
       strErr += to_string(errno);
@@ -54,10 +64,63 @@ const inline int Cpipe::writeFd() const
   return m_aiFd[1];
 }
 
+/**
+ * Closes the read end, unless closed or released before.
+ *
+ * Each end is closed once only, a second close() could close a descriptor
+ * another thread got the same number for in the meantime.
+ */
+void Cpipe::closeReadFd()
+{
+  if (m_aiFd[0] >= 0)
+    ::close(m_aiFd[0]);
+
+  m_aiFd[0] = -1;
+}
+
+/**
+ * Closes the write end, unless closed or released before.
+ */
+void Cpipe::closeWriteFd()
+{
+  if (m_aiFd[1] >= 0)
+    ::close(m_aiFd[1]);
+
+  m_aiFd[1] = -1;
+}
+
+/**
+ * Hands the read end over to the caller, it is not closed by this pipe
+ * anymore.
+ *
+ * @return the read end.
+ */
+int Cpipe::releaseReadFd()
+{
+  const int iFd(m_aiFd[0]);
+  m_aiFd[0] = -1;
+
+  return(iFd);
+}
+
+/**
+ * Hands the write end over to the caller, it is not closed by this pipe
+ * anymore.
+ *
+ * @return the write end.
+ */
+int Cpipe::releaseWriteFd()
+{
+  const int iFd(m_aiFd[1]);
+  m_aiFd[1] = -1;
+
+  return(iFd);
+}
+
 void Cpipe::close()
 {
-  ::close(m_aiFd[0]);
-  ::close(m_aiFd[1]);
+  closeReadFd();
+  closeWriteFd();
 }
 
 Cpipe::~Cpipe()
@@ -68,6 +131,10 @@ Cpipe::~Cpipe()
 /**
  * Spawns a child process.
  *
+ * The child is created with posix_spawn(), which does not copy the page
+ * tables of this process like fork() does, so spawning does not get slower
+ * the more memory the caches use.
+ *
  * @param argv an array of pointers to null-terminated strings that represent
  *        the argument list available to the new program. The first argument,
  *        by convention, must point to the filename associated with the file
@@ -86,58 +153,41 @@ Cpipe::~Cpipe()
  */
 Spawn::Spawn(const char* const argv[], bool fUseStdErr, bool fWithPath, const char* const envp[]): m_iChildPid(-1), m_pWriteBuf(NULL), m_pReadBuf(NULL), stdin(NULL), stdout(NULL), m_WritePipe(), m_ReadPipe()
 {
-    m_iChildPid = ::fork();
-    if (m_iChildPid == -1)
-        throw runtime_error("Failed to start child process");
-
-    if (m_iChildPid == 0)
-    {
-        // In child process
-        ::dup2(m_WritePipe.readFd(), STDIN_FILENO);
-
-        if (fUseStdErr)
-            ::dup2(m_ReadPipe.writeFd(), STDERR_FILENO);
-        else
-            ::dup2(m_ReadPipe.writeFd(), STDOUT_FILENO);
+    // all pipe ends are closed on exec, dup2() clears the flag of the
+    // duplicates
+    posix_spawn_file_actions_t fileActions;
+    ::posix_spawn_file_actions_init(&fileActions);
+    ::posix_spawn_file_actions_adddup2(&fileActions, m_WritePipe.readFd(), STDIN_FILENO);
+    ::posix_spawn_file_actions_adddup2(&fileActions, m_ReadPipe.writeFd(), fUseStdErr ? STDERR_FILENO : STDOUT_FILENO);
 
-        m_WritePipe.close();
-        m_ReadPipe.close();
+    char* const* const ppcArgv(const_cast<char* const*>(argv));
+    char* const* const ppcEnvp(envp ? const_cast<char* const*>(envp) : environ);
 
-        int iRes;
-        if (fWithPath)
-        {
-            if (envp != 0)
-                iRes = ::execvpe(argv[0], const_cast<char* const*>(argv), const_cast<char* const*>(envp));
-            else
-                iRes = ::execvp(argv[0], const_cast<char* const*>(argv));
-        }
-        else
-        {
-            if (envp != 0)
-                iRes = ::execve(argv[0], const_cast<char* const*>(argv), const_cast<char* const*>(envp));
-            else
-                iRes = ::execv(argv[0], const_cast<char* const*>(argv));
-        }
+    int iRes;
+    if (fWithPath)
+        iRes = ::posix_spawnp(&m_iChildPid, argv[0], &fileActions, NULL, ppcArgv, ppcEnvp);
+    else
+        iRes = ::posix_spawn(&m_iChildPid, argv[0], &fileActions, NULL, ppcArgv, ppcEnvp);
 
-        if (iRes == -1)
-        {
-            if (fUseStdErr)
-                cout << "Error: Failed to launch program \"" << argv[0] << "\" Error: " << to_string(errno) << endl;
-            else
-                cerr << "Error: Failed to launch program \"" << argv[0] << "\" Error: " << to_string(errno) << endl;
+    ::posix_spawn_file_actions_destroy(&fileActions);
 
-            ::exit(errno);
-        }
-    }
-    else
+    if (iRes)
     {
-        ::close(m_WritePipe.readFd());
-        ::close(m_ReadPipe.writeFd());
-        m_pWriteBuf = new __gnu_cxx::stdio_filebuf<char>(m_WritePipe.writeFd(), ios::out);
-        m_pReadBuf = new __gnu_cxx::stdio_filebuf<char>(m_ReadPipe.readFd(), ios::in);
-        stdin.rdbuf(m_pWriteBuf);
-        stdout.rdbuf(m_pReadBuf);
+        m_iChildPid = -1;
+
+        string strErr("Failed to launch program \"");
+        strErr.append(argv[0]).append("\" Error: ").append(to_string(iRes));
+        throw runtime_error(strErr);
     }
+
+    m_WritePipe.closeReadFd();
+    m_ReadPipe.closeWriteFd();
+
+    // the buffers close the remaining ends
+    m_pWriteBuf = new __gnu_cxx::stdio_filebuf<char>(m_WritePipe.releaseWriteFd(), ios::out);
+    m_pReadBuf = new __gnu_cxx::stdio_filebuf<char>(m_ReadPipe.releaseReadFd(), ios::in);
+    stdin.rdbuf(m_pWriteBuf);
+    stdout.rdbuf(m_pReadBuf);
 }
 
 Spawn::~Spawn()
@@ -186,4 +236,131 @@ int Spawn::wait()
     return(iStatus);
 }
 
+/**
+ * Returns microseconds since some unspecified starting point.
+ */
+static unsigned long long monotonicMicros()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+
+/**
+ * Constructor.
+ *
+ * @param uiLimit the maximum number of child processes running at the same
+ *        time, 0 for no limit.
+ */
+SpawnQueue::SpawnQueue(unsigned int uiLimit) : m_uiLimit(uiLimit), m_uiRunning(0), m_ulSpawns(0), m_ulWaits(0), m_ullWaitMicros(0), m_ullMaxWaitMicros(0), m_ullSpawnMicros(0)
+{
+    m_aulNext[0] = m_aulNext[1] = 0;
+    m_aulServing[0] = m_aulServing[1] = 0;
+
+    ::pthread_mutex_init(&m_Mutex, NULL);
+    ::pthread_cond_init(&m_Cond, NULL);
+}
+
+SpawnQueue::~SpawnQueue()
+{
+    ::pthread_mutex_destroy(&m_Mutex);
+    ::pthread_cond_destroy(&m_Cond);
+}
+
+/**
+ * Sets the maximum number of child processes running at the same time.
+ *
+ * @param uiLimit the maximum, 0 for no limit.
+ */
+void SpawnQueue::limit(unsigned int uiLimit)
+{
+    ::pthread_mutex_lock(&m_Mutex);
+    m_uiLimit = uiLimit;
+    ::pthread_cond_broadcast(&m_Cond);
+    ::pthread_mutex_unlock(&m_Mutex);
+}
+
+/**
+ * Waits for a free slot and takes it.
+ *
+ * @param fUrgent if true the caller is served before all callers not urgent.
+ */
+void SpawnQueue::acquire(bool fUrgent)
+{
+    const int iPriority(fUrgent ? 0 : 1);
+    const unsigned long long ullStart(monotonicMicros());
+    bool fWaited(false);
+
+    ::pthread_mutex_lock(&m_Mutex);
+
+    const unsigned long ulTicket(m_aulNext[iPriority]++);
+    while (!mayRun(iPriority, ulTicket))
+    {
+        fWaited = true;
+        ::pthread_cond_wait(&m_Cond, &m_Mutex);
+    }
+
+    m_aulServing[iPriority]++;
+    m_uiRunning++;
+
+    // the next ticket may be served too
+    if (m_aulNext[0] != m_aulServing[0] || m_aulNext[1] != m_aulServing[1])
+        ::pthread_cond_broadcast(&m_Cond);
+
+    ::pthread_mutex_unlock(&m_Mutex);
+
+    m_ulSpawns++;
+    if (fWaited)
+    {
+        const unsigned long long ullWait(monotonicMicros() - ullStart);
+
+        m_ulWaits++;
+        m_ullWaitMicros += ullWait;
+
+        unsigned long long ullMax(m_ullMaxWaitMicros);
+        while (ullWait > ullMax && !m_ullMaxWaitMicros.compare_exchange_weak(ullMax, ullWait));
+    }
+}
+
+/**
+ * Records the time it took to spawn the child process of an acquired slot.
+ *
+ * @param ullMicros the microseconds spent spawning.
+ */
+void SpawnQueue::spawned(unsigned long long ullMicros)
+{
+    m_ullSpawnMicros += ullMicros;
+}
+
+/**
+ * Frees a slot taken by acquire().
+ */
+void SpawnQueue::release()
+{
+    ::pthread_mutex_lock(&m_Mutex);
+    m_uiRunning--;
+    ::pthread_cond_broadcast(&m_Cond);
+    ::pthread_mutex_unlock(&m_Mutex);
+}
+
+/**
+ * Tells whether a ticket may take a slot now, #m_Mutex must be held.
+ *
+ * @param iPriority 0 if the ticket is urgent, 1 otherwise.
+ * @param ulTicket the ticket.
+ *
+ * @return true if a slot is free, the ticket is the next one of its
+ *         priority and, if not urgent, no urgent ticket is waiting.
+ */
+bool SpawnQueue::mayRun(int iPriority, unsigned long ulTicket) const
+{
+    if (m_uiLimit && m_uiRunning >= m_uiLimit)
+        return(false);
+
+    if (ulTicket != m_aulServing[iPriority])
+        return(false);
+
+    return(iPriority == 0 || m_aulServing[0] == m_aulNext[0]);
+}
+
 #endif /* SPAWN_CPP */
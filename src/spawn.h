@@ -26,8 +26,10 @@
 #define SPAWN_H
 
 #include <ext/stdio_filebuf.h> // NB: Specific to libstdc++
+#include <pthread.h>
 #include <iostream>
 #include <fstream>
+#include <atomic>
 
 /** Wrapping pipe in a class makes sure they are closed when we leave scope. */
 class Cpipe
@@ -39,6 +41,10 @@ public:
 
    const inline int readFd() const;
    const inline int writeFd() const;
+   void closeReadFd();
+   void closeWriteFd();
+   int releaseReadFd();
+   int releaseWriteFd();
    void close();
 
 private:
@@ -101,5 +107,86 @@ private:
     Cpipe m_ReadPipe;
 };
 
+/**
+ * Limits the number of child processes running at the same time.
+ *
+ * A caller acquire()s a slot before spawning a child process and release()s
+ * it once the child terminated. If all slots are taken the caller waits, urgent
+ * callers are served before all others, callers of the same urgency in the
+ * order they arrived.
+ *
+ * Usage:
+ *    queue.acquire(fUrgent);
+ *    Spawn s(argv);
+ *    queue.spawned(microseconds it took to construct s);
+ *    ...
+ *    s.wait();
+ *    queue.release();
+ */
+class SpawnQueue
+{
+public:
+    SpawnQueue(unsigned int uiLimit = 0);
+    virtual ~SpawnQueue();
+
+    // getters
+    unsigned int limit() const { return(m_uiLimit); }
+    unsigned long spawns() const { return(m_ulSpawns); }
+    unsigned long waits() const { return(m_ulWaits); }
+    unsigned long long waitMicros() const { return(m_ullWaitMicros); }
+    unsigned long long maxWaitMicros() const { return(m_ullMaxWaitMicros); }
+    unsigned long long spawnMicros() const { return(m_ullSpawnMicros); }
+
+    // setters
+    void limit(unsigned int uiLimit);
+
+    // operations
+    void acquire(bool fUrgent);
+    void spawned(unsigned long long ullMicros);
+    void release();
+
+private:
+    /** Prevent copy-construction */
+    SpawnQueue(const SpawnQueue& orig);
+
+    /** Prevent assignment */
+    SpawnQueue& operator=(const SpawnQueue& orig);
+
+    bool mayRun(int iPriority, unsigned long ulTicket) const;
+
+    /** Maximum number of slots taken at the same time, 0 for no limit */
+    unsigned int m_uiLimit;
+
+    /** Number of slots taken */
+    unsigned int m_uiRunning;
+
+    /** Next ticket to hand out, per priority, urgent first */
+    unsigned long m_aulNext[2];
+
+    /** Ticket to be served next, per priority, urgent first */
+    unsigned long m_aulServing[2];
+
+    /** Number of slots acquired */
+    std::atomic<unsigned long> m_ulSpawns;
+
+    /** Number of slots acquired after waiting */
+    std::atomic<unsigned long> m_ulWaits;
+
+    /** Microseconds waited for slots in total */
+    std::atomic<unsigned long long> m_ullWaitMicros;
+
+    /** Longest wait for a slot in microseconds */
+    std::atomic<unsigned long long> m_ullMaxWaitMicros;
+
+    /** Microseconds spent spawning child processes in total */
+    std::atomic<unsigned long long> m_ullSpawnMicros;
+
+    /** Guards #m_uiLimit, #m_uiRunning, #m_aulNext and #m_aulServing */
+    pthread_mutex_t m_Mutex;
+
+    /** Broadcast when a slot may have become available */
+    pthread_cond_t m_Cond;
+};
+
 #endif /* SPAWN_H */
 
@@ -21,15 +21,34 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <fstream>
+#include <algorithm>
+#include <sys/stat.h>
 #include "testAdbncFileSystem.h"
 #include "adbncfs.h"
+#include "spawn.h"
 
 using namespace std;
 
 // Forward declarations for static function in adbncfs.cpp.
 extern vector<string> tokenize(const string& strData);
-void stringReplacer(string& strSource, const string& strFind, const string& strReplace);
 string parent(const string& strPath);
+string extension(const string& strPath);
+bool isCompressedFormat(const string& strPath);
+bool isCompressibleFormat(const string& strPath);
+double estimateCompressionRatio(const char* pcData, const size_t uiSize);
+bool linkFromBlobStore(const string& strBlobPath, const string& strLocalPath);
+int unshareLocalFile(const string& strLocalPath);
+int parseStatOutput(const deque<string>& output, struct stat* pStatBuf);
+int parseStatListing(const string& strPrefix, const deque<string>& output, deque<string>* pNames, map<string, struct stat>* pAttributes);
+deque<string> statListingCommands(const string& strPrefix, const deque<string>& names);
+int parseStatFsOutput(const deque<string>& output, struct statvfs* pFst);
+int parseCommandResult(const deque<string>& output);
+bool parseWatchEvent(const string& strLine, string* pstrEvents, string* pstrDir, string* pstrName);
+bool hasFuseOption(const struct fuse_args* pArgs, const char *pcName);
 
 CPPUNIT_TEST_SUITE_REGISTRATION(testAdbncFileSystem);
 
@@ -59,13 +78,6 @@ void testAdbncFileSystem::testTokenize()
     CPPUNIT_ASSERT(tokens[2] == "ghi");
 }
 
-void testAdbncFileSystem::testStringReplacer()
-{
-    string strTestee("/storage/extSdCard/test1/test1.txt");
-    stringReplacer(strTestee, "/", "-");
-    CPPUNIT_ASSERT(strTestee == "-storage-extSdCard-test1-test1.txt");
-}
-
 void testAdbncFileSystem::testParent()
 {
     const string str1("/usr/lib");
@@ -84,3 +96,336 @@ void testAdbncFileSystem::testParent()
     CPPUNIT_ASSERT(parent(str6) == ".");
     CPPUNIT_ASSERT(parent(str7) == ".");
 }
+
+void testAdbncFileSystem::testExtension()
+{
+    CPPUNIT_ASSERT(extension("/sdcard/DCIM/IMG_0001.JPG") == "jpg");
+    CPPUNIT_ASSERT(extension("/sdcard/backup.tar.gz") == "gz");
+    CPPUNIT_ASSERT(extension("/sdcard/.bashrc") == "");
+    CPPUNIT_ASSERT(extension(".bashrc") == "");
+    CPPUNIT_ASSERT(extension("/sdcard/my.dir/README") == "");
+    CPPUNIT_ASSERT(extension("notes.txt") == "txt");
+}
+
+void testAdbncFileSystem::testCompressionFormats()
+{
+    CPPUNIT_ASSERT(isCompressedFormat("/sdcard/DCIM/IMG_0001.jpg"));
+    CPPUNIT_ASSERT(isCompressedFormat("/sdcard/Movies/clip.MP4"));
+    CPPUNIT_ASSERT(!isCompressedFormat("/sdcard/log/main.log"));
+    CPPUNIT_ASSERT(isCompressibleFormat("/data/data/app/databases/app.db"));
+    CPPUNIT_ASSERT(isCompressibleFormat("/sdcard/config.json"));
+    CPPUNIT_ASSERT(!isCompressibleFormat("/sdcard/unknown.bin"));
+    CPPUNIT_ASSERT(!isCompressibleFormat("/sdcard/.json"));
+}
+
+void testAdbncFileSystem::testEstimateCompressionRatio()
+{
+    const string strText("2015-11-17 13:28:00 I/adbncfs: some log line repeated over and over\n");
+    string strLog;
+    while (strLog.size() < 4096)
+        strLog.append(strText);
+
+    string strRandom(4096, '\0');
+    unsigned int uiSeed(42);
+    for (size_t i(0); i < strRandom.size(); i++)
+        strRandom[i] = static_cast<char>(::rand_r(&uiSeed) & 0xff);
+
+    CPPUNIT_ASSERT(estimateCompressionRatio(strLog.data(), strLog.size()) < 0.8);
+    CPPUNIT_ASSERT(estimateCompressionRatio(strRandom.data(), strRandom.size()) > 0.9);
+    CPPUNIT_ASSERT(estimateCompressionRatio(strLog.data(), 0) == 1.0);
+}
+
+void testAdbncFileSystem::testBlobStoreLinks()
+{
+    char acDir[] = "/tmp/adbncfs-test-XXXXXX";
+    CPPUNIT_ASSERT(::mkdtemp(acDir) != NULL);
+
+    const string strBlob(string(acDir) + "/blob");
+    const string strLocal(string(acDir) + "/-sdcard-a.jpg");
+    ofstream(strBlob.c_str()) << "content";
+    ofstream(strLocal.c_str()) << "stale";
+
+    struct stat statBuf;
+    CPPUNIT_ASSERT(linkFromBlobStore(strBlob, strLocal));
+    CPPUNIT_ASSERT(::stat(strBlob.c_str(), &statBuf) == 0 && statBuf.st_nlink == 2);
+
+    CPPUNIT_ASSERT(unshareLocalFile(strLocal) == 0);
+    CPPUNIT_ASSERT(::stat(strBlob.c_str(), &statBuf) == 0 && statBuf.st_nlink == 1);
+
+    ofstream(strLocal.c_str()) << "modified";
+    string strContent;
+    ifstream(strBlob.c_str()) >> strContent;
+    CPPUNIT_ASSERT(strContent == "content");
+
+    ::unlink(strBlob.c_str());
+    ::unlink(strLocal.c_str());
+    ::rmdir(acDir);
+}
+
+void testAdbncFileSystem::testParseStatOutput()
+{
+    struct stat statBuf;
+
+    // file name with blanks, split over two lines
+    deque<string> output;
+    output.push_back("/sdcard/My Photos/IMG 0001.jpg 2811392 5496 81b0 1023 1028 ");
+    output.push_back("1c 53825 1 0 0 1448450001 1448450002 1448450003 4096");
+
+    CPPUNIT_ASSERT(parseStatOutput(output, &statBuf) == 0);
+    CPPUNIT_ASSERT(statBuf.st_size == 2811392);
+    CPPUNIT_ASSERT(statBuf.st_blocks == 5496);
+    CPPUNIT_ASSERT(statBuf.st_mode == 0x81b0);
+    CPPUNIT_ASSERT(statBuf.st_uid == 1023 && statBuf.st_gid == 1028);
+    CPPUNIT_ASSERT(statBuf.st_rdev == 0x1c);
+    CPPUNIT_ASSERT(statBuf.st_ino == 53825);
+    CPPUNIT_ASSERT(statBuf.st_nlink == 1);
+    CPPUNIT_ASSERT(statBuf.st_atime == 1448450001 && statBuf.st_mtime == 1448450002 && statBuf.st_ctime == 1448450003);
+    CPPUNIT_ASSERT(statBuf.st_blksize == 4096);
+
+    CPPUNIT_ASSERT(parseStatOutput(deque<string>(), &statBuf) == -ENOENT);
+    CPPUNIT_ASSERT(parseStatOutput(deque<string>(1, "stat: can't stat '/x': No such file or directory"), &statBuf) == -ENOENT);
+
+    // truncated line, 13 and 14 tokens
+    CPPUNIT_ASSERT(parseStatOutput(deque<string>(1, "/x 0 0 81b0 1023 1028 1c 3 1 0 0 1448450000 1448450000"), &statBuf) == -ENOENT);
+    CPPUNIT_ASSERT(parseStatOutput(deque<string>(1, "/x 0 0 81b0 1023 1028 1c 3 1 0 0 1448450000 1448450000 1448450000"), &statBuf) == -ENOENT);
+    CPPUNIT_ASSERT(parseStatOutput(deque<string>(1, "/x 1 2 zz 4 5 6 7 8 9 10 11 12 13 14"), &statBuf) == -EIO);
+}
+
+void testAdbncFileSystem::testParseStatFsOutput()
+{
+    struct statvfs fst;
+
+    CPPUNIT_ASSERT(parseStatFsOutput(deque<string>(1, "4096 32768 3092043 1524383 1520287 786432 770345 255"), &fst) == 0);
+    CPPUNIT_ASSERT(fst.f_frsize == 4096 && fst.f_bsize == 32768);
+    CPPUNIT_ASSERT(fst.f_blocks == 3092043 && fst.f_bfree == 1524383 && fst.f_bavail == 1520287);
+    CPPUNIT_ASSERT(fst.f_files == 786432 && fst.f_ffree == 770345 && fst.f_favail == 770345);
+    CPPUNIT_ASSERT(fst.f_namemax == 255);
+
+    CPPUNIT_ASSERT(parseStatFsOutput(deque<string>(), &fst) == -EIO);
+    CPPUNIT_ASSERT(parseStatFsOutput(deque<string>(1, "stat: can't stat '/x': No such file or directory"), &fst) == -EIO);
+    CPPUNIT_ASSERT(parseStatFsOutput(deque<string>(1, "4096 4096 zz 1 1 1 1 255"), &fst) == -EIO);
+}
+
+void testAdbncFileSystem::testParseCommandResult()
+{
+    CPPUNIT_ASSERT(parseCommandResult(deque<string>(1, "---ok---")) == 0);
+    CPPUNIT_ASSERT(parseCommandResult(deque<string>(1, "rm: can't remove '/system/app': Read-only file system")) == -EROFS);
+    CPPUNIT_ASSERT(parseCommandResult(deque<string>(1, "mkdir: can't create directory '/x': Permission denied")) == -EACCES);
+    CPPUNIT_ASSERT(parseCommandResult(deque<string>(1, "rmdir: '/sdcard/DCIM': Directory not empty")) == -ENOTEMPTY);
+    CPPUNIT_ASSERT(parseCommandResult(deque<string>(1, "mv: can't rename '/a': No such file or directory")) == -ENOENT);
+    CPPUNIT_ASSERT(parseCommandResult(deque<string>(1, "something unexpected")) == -EIO);
+
+    // netcat gone
+    CPPUNIT_ASSERT(parseCommandResult(deque<string>()) == -EIO);
+}
+
+void testAdbncFileSystem::testParseStatListing()
+{
+    deque<string> names;
+    map<string, struct stat> attributes;
+
+    deque<string> output;
+    output.push_back("/sdcard/DCIM/. 4096 8 41f9 0 1028 1c 2 1 0 0 1448450000 1448450010 1448450010 4096");
+    output.push_back("/sdcard/DCIM/.. 4096 8 41f9 0 1028 1c 1 1 0 0 1448450000 1448450000 1448450000 4096");
+    output.push_back("/sdcard/DCIM/. 4096 8 41f9 0 1028 1c 2 1 0 0 1448450000 1448450010 1448450010 4096");
+    output.push_back("/sdcard/DCIM/.nomedia 0 0 81b0 1023 1028 1c 3 1 0 0 1448450000 1448450000 1448450000 4096");
+    output.push_back("/sdcard/DCIM/IMG 0001.jpg 2811392 5496 81b0 1023 1028 ");
+    output.push_back("1c 53825 1 0 0 1448450001 1448450002 1448450003 4096");
+    output.push_back("/sdcard/DCIM/-rf 1 8 81b0 1023 1028 1c 4 1 0 0 1448450000 1448450000 1448450000 4096");
+
+    // not an entry of the directory
+    output.push_back("/sdcard/Music 4096 8 41f9 0 1028 1c 5 1 0 0 1448450000 1448450000 1448450000 4096");
+
+    CPPUNIT_ASSERT(parseStatListing("/sdcard/DCIM/", output, &names, &attributes) == 0);
+    CPPUNIT_ASSERT(names.size() == 5);
+    CPPUNIT_ASSERT(names[0] == "." && names[1] == "..");
+    CPPUNIT_ASSERT(names[2] == ".nomedia" && names[3] == "IMG 0001.jpg" && names[4] == "-rf");
+    CPPUNIT_ASSERT(attributes["."].st_mtime == 1448450010);
+    CPPUNIT_ASSERT(attributes["IMG 0001.jpg"].st_size == 2811392);
+    CPPUNIT_ASSERT(attributes["IMG 0001.jpg"].st_mode == 0x81b0);
+
+    // an empty directory, the glob patterns did not match
+    output.clear();
+    output.push_back("/sdcard/DCIM/. 4096 8 41f9 0 1028 1c 2 1 0 0 1448450000 1448450010 1448450010 4096");
+    output.push_back("/sdcard/DCIM/.. 4096 8 41f9 0 1028 1c 1 1 0 0 1448450000 1448450000 1448450000 4096");
+    CPPUNIT_ASSERT(parseStatListing("/sdcard/DCIM/", output, &names, &attributes) == 0);
+    CPPUNIT_ASSERT(names.size() == 2);
+
+    // the root directory
+    output.clear();
+    output.push_back("/. 4096 8 41ed 0 0 1c 1 1 0 0 1448450000 1448450010 1448450010 4096");
+    output.push_back("/.. 4096 8 41ed 0 0 1c 1 1 0 0 1448450000 1448450010 1448450010 4096");
+    output.push_back("/sdcard 4096 8 41f9 0 1028 1c 2 1 0 0 1448450000 1448450010 1448450010 4096");
+    CPPUNIT_ASSERT(parseStatListing("/", output, &names, &attributes) == 0);
+    CPPUNIT_ASSERT(names.size() == 3 && names[2] == "sdcard");
+
+    // the directory does not exist
+    CPPUNIT_ASSERT(parseStatListing("/sdcard/DCIM/", deque<string>(), &names, &attributes) == -ENOENT);
+    CPPUNIT_ASSERT(names.empty());
+}
+
+void testAdbncFileSystem::testStatListingCommands()
+{
+    // ls -1a output of a directory too large for a single argument list
+    deque<string> lsOutput;
+    lsOutput.push_back(".");
+    lsOutput.push_back("..");
+    char acName[32];
+    for (int i = 0; i < 20000; i++)
+    {
+        ::snprintf(acName, sizeof(acName), "IMG %05d.jpg", i);
+        lsOutput.push_back(acName);
+    }
+
+    const deque<string> commands(statListingCommands("/sdcard/DCIM/", lsOutput));
+    CPPUNIT_ASSERT(commands.size() > 1);
+
+    size_t uiArgs(0);
+    for (deque<string>::const_iterator it(commands.begin()); it != commands.end(); ++it)
+    {
+        CPPUNIT_ASSERT(it->length() <= 64 * 1024);
+        CPPUNIT_ASSERT(it->compare(0, 11, "stat -t -- ") == 0);
+        uiArgs += count(it->begin(), it->end(), '\'') / 2;
+    }
+    CPPUNIT_ASSERT(uiArgs == lsOutput.size());
+    CPPUNIT_ASSERT(commands.front().find(" '/sdcard/DCIM/.' '/sdcard/DCIM/..' '/sdcard/DCIM/IMG 00000.jpg'") != string::npos);
+
+    // the output of all batches put together is parsed like a single listing
+    deque<string> output;
+    for (deque<string>::const_iterator it(lsOutput.begin()); it != lsOutput.end(); ++it)
+        output.push_back("/sdcard/DCIM/" + *it + " 1 8 81b0 1023 1028 1c 4 1 0 0 1448450000 1448450000 1448450000 4096");
+
+    deque<string> names;
+    map<string, struct stat> attributes;
+    CPPUNIT_ASSERT(parseStatListing("/sdcard/DCIM/", output, &names, &attributes) == 0);
+    CPPUNIT_ASSERT(names.size() == lsOutput.size() && names[0] == "." && names[2] == "IMG 00000.jpg");
+
+    CPPUNIT_ASSERT(statListingCommands("/sdcard/DCIM/", deque<string>()).empty());
+}
+
+void testAdbncFileSystem::testParseWatchEvent()
+{
+    string strEvents, strDir, strName;
+
+    CPPUNIT_ASSERT(parseWatchEvent("n\t/sdcard/DCIM\tIMG 0001.jpg", &strEvents, &strDir, &strName));
+    CPPUNIT_ASSERT(strEvents == "n" && strDir == "/sdcard/DCIM" && strName == "IMG 0001.jpg");
+
+    // an event of the watched directory itself
+    CPPUNIT_ASSERT(parseWatchEvent("xu\t/sdcard/DCIM", &strEvents, &strDir, &strName));
+    CPPUNIT_ASSERT(strEvents == "xu" && strDir == "/sdcard/DCIM" && strName.empty());
+
+    CPPUNIT_ASSERT(!parseWatchEvent("", &strEvents, &strDir, &strName));
+    CPPUNIT_ASSERT(!parseWatchEvent("inotifyd: applet not found", &strEvents, &strDir, &strName));
+    CPPUNIT_ASSERT(!parseWatchEvent("\t/sdcard", &strEvents, &strDir, &strName));
+}
+
+void testAdbncFileSystem::testHasFuseOption()
+{
+    char acProg[] = "adbncfs";
+    char acMountPoint[] = "/mnt";
+    char acO[] = "-o";
+    char acOptions[] = "allow_other,ac_attr_timeout=5,negative_timeout=0";
+    char acJoined[] = "-oentry_timeout=2";
+    char* argv[] = { acProg, acMountPoint, acO, acOptions, acJoined, NULL };
+    const struct fuse_args args = FUSE_ARGS_INIT(5, argv);
+
+    CPPUNIT_ASSERT(hasFuseOption(&args, "allow_other"));
+    CPPUNIT_ASSERT(hasFuseOption(&args, "negative_timeout"));
+    CPPUNIT_ASSERT(hasFuseOption(&args, "entry_timeout"));
+    CPPUNIT_ASSERT(!hasFuseOption(&args, "attr_timeout"));
+    CPPUNIT_ASSERT(!hasFuseOption(&args, "allow"));
+}
+
+/**
+ * Argument of spawnQueueThread().
+ */
+struct SpawnQueueArg
+{
+    SpawnQueue* pSpawnQueue;
+    bool fUrgent;
+    std::atomic<int>* piServed;
+    int iServedAs;
+};
+
+static void* spawnQueueThread(void* pvArg)
+{
+    SpawnQueueArg* pArg(static_cast<SpawnQueueArg*>(pvArg));
+
+    pArg->pSpawnQueue->acquire(pArg->fUrgent);
+    pArg->iServedAs = (*pArg->piServed)++;
+    pArg->pSpawnQueue->release();
+
+    return(NULL);
+}
+
+void testAdbncFileSystem::testSpawnQueue()
+{
+    SpawnQueue spawnQueue(1);
+    std::atomic<int> iServed(0);
+    pthread_t threads[3];
+    SpawnQueueArg args[3];
+
+    for (int i = 0; i < 3; i++)
+    {
+        args[i].pSpawnQueue = &spawnQueue;
+        args[i].fUrgent = i == 2;
+        args[i].piServed = &iServed;
+        args[i].iServedAs = -1;
+    }
+
+    // take the only slot
+    spawnQueue.acquire(true);
+
+    // give each caller time to queue up
+    for (int i = 0; i < 3; i++)
+    {
+        CPPUNIT_ASSERT(::pthread_create(&threads[i], NULL, spawnQueueThread, &args[i]) == 0);
+        ::usleep(50000);
+    }
+
+    CPPUNIT_ASSERT(iServed == 0);
+
+    spawnQueue.release();
+    for (int i = 0; i < 3; i++)
+        ::pthread_join(threads[i], NULL);
+
+    // the urgent caller first, the others in the order they arrived
+    CPPUNIT_ASSERT(args[2].iServedAs == 0);
+    CPPUNIT_ASSERT(args[0].iServedAs == 1);
+    CPPUNIT_ASSERT(args[1].iServedAs == 2);
+
+    CPPUNIT_ASSERT(spawnQueue.spawns() == 4);
+    CPPUNIT_ASSERT(spawnQueue.waits() == 3);
+    CPPUNIT_ASSERT(spawnQueue.maxWaitMicros() >= 50000);
+    CPPUNIT_ASSERT(spawnQueue.waitMicros() >= spawnQueue.maxWaitMicros());
+
+    // no limit
+    spawnQueue.limit(0);
+    spawnQueue.acquire(false);
+    spawnQueue.acquire(false);
+    spawnQueue.release();
+    spawnQueue.release();
+    CPPUNIT_ASSERT(spawnQueue.waits() == 3);
+}
+
+void testAdbncFileSystem::testSpawnClosesOnce()
+{
+    int aiFd[2];
+    {
+        const char* const argv[] = { "true", NULL };
+        Spawn cmd(argv, false, true);
+
+        // gets the numbers of the pipe ends cmd passed to the child
+        CPPUNIT_ASSERT(::pipe(aiFd) == 0);
+
+        cmd.sendEof();
+        cmd.wait();
+    }
+
+    // still open after cmd is gone
+    CPPUNIT_ASSERT(::fcntl(aiFd[0], F_GETFD) != -1);
+    CPPUNIT_ASSERT(::fcntl(aiFd[1], F_GETFD) != -1);
+
+    ::close(aiFd[0]);
+    ::close(aiFd[1]);
+}
@@ -31,8 +31,20 @@ class testAdbncFileSystem : public CPPUNIT_NS::TestFixture
    CPPUNIT_TEST_SUITE(testAdbncFileSystem);
 
    CPPUNIT_TEST(testTokenize);
-   CPPUNIT_TEST(testStringReplacer);
    CPPUNIT_TEST(testParent);
+   CPPUNIT_TEST(testExtension);
+   CPPUNIT_TEST(testCompressionFormats);
+   CPPUNIT_TEST(testEstimateCompressionRatio);
+   CPPUNIT_TEST(testBlobStoreLinks);
+   CPPUNIT_TEST(testParseStatOutput);
+   CPPUNIT_TEST(testParseStatListing);
+   CPPUNIT_TEST(testStatListingCommands);
+   CPPUNIT_TEST(testParseStatFsOutput);
+   CPPUNIT_TEST(testParseCommandResult);
+   CPPUNIT_TEST(testParseWatchEvent);
+   CPPUNIT_TEST(testHasFuseOption);
+   CPPUNIT_TEST(testSpawnQueue);
+   CPPUNIT_TEST(testSpawnClosesOnce);
 
    CPPUNIT_TEST_SUITE_END();
 
@@ -44,8 +56,20 @@ public:
 
 private:
    void testTokenize();
-   void testStringReplacer();
    void testParent();
+   void testExtension();
+   void testCompressionFormats();
+   void testEstimateCompressionRatio();
+   void testBlobStoreLinks();
+   void testParseStatOutput();
+   void testParseStatListing();
+   void testStatListingCommands();
+   void testParseStatFsOutput();
+   void testParseCommandResult();
+   void testParseWatchEvent();
+   void testHasFuseOption();
+   void testSpawnQueue();
+   void testSpawnClosesOnce();
 };
 
 #endif /* TESTADBNCSFILESYSTEM_H */
@@ -0,0 +1,682 @@
+/*
+ * $Id$
+ *
+ * File:   testFileCache.cpp
+ * Author: Werner Jaeger
+ *
+ * Copyright 2015 Werner Jaeger.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sstream>
+#include <pthread.h>
+#include <atomic>
+#include <algorithm>
+#include "testFileCache.h"
+
+CPPUNIT_TEST_SUITE_REGISTRATION(testFileCache);
+
+/** Number of threads hammering the cache in testConcurrentAccess() */
+static const int iNumThreads(32);
+
+/** Number of operations per thread in testConcurrentAccess() */
+static const int iNumOperations(20000);
+
+/** Number of distinct paths used in testConcurrentAccess() */
+static const int iNumPaths(256);
+
+testFileCache::testFileCache()
+{
+}
+
+testFileCache::~testFileCache()
+{
+}
+
+void testFileCache::setUp()
+{
+}
+
+void testFileCache::tearDown()
+{
+}
+
+/**
+ * Returns attributes with the given size, used to tell entries apart.
+ */
+static struct stat attributes(const off_t size)
+{
+    struct stat statBuf;
+    ::memset(&statBuf, 0, sizeof(statBuf));
+    statBuf.st_mode = S_IFREG | 0660;
+    statBuf.st_size = size;
+    return(statBuf);
+}
+
+void testFileCache::testPutGet()
+{
+    FileCache cache;
+    deque<string> output;
+    struct stat statBuf;
+
+    CPPUNIT_ASSERT(!cache.getStat("/sdcard/a", &statBuf));
+    CPPUNIT_ASSERT(!cache.getReadLink("/sdcard/a", &output));
+
+    const struct stat attr(attributes(100));
+    cache.putStat("/sdcard/a", attr);
+    CPPUNIT_ASSERT(cache.getStat("/sdcard/a", &statBuf));
+    CPPUNIT_ASSERT(statBuf.st_size == 100 && statBuf.st_mode == (S_IFREG | 0660));
+
+    // only the attributes are cached so far
+    CPPUNIT_ASSERT(!cache.getReadLink("/sdcard/a", &output));
+
+    cache.putReadLink("/sdcard/a", deque<string>(1, "/storage/a"));
+    CPPUNIT_ASSERT(cache.getReadLink("/sdcard/a", &output));
+    CPPUNIT_ASSERT(output.front() == "/storage/a");
+    CPPUNIT_ASSERT(cache.getStat("/sdcard/a", &statBuf) && statBuf.st_size == 100);
+}
+
+void testFileCache::testInvalidate()
+{
+    FileCache cache;
+    struct stat statBuf;
+
+    cache.putStat("/sdcard/a", attributes(1));
+    cache.putStat("/sdcard/b", attributes(2));
+
+    cache.invalidate("/sdcard/a");
+    cache.invalidate("/sdcard/c");
+
+    CPPUNIT_ASSERT(!cache.getStat("/sdcard/a", &statBuf));
+    CPPUNIT_ASSERT(cache.getStat("/sdcard/b", &statBuf));
+    CPPUNIT_ASSERT(statBuf.st_size == 2);
+}
+
+void testFileCache::testNegativeCache()
+{
+    FileCache cache;
+    struct stat statBuf;
+
+    CPPUNIT_ASSERT(!cache.isMissing("/sdcard/.hidden"));
+
+    cache.putMissing("/sdcard/.hidden");
+    cache.putMissing("/sdcard/desktop.ini");
+    CPPUNIT_ASSERT(cache.isMissing("/sdcard/.hidden"));
+    CPPUNIT_ASSERT(!cache.getStat("/sdcard/.hidden", &statBuf));
+    CPPUNIT_ASSERT(cache.negativeEntries() == 2);
+    CPPUNIT_ASSERT(cache.negativeHits() == 1);
+
+    // created files are invalidated
+    cache.invalidate("/sdcard/.hidden");
+    CPPUNIT_ASSERT(!cache.isMissing("/sdcard/.hidden"));
+    CPPUNIT_ASSERT(cache.isMissing("/sdcard/desktop.ini"));
+
+    // attributes replace a negative entry and vice versa
+    cache.putStat("/sdcard/desktop.ini", attributes(10));
+    CPPUNIT_ASSERT(!cache.isMissing("/sdcard/desktop.ini"));
+    cache.putMissing("/sdcard/desktop.ini");
+    CPPUNIT_ASSERT(!cache.getStat("/sdcard/desktop.ini", &statBuf));
+
+    // a timeout of 0 disables the negative cache
+    cache.negativeTimeout(0);
+    CPPUNIT_ASSERT(!cache.isMissing("/sdcard/desktop.ini"));
+    cache.putMissing("/sdcard/autorun.inf");
+    CPPUNIT_ASSERT(!cache.isMissing("/sdcard/autorun.inf"));
+    CPPUNIT_ASSERT(cache.negativeEntries() == 3);
+}
+
+void testFileCache::testLimits()
+{
+    FileCache cache;
+    struct stat statBuf;
+    char acPath[32];
+
+    cache.limits(FileCache::uiNumShards * 4, 0);
+
+    cache.putStat("/sdcard/hot", attributes(1));
+    for (int i = 0; i < 10000; i++)
+    {
+        ::snprintf(acPath, sizeof(acPath), "/sdcard/f%d", i);
+        if (i % 2)
+            cache.putStat(acPath, attributes(i));
+        else
+            cache.putMissing(acPath);
+
+        // referenced between two evictions, never the least recently used
+        CPPUNIT_ASSERT(cache.getStat("/sdcard/hot", &statBuf));
+    }
+
+    // each shard keeps its share
+    CPPUNIT_ASSERT(cache.entries() <= FileCache::uiNumShards * 4);
+    CPPUNIT_ASSERT(cache.evictions() == 10001 - cache.entries());
+
+    // the most recently put entries are kept
+    CPPUNIT_ASSERT(cache.getStat("/sdcard/f9999", &statBuf));
+
+    // memory limit
+    cache.limits(0, FileCache::uiNumShards * 2 * cache.bytesPerEntry());
+    for (int i = 0; i < 1000; i++)
+    {
+        ::snprintf(acPath, sizeof(acPath), "/sdcard/g%d", i);
+        cache.putStat(acPath, attributes(i));
+    }
+    CPPUNIT_ASSERT(cache.entries() <= FileCache::uiNumShards * 3);
+    CPPUNIT_ASSERT(cache.getStat("/sdcard/g999", &statBuf));
+
+    // resolved links take memory too
+    FileCache unlimited;
+    unlimited.putStat("/sdcard/link", attributes(1));
+    const unsigned long long ullBytes(unlimited.bytes());
+    unlimited.putReadLink("/sdcard/link", deque<string>(1, string(1000, 'x')));
+    CPPUNIT_ASSERT(unlimited.bytes() > ullBytes + 1000);
+    unlimited.invalidate("/sdcard/link");
+    CPPUNIT_ASSERT(unlimited.bytes() == 0 && unlimited.entries() == 0);
+}
+
+void testFileCache::testSweep()
+{
+    FileCache cache;
+    char acPath[32];
+
+    for (int i = 0; i < 1000; i++)
+    {
+        ::snprintf(acPath, sizeof(acPath), "/sdcard/f%d", i);
+        cache.putStat(acPath, attributes(i));
+        ::snprintf(acPath, sizeof(acPath), "/sdcard/m%d", i);
+        cache.putMissing(acPath);
+    }
+    CPPUNIT_ASSERT(cache.entries() == 2000);
+    CPPUNIT_ASSERT(cache.bytes() > 0);
+
+    // nothing expired yet
+    CPPUNIT_ASSERT(cache.sweep(10000) == 0);
+
+    // every entry expired, swept a few at a time
+    cache.timeout(0);
+    cache.negativeTimeout(0);
+    unsigned long ulExpired(0);
+    for (int i = 0; i < 8; i++)
+        ulExpired += cache.sweep(250);
+
+    CPPUNIT_ASSERT(ulExpired == 2000);
+    CPPUNIT_ASSERT(cache.expirations() == 2000);
+    CPPUNIT_ASSERT(cache.entries() == 0);
+
+    // the trie nodes are gone too
+    CPPUNIT_ASSERT(cache.bytes() == 0);
+}
+
+void testFileCache::testRename()
+{
+    FileCache cache;
+    struct stat statBuf;
+
+    cache.putStat("/sdcard/a", attributes(1));
+    cache.putStat("/sdcard/a/b", attributes(2));
+    cache.putStat("/sdcard/a/b/c", attributes(3));
+    cache.putMissing("/sdcard/a/.hidden");
+    cache.putStat("/sdcard/a-x", attributes(4));
+    cache.putStat("/sdcard/x/old", attributes(5));
+
+    cache.rename("/sdcard/a", "/sdcard/x");
+
+    // the subtree moved, the renamed directory itself has to be stat'ed again
+    CPPUNIT_ASSERT(!cache.getStat("/sdcard/a", &statBuf));
+    CPPUNIT_ASSERT(!cache.getStat("/sdcard/a/b", &statBuf));
+    CPPUNIT_ASSERT(!cache.getStat("/sdcard/x", &statBuf));
+    CPPUNIT_ASSERT(cache.getStat("/sdcard/x/b", &statBuf) && statBuf.st_size == 2);
+    CPPUNIT_ASSERT(cache.getStat("/sdcard/x/b/c", &statBuf) && statBuf.st_size == 3);
+    CPPUNIT_ASSERT(cache.isMissing("/sdcard/x/.hidden"));
+
+    // what was cached for the target is dropped, siblings are not affected
+    CPPUNIT_ASSERT(!cache.getStat("/sdcard/x/old", &statBuf));
+    CPPUNIT_ASSERT(cache.getStat("/sdcard/a-x", &statBuf) && statBuf.st_size == 4);
+    CPPUNIT_ASSERT(cache.entries() == 4);
+
+    // into another directory, not cached yet
+    cache.rename("/sdcard/x/b", "/storage/b");
+    CPPUNIT_ASSERT(cache.getStat("/storage/b/c", &statBuf) && statBuf.st_size == 3);
+    CPPUNIT_ASSERT(!cache.getStat("/sdcard/x/b/c", &statBuf));
+
+    cache.invalidateTree("/storage");
+    CPPUNIT_ASSERT(!cache.getStat("/storage/b/c", &statBuf));
+    CPPUNIT_ASSERT(cache.isMissing("/sdcard/x/.hidden"));
+    CPPUNIT_ASSERT(cache.entries() == 2);
+
+    cache.invalidateTree("/");
+    CPPUNIT_ASSERT(cache.entries() == 0 && cache.bytes() == 0);
+}
+
+void testFileCache::testWatch()
+{
+    FileCache cache;
+    struct stat statBuf;
+
+    // entries not watched expire at once
+    cache.timeout(0);
+    cache.watch("/sdcard/DCIM", true);
+
+    cache.putStat("/sdcard/DCIM", attributes(1));
+    cache.putStat("/sdcard/DCIM/a", attributes(2));
+    cache.putMissing("/sdcard/DCIM/.hidden");
+    cache.putStat("/sdcard/DCIM/sub/b", attributes(3));
+    cache.putStat("/sdcard/other", attributes(4));
+
+    CPPUNIT_ASSERT(cache.isWatched("/sdcard/DCIM") && cache.isWatched("/sdcard/DCIM/a"));
+    CPPUNIT_ASSERT(!cache.isWatched("/sdcard/DCIM/sub/b") && !cache.isWatched("/sdcard"));
+
+    CPPUNIT_ASSERT(cache.getStat("/sdcard/DCIM", &statBuf) && statBuf.st_size == 1);
+    CPPUNIT_ASSERT(cache.getStat("/sdcard/DCIM/a", &statBuf) && statBuf.st_size == 2);
+    CPPUNIT_ASSERT(cache.isMissing("/sdcard/DCIM/.hidden"));
+    CPPUNIT_ASSERT(!cache.getStat("/sdcard/DCIM/sub/b", &statBuf));
+    CPPUNIT_ASSERT(!cache.getStat("/sdcard/other", &statBuf));
+
+    // the sweeper keeps watched entries
+    CPPUNIT_ASSERT(cache.sweep(100) == 2);
+    CPPUNIT_ASSERT(cache.entries() == 3);
+    CPPUNIT_ASSERT(cache.getStat("/sdcard/DCIM/a", &statBuf));
+
+    // notifications name the old path, a renamed directory is not watched
+    cache.rename("/sdcard/DCIM", "/sdcard/Pictures");
+    CPPUNIT_ASSERT(!cache.isWatched("/sdcard/Pictures/a"));
+    CPPUNIT_ASSERT(!cache.getStat("/sdcard/Pictures/a", &statBuf));
+
+    cache.watch("/sdcard/Pictures", true);
+    cache.putStat("/sdcard/Pictures/c", attributes(5));
+    cache.watch("/sdcard/Pictures", false);
+    CPPUNIT_ASSERT(!cache.getStat("/sdcard/Pictures/c", &statBuf));
+
+    cache.watch("/sdcard/Pictures", true);
+    cache.invalidateTree("/sdcard/Pictures");
+    CPPUNIT_ASSERT(!cache.isWatched("/sdcard/Pictures"));
+}
+
+void testFileCache::testSnapshot()
+{
+    FileCache fileCache;
+    DirCache dirCache;
+    struct stat statBuf;
+    deque<string> names;
+
+    deque<string> readLinkOutput;
+    readLinkOutput.push_back("/storage/emulated/0");
+
+    fileCache.putStat("/", attributes(1));
+    fileCache.putStat("/sdcard/DCIM/IMG 0001.jpg", attributes(2));
+    fileCache.putReadLink("/sdcard", readLinkOutput);
+    fileCache.putMissing("/sdcard/.hidden");
+
+    names.push_back(".");
+    names.push_back("..");
+    names.push_back("IMG 0001.jpg");
+    dirCache.put("/sdcard/DCIM", names, 1448450010);
+
+    char acFile[] = "/tmp/testFileCache-XXXXXX";
+    const int iFd(::mkstemp(acFile));
+    CPPUNIT_ASSERT(iFd != -1);
+    ::close(iFd);
+
+    CPPUNIT_ASSERT(CacheSnapshot::save(acFile, fileCache, dirCache));
+
+    FileCache restoredFileCache;
+    DirCache restoredDirCache;
+    CPPUNIT_ASSERT(CacheSnapshot::load(acFile, &restoredFileCache, &restoredDirCache));
+    ::unlink(acFile);
+
+    CPPUNIT_ASSERT(restoredFileCache.entries() == 3);
+    CPPUNIT_ASSERT(!restoredFileCache.isMissing("/sdcard/.hidden"));
+
+    // restored attributes are served stale, also without a stale timeout and
+    // after the timeout, the first lookup is asked to refresh them
+    bool fRefresh(false);
+    restoredFileCache.timeout(0);
+    CPPUNIT_ASSERT(restoredFileCache.sweep(100) == 0);
+    CPPUNIT_ASSERT(!restoredFileCache.getStat("/", &statBuf));
+    CPPUNIT_ASSERT(restoredFileCache.getStat("/", &statBuf, &fRefresh) && statBuf.st_size == 1 && fRefresh);
+    CPPUNIT_ASSERT(restoredFileCache.getStat("/", &statBuf, &fRefresh) && !fRefresh);
+    CPPUNIT_ASSERT(restoredFileCache.getStat("/sdcard/DCIM/IMG 0001.jpg", &statBuf, &fRefresh) && statBuf.st_size == 2 && fRefresh);
+    CPPUNIT_ASSERT(!restoredFileCache.getReadLink("/sdcard", &readLinkOutput));
+
+    restoredFileCache.timeout(120);
+    restoredFileCache.putStat("/", attributes(1));
+    CPPUNIT_ASSERT(restoredFileCache.getStat("/", &statBuf));
+    CPPUNIT_ASSERT(!restoredFileCache.getStat("/sdcard/DCIM/IMG 0001.jpg", &statBuf));
+
+    // restored listings have to be revalidated first
+    names.clear();
+    CPPUNIT_ASSERT(!restoredDirCache.get("/sdcard/DCIM", &names) && restoredDirCache.contains("/sdcard/DCIM"));
+    CPPUNIT_ASSERT(!restoredDirCache.revalidate("/sdcard/DCIM", 1448450011));
+    CPPUNIT_ASSERT(restoredDirCache.revalidate("/sdcard/DCIM", 1448450010));
+    CPPUNIT_ASSERT(restoredDirCache.get("/sdcard/DCIM", &names) && names.size() == 3 && names[2] == "IMG 0001.jpg");
+
+    // a truncated snapshot keeps the records read before
+    ostringstream out;
+    fileCache.save(out);
+    const string strData(out.str());
+    const char* pcPos(strData.data());
+    FileCache truncatedFileCache;
+    CPPUNIT_ASSERT(!truncatedFileCache.load(&pcPos, strData.data() + strData.length() - 1));
+    CPPUNIT_ASSERT(truncatedFileCache.entries() == 2);
+
+    CPPUNIT_ASSERT(!CacheSnapshot::load(acFile, &restoredFileCache, &restoredDirCache));
+}
+
+void testFileCache::testStale()
+{
+    FileCache cache;
+    struct stat statBuf;
+    bool fRefresh(true);
+
+    // entries expire at once
+    cache.timeout(0);
+    cache.putStat("/sdcard/a", attributes(1));
+
+    // without a stale timeout nothing is served expired
+    CPPUNIT_ASSERT(!cache.getStat("/sdcard/a", &statBuf, &fRefresh) && !fRefresh);
+
+    cache.staleTimeout(60);
+    CPPUNIT_ASSERT(!cache.getStat("/sdcard/a", &statBuf));
+
+    // only the first lookup is asked to refresh
+    CPPUNIT_ASSERT(cache.getStat("/sdcard/a", &statBuf, &fRefresh) && fRefresh && statBuf.st_size == 1);
+    CPPUNIT_ASSERT(cache.getStat("/sdcard/a", &statBuf, &fRefresh) && !fRefresh && statBuf.st_size == 1);
+    CPPUNIT_ASSERT(cache.staleHits() == 2);
+
+    // the sweeper keeps stale entries
+    CPPUNIT_ASSERT(cache.sweep(100) == 0);
+
+    cache.putStat("/sdcard/a", attributes(2));
+    CPPUNIT_ASSERT(cache.getStat("/sdcard/a", &statBuf, &fRefresh) && fRefresh && statBuf.st_size == 2);
+
+    cache.invalidate("/sdcard/a");
+    CPPUNIT_ASSERT(!cache.getStat("/sdcard/a", &statBuf, &fRefresh));
+
+    cache.putStat("/sdcard/b", attributes(3));
+    cache.staleTimeout(0);
+    CPPUNIT_ASSERT(cache.sweep(100) == 1);
+}
+
+/**
+ * Argument of concurrentAccessThread().
+ */
+struct ConcurrentAccessArg
+{
+    FileCache* pCache;
+    unsigned int uiSeed;
+    atomic<int>* piErrors;
+};
+
+/**
+ * Puts, gets and invalidates random paths, every cached value must belong to
+ * the path it is retrieved for. The size of the cached attributes is the
+ * number of the path.
+ */
+static void* concurrentAccessThread(void* pvArg)
+{
+    ConcurrentAccessArg* pArg(static_cast<ConcurrentAccessArg*>(pvArg));
+    deque<string> output;
+    struct stat statBuf;
+    char acPath[32];
+
+    for (int i = 0; i < iNumOperations; i++)
+    {
+        const int iRandom(::rand_r(&pArg->uiSeed));
+        const int iPath(iRandom % iNumPaths);
+        ::snprintf(acPath, sizeof(acPath), "/sdcard/f%d", iPath);
+        const struct stat attr(attributes(iPath));
+
+        switch ((iRandom >> 16) % 8)
+        {
+            case 0:
+                pArg->pCache->putStat(acPath, attr);
+                break;
+
+            case 1:
+                pArg->pCache->putReadLink(acPath, deque<string>(1, acPath));
+                break;
+
+            case 2:
+                pArg->pCache->invalidate(acPath);
+                break;
+
+            case 3:
+                pArg->pCache->putMissing(acPath);
+                break;
+
+            case 4:
+                if (pArg->pCache->getReadLink(acPath, &output) && (output.size() != 1 || output.front() != acPath))
+                    (*pArg->piErrors)++;
+                break;
+
+            default:
+                if (pArg->pCache->getStat(acPath, &statBuf) && statBuf.st_size != iPath)
+                    (*pArg->piErrors)++;
+                break;
+        }
+    }
+
+    return(NULL);
+}
+
+void testFileCache::testConcurrentAccess()
+{
+    FileCache cache;
+    atomic<int> iErrors(0);
+
+    // fewer entries than paths, so entries are evicted concurrently too
+    cache.limits(iNumPaths / 2, 0);
+
+    pthread_t threads[iNumThreads];
+    ConcurrentAccessArg args[iNumThreads];
+
+    for (int i = 0; i < iNumThreads; i++)
+    {
+        args[i].pCache = &cache;
+        args[i].uiSeed = i;
+        args[i].piErrors = &iErrors;
+        CPPUNIT_ASSERT(::pthread_create(&threads[i], NULL, concurrentAccessThread, &args[i]) == 0);
+    }
+
+    for (int i = 0; i < iNumThreads; i++)
+        ::pthread_join(threads[i], NULL);
+
+    CPPUNIT_ASSERT(iErrors == 0);
+    CPPUNIT_ASSERT(cache.entries() <= iNumPaths / 2);
+}
+
+/** Number of requests executed by slowRequest() */
+static atomic<int> iSlowRequests(0);
+
+/** Set to let slowRequest() return */
+static atomic<bool> fReleaseRequests(false);
+
+/**
+ * A request to the device blocking until fReleaseRequests is set, its
+ * result is the key.
+ */
+static deque<string> slowRequest(const string& strKey)
+{
+    iSlowRequests++;
+    while (!fReleaseRequests)
+        ::usleep(1000);
+
+    return(deque<string>(1, strKey));
+}
+
+/**
+ * Argument of singleFlightThread().
+ */
+struct SingleFlightArg
+{
+    SingleFlight* pSingleFlight;
+    const char* pcKey;
+    deque<string> result;
+};
+
+static void* singleFlightThread(void* pvArg)
+{
+    SingleFlightArg* pArg(static_cast<SingleFlightArg*>(pvArg));
+    pArg->result = pArg->pSingleFlight->run(pArg->pcKey, slowRequest);
+
+    return(NULL);
+}
+
+void testFileCache::testSingleFlight()
+{
+    SingleFlight singleFlight;
+    const int iNumCallers(4);
+    pthread_t threads[iNumCallers + 2];
+    SingleFlightArg args[iNumCallers + 2];
+
+    for (int i = 0; i < iNumCallers + 2; i++)
+    {
+        args[i].pSingleFlight = &singleFlight;
+        args[i].pcKey = i == iNumCallers ? "stat -t '/sdcard/b'" : "stat -t '/sdcard/a'";
+    }
+
+    CPPUNIT_ASSERT(::pthread_create(&threads[0], NULL, singleFlightThread, &args[0]) == 0);
+    while (iSlowRequests < 1)
+        ::usleep(1000);
+
+    // a different key is not shared
+    CPPUNIT_ASSERT(::pthread_create(&threads[iNumCallers], NULL, singleFlightThread, &args[iNumCallers]) == 0);
+    while (iSlowRequests < 2)
+        ::usleep(1000);
+
+    for (int i = 1; i < iNumCallers; i++)
+        CPPUNIT_ASSERT(::pthread_create(&threads[i], NULL, singleFlightThread, &args[i]) == 0);
+
+    // give the callers time to join the request in flight
+    ::usleep(100000);
+    CPPUNIT_ASSERT(iSlowRequests == 2);
+
+    // after a change callers do not join the requests in flight
+    singleFlight.forget();
+    CPPUNIT_ASSERT(::pthread_create(&threads[iNumCallers + 1], NULL, singleFlightThread, &args[iNumCallers + 1]) == 0);
+    while (iSlowRequests < 3)
+        ::usleep(1000);
+
+    fReleaseRequests = true;
+    for (int i = 0; i < iNumCallers + 2; i++)
+    {
+        ::pthread_join(threads[i], NULL);
+        CPPUNIT_ASSERT(args[i].result.size() == 1 && args[i].result.front() == args[i].pcKey);
+    }
+
+    CPPUNIT_ASSERT(iSlowRequests == 3);
+    CPPUNIT_ASSERT(singleFlight.shared() == iNumCallers - 1);
+}
+
+/**
+ * Returns the content of a directory as listed by ls -1a.
+ */
+static deque<string> listing(const char* pcNames)
+{
+    deque<string> names;
+    names.push_back(".");
+    names.push_back("..");
+
+    string strNames(pcNames);
+    for (size_t iStart = 0; iStart < strNames.length();)
+    {
+        size_t iEnd(strNames.find(' ', iStart));
+        if (iEnd == string::npos)
+            iEnd = strNames.length();
+        names.push_back(strNames.substr(iStart, iEnd - iStart));
+        iStart = iEnd + 1;
+    }
+
+    return(names);
+}
+
+/**
+ * Returns true if the cached listing of directory pcDir contains pcName.
+ */
+static bool listed(const DirCache& cache, const char* pcDir, const char* pcName)
+{
+    deque<string> names;
+    return(cache.get(pcDir, &names) && find(names.begin(), names.end(), pcName) != names.end());
+}
+
+void testFileCache::testDirCache()
+{
+    DirCache cache;
+    deque<string> names;
+
+    CPPUNIT_ASSERT(!cache.get("/sdcard", &names));
+    CPPUNIT_ASSERT(!cache.add("/sdcard/new"));
+
+    cache.put("/sdcard", listing("a b"), 100);
+    CPPUNIT_ASSERT(cache.get("/sdcard", &names) && names.size() == 4);
+
+    // mutations update the listing in place
+    CPPUNIT_ASSERT(cache.add("/sdcard/c"));
+    CPPUNIT_ASSERT(listed(cache, "/sdcard", "c"));
+    CPPUNIT_ASSERT(cache.add("/sdcard/c"));
+    CPPUNIT_ASSERT(cache.get("/sdcard", &names) && names.size() == 5);
+    CPPUNIT_ASSERT(cache.remove("/sdcard/a"));
+    CPPUNIT_ASSERT(!listed(cache, "/sdcard", "a"));
+    CPPUNIT_ASSERT(listed(cache, "/sdcard", "b"));
+
+    // removing a directory drops its own listing
+    cache.put("/sdcard/b", listing("x"), 100);
+    CPPUNIT_ASSERT(cache.remove("/sdcard/b"));
+    CPPUNIT_ASSERT(!cache.contains("/sdcard/b"));
+
+    // expired listings are kept for revalidation
+    cache.timeout(0);
+    CPPUNIT_ASSERT(!cache.get("/sdcard", &names));
+    CPPUNIT_ASSERT(cache.contains("/sdcard"));
+    CPPUNIT_ASSERT(!cache.revalidate("/sdcard", 200));
+    cache.mtime("/sdcard", 200);
+    CPPUNIT_ASSERT(cache.revalidate("/sdcard", 200));
+
+    cache.timeout(30);
+    CPPUNIT_ASSERT(listed(cache, "/sdcard", "c"));
+
+    cache.invalidate("/sdcard");
+    CPPUNIT_ASSERT(!cache.contains("/sdcard"));
+}
+
+void testFileCache::testDirCacheRename()
+{
+    DirCache cache;
+
+    cache.put("/sdcard", listing("a a-x b"), 100);
+    cache.put("/sdcard/a", listing("d f"), 100);
+    cache.put("/sdcard/a/d", listing("g"), 100);
+    cache.put("/sdcard/a-x", listing("h"), 100);
+    cache.put("/sdcard/b", listing(""), 100);
+
+    CPPUNIT_ASSERT(cache.rename("/sdcard/a", "/sdcard/b/a"));
+
+    CPPUNIT_ASSERT(!listed(cache, "/sdcard", "a"));
+    CPPUNIT_ASSERT(listed(cache, "/sdcard/b", "a"));
+
+    // listings below the renamed directory move along
+    CPPUNIT_ASSERT(!cache.contains("/sdcard/a") && !cache.contains("/sdcard/a/d"));
+    CPPUNIT_ASSERT(listed(cache, "/sdcard/b/a", "f"));
+    CPPUNIT_ASSERT(listed(cache, "/sdcard/b/a/d", "g"));
+
+    // a sibling sharing the prefix is not affected
+    CPPUNIT_ASSERT(listed(cache, "/sdcard", "a-x"));
+    CPPUNIT_ASSERT(listed(cache, "/sdcard/a-x", "h"));
+
+    // renaming a file within a directory that is not cached
+    CPPUNIT_ASSERT(!cache.rename("/storage/x", "/storage/y"));
+}
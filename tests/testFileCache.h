@@ -0,0 +1,70 @@
+/*
+ * $Id$
+ *
+ * File:   testFileCache.h
+ * Author: Werner Jaeger
+ *
+ * Copyright 2015 Werner Jaeger.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TESTFILECACHE_H
+#define TESTFILECACHE_H
+
+#include <cppunit/extensions/HelperMacros.h>
+#include "fileInfoCache.h"
+
+class testFileCache : public CPPUNIT_NS::TestFixture
+{
+   CPPUNIT_TEST_SUITE(testFileCache);
+
+   CPPUNIT_TEST(testPutGet);
+   CPPUNIT_TEST(testInvalidate);
+   CPPUNIT_TEST(testNegativeCache);
+   CPPUNIT_TEST(testLimits);
+   CPPUNIT_TEST(testSweep);
+   CPPUNIT_TEST(testRename);
+   CPPUNIT_TEST(testWatch);
+   CPPUNIT_TEST(testSnapshot);
+   CPPUNIT_TEST(testStale);
+   CPPUNIT_TEST(testSingleFlight);
+   CPPUNIT_TEST(testConcurrentAccess);
+   CPPUNIT_TEST(testDirCache);
+   CPPUNIT_TEST(testDirCacheRename);
+
+   CPPUNIT_TEST_SUITE_END();
+
+public:
+   testFileCache();
+   virtual ~testFileCache();
+   void setUp() override;
+   void tearDown() override;
+
+private:
+   void testPutGet();
+   void testInvalidate();
+   void testNegativeCache();
+   void testLimits();
+   void testSweep();
+   void testRename();
+   void testWatch();
+   void testSnapshot();
+   void testStale();
+   void testSingleFlight();
+   void testConcurrentAccess();
+   void testDirCache();
+   void testDirCacheRename();
+};
+
+#endif /* TESTFILECACHE_H */
@@ -0,0 +1,227 @@
+/*
+ * $Id$
+ *
+ * File:   testLocalCache.cpp
+ * Author: Werner Jaeger
+ *
+ * Copyright 2015 Werner Jaeger.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <fstream>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "testLocalCache.h"
+
+CPPUNIT_TEST_SUITE_REGISTRATION(testLocalCache);
+
+static bool fileExists(const string& strPath)
+{
+    struct stat statBuf;
+    return(::stat(strPath.c_str(), &statBuf) == 0);
+}
+
+testLocalCache::testLocalCache() : m_strRootDir()
+{
+}
+
+testLocalCache::~testLocalCache()
+{
+}
+
+void testLocalCache::setUp()
+{
+    char acDir[] = "/tmp/adbncfs-test-XXXXXX";
+    CPPUNIT_ASSERT(::mkdtemp(acDir) != NULL);
+    m_strRootDir.assign(acDir);
+    m_strRootDir.append("/");
+}
+
+void testLocalCache::tearDown()
+{
+    const string strCommand("rm -rf '" + m_strRootDir + "'");
+    CPPUNIT_ASSERT(::system(strCommand.c_str()) == 0);
+}
+
+void testLocalCache::testNoCollisions()
+{
+    LocalCache cache;
+    cache.rootDir(m_strRootDir);
+
+    // these used to be flattened to the same local file -a-b-c
+    const string strPath1(cache.localPath("/a/b-c"));
+    const string strPath2(cache.localPath("/a-b/c"));
+
+    CPPUNIT_ASSERT(strPath1 != strPath2);
+    CPPUNIT_ASSERT(cache.localPath("/a/b-c") == strPath1);
+    CPPUNIT_ASSERT(strPath1.compare(0, m_strRootDir.length(), m_strRootDir) == 0);
+}
+
+void testLocalCache::testFanOut()
+{
+    LocalCache cache;
+    cache.rootDir(m_strRootDir);
+
+    const string strPath(cache.localPath("/sdcard/DCIM/Camera/IMG_0001.jpg"));
+
+    // root/files/xx/yy/<16 hex digits>
+    const string strRelative(strPath.substr(m_strRootDir.length()));
+    CPPUNIT_ASSERT(strRelative.length() == string("files/xx/yy/").length() + 16);
+    CPPUNIT_ASSERT(strRelative.compare(0, 6, "files/") == 0);
+
+    struct stat statBuf;
+    const string strDir(strPath.substr(0, strPath.rfind('/')));
+    CPPUNIT_ASSERT(::stat(strDir.c_str(), &statBuf) == 0 && S_ISDIR(statBuf.st_mode));
+
+    char acHash[17];
+    ::snprintf(acHash, sizeof(acHash), "%016llx", static_cast<unsigned long long>(LocalCache::hash("/sdcard/DCIM/Camera/IMG_0001.jpg")));
+    CPPUNIT_ASSERT(strRelative.substr(12) == acHash);
+    CPPUNIT_ASSERT(strRelative.substr(6, 2) == string(acHash, 2));
+    CPPUNIT_ASSERT(strRelative.substr(9, 2) == string(acHash + 2, 2));
+}
+
+void testLocalCache::testRemove()
+{
+    LocalCache cache;
+    cache.rootDir(m_strRootDir);
+
+    const string strPath(cache.localPath("/sdcard/a.txt"));
+    std::ofstream(strPath.c_str()) << "content";
+    CPPUNIT_ASSERT(cache.contains("/sdcard/a.txt"));
+
+    cache.remove("/sdcard/a.txt");
+
+    struct stat statBuf;
+    CPPUNIT_ASSERT(!cache.contains("/sdcard/a.txt"));
+    CPPUNIT_ASSERT(::stat(strPath.c_str(), &statBuf) == -1);
+}
+
+/**
+ * Pulls a file of the given size into the cache by opening and releasing it.
+ */
+static string cacheFile(LocalCache& cache, const char* pcPath, const size_t uiSize)
+{
+    cache.opened(pcPath);
+    const string strLocalPath(cache.localPath(pcPath));
+    std::ofstream(strLocalPath.c_str()) << string(uiSize, 'x');
+    cache.released(pcPath);
+
+    return(strLocalPath);
+}
+
+void testLocalCache::testEvict()
+{
+    LocalCache cache;
+    cache.rootDir(m_strRootDir);
+
+    const string strOld(cacheFile(cache, "/sdcard/old", 100));
+    const string strOpen(cacheFile(cache, "/sdcard/open", 100));
+    const string strDirty(cacheFile(cache, "/sdcard/dirty", 100));
+    const string strNew(cacheFile(cache, "/sdcard/new", 100));
+    CPPUNIT_ASSERT(cache.bytes() == 400);
+
+    cache.opened("/sdcard/open");
+    cache.dirty("/sdcard/dirty", true);
+
+    // /sdcard/old is the least recently used one
+    CPPUNIT_ASSERT(cache.evict(300) == 1);
+    CPPUNIT_ASSERT(!cache.contains("/sdcard/old"));
+    CPPUNIT_ASSERT(!fileExists(strOld));
+    CPPUNIT_ASSERT(cache.bytes() == 300);
+
+    // open and dirty files are kept
+    CPPUNIT_ASSERT(cache.evict(0) == 1);
+    CPPUNIT_ASSERT(!fileExists(strNew));
+    CPPUNIT_ASSERT(fileExists(strOpen) && fileExists(strDirty));
+    CPPUNIT_ASSERT(cache.bytes() == 200);
+    CPPUNIT_ASSERT(cache.evictions() == 2);
+
+    cache.released("/sdcard/open");
+    cache.dirty("/sdcard/dirty", false);
+    CPPUNIT_ASSERT(cache.evict(0) == 2);
+    CPPUNIT_ASSERT(cache.bytes() == 0);
+}
+
+void testLocalCache::testEvictBlob()
+{
+    LocalCache cache;
+    cache.rootDir(m_strRootDir);
+
+    const string strBlob(m_strRootDir + "blob");
+    const string strLocal1(cacheFile(cache, "/sdcard/a", 100));
+    CPPUNIT_ASSERT(::link(strLocal1.c_str(), strBlob.c_str()) == 0);
+    cache.blob("/sdcard/a", strBlob);
+
+    cache.opened("/sdcard/b");
+    const string strLocal2(cache.localPath("/sdcard/b"));
+    CPPUNIT_ASSERT(::link(strBlob.c_str(), strLocal2.c_str()) == 0);
+    cache.blob("/sdcard/b", strBlob);
+    cache.released("/sdcard/b");
+
+    // blob still linked to /sdcard/b
+    cache.remove("/sdcard/a");
+    CPPUNIT_ASSERT(fileExists(strBlob));
+
+    CPPUNIT_ASSERT(cache.evict(0) == 1);
+    CPPUNIT_ASSERT(!fileExists(strBlob));
+}
+
+void testLocalCache::testIsCurrent()
+{
+    LocalCache cache;
+    cache.rootDir(m_strRootDir);
+
+    // nothing recorded yet
+    CPPUNIT_ASSERT(!cache.isCurrent("/sdcard/a", 100, 1000));
+
+    cacheFile(cache, "/sdcard/a", 100);
+    CPPUNIT_ASSERT(!cache.isCurrent("/sdcard/a", 100, 1000));
+
+    cache.remoteVersion("/sdcard/a", 100, 1000);
+    CPPUNIT_ASSERT(cache.isCurrent("/sdcard/a", 100, 1000));
+    CPPUNIT_ASSERT(!cache.isCurrent("/sdcard/a", 101, 1000));
+    CPPUNIT_ASSERT(!cache.isCurrent("/sdcard/a", 100, 1001));
+
+    // unsaved modifications must not be replaced by a pull
+    cache.dirty("/sdcard/a", true);
+    CPPUNIT_ASSERT(cache.isCurrent("/sdcard/a", 100, 1001));
+    cache.dirty("/sdcard/a", false);
+
+    // evicted files have to be pulled again
+    CPPUNIT_ASSERT(cache.evict(0) == 1);
+    CPPUNIT_ASSERT(!cache.isCurrent("/sdcard/a", 100, 1000));
+}
+
+void testLocalCache::testRename()
+{
+    LocalCache cache;
+    cache.rootDir(m_strRootDir);
+
+    const string strFrom(cacheFile(cache, "/sdcard/from", 100));
+    const string strTo(cacheFile(cache, "/sdcard/to", 50));
+    cache.remoteVersion("/sdcard/from", 100, 1000);
+
+    cache.rename("/sdcard/from", "/sdcard/to");
+
+    CPPUNIT_ASSERT(!cache.contains("/sdcard/from"));
+    CPPUNIT_ASSERT(cache.localPath("/sdcard/to") == strFrom);
+    CPPUNIT_ASSERT(cache.isCurrent("/sdcard/to", 100, 1000));
+    CPPUNIT_ASSERT(!fileExists(strTo));
+    CPPUNIT_ASSERT(cache.bytes() == 100);
+
+    // the moved entry is still evictable
+    CPPUNIT_ASSERT(cache.evict(0) == 1);
+    CPPUNIT_ASSERT(!cache.contains("/sdcard/to"));
+}
@@ -0,0 +1,60 @@
+/*
+ * $Id$
+ *
+ * File:   testLocalCache.h
+ * Author: Werner Jaeger
+ *
+ * Copyright 2015 Werner Jaeger.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TESTLOCALCACHE_H
+#define TESTLOCALCACHE_H
+
+#include <cppunit/extensions/HelperMacros.h>
+#include "localCache.h"
+
+class testLocalCache : public CPPUNIT_NS::TestFixture
+{
+   CPPUNIT_TEST_SUITE(testLocalCache);
+
+   CPPUNIT_TEST(testNoCollisions);
+   CPPUNIT_TEST(testFanOut);
+   CPPUNIT_TEST(testRemove);
+   CPPUNIT_TEST(testEvict);
+   CPPUNIT_TEST(testEvictBlob);
+   CPPUNIT_TEST(testIsCurrent);
+   CPPUNIT_TEST(testRename);
+
+   CPPUNIT_TEST_SUITE_END();
+
+public:
+   testLocalCache();
+   virtual ~testLocalCache();
+   void setUp() override;
+   void tearDown() override;
+
+private:
+   void testNoCollisions();
+   void testFanOut();
+   void testRemove();
+   void testEvict();
+   void testEvictBlob();
+   void testIsCurrent();
+   void testRename();
+
+   std::string m_strRootDir;
+};
+
+#endif /* TESTLOCALCACHE_H */